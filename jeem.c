@@ -7,6 +7,10 @@
     Windows:   gcc -O2 -o jeem.exe jeem.c -lm -lws2_32
 */
 
+#ifdef __APPLE__
+#define _XOPEN_SOURCE 600 /* ucontext, used by generators */
+#define _DARWIN_C_SOURCE
+#endif
 #ifdef _WIN32
 #include <winsock2.h>
 #include <ws2tcpip.h>
@@ -18,6 +22,7 @@
 #define getcwd _getcwd
 #define close closesocket
 typedef int socklen_t;
+#define poll WSAPoll
 #else
 #include <unistd.h>
 #include <sys/stat.h>
@@ -27,6 +32,15 @@ typedef int socklen_t;
 #include <netdb.h>
 #include <fcntl.h>
 #include <sys/select.h>
+#include <sys/mman.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <sys/wait.h>
+#include <ucontext.h>
+#ifdef __linux__
+#include <sys/epoll.h>
+#include <sys/prctl.h>
+#endif
 #define sleep_ms(ms) usleep((ms)*1000)
 #define PATH_SEP '/'
 #define SOCKET int
@@ -42,18 +56,24 @@ typedef int socklen_t;
 #include <stdarg.h>
 #include <limits.h>
 #include <time.h>
+#include <stdint.h>
 #include <errno.h>
+#include <signal.h>
 
 #define MAX_TOK 4096
 #define MAX_SRC 1000000
 #define MAX_STR 65536
 #define MAX_IMPORTS 256
 #define HTTP_BUF 65536
+#define HTTP_MAX_BODY (64<<20)
+#define HTTP_IDLE_MS 5000
 
 typedef struct Value Value;
 typedef struct AST AST;
 typedef struct Scope Scope;
 typedef struct ClassDef ClassDef;
+typedef struct Chunk Chunk;
+typedef struct Shape Shape;
 
 typedef enum {
     TOK_EOF,TOK_NUMBER,TOK_STRING,TOK_IDENT,TOK_TEMPLATE,
@@ -67,21 +87,35 @@ typedef enum {
     TOK_IF,TOK_ELSE,TOK_FOR,TOK_IN,TOK_WHILE,TOK_FUNC,TOK_RETURN,
     TOK_BREAK,TOK_CONTINUE,TOK_CONST,TOK_NULL,TOK_TRUE,TOK_FALSE,
     TOK_CASE,TOK_DEFAULT,TOK_CLASS,TOK_NEW,TOK_THIS,TOK_EXTENDS,TOK_SUPER,
-    TOK_IMPORT,TOK_AS,TOK_EXPORT,TOK_UNKNOWN
+    TOK_IMPORT,TOK_AS,TOK_EXPORT,TOK_YIELD,TOK_UNKNOWN
 } TokType;
 
 typedef struct { int is_expr; char *text; } TemplatePart;
-typedef struct { TokType type; char text[MAX_TOK]; double num; int line; TemplatePart *tpl; int tpl_n; } Token;
-typedef enum { V_NULL,V_BOOL,V_INT,V_FLOAT,V_STRING,V_ARRAY,V_OBJECT,V_FUNC,V_CLASS,V_INSTANCE,V_MODULE,V_CLOSURE } ValueType;
+/* text is a slice of the source (len bytes, not terminated); unescaped strings live in the arena */
+typedef struct { TokType type; const char *text; int len; double num; int line; TemplatePart *tpl; int tpl_n; } Token;
+typedef enum { V_NULL,V_BOOL,V_INT,V_FLOAT,V_STRING,V_ARRAY,V_OBJECT,V_FUNC,V_CLASS,V_INSTANCE,V_MODULE,V_CLOSURE,V_BUILDER,V_TYPED,V_MAP,V_SET,V_DEQUE,V_PQ,V_GRAPH,V_ITER,V_FILE,V_WORKER } ValueType;
 typedef struct { int len,cap; Value **items; } Array;
+enum { TA_F64,TA_I64 };
+typedef struct { int kind,len,cap; union { double *f; long long *i; void *p; } d; } TypedArr;
+typedef struct { Value *key,*val; uint64_t hash; } MapEnt;
+typedef struct { MapEnt *ents; int n,cap,live,mask; int *slots; } HMap;
+typedef struct { Value **items; int head,len,cap; } Deque;
+#define DQ_AT(d,i) (d)->items[((d)->head+(i))&((d)->cap-1)]
+typedef struct { Value *item,*pri; long long seq; int pos; } PQEnt;
+typedef struct { PQEnt *ents; int *heap; int n,cap,max,indexed; long long seq; Value *key; HMap index; } PQueue;
+typedef struct { int n,m,directed; int *off,*adj; double *w; Value **ids; HMap index; } CsrGraph;
+typedef struct { FILE *f; char *map,*line,*path; size_t size,pos,line_cap; int mapped,closed; } FileH;
+typedef struct { int pid,fd,alive; Value *result; } WorkerH;
+typedef struct Iter { Value *(*next)(struct Iter*); void (*drop)(struct Iter*); void *st; int done; } Iter;
 typedef struct { char *key; Value *val; } KV;
-typedef struct { int count,cap; KV *pairs; } Object;
+typedef struct { int count,cap; KV *pairs; Shape *shape; int *index,index_cap; } Object;
 typedef struct { ClassDef *cd; Object *props; } Instance;
-typedef struct { char *name; char **params; int param_n; AST *body; Scope *env; int is_arrow; } Closure;
+typedef struct { Value *val; int is_const,refs; unsigned char gc; } Upvalue;
+typedef struct { char *name; char **params; int param_n; AST *body; Scope *env; int is_arrow; Upvalue **upvals; int upval_n; } Closure;
 
 struct Value {
-    ValueType type; int ref;
-    union { int b; long long i; double f; char *s; Array *arr; Object *obj; Instance *inst; Closure *cl; } as;
+    unsigned char type,gc; int ref;
+    union { int b; long long i; double f; char *s; Array *arr; Object *obj; Instance *inst; Closure *cl; TypedArr *ta; HMap *map; Deque *dq; PQueue *pq; CsrGraph *graph; Iter *it; FileH *fh; WorkerH *wk; } as;
 };
 
 typedef enum {
@@ -89,13 +123,14 @@ typedef enum {
     AST_ASSIGN,AST_INDEX_ASSIGN,AST_BINOP,AST_UNARY,AST_TERNARY,AST_INDEX,
     AST_MEMBER,AST_CALL,AST_IF,AST_WHILE,AST_FOR,AST_FOR_C,AST_CASE,
     AST_BREAK,AST_CONTINUE,AST_RETURN,AST_FUNC,AST_CLASS,AST_NEW,AST_THIS,
-    AST_SUPER,AST_IMPORT,AST_COMPOUND,AST_EXPR_STMT,AST_ARROW
+    AST_SUPER,AST_IMPORT,AST_COMPOUND,AST_EXPR_STMT,AST_ARROW,AST_YIELD
 } ASTType;
 
 typedef struct { int is_def,is_range; long long *vals; int val_n; long long rs,re; AST *body; } CaseBr;
+typedef Value *(*BuiltinFn)(Value**,int);
 
 struct AST {
-    ASTType type; int line,is_const,is_arrow; char *name; char op[4];
+    ASTType type; int line,is_const,is_arrow,is_gen; char *name; char op[4];
     AST *left,*right,*cond,*body; Value *lit;
     AST **children; int child_n; char **keys;
     char **params; int param_n;
@@ -104,72 +139,187 @@ struct AST {
     char *parent; AST **methods; int method_n;
     char *imp_path,*imp_alias;
     TemplatePart *tpl; int tpl_n;
+    Chunk *chunk;
+    BuiltinFn bi; int mid; unsigned bi_epoch;
+    int mod; /* module the node was parsed in (0: main script); -1 on a call that must reach the builtin */
 };
 
 typedef struct { char *name; char **params; int param_n; AST *body; } Method;
-struct ClassDef { char *name,*parent; Method *methods; int method_n,method_cap; };
+struct ClassDef { char *name,*parent; Method *methods; int method_n,method_cap; ClassDef *super; };
 typedef struct { char *name; Value *val; int is_const; } Symbol;
-struct Scope { Symbol *syms; int count,cap; Scope *parent; };
-typedef struct { char *name; char **params; int param_n; AST *body; Scope *closure; } FuncDef;
+struct Scope { Symbol *syms; int count,cap,refs; Scope *parent; unsigned char gc; };
+typedef struct { char *name; char **params; int param_n; AST *body; Scope *closure; int mod; } FuncDef;
 typedef struct { char *path,*alias; Value *module; } ImportEntry;
 
-/* HTTP Server */
-typedef struct { char *method; char *path; Value *handler; } HttpRoute;
-typedef struct { SOCKET sock; int running,port; HttpRoute *routes; int route_n,route_cap; } HttpServer;
+/* Growable string buffer that becomes the string value's storage when done */
+typedef struct { char *s; } StrBuf;
+
+/* HTTP Server: one event loop over non-blocking sockets (epoll on Linux, poll elsewhere).
+   Each connection buffers its input until a whole request has arrived and its output until
+   the socket takes it, so slow clients never block the loop. */
+typedef struct RouteNode { char *seg; struct RouteNode **kids,*param,*wild; int kid_n; Value *handler; } RouteNode;
+typedef struct { char *method; RouteNode *root; } RouteTree;
+typedef struct { SOCKET fd; StrBuf in,out; size_t out_pos,scan; long long last; int keep,want_write; } HttpConn;
+typedef struct { SOCKET sock; int running,draining,port,ep; RouteTree *trees; int tree_n; HttpConn **conns; int conn_n,conn_cap,*free_slots,free_n; long long swept; } HttpServer;
 
 static char *g_src=NULL; static int g_pos=0,g_len=0,g_line=1;
 static Token g_tok; static const char *g_file="<input>"; static char *g_dir=NULL;
 static Scope *g_global=NULL,*g_scope=NULL;
 static FuncDef *g_funcs=NULL; static int g_func_n=0,g_func_cap=0;
-static ClassDef *g_classes=NULL; static int g_class_n=0,g_class_cap=0;
+static unsigned g_sym_epoch=0; /* bumped whenever a scope or symbol is created, to expire cached lookup misses */
+static ClassDef **g_classes=NULL; static int g_class_n=0,g_class_cap=0;
 static ImportEntry g_imports[MAX_IMPORTS]; static int g_import_n=0;
-static int g_break=0,g_continue=0,g_return=0,g_rand_init=0,g_ws_init=0;
+static int g_break=0,g_continue=0,g_return=0,g_rand_init=0,g_ws_init=0,g_use_vm=1;
 static Value *g_retval=NULL,*g_this=NULL;
 static HttpServer *g_server=NULL;
 
 /* Timer system */
-typedef struct { int id; long long fire_at; int interval; int active; Value *callback; } Timer;
+/* Pending timers form a binary min-heap on (fire_at, id); cleared ones are removed at once */
+typedef struct { int id; long long fire_at; int interval; Value *callback; } Timer;
 static Timer *g_timers=NULL; static int g_timer_n=0,g_timer_cap=0,g_timer_next_id=1;
 
 static void *xmalloc(size_t n) { void *p=malloc(n); if(!p&&n){fprintf(stderr,"OOM\n");exit(1);} return p; }
 static void *xrealloc(void *p,size_t n) { void *q=realloc(p,n); if(!q&&n){fprintf(stderr,"OOM\n");exit(1);} return q; }
 static char *xstrdup(const char *s) { if(!s)return NULL; char *p=xmalloc(strlen(s)+1); strcpy(p,s); return p; }
+static char *xstrndup(const char *s,int n) { char *p=xmalloc(n+1); memcpy(p,s,n); p[n]='\0'; return p; }
 static void error(int line,const char *fmt,...) { va_list ap; fprintf(stderr,"%s:%d: error: ",g_file,line); va_start(ap,fmt); vfprintf(stderr,fmt,ap); va_end(ap); fprintf(stderr,"\n"); exit(1); }
 #define runtime_error error
 
 static Value *eval(AST *node);
 static Value *call_closure(Value *closure, Value **args, int argc);
-static Value *call_method(Value *obj, const char *method, Value **args, int argc);
+static Value *hmap_new(ValueType t); static void hmap_set(HMap *m,Value *key,Value *val); static void hmap_clear(HMap *m);
+static Value *dq_new(int cap); static void dq_push(Deque *d,Value *x,int front);
+static void coll_sprint(Value *v,char *buf,int size);
+static int val_order(Value *va,Value *vb);
+static Value *pq_method(Value *obj,int mid,Value **args,int argc);
+static void iter_close(Iter *t);
+static void file_close(FileH *h);
+static void worker_close(WorkerH *w,int kill_it);
+static Value *iter_next(Value *v);
+static Value *run_body(AST *body);
+static Chunk *vm_compile(AST *node,int toplevel);
+static Value *vm_exec(Chunk *ch,Value **args,int argc,Upvalue **upvals);
+static Value *vm_call(AST *body,char **params,int param_n,Value **args,int argc);
+static void upval_release(Upvalue *u);
+static Value *call_method_body(Value *inst,Method *m,Value **args,int argc);
+static Value *gen_new(Value *fn,Value *self,Method *m,Value **args,int argc);
+static int gen_yield(Value *v);
+static int g_gen_enter=0;
+static uintptr_t g_cstack_limit=0; /* inside a generator: lowest safe C stack address */
+static int cstack_low(void){char here;return g_cstack_limit&&(uintptr_t)&here<g_cstack_limit;}
+static char *resolve_path(const char *imp,const char *cur);
+static Value *do_import(const char *path,const char *alias);
+
+/* Memory pools
+   Values, arrays, objects and instances are fixed-size cells carved from slabs
+   and recycled through per-type free lists; AST nodes are bump-allocated from
+   an arena that lives as long as the program. The counters feed memStats().
+   Build with -DJEEM_NO_POOLS to give each cell its own malloc for sanitizers. */
+#define POOL_SLAB 256
+#define ARENA_BLOCK 65536
+typedef struct PoolCell { struct PoolCell *next; } PoolCell;
+typedef struct { const char *name; size_t size; PoolCell *free; long live,peak,slabs; } Pool;
+enum { POOL_VALUE,POOL_ARRAY,POOL_OBJECT,POOL_INSTANCE,POOL_COUNT };
+static Pool g_pools[POOL_COUNT]={{"values",sizeof(Value)},{"arrays",sizeof(Array)},{"objects",sizeof(Object)},{"instances",sizeof(Instance)}};
+static long g_val_live[V_WORKER+1],g_pool_bytes=0,g_pool_peak=0;
+static char *g_arena=NULL; static size_t g_arena_used=0,g_arena_cap=0; static long g_arena_bytes=0,g_ast_n=0;
+static int g_mem_stats=0;
+
+static void *pool_alloc(int kind) {
+    Pool *p=&g_pools[kind]; size_t sz=p->size<sizeof(PoolCell)?sizeof(PoolCell):p->size;
+#ifdef JEEM_NO_POOLS
+    PoolCell *c=xmalloc(sz);
+#else
+    if(!p->free){char *slab=xmalloc(sz*POOL_SLAB);for(int i=POOL_SLAB-1;i>=0;i--){PoolCell *c=(PoolCell*)(slab+sz*i);c->next=p->free;p->free=c;}p->slabs++;}
+    PoolCell *c=p->free; p->free=c->next;
+#endif
+    p->live++; if(p->live>p->peak)p->peak=p->live;
+    g_pool_bytes+=p->size; if(g_pool_bytes>g_pool_peak)g_pool_peak=g_pool_bytes; return c;
+}
+static void pool_free(int kind,void *ptr) {
+    Pool *p=&g_pools[kind]; p->live--; g_pool_bytes-=p->size;
+#ifdef JEEM_NO_POOLS
+    free(ptr);
+#else
+    PoolCell *c=ptr; c->next=p->free; p->free=c;
+#endif
+}
+static void *arena_alloc(size_t n) {
+    n=(n+15)&~(size_t)15;
+    if(g_arena_used+n>g_arena_cap){g_arena_cap=n>ARENA_BLOCK?n:ARENA_BLOCK;g_arena=xmalloc(g_arena_cap);g_arena_used=0;g_arena_bytes+=g_arena_cap;}
+    void *p=g_arena+g_arena_used; g_arena_used+=n; return p;
+}
 
-static Value *val_new(ValueType t) { Value *v=xmalloc(sizeof(Value)); memset(v,0,sizeof(Value)); v->type=t; v->ref=1; return v; }
-static Value *val_null(void) { return val_new(V_NULL); }
-static Value *val_bool(int b) { Value *v=val_new(V_BOOL); v->as.b=b?1:0; return v; }
-static Value *val_int(long long i) { Value *v=val_new(V_INT); v->as.i=i; return v; }
+static Value *val_new(ValueType t) { Value *v=pool_alloc(POOL_VALUE); memset(v,0,sizeof(Value)); v->type=t; v->ref=1; g_val_live[t]++; return v; }
+/* Immediates: null, booleans and small ints are preallocated and pinned, so
+   producing one never allocates. Scalars are never mutated, so copies share. */
+#define VAL_PINNED INT_MAX
+#define SMALL_INT_MIN (-256)
+#define SMALL_INT_MAX 1024
+static Value g_val_null={V_NULL,0,VAL_PINNED,{0}},g_val_bool[2]={{V_BOOL,0,VAL_PINNED,{0}},{V_BOOL,0,VAL_PINNED,{1}}};
+static Value g_val_ints[SMALL_INT_MAX-SMALL_INT_MIN];
+static void val_init_immediates(void) { for(int i=0;i<SMALL_INT_MAX-SMALL_INT_MIN;i++){g_val_ints[i].type=V_INT;g_val_ints[i].ref=VAL_PINNED;g_val_ints[i].as.i=i+SMALL_INT_MIN;} }
+static Value *val_null(void) { return &g_val_null; }
+static Value *val_bool(int b) { return &g_val_bool[b?1:0]; }
+static Value *val_int(long long i) { if(i>=SMALL_INT_MIN&&i<SMALL_INT_MAX)return &g_val_ints[i-SMALL_INT_MIN]; Value *v=val_new(V_INT); v->as.i=i; return v; }
 static Value *val_float(double f) { Value *v=val_new(V_FLOAT); v->as.f=f; return v; }
-static Value *val_string(const char *s) { Value *v=val_new(V_STRING); v->as.s=xstrdup(s?s:""); return v; }
-static Value *val_array(int cap) { Value *v=val_new(V_ARRAY); v->as.arr=xmalloc(sizeof(Array)); v->as.arr->len=0; v->as.arr->cap=cap>0?cap:8; v->as.arr->items=xmalloc(sizeof(Value*)*v->as.arr->cap); return v; }
-static Value *val_object(void) { Value *v=val_new(V_OBJECT); v->as.obj=xmalloc(sizeof(Object)); v->as.obj->count=0; v->as.obj->cap=8; v->as.obj->pairs=xmalloc(sizeof(KV)*8); return v; }
+/* Strings carry a hidden {len,cap} header in front of their characters, so length
+   is O(1) and a string that only its variable holds can be appended to in place */
+typedef struct { int len,cap; } StrHdr;
+#define STR_HDR(s) ((StrHdr*)(s)-1)
+static char *str_alloc(int cap) { StrHdr *h=xmalloc(sizeof(StrHdr)+cap); h->len=0; h->cap=cap; ((char*)(h+1))[0]='\0'; return (char*)(h+1); }
+static char *str_reserve(char *s,int need) { StrHdr *h=STR_HDR(s); if(need<=h->cap)return s; int cap=h->cap*2; if(cap<need)cap=need; h=xrealloc(h,sizeof(StrHdr)+cap); h->cap=cap; return (char*)(h+1); }
+static void str_free(char *s) { free(STR_HDR(s)); }
+static Value *val_string_n(const char *s,int n) { Value *v=val_new(V_STRING); v->as.s=str_alloc(n+1); memcpy(v->as.s,s,n); v->as.s[n]='\0'; STR_HDR(v->as.s)->len=n; return v; }
+static Value *val_string(const char *s) { if(!s)s=""; return val_string_n(s,strlen(s)); }
+static int str_len(Value *v) { return STR_HDR(v->as.s)->len; }
+static void str_append(Value *v,const char *s,int n) { int len=STR_HDR(v->as.s)->len; long off=s-v->as.s; v->as.s=str_reserve(v->as.s,len+n+1); if(off>=0&&off<=len)s=v->as.s+off; memcpy(v->as.s+len,s,n); v->as.s[len+n]='\0'; STR_HDR(v->as.s)->len=len+n; }
+static Value *val_array(int cap) { Value *v=val_new(V_ARRAY); v->as.arr=pool_alloc(POOL_ARRAY); v->as.arr->len=0; v->as.arr->cap=cap>0?cap:8; v->as.arr->items=xmalloc(sizeof(Value*)*v->as.arr->cap); return v; }
+static Object *obj_new(int cap);
+static Value *val_object(void) { Value *v=val_new(V_OBJECT); v->as.obj=obj_new(8); return v; }
 static Value *val_func(const char *n) { Value *v=val_new(V_FUNC); v->as.s=xstrdup(n); return v; }
-static Value *val_module(void) { Value *v=val_new(V_MODULE); v->as.obj=xmalloc(sizeof(Object)); v->as.obj->count=0; v->as.obj->cap=16; v->as.obj->pairs=xmalloc(sizeof(KV)*16); return v; }
+static Value *val_module(void) { Value *v=val_new(V_MODULE); v->as.obj=obj_new(16); return v; }
 static Value *val_closure_new(Closure *cl) { Value *v=val_new(V_CLOSURE); v->as.cl=cl; return v; }
-static Value *val_instance(ClassDef *cd) { Value *v=val_new(V_INSTANCE); v->as.inst=xmalloc(sizeof(Instance)); v->as.inst->cd=cd; v->as.inst->props=xmalloc(sizeof(Object)); v->as.inst->props->count=0; v->as.inst->props->cap=16; v->as.inst->props->pairs=xmalloc(sizeof(KV)*16); return v; }
+static Value *val_instance(ClassDef *cd) { Value *v=val_new(V_INSTANCE); v->as.inst=pool_alloc(POOL_INSTANCE); v->as.inst->cd=cd; v->as.inst->props=obj_new(16); return v; }
 
-static void val_incref(Value *v) { if(v)v->ref++; }
+static void val_incref(Value *v) { if(v&&v->ref!=VAL_PINNED)v->ref++; }
 static void scope_free(Scope *s);
 static void val_free(Value *v);
-static void val_decref(Value *v) { if(v&&--v->ref<=0)val_free(v); }
+static void obj_free(Object *o);
+enum { GC_VALUE,GC_SCOPE,GC_UPVAL };
+#define GC_COLOR 3
+#define GC_BLACK 0
+#define GC_GRAY 1
+#define GC_WHITE 2
+#define GC_PURPLE 3
+#define GC_BUFFERED 4
+#define GC_DEAD 8
+#define GC_TRACKED(t) ((1<<(t))&((1<<V_ARRAY)|(1<<V_OBJECT)|(1<<V_INSTANCE)|(1<<V_MODULE)|(1<<V_CLOSURE)|(1<<V_MAP)|(1<<V_SET)|(1<<V_DEQUE)|(1<<V_PQ)))
+static void gc_possible_root(int kind,void *p);
+static void val_decref(Value *v) { if(!v||v->ref==VAL_PINNED)return; if(--v->ref<=0)val_free(v); else if(GC_TRACKED(v->type)&&!(v->gc&GC_BUFFERED))gc_possible_root(GC_VALUE,v); }
 
 static void val_free(Value *v) {
     if(!v)return;
     switch(v->type) {
-        case V_STRING: case V_FUNC: free(v->as.s); break;
-        case V_ARRAY: if(v->as.arr){for(int i=0;i<v->as.arr->len;i++)val_decref(v->as.arr->items[i]);free(v->as.arr->items);free(v->as.arr);} break;
-        case V_OBJECT: case V_MODULE: if(v->as.obj){for(int i=0;i<v->as.obj->count;i++){free(v->as.obj->pairs[i].key);val_decref(v->as.obj->pairs[i].val);}free(v->as.obj->pairs);free(v->as.obj);} break;
-        case V_INSTANCE: if(v->as.inst&&v->as.inst->props){for(int i=0;i<v->as.inst->props->count;i++){free(v->as.inst->props->pairs[i].key);val_decref(v->as.inst->props->pairs[i].val);}free(v->as.inst->props->pairs);free(v->as.inst->props);free(v->as.inst);} break;
-        case V_CLOSURE: if(v->as.cl){free(v->as.cl->name);for(int i=0;i<v->as.cl->param_n;i++)free(v->as.cl->params[i]);free(v->as.cl->params);if(v->as.cl->env)scope_free(v->as.cl->env);free(v->as.cl);} break;
+        case V_STRING: case V_BUILDER: str_free(v->as.s); break;
+        case V_TYPED: free(v->as.ta->d.p); free(v->as.ta); break;
+        case V_MAP: case V_SET: hmap_clear(v->as.map); free(v->as.map); break;
+        case V_DEQUE: for(int i=0;i<v->as.dq->len;i++)val_decref(DQ_AT(v->as.dq,i)); free(v->as.dq->items); free(v->as.dq); break;
+        case V_PQ: {PQueue *q=v->as.pq;for(int i=0;i<q->n;i++){val_decref(q->ents[i].item);val_decref(q->ents[i].pri);}val_decref(q->key);hmap_clear(&q->index);free(q->ents);free(q->heap);free(q);} break;
+        case V_ITER: iter_close(v->as.it); free(v->as.it); break;
+        case V_FILE: file_close(v->as.fh); free(v->as.fh->line); free(v->as.fh->path); free(v->as.fh); break;
+        case V_WORKER: worker_close(v->as.wk,1); if(v->as.wk->result)val_decref(v->as.wk->result); free(v->as.wk); break;
+        case V_GRAPH: {CsrGraph *g=v->as.graph;for(int i=0;i<g->n;i++)val_decref(g->ids[i]);hmap_clear(&g->index);free(g->ids);free(g->off);free(g->adj);free(g->w);free(g);} break;
+        case V_FUNC: free(v->as.s); break;
+        case V_ARRAY: if(v->as.arr){for(int i=0;i<v->as.arr->len;i++)val_decref(v->as.arr->items[i]);free(v->as.arr->items);pool_free(POOL_ARRAY,v->as.arr);} break;
+        case V_OBJECT: case V_MODULE: if(v->as.obj)obj_free(v->as.obj); break;
+        case V_INSTANCE: if(v->as.inst&&v->as.inst->props){obj_free(v->as.inst->props);pool_free(POOL_INSTANCE,v->as.inst);} break;
+        case V_CLOSURE: if(v->as.cl){free(v->as.cl->name);for(int i=0;i<v->as.cl->param_n;i++)free(v->as.cl->params[i]);free(v->as.cl->params);if(v->as.cl->env)scope_free(v->as.cl->env);for(int i=0;i<v->as.cl->upval_n;i++)upval_release(v->as.cl->upvals[i]);free(v->as.cl->upvals);free(v->as.cl);} break;
         default: break;
     }
-    free(v);
+    g_val_live[v->type]--;
+    if(v->gc&GC_BUFFERED){v->gc|=GC_DEAD;return;}
+    pool_free(POOL_VALUE,v);
 }
 
 static void arr_push(Value *arr,Value *item) { if(arr->type!=V_ARRAY)return; Array *a=arr->as.arr; if(a->len>=a->cap){a->cap*=2;a->items=xrealloc(a->items,sizeof(Value*)*a->cap);} val_incref(item); a->items[a->len++]=item; }
@@ -177,103 +327,319 @@ static Value *arr_pop(Value *arr) { if(arr->type!=V_ARRAY||arr->as.arr->len==0)r
 static Value *arr_get(Value *arr,int idx) { if(arr->type!=V_ARRAY)return NULL; Array *a=arr->as.arr; if(idx<0)idx=a->len+idx; if(idx<0||idx>=a->len)return NULL; return a->items[idx]; }
 static void arr_set(Value *arr,int idx,Value *val) { if(arr->type!=V_ARRAY)return; Array *a=arr->as.arr; if(idx<0)idx=a->len+idx; if(idx<0||idx>=a->len)return; val_decref(a->items[idx]); val_incref(val); a->items[idx]=val; }
 
-static Value *obj_get(Value *obj,const char *key) { if(obj->type!=V_OBJECT&&obj->type!=V_MODULE)return NULL; for(int i=0;i<obj->as.obj->count;i++)if(strcmp(obj->as.obj->pairs[i].key,key)==0)return obj->as.obj->pairs[i].val; return NULL; }
-static void obj_set(Value *obj,const char *key,Value *val) { if(obj->type!=V_OBJECT&&obj->type!=V_MODULE)return; Object *o=obj->as.obj; for(int i=0;i<o->count;i++){if(strcmp(o->pairs[i].key,key)==0){val_decref(o->pairs[i].val);val_incref(val);o->pairs[i].val=val;return;}} if(o->count>=o->cap){o->cap*=2;o->pairs=xrealloc(o->pairs,sizeof(KV)*o->cap);} o->pairs[o->count].key=xstrdup(key); val_incref(val); o->pairs[o->count++].val=val; }
-static int obj_has(Value *obj,const char *key) { if(obj->type!=V_OBJECT&&obj->type!=V_MODULE)return 0; for(int i=0;i<obj->as.obj->count;i++)if(strcmp(obj->as.obj->pairs[i].key,key)==0)return 1; return 0; }
-static void obj_del(Value *obj,const char *key) { if(obj->type!=V_OBJECT&&obj->type!=V_MODULE)return; Object *o=obj->as.obj; for(int i=0;i<o->count;i++){if(strcmp(o->pairs[i].key,key)==0){free(o->pairs[i].key);val_decref(o->pairs[i].val);memmove(&o->pairs[i],&o->pairs[i+1],sizeof(KV)*(o->count-i-1));o->count--;return;}} }
+/* Objects
+   Keys are interned; an object built key by key follows a path in the global
+   shape tree, so objects with the same layout share one shape (hidden class)
+   and its key->slot index. Deleting a key or outgrowing SHAPE_MAX_KEYS moves
+   the object to dictionary mode with owned keys and a private hash index. */
+#define SHAPE_MAX_KEYS 64
+#define SHAPE_LIMIT 65536
+#define OBJ_LINEAR 8
+struct Shape { Shape *parent; const char *key; int count,*index,index_cap; };
+static const char **g_interns=NULL; static int g_intern_n=0,g_intern_cap=0;
+static Shape **g_shapes=NULL; static int g_shape_n=0,g_shape_cap=0;
+static Shape g_root_shape={NULL,NULL,0,NULL,0};
 
-static Value *inst_get(Value *inst,const char *key) { if(inst->type!=V_INSTANCE)return NULL; Object *o=inst->as.inst->props; for(int i=0;i<o->count;i++)if(strcmp(o->pairs[i].key,key)==0)return o->pairs[i].val; return NULL; }
-static void inst_set(Value *inst,const char *key,Value *val) { if(inst->type!=V_INSTANCE)return; Object *o=inst->as.inst->props; for(int i=0;i<o->count;i++){if(strcmp(o->pairs[i].key,key)==0){val_decref(o->pairs[i].val);val_incref(val);o->pairs[i].val=val;return;}} if(o->count>=o->cap){o->cap*=2;o->pairs=xrealloc(o->pairs,sizeof(KV)*o->cap);} o->pairs[o->count].key=xstrdup(key); val_incref(val); o->pairs[o->count++].val=val; }
+static uint64_t str_hash(const char *s) { uint64_t h=1469598103934665603UL; while(*s)h=(h^(unsigned char)*s++)*1099511628211UL; return h; }
+static uint64_t ptr_hash(const void *p) { uint64_t h=(uint64_t)(uintptr_t)p*11400714819323198485UL; return h^(h>>29); }
+static void index_put(int *idx,int cap,uint64_t h,int pos) { uint64_t m=cap-1; for(h&=m;idx[h];h=(h+1)&m); idx[h]=pos+1; }
+static int index_cap_for(int n) { int cap=16; while(cap<n*2)cap*=2; return cap; }
 
-static Value *val_copy(Value *v) { if(!v)return val_null(); switch(v->type){case V_NULL:return val_null();case V_BOOL:return val_bool(v->as.b);case V_INT:return val_int(v->as.i);case V_FLOAT:return val_float(v->as.f);case V_STRING:return val_string(v->as.s);case V_FUNC:return val_func(v->as.s);case V_CLASS:{Value *c=val_new(V_CLASS);c->as.s=xstrdup(v->as.s);return c;}case V_CLOSURE:val_incref(v);return v;default:val_incref(v);return v;} }
-static Value *val_clone(Value *v) { if(!v)return val_null(); switch(v->type){case V_NULL:case V_BOOL:case V_INT:case V_FLOAT:case V_STRING:case V_FUNC:return val_copy(v);case V_ARRAY:{Value *arr=val_array(v->as.arr->cap);for(int i=0;i<v->as.arr->len;i++){Value *item=val_clone(v->as.arr->items[i]);arr_push(arr,item);val_decref(item);}return arr;}case V_OBJECT:{Value *obj=val_object();for(int i=0;i<v->as.obj->count;i++){Value *val=val_clone(v->as.obj->pairs[i].val);obj_set(obj,v->as.obj->pairs[i].key,val);val_decref(val);}return obj;}default:return val_copy(v);} }
+static const char *intern_find(const char *s) { if(!g_intern_cap)return NULL; uint64_t m=g_intern_cap-1; for(uint64_t i=str_hash(s)&m;g_interns[i];i=(i+1)&m)if(strcmp(g_interns[i],s)==0)return g_interns[i]; return NULL; }
+static void intern_put(const char *s) { uint64_t m=g_intern_cap-1,i; for(i=str_hash(s)&m;g_interns[i];i=(i+1)&m); g_interns[i]=s; }
+static const char *intern(const char *s) {
+    const char *k=intern_find(s); if(k)return k;
+    if((g_intern_n+1)*2>g_intern_cap){const char **old=g_interns;int n=g_intern_cap;g_intern_cap=n?n*2:256;g_interns=calloc(g_intern_cap,sizeof(char*));for(int i=0;i<n;i++)if(old[i])intern_put(old[i]);free(old);}
+    k=xstrdup(s); intern_put(k); g_intern_n++; return k;
+}
+
+/* Built-in method names; call sites resolve them to an id once so dispatch is a switch */
+#define METHOD_NAMES(X) X(map) X(filter) X(reduce) X(forEach) X(find) X(findIndex) X(every) X(some) X(includes) X(push) X(pop) X(len) X(join) \
+    X(reverse) X(sort) X(sortBy) X(slice) X(indexOf) X(upper) X(lower) X(trim) X(split) X(replace) X(substring) X(startsWith) X(endsWith) X(charAt) \
+    X(append) X(appendLine) X(length) X(toString) X(clear) X(keys) X(values) X(entries) X(hasOwnProperty) \
+    X(sum) X(mean) X(min) X(max) X(std) X(dot) X(cumsum) X(argsort) X(select) X(toArray) \
+    X(get) X(set) X(has) X(add) X(delete) X(size) X(union) X(intersection) X(difference) X(isSubset) \
+    X(pushFront) X(pushBack) X(popFront) X(popBack) X(peekFront) X(peekBack) X(peek) X(peekPriority) X(update) \
+    X(neighbors) X(bfs) X(dijkstra) X(shortestPath) X(topologicalSort) X(components) X(next) X(close) X(take) X(skip) X(send) X(recv) \
+    X(readLine) X(lines) X(read) X(write) X(flush) X(eof)
+#define METHOD_ENUM(n) M_##n,
+#define METHOD_NAME(n) #n,
+enum { M_NONE,METHOD_NAMES(METHOD_ENUM) M_COUNT };
+static const char *g_method_names[]={"",METHOD_NAMES(METHOD_NAME)};
+static unsigned char g_method_tab[256]; static int g_method_init=0;
+static int method_id(const char *name) {
+    if(!g_method_init){g_method_init=1;for(int id=1;id<M_COUNT;id++){uint64_t i=str_hash(g_method_names[id])&255;while(g_method_tab[i])i=(i+1)&255;g_method_tab[i]=id;}}
+    for(uint64_t i=str_hash(name)&255;g_method_tab[i];i=(i+1)&255)if(strcmp(g_method_names[g_method_tab[i]],name)==0)return g_method_tab[i];
+    return M_NONE;
+}
+static BuiltinFn builtin_find(const char *name);
+
+/* Child of sh adding key k, or NULL once the shape budget is spent */
+static Shape *shape_add(Shape *sh,const char *k) {
+    if(g_shape_cap){uint64_t m=g_shape_cap-1;for(uint64_t i=(ptr_hash(sh)^ptr_hash(k))&m;g_shapes[i];i=(i+1)&m)if(g_shapes[i]->parent==sh&&g_shapes[i]->key==k)return g_shapes[i];}
+    if(g_shape_n>=SHAPE_LIMIT)return NULL;
+    if((g_shape_n+1)*2>g_shape_cap){Shape **old=g_shapes;int n=g_shape_cap;g_shape_cap=n?n*2:1024;g_shapes=calloc(g_shape_cap,sizeof(Shape*));for(int j=0;j<n;j++)if(old[j]){uint64_t m=g_shape_cap-1,i;for(i=(ptr_hash(old[j]->parent)^ptr_hash(old[j]->key))&m;g_shapes[i];i=(i+1)&m);g_shapes[i]=old[j];}free(old);}
+    Shape *c=xmalloc(sizeof(Shape)); c->parent=sh; c->key=k; c->count=sh->count+1; c->index=NULL; c->index_cap=0;
+    uint64_t m=g_shape_cap-1,i; for(i=(ptr_hash(sh)^ptr_hash(k))&m;g_shapes[i];i=(i+1)&m); g_shapes[i]=c; g_shape_n++; return c;
+}
+static int shape_find(Shape *sh,KV *pairs,const char *k) {
+    if(sh->count<=OBJ_LINEAR){for(int i=0;i<sh->count;i++)if(pairs[i].key==k)return i;return -1;}
+    if(!sh->index){sh->index_cap=index_cap_for(sh->count);sh->index=calloc(sh->index_cap,sizeof(int));for(Shape *s=sh;s->count;s=s->parent)index_put(sh->index,sh->index_cap,ptr_hash(s->key),s->count-1);}
+    uint64_t m=sh->index_cap-1; for(uint64_t h=ptr_hash(k)&m;sh->index[h];h=(h+1)&m)if(pairs[sh->index[h]-1].key==k)return sh->index[h]-1; return -1;
+}
+
+static Object *obj_new(int cap) { Object *o=pool_alloc(POOL_OBJECT); o->count=0; o->cap=cap; o->pairs=xmalloc(sizeof(KV)*cap); o->shape=&g_root_shape; o->index=NULL; o->index_cap=0; return o; }
+static void obj_free(Object *o) { for(int i=0;i<o->count;i++){if(!o->shape)free(o->pairs[i].key);val_decref(o->pairs[i].val);} free(o->pairs); free(o->index); pool_free(POOL_OBJECT,o); }
+static void obj_reindex(Object *o) { free(o->index); o->index=NULL; o->index_cap=0; if(o->count<=OBJ_LINEAR)return; o->index_cap=index_cap_for(o->count); o->index=calloc(o->index_cap,sizeof(int)); for(int i=0;i<o->count;i++)index_put(o->index,o->index_cap,str_hash(o->pairs[i].key),i); }
+static void obj_to_dict(Object *o) { for(int i=0;i<o->count;i++)o->pairs[i].key=xstrdup(o->pairs[i].key); o->shape=NULL; obj_reindex(o); }
+static int obj_index(Object *o,const char *key) {
+    if(o->shape){const char *k=intern_find(key);return k?shape_find(o->shape,o->pairs,k):-1;}
+    if(!o->index){for(int i=0;i<o->count;i++)if(strcmp(o->pairs[i].key,key)==0)return i;return -1;}
+    uint64_t m=o->index_cap-1; for(uint64_t h=str_hash(key)&m;o->index[h];h=(h+1)&m)if(strcmp(o->pairs[o->index[h]-1].key,key)==0)return o->index[h]-1; return -1;
+}
+static void obj_put(Object *o,const char *key,Value *val) {
+    int i=obj_index(o,key); if(i>=0){val_incref(val);val_decref(o->pairs[i].val);o->pairs[i].val=val;return;}
+    if(o->count>=o->cap){o->cap*=2;o->pairs=xrealloc(o->pairs,sizeof(KV)*o->cap);}
+    val_incref(val);
+    if(o->shape){
+        const char *k=intern_find(key); Shape *next=NULL;
+        if(o->count<SHAPE_MAX_KEYS){if(!k&&g_shape_n<SHAPE_LIMIT)k=intern(key);if(k)next=shape_add(o->shape,k);}
+        if(next){o->pairs[o->count].key=(char*)k;o->pairs[o->count++].val=val;o->shape=next;return;}
+        obj_to_dict(o);
+    }
+    o->pairs[o->count].key=xstrdup(key); o->pairs[o->count++].val=val;
+    if(o->index&&o->count*2<=o->index_cap)index_put(o->index,o->index_cap,str_hash(key),o->count-1); else obj_reindex(o);
+}
+static void obj_remove(Object *o,const char *key) { int i=obj_index(o,key); if(i<0)return; if(o->shape)obj_to_dict(o); free(o->pairs[i].key); val_decref(o->pairs[i].val); memmove(&o->pairs[i],&o->pairs[i+1],sizeof(KV)*(o->count-i-1)); o->count--; obj_reindex(o); }
+
+static Value *obj_get(Value *obj,const char *key) { if(obj->type!=V_OBJECT&&obj->type!=V_MODULE)return NULL; int i=obj_index(obj->as.obj,key); return i>=0?obj->as.obj->pairs[i].val:NULL; }
+static void obj_set(Value *obj,const char *key,Value *val) { if(obj->type!=V_OBJECT&&obj->type!=V_MODULE)return; obj_put(obj->as.obj,key,val); }
+static int obj_has(Value *obj,const char *key) { if(obj->type!=V_OBJECT&&obj->type!=V_MODULE)return 0; return obj_index(obj->as.obj,key)>=0; }
+static void obj_del(Value *obj,const char *key) { if(obj->type!=V_OBJECT&&obj->type!=V_MODULE)return; obj_remove(obj->as.obj,key); }
+
+static Value *inst_get(Value *inst,const char *key) { if(inst->type!=V_INSTANCE)return NULL; Object *o=inst->as.inst->props; int i=obj_index(o,key); return i>=0?o->pairs[i].val:NULL; }
+static void inst_set(Value *inst,const char *key,Value *val) { if(inst->type!=V_INSTANCE)return; obj_put(inst->as.inst->props,key,val); }
+
+static Value *val_copy(Value *v) { if(!v)return val_null(); switch(v->type){case V_NULL:case V_BOOL:case V_INT:case V_FLOAT:case V_STRING:val_incref(v);return v;case V_FUNC:return val_func(v->as.s);case V_CLASS:{Value *c=val_new(V_CLASS);c->as.s=xstrdup(v->as.s);return c;}case V_CLOSURE:val_incref(v);return v;default:val_incref(v);return v;} }
+static Value *val_clone(Value *v) { if(!v)return val_null(); switch(v->type){case V_NULL:case V_BOOL:case V_INT:case V_FLOAT:case V_STRING:case V_FUNC:return val_copy(v);case V_ARRAY:{Value *arr=val_array(v->as.arr->cap);for(int i=0;i<v->as.arr->len;i++){Value *item=val_clone(v->as.arr->items[i]);arr_push(arr,item);val_decref(item);}return arr;}case V_OBJECT:{Value *obj=val_object();for(int i=0;i<v->as.obj->count;i++){Value *val=val_clone(v->as.obj->pairs[i].val);obj_set(obj,v->as.obj->pairs[i].key,val);val_decref(val);}return obj;}case V_TYPED:{Value *c=val_new(V_TYPED);TypedArr *t=xmalloc(sizeof(TypedArr));*t=*v->as.ta;t->d.p=xmalloc((size_t)t->cap*8);memcpy(t->d.p,v->as.ta->d.p,(size_t)t->len*8);c->as.ta=t;return c;}case V_MAP:case V_SET:{Value *c=hmap_new(v->type);HMap *m=v->as.map;for(int i=0;i<m->n;i++)if(m->ents[i].key){Value *val=m->ents[i].val?val_clone(m->ents[i].val):NULL;hmap_set(c->as.map,m->ents[i].key,val);if(val)val_decref(val);}return c;}case V_DEQUE:{Value *c=dq_new(v->as.dq->len);for(int i=0;i<v->as.dq->len;i++){Value *item=val_clone(DQ_AT(v->as.dq,i));dq_push(c->as.dq,item,0);val_decref(item);}return c;}default:return val_copy(v);} }
 
 static void val_sprint(Value *v,char *buf,int size) {
     if(!v){snprintf(buf,size,"null");return;} int pos=0;
     switch(v->type) {
         case V_NULL:snprintf(buf,size,"null");break; case V_BOOL:snprintf(buf,size,"%s",v->as.b?"true":"false");break;
         case V_INT:snprintf(buf,size,"%lld",v->as.i);break; case V_FLOAT:snprintf(buf,size,"%g",v->as.f);break;
-        case V_STRING:snprintf(buf,size,"%s",v->as.s);break; case V_FUNC:snprintf(buf,size,"<func:%s>",v->as.s);break;
+        case V_STRING:case V_BUILDER:snprintf(buf,size,"%s",v->as.s);break; case V_FUNC:snprintf(buf,size,"<func:%s>",v->as.s);break;
         case V_MODULE:snprintf(buf,size,"<module>");break; case V_CLASS:snprintf(buf,size,"<class:%s>",v->as.s);break;
         case V_INSTANCE:snprintf(buf,size,"<%s>",v->as.inst->cd->name);break; case V_CLOSURE:snprintf(buf,size,"<closure>");break;
         case V_ARRAY: pos+=snprintf(buf+pos,size-pos,"["); for(int i=0;i<v->as.arr->len&&i<20&&pos<size-50;i++){if(i)pos+=snprintf(buf+pos,size-pos,", ");Value *item=v->as.arr->items[i];if(item->type==V_STRING)pos+=snprintf(buf+pos,size-pos,"\"%s\"",item->as.s);else{char t[256];val_sprint(item,t,256);pos+=snprintf(buf+pos,size-pos,"%s",t);}} if(v->as.arr->len>20)pos+=snprintf(buf+pos,size-pos,"..."); snprintf(buf+pos,size-pos,"]");break;
+        case V_TYPED: pos+=snprintf(buf+pos,size-pos,"%s[",v->as.ta->kind==TA_F64?"Float64Array":"Int64Array"); for(int i=0;i<v->as.ta->len&&i<20&&pos<size-50;i++){if(i)pos+=snprintf(buf+pos,size-pos,", ");if(v->as.ta->kind==TA_F64)pos+=snprintf(buf+pos,size-pos,"%g",v->as.ta->d.f[i]);else pos+=snprintf(buf+pos,size-pos,"%lld",v->as.ta->d.i[i]);} if(v->as.ta->len>20)pos+=snprintf(buf+pos,size-pos,"..."); snprintf(buf+pos,size-pos,"]");break;
+        case V_MAP: case V_SET: case V_DEQUE: coll_sprint(v,buf,size); break;
+        case V_PQ: snprintf(buf,size,"<PriorityQueue size=%d>",v->as.pq->n); break;
+        case V_ITER: snprintf(buf,size,"<iterator>"); break;
+        case V_FILE: snprintf(buf,size,"<file:%s%s>",v->as.fh->path,v->as.fh->closed?" (closed)":""); break;
+        case V_WORKER: snprintf(buf,size,"<worker:%d%s>",v->as.wk->pid,v->as.wk->fd<0?" (finished)":""); break;
+        case V_GRAPH: snprintf(buf,size,"<CsrGraph nodes=%d edges=%d>",v->as.graph->n,v->as.graph->m); break;
         case V_OBJECT: pos+=snprintf(buf+pos,size-pos,"{"); for(int i=0;i<v->as.obj->count&&i<10&&pos<size-50;i++){if(i)pos+=snprintf(buf+pos,size-pos,", ");Value *val=v->as.obj->pairs[i].val;if(val->type==V_STRING)pos+=snprintf(buf+pos,size-pos,"%s: \"%s\"",v->as.obj->pairs[i].key,val->as.s);else{char t[256];val_sprint(val,t,256);pos+=snprintf(buf+pos,size-pos,"%s: %s",v->as.obj->pairs[i].key,t);}} if(v->as.obj->count>10)pos+=snprintf(buf+pos,size-pos,"..."); snprintf(buf+pos,size-pos,"}");break;
     }
 }
-static char *val_tostr(Value *v) { static char buf[MAX_STR]; val_sprint(v,buf,sizeof(buf)); return buf; }
-static int val_truthy(Value *v) { if(!v)return 0; switch(v->type){case V_NULL:return 0;case V_BOOL:return v->as.b;case V_INT:return v->as.i!=0;case V_FLOAT:return v->as.f!=0.0;case V_STRING:return v->as.s&&v->as.s[0];case V_ARRAY:return v->as.arr->len>0;case V_OBJECT:return v->as.obj->count>0;case V_CLOSURE:return 1;default:return 1;} }
+/* Strings are returned as-is; other values are printed into a shared buffer */
+static char *val_tostr(Value *v) { static char buf[MAX_STR]; if(v->type==V_STRING||v->type==V_BUILDER)return v->as.s; val_sprint(v,buf,sizeof(buf)); return buf; }
+static void sb_init(StrBuf *sb) { sb->s=str_alloc(64); }
+static void sb_append(StrBuf *sb,const char *s,int n) { int len=STR_HDR(sb->s)->len; sb->s=str_reserve(sb->s,len+n+1); memcpy(sb->s+len,s,n); sb->s[len+n]='\0'; STR_HDR(sb->s)->len=len+n; }
+static void sb_puts(StrBuf *sb,const char *s) { sb_append(sb,s,strlen(s)); }
+static void sb_append_val(StrBuf *sb,Value *v) { if(v->type==V_STRING||v->type==V_BUILDER)sb_append(sb,v->as.s,str_len(v)); else sb_puts(sb,val_tostr(v)); }
+static Value *sb_value(StrBuf *sb) { Value *v=val_new(V_STRING); v->as.s=sb->s; return v; }
+static void str_append_val(Value *v,Value *x) { if(x->type==V_STRING||x->type==V_BUILDER)str_append(v,x->as.s,str_len(x)); else{const char *t=val_tostr(x);str_append(v,t,strlen(t));} }
+static Value *str_concat(Value *l,Value *r) { StrBuf sb; sb_init(&sb); sb_append_val(&sb,l); sb_append_val(&sb,r); return sb_value(&sb); }
+/* s = s + x and s += x: append in place when the variable at p holds the only other reference to cur */
+static int str_append_inplace(Value **p,Value *cur,Value *rhs) { if(!p||*p!=cur||cur->type!=V_STRING||cur->ref!=2)return 0; str_append_val(cur,rhs); return 1; }
+static int val_truthy(Value *v) { if(!v)return 0; switch(v->type){case V_NULL:return 0;case V_BOOL:return v->as.b;case V_INT:return v->as.i!=0;case V_FLOAT:return v->as.f!=0.0;case V_STRING:return v->as.s&&v->as.s[0];case V_ARRAY:return v->as.arr->len>0;case V_OBJECT:return v->as.obj->count>0;case V_TYPED:return v->as.ta->len>0;case V_MAP:case V_SET:return v->as.map->live>0;case V_DEQUE:return v->as.dq->len>0;case V_PQ:return v->as.pq->n>0;case V_CLOSURE:return 1;default:return 1;} }
+/* Unboxes a number without the call for the common int/float cases */
+#define VAL_NUM(x) ((x)->type==V_FLOAT?(x)->as.f:(x)->type==V_INT?(double)(x)->as.i:val_tonum(x))
 static double val_tonum(Value *v) { if(!v)return 0; switch(v->type){case V_INT:return(double)v->as.i;case V_FLOAT:return v->as.f;case V_BOOL:return v->as.b?1.0:0.0;case V_STRING:return atof(v->as.s);default:return 0;} }
 
-static Scope *scope_new(Scope *parent) { Scope *s=xmalloc(sizeof(Scope)); s->syms=NULL; s->count=s->cap=0; s->parent=parent; return s; }
-static Scope *scope_clone(Scope *s) { 
-    if(!s)return NULL; 
-    Scope *clone=xmalloc(sizeof(Scope)); 
-    clone->count=0; clone->cap=32; 
-    clone->syms=xmalloc(sizeof(Symbol)*clone->cap); 
-    clone->parent=g_global;
-    /* Walk up scope chain and copy all variables */
-    for(Scope *cur=s; cur && cur!=g_global; cur=cur->parent) {
-        for(int i=0;i<cur->count;i++) {
-            /* Check if we already have this var (inner scope shadows outer) */
-            int found=0;
-            for(int j=0;j<clone->count;j++) {
-                if(strcmp(clone->syms[j].name,cur->syms[i].name)==0) { found=1; break; }
-            }
-            if(!found) {
-                if(clone->count>=clone->cap) { clone->cap*=2; clone->syms=xrealloc(clone->syms,sizeof(Symbol)*clone->cap); }
-                clone->syms[clone->count].name=xstrdup(cur->syms[i].name);
-                clone->syms[clone->count].val=val_copy(cur->syms[i].val);
-                clone->syms[clone->count].is_const=cur->syms[i].is_const;
-                clone->count++;
-            }
-        }
-    }
-    return clone; 
-}
-static void scope_free(Scope *s) { if(!s)return; for(int i=0;i<s->count;i++){free(s->syms[i].name);val_decref(s->syms[i].val);} free(s->syms); free(s); }
+static Scope *scope_new(Scope *parent) { Scope *s=xmalloc(sizeof(Scope)); s->syms=NULL; s->count=s->cap=0; s->refs=1; s->gc=0; s->parent=parent; if(parent)parent->refs++; g_sym_epoch++; return s; }
+/* Scopes are shared by eval-mode closures, so freeing drops a reference */
+static void scope_free(Scope *s) { if(!s)return; if(--s->refs>0){if(!(s->gc&GC_BUFFERED))gc_possible_root(GC_SCOPE,s);return;} for(int i=0;i<s->count;i++){free(s->syms[i].name);val_decref(s->syms[i].val);} free(s->syms); s->syms=NULL; s->count=0; Scope *parent=s->parent; if(s->gc&GC_BUFFERED)s->gc|=GC_DEAD; else free(s); scope_free(parent); }
 static Symbol *scope_find(Scope *s,const char *name) { while(s){for(int i=0;i<s->count;i++)if(strcmp(s->syms[i].name,name)==0)return &s->syms[i];s=s->parent;} return NULL; }
 static Symbol *scope_find_local(Scope *s,const char *name) { for(int i=0;i<s->count;i++)if(strcmp(s->syms[i].name,name)==0)return &s->syms[i]; return NULL; }
-static void scope_def(Scope *s,const char *name,Value *val,int is_const) { Symbol *ex=scope_find_local(s,name); if(ex){if(ex->is_const)runtime_error(g_line,"cannot reassign constant '%s'",name);val_decref(ex->val);val_incref(val);ex->val=val;return;} if(s->count>=s->cap){s->cap=s->cap?s->cap*2:8;s->syms=xrealloc(s->syms,sizeof(Symbol)*s->cap);} s->syms[s->count].name=xstrdup(name);val_incref(val);s->syms[s->count].val=val;s->syms[s->count++].is_const=is_const; }
+static void scope_def(Scope *s,const char *name,Value *val,int is_const) { Symbol *ex=scope_find_local(s,name); if(ex){if(ex->is_const)runtime_error(g_line,"cannot reassign constant '%s'",name);val_decref(ex->val);val_incref(val);ex->val=val;return;} if(s->count>=s->cap){s->cap=s->cap?s->cap*2:8;s->syms=xrealloc(s->syms,sizeof(Symbol)*s->cap);} s->syms[s->count].name=xstrdup(name);val_incref(val);s->syms[s->count].val=val;s->syms[s->count++].is_const=is_const; g_sym_epoch++; }
 static void scope_set(Scope *s,const char *name,Value *val) { Symbol *sym=scope_find(s,name); if(!sym){scope_def(s,name,val,0);return;} if(sym->is_const)runtime_error(g_line,"cannot reassign constant '%s'",name); val_decref(sym->val);val_incref(val);sym->val=val; }
 
-static ClassDef *class_find(const char *name) { for(int i=0;i<g_class_n;i++)if(strcmp(g_classes[i].name,name)==0)return &g_classes[i]; return NULL; }
-static Method *method_find(ClassDef *cd,const char *name) { for(int i=0;i<cd->method_n;i++)if(strcmp(cd->methods[i].name,name)==0)return &cd->methods[i]; if(cd->parent){ClassDef *p=class_find(cd->parent);if(p)return method_find(p,name);} return NULL; }
-static void class_register(ClassDef *cd) { if(g_class_n>=g_class_cap){g_class_cap=g_class_cap?g_class_cap*2:64;g_classes=xrealloc(g_classes,sizeof(ClassDef)*g_class_cap);} g_classes[g_class_n++]=*cd; }
-static FuncDef *func_find(const char *name) { for(int i=g_func_n-1;i>=0;i--)if(strcmp(g_funcs[i].name,name)==0)return &g_funcs[i]; return NULL; }
-static void func_register(AST *node) { if(g_func_n>=g_func_cap){g_func_cap=g_func_cap?g_func_cap*2:16;g_funcs=xrealloc(g_funcs,sizeof(FuncDef)*g_func_cap);} FuncDef *fn=&g_funcs[g_func_n++]; fn->name=xstrdup(node->name); fn->params=xmalloc(sizeof(char*)*node->param_n); fn->param_n=node->param_n; for(int i=0;i<node->param_n;i++)fn->params[i]=xstrdup(node->params[i]); fn->body=node->body; fn->closure=g_global; }
+/* Cycle collector
+   Reference counting cannot reclaim cycles (a graph node listing its
+   neighbours, an instance holding itself, a closure whose scope holds the
+   closure). Containers, scopes and upvalues whose count drops without reaching
+   zero are buffered as possible cycle roots; once the buffer passes
+   g_gc_threshold, the next statement boundary runs a synchronous trial deletion
+   over them (Bacon & Rajan): subtract internal references, keep what still has
+   outside references, free the rest. References held by C code and the VM
+   stack are never traversed, so they always count as outside references. */
+typedef struct { int kind; void *p; } GCNode;
+static GCNode *g_gc_roots=NULL; static int g_gc_n=0,g_gc_cap=0,g_gc_threshold=10000,g_gc_busy=0;
+static long g_gc_runs=0,g_gc_freed=0;
+static GCNode *g_gc_work=NULL; static int g_gc_work_n=0,g_gc_work_cap=0;
+
+static unsigned char *gc_flags(GCNode n) { return n.kind==GC_VALUE?&((Value*)n.p)->gc:n.kind==GC_SCOPE?&((Scope*)n.p)->gc:&((Upvalue*)n.p)->gc; }
+static int *gc_refs(GCNode n) { return n.kind==GC_VALUE?&((Value*)n.p)->ref:n.kind==GC_SCOPE?&((Scope*)n.p)->refs:&((Upvalue*)n.p)->refs; }
+static int gc_color(GCNode n) { return *gc_flags(n)&GC_COLOR; }
+static void gc_paint(GCNode n,int c) { unsigned char *f=gc_flags(n); *f=(*f&~GC_COLOR)|c; }
+static int gc_tracked(Value *v) { return v&&v->ref!=VAL_PINNED&&GC_TRACKED(v->type); }
+static void gc_possible_root(int kind,void *p) {
+    GCNode n={kind,p}; gc_paint(n,GC_PURPLE); *gc_flags(n)|=GC_BUFFERED;
+    if(g_gc_n>=g_gc_cap){g_gc_cap=g_gc_cap?g_gc_cap*2:1024;g_gc_roots=xrealloc(g_gc_roots,sizeof(GCNode)*g_gc_cap);} g_gc_roots[g_gc_n++]=n;
+}
+static void gc_push(int kind,void *p) { if(g_gc_work_n>=g_gc_work_cap){g_gc_work_cap=g_gc_work_cap?g_gc_work_cap*2:1024;g_gc_work=xrealloc(g_gc_work,sizeof(GCNode)*g_gc_work_cap);} g_gc_work[g_gc_work_n].kind=kind; g_gc_work[g_gc_work_n++].p=p; }
+static void gc_push_val(Value *v) { if(gc_tracked(v))gc_push(GC_VALUE,v); }
+static void gc_push_obj(Object *o) { for(int i=0;i<o->count;i++)gc_push_val(o->pairs[i].val); }
+/* Push every traced child of n onto the work stack */
+static void gc_children(GCNode n) {
+    if(n.kind==GC_SCOPE){Scope *s=n.p;for(int i=0;i<s->count;i++)gc_push_val(s->syms[i].val);if(s->parent)gc_push(GC_SCOPE,s->parent);return;}
+    if(n.kind==GC_UPVAL){gc_push_val(((Upvalue*)n.p)->val);return;}
+    Value *v=n.p;
+    switch(v->type){
+        case V_ARRAY: for(int i=0;i<v->as.arr->len;i++)gc_push_val(v->as.arr->items[i]); break;
+        case V_OBJECT: case V_MODULE: gc_push_obj(v->as.obj); break;
+        case V_INSTANCE: gc_push_obj(v->as.inst->props); break;
+        case V_CLOSURE: if(v->as.cl->env)gc_push(GC_SCOPE,v->as.cl->env); for(int i=0;i<v->as.cl->upval_n;i++)gc_push(GC_UPVAL,v->as.cl->upvals[i]); break;
+        case V_MAP: case V_SET: for(int i=0;i<v->as.map->n;i++){gc_push_val(v->as.map->ents[i].key);gc_push_val(v->as.map->ents[i].val);} break;
+        case V_DEQUE: for(int i=0;i<v->as.dq->len;i++)gc_push_val(DQ_AT(v->as.dq,i)); break;
+        case V_PQ: {PQueue *q=v->as.pq;for(int i=0;i<q->n;i++){gc_push_val(q->ents[i].item);gc_push_val(q->ents[i].pri);}gc_push_val(q->key);for(int i=0;i<q->index.n;i++)gc_push_val(q->index.ents[i].key);} break;
+        default: break;
+    }
+}
+static void gc_mark_gray(GCNode n) {
+    g_gc_work_n=0; gc_push(n.kind,n.p);
+    while(g_gc_work_n){GCNode m=g_gc_work[--g_gc_work_n];if(gc_color(m)==GC_GRAY)continue;gc_paint(m,GC_GRAY);int base=g_gc_work_n;gc_children(m);for(int i=base;i<g_gc_work_n;i++)(*gc_refs(g_gc_work[i]))--;}
+}
+static void gc_scan_black(GCNode n) {
+    int base=g_gc_work_n; gc_paint(n,GC_BLACK); gc_push(n.kind,n.p);
+    while(g_gc_work_n>base){GCNode m=g_gc_work[--g_gc_work_n];int top=g_gc_work_n;gc_children(m);int keep=top;
+        for(int i=top;i<g_gc_work_n;i++){GCNode t=g_gc_work[i];(*gc_refs(t))++;if(gc_color(t)!=GC_BLACK){gc_paint(t,GC_BLACK);g_gc_work[keep++]=t;}}g_gc_work_n=keep;}
+}
+static void gc_scan(GCNode n) {
+    g_gc_work_n=0; gc_push(n.kind,n.p);
+    while(g_gc_work_n){GCNode m=g_gc_work[--g_gc_work_n];if(gc_color(m)!=GC_GRAY)continue;if(*gc_refs(m)>0)gc_scan_black(m);else{gc_paint(m,GC_WHITE);gc_children(m);}}
+}
+/* Freeing white nodes takes two passes: first drop their untraced children (strings,
+   numbers), while every white node is still readable, then release the nodes themselves.
+   Traced children are either white too or already had this edge subtracted. */
+static void gc_drop_val(Value **v) { if(!gc_tracked(*v))val_decref(*v); *v=NULL; }
+static void gc_drop_leaves(GCNode n) {
+    if(n.kind==GC_SCOPE){Scope *s=n.p;for(int i=0;i<s->count;i++)gc_drop_val(&s->syms[i].val);return;}
+    if(n.kind==GC_UPVAL){gc_drop_val(&((Upvalue*)n.p)->val);return;}
+    Value *v=n.p; Object *o=v->type==V_OBJECT||v->type==V_MODULE?v->as.obj:v->type==V_INSTANCE?v->as.inst->props:NULL;
+    if(v->type==V_ARRAY)for(int i=0;i<v->as.arr->len;i++)gc_drop_val(&v->as.arr->items[i]);
+    if(o)for(int i=0;i<o->count;i++)gc_drop_val(&o->pairs[i].val);
+    if(v->type==V_MAP||v->type==V_SET)for(int i=0;i<v->as.map->n;i++){if(v->as.map->ents[i].key)gc_drop_val(&v->as.map->ents[i].key);if(v->as.map->ents[i].val)gc_drop_val(&v->as.map->ents[i].val);}
+    if(v->type==V_DEQUE)for(int i=0;i<v->as.dq->len;i++)gc_drop_val(&DQ_AT(v->as.dq,i));
+    if(v->type==V_PQ){PQueue *q=v->as.pq;for(int i=0;i<q->n;i++){gc_drop_val(&q->ents[i].item);gc_drop_val(&q->ents[i].pri);}if(q->key)gc_drop_val(&q->key);
+        for(int i=0;i<q->index.n;i++)if(q->index.ents[i].key){gc_drop_val(&q->index.ents[i].key);gc_drop_val(&q->index.ents[i].val);}}
+}
+static void gc_free_obj(Object *o) { if(!o->shape)for(int i=0;i<o->count;i++)free(o->pairs[i].key); free(o->pairs); free(o->index); pool_free(POOL_OBJECT,o); }
+static void gc_free_node(GCNode n) {
+    if(n.kind==GC_SCOPE){Scope *s=n.p;for(int i=0;i<s->count;i++)free(s->syms[i].name);free(s->syms);free(s);return;}
+    if(n.kind==GC_UPVAL){free(n.p);return;}
+    Value *v=n.p;
+    switch(v->type){
+        case V_ARRAY: free(v->as.arr->items); pool_free(POOL_ARRAY,v->as.arr); break;
+        case V_OBJECT: case V_MODULE: gc_free_obj(v->as.obj); break;
+        case V_INSTANCE: gc_free_obj(v->as.inst->props); pool_free(POOL_INSTANCE,v->as.inst); break;
+        case V_CLOSURE: {Closure *cl=v->as.cl;free(cl->name);for(int i=0;i<cl->param_n;i++)free(cl->params[i]);free(cl->params);free(cl->upvals);free(cl);} break;
+        case V_MAP: case V_SET: free(v->as.map->ents); free(v->as.map->slots); free(v->as.map); break;
+        case V_DEQUE: free(v->as.dq->items); free(v->as.dq); break;
+        case V_PQ: free(v->as.pq->ents); free(v->as.pq->heap); free(v->as.pq->index.ents); free(v->as.pq->index.slots); free(v->as.pq); break;
+        default: break;
+    }
+    g_val_live[v->type]--; pool_free(POOL_VALUE,v);
+}
+static void gc_release_dead(GCNode n) { if(n.kind==GC_VALUE)pool_free(POOL_VALUE,n.p); else free(n.p); }
+static long gc_collect(void) {
+    if(g_gc_busy)return 0; g_gc_busy=1; g_gc_runs++;
+    int n=0;
+    for(int i=0;i<g_gc_n;i++){GCNode r=g_gc_roots[i];unsigned char *f=gc_flags(r);
+        if(*f&GC_DEAD){gc_release_dead(r);continue;}
+        if(gc_color(r)==GC_PURPLE&&*gc_refs(r)>0){gc_mark_gray(r);g_gc_roots[n++]=r;}else *f&=~GC_BUFFERED;}
+    g_gc_n=n;
+    for(int i=0;i<n;i++)gc_scan(g_gc_roots[i]);
+    /* Gather the white subgraph first, then free it, so no node is read after it is released */
+    GCNode *white=NULL; int white_n=0,white_cap=0;
+    for(int i=0;i<n;i++){GCNode r=g_gc_roots[i];*gc_flags(r)&=~GC_BUFFERED;if(gc_color(r)!=GC_WHITE)continue;g_gc_work_n=0;gc_push(r.kind,r.p);
+        while(g_gc_work_n){GCNode m=g_gc_work[--g_gc_work_n];if(gc_color(m)!=GC_WHITE||(*gc_flags(m)&GC_BUFFERED))continue;gc_paint(m,GC_BLACK);gc_children(m);
+            if(white_n>=white_cap){white_cap=white_cap?white_cap*2:256;white=xrealloc(white,sizeof(GCNode)*white_cap);}white[white_n++]=m;}}
+    g_gc_n=0;
+    for(int i=0;i<white_n;i++)gc_drop_leaves(white[i]);
+    for(int i=0;i<white_n;i++)gc_free_node(white[i]);
+    free(white); g_gc_freed+=white_n; g_gc_busy=0; return white_n;
+}
+#define GC_SAFEPOINT() do{ if(g_gc_n>=g_gc_threshold&&g_gc_threshold>0)gc_collect(); }while(0)
+
+static ClassDef *class_find(const char *name) { for(int i=0;i<g_class_n;i++)if(strcmp(g_classes[i]->name,name)==0)return g_classes[i]; return NULL; }
+static Method *method_find(ClassDef *cd,const char *name) { for(int i=0;i<cd->method_n;i++)if(strcmp(cd->methods[i].name,name)==0)return &cd->methods[i]; if(cd->parent&&!cd->super)cd->super=class_find(cd->parent); return cd->super?method_find(cd->super,name):NULL; }
+static void class_register(ClassDef *cd) { if(g_class_n>=g_class_cap){g_class_cap=g_class_cap?g_class_cap*2:64;g_classes=xrealloc(g_classes,sizeof(ClassDef*)*g_class_cap);} ClassDef *c=xmalloc(sizeof(ClassDef)); *c=*cd; g_classes[g_class_n++]=c; }
+/* Name -> index+1 of the latest definition, so redefinitions shadow earlier ones */
+static int *g_func_tab=NULL; static int g_func_tab_cap=0; static unsigned g_func_epoch=1; /* bumped on every definition */
+static void func_index(int idx) { uint64_t m=g_func_tab_cap-1,i; for(i=str_hash(g_funcs[idx].name)&m;g_func_tab[i];i=(i+1)&m)if(strcmp(g_funcs[g_func_tab[i]-1].name,g_funcs[idx].name)==0)break; g_func_tab[i]=idx+1; }
+static FuncDef *func_find(const char *name) { if(!g_func_tab_cap)return NULL; uint64_t m=g_func_tab_cap-1; for(uint64_t i=str_hash(name)&m;g_func_tab[i];i=(i+1)&m)if(strcmp(g_funcs[g_func_tab[i]-1].name,name)==0)return &g_funcs[g_func_tab[i]-1]; return NULL; }
+static void func_register(AST *node) { if(g_func_n>=g_func_cap){g_func_cap=g_func_cap?g_func_cap*2:16;g_funcs=xrealloc(g_funcs,sizeof(FuncDef)*g_func_cap);} FuncDef *fn=&g_funcs[g_func_n++]; g_func_epoch++; fn->name=xstrdup(node->name); fn->params=xmalloc(sizeof(char*)*node->param_n); fn->param_n=node->param_n; for(int i=0;i<node->param_n;i++)fn->params[i]=xstrdup(node->params[i]); fn->body=node->body; fn->closure=g_global; fn->mod=node->mod;
+    if(g_func_n*2>g_func_tab_cap){free(g_func_tab);g_func_tab_cap=g_func_tab_cap?g_func_tab_cap*2:64;g_func_tab=calloc(g_func_tab_cap,sizeof(int));for(int i=0;i<g_func_n;i++)func_index(i);}else func_index(g_func_n-1); }
 
 /* Lexer */
 static void skip_ws(void) { while(g_pos<g_len){char c=g_src[g_pos];if(c==' '||c=='\t'||c=='\r'){g_pos++;continue;}if(c=='\n'){g_pos++;g_line++;continue;}if((c=='/'&&g_pos+1<g_len&&g_src[g_pos+1]=='/')||c=='#'){if(c=='/')g_pos+=2;else g_pos++;while(g_pos<g_len&&g_src[g_pos]!='\n')g_pos++;continue;}if(c=='/'&&g_pos+1<g_len&&g_src[g_pos+1]=='*'){g_pos+=2;while(g_pos+1<g_len){if(g_src[g_pos]=='\n')g_line++;if(g_src[g_pos]=='*'&&g_src[g_pos+1]=='/'){g_pos+=2;break;}g_pos++;}continue;}break;} }
 
+/* Copy source [from,to) into dst resolving backslash escapes; returns the length written */
+static int lex_unescape(char *dst,int from,int to) { int n=0; for(int i=from;i<to;i++){char c=g_src[i];if(c=='\\'&&i+1<to){c=g_src[++i];c=c=='n'?'\n':c=='t'?'\t':c=='r'?'\r':c;}dst[n++]=c;} dst[n]='\0'; return n; }
+static void tpl_add(Token *tk,int is_expr,char *text) { tk->tpl=xrealloc(tk->tpl,sizeof(TemplatePart)*(tk->tpl_n+1)); tk->tpl[tk->tpl_n].is_expr=is_expr; tk->tpl[tk->tpl_n++].text=text; }
+static void tpl_add_text(Token *tk,int from,int to) { char *d=xmalloc(to-from+1); lex_unescape(d,from,to); tpl_add(tk,0,d); }
+
 static void lex_template(Token *tk,char quote) {
-    tk->tpl=NULL; tk->tpl_n=0; g_pos++; char buf[MAX_TOK]; int bp=0;
+    g_pos++; int start=g_pos,esc=0;
     while(g_pos<g_len) {
-        char c=g_src[g_pos]; if(c==quote){g_pos++;break;} if(c=='\n')g_line++;
-        if(c=='{'&&g_pos+1<g_len&&g_src[g_pos+1]=='{') { if(bp>0){buf[bp]='\0';tk->tpl=xrealloc(tk->tpl,sizeof(TemplatePart)*(tk->tpl_n+1));tk->tpl[tk->tpl_n].is_expr=0;tk->tpl[tk->tpl_n++].text=xstrdup(buf);bp=0;} g_pos+=2; char expr[MAX_TOK];int ep=0,depth=0; while(g_pos<g_len&&ep<MAX_TOK-1){if(g_src[g_pos]=='{'){depth++;expr[ep++]=g_src[g_pos++];}else if(g_src[g_pos]=='}'){if(depth>0){depth--;expr[ep++]=g_src[g_pos++];}else if(g_pos+1<g_len&&g_src[g_pos+1]=='}'){g_pos+=2;break;}else expr[ep++]=g_src[g_pos++];}else{if(g_src[g_pos]=='\n')g_line++;expr[ep++]=g_src[g_pos++];}} expr[ep]='\0'; tk->tpl=xrealloc(tk->tpl,sizeof(TemplatePart)*(tk->tpl_n+1));tk->tpl[tk->tpl_n].is_expr=1;tk->tpl[tk->tpl_n++].text=xstrdup(expr);continue; }
-        if(c=='\\'&&g_pos+1<g_len){g_pos++;char n=g_src[g_pos++];switch(n){case 'n':buf[bp++]='\n';break;case 't':buf[bp++]='\t';break;case 'r':buf[bp++]='\r';break;case '\\':case '"':case '\'':case '{':buf[bp++]=n;break;default:buf[bp++]=n;}continue;}
-        buf[bp++]=c; g_pos++;
+        char c=g_src[g_pos]; if(c==quote)break; if(c=='\n')g_line++;
+        if(c=='{'&&g_pos+1<g_len&&g_src[g_pos+1]=='{') {
+            if(g_pos>start)tpl_add_text(tk,start,g_pos);
+            g_pos+=2; int from=g_pos,depth=0;
+            while(g_pos<g_len){c=g_src[g_pos];if(c=='{')depth++;else if(c=='}'){if(depth>0)depth--;else if(g_pos+1<g_len&&g_src[g_pos+1]=='}')break;}else if(c=='\n')g_line++;g_pos++;}
+            tpl_add(tk,1,xstrndup(g_src+from,g_pos-from)); if(g_pos<g_len)g_pos+=2; start=g_pos; continue;
+        }
+        if(c=='\\'&&g_pos+1<g_len){esc=1;g_pos+=2;continue;}
+        g_pos++;
     }
-    if(bp>0){buf[bp]='\0';tk->tpl=xrealloc(tk->tpl,sizeof(TemplatePart)*(tk->tpl_n+1));tk->tpl[tk->tpl_n].is_expr=0;tk->tpl[tk->tpl_n++].text=xstrdup(buf);}
-    int has_expr=0; for(int i=0;i<tk->tpl_n;i++)if(tk->tpl[i].is_expr){has_expr=1;break;}
-    if(has_expr){tk->type=TOK_TEMPLATE;tk->text[0]='\0';}
-    else{tk->type=TOK_STRING;int pos=0;for(int i=0;i<tk->tpl_n&&pos<MAX_TOK-1;i++){int len=strlen(tk->tpl[i].text);if(pos+len<MAX_TOK-1){strcpy(tk->text+pos,tk->tpl[i].text);pos+=len;}free(tk->tpl[i].text);}tk->text[pos]='\0';free(tk->tpl);tk->tpl=NULL;tk->tpl_n=0;}
+    int end=g_pos; if(g_pos<g_len)g_pos++;
+    if(tk->tpl_n){if(end>start)tpl_add_text(tk,start,end);tk->type=TOK_TEMPLATE;return;}
+    tk->type=TOK_STRING;
+    if(esc){char *d=arena_alloc(end-start+1);tk->len=lex_unescape(d,start,end);tk->text=d;}else{tk->text=g_src+start;tk->len=end-start;}
 }
 
-static void lex_number(Token *tk) { int i=0,has_dot=0; while(g_pos<g_len&&i<MAX_TOK-1){char c=g_src[g_pos];if(isdigit((unsigned char)c)){tk->text[i++]=c;g_pos++;}else if(c=='.'&&!has_dot&&g_pos+1<g_len&&isdigit((unsigned char)g_src[g_pos+1])){has_dot=1;tk->text[i++]=c;g_pos++;}else if((c=='e'||c=='E')&&i>0){tk->text[i++]=c;g_pos++;if(g_pos<g_len&&(g_src[g_pos]=='+'||g_src[g_pos]=='-'))tk->text[i++]=g_src[g_pos++];}else break;} tk->text[i]='\0';tk->num=atof(tk->text);tk->type=TOK_NUMBER; }
+static void lex_number(Token *tk) { int has_dot=0; while(g_pos<g_len){char c=g_src[g_pos];if(isdigit((unsigned char)c))g_pos++;else if(c=='.'&&!has_dot&&g_pos+1<g_len&&isdigit((unsigned char)g_src[g_pos+1])){has_dot=1;g_pos++;}else if(c=='e'||c=='E'){g_pos++;if(g_pos<g_len&&(g_src[g_pos]=='+'||g_src[g_pos]=='-'))g_pos++;}else break;}
+    tk->len=g_src+g_pos-tk->text; char buf[64]; int n=tk->len<63?tk->len:63; memcpy(buf,tk->text,n); buf[n]='\0'; tk->num=atof(buf); tk->type=TOK_NUMBER; }
 
-static void next_tok(Token *tk) {
-    skip_ws(); memset(tk,0,sizeof(Token)); tk->line=g_line;
-    if(g_pos>=g_len){tk->type=TOK_EOF;return;}
-    char c=g_src[g_pos];
-    if(c=='"'||c=='\''||c=='`'){lex_template(tk,c);return;}
-    if(isdigit((unsigned char)c)){lex_number(tk);return;}
-    if(isalpha((unsigned char)c)||c=='_') {
-        int i=0;while(g_pos<g_len&&(isalnum((unsigned char)g_src[g_pos])||g_src[g_pos]=='_')&&i<MAX_TOK-1)tk->text[i++]=g_src[g_pos++];tk->text[i]='\0';
-        struct{const char *kw;TokType t;}kws[]={{"if",TOK_IF},{"else",TOK_ELSE},{"for",TOK_FOR},{"in",TOK_IN},{"while",TOK_WHILE},{"func",TOK_FUNC},{"fn",TOK_FUNC},{"function",TOK_FUNC},{"return",TOK_RETURN},{"break",TOK_BREAK},{"continue",TOK_CONTINUE},{"const",TOK_CONST},{"let",TOK_CONST},{"null",TOK_NULL},{"nil",TOK_NULL},{"undefined",TOK_NULL},{"true",TOK_TRUE},{"false",TOK_FALSE},{"case",TOK_CASE},{"default",TOK_DEFAULT},{"class",TOK_CLASS},{"new",TOK_NEW},{"this",TOK_THIS},{"extends",TOK_EXTENDS},{"super",TOK_SUPER},{"import",TOK_IMPORT},{"as",TOK_AS},{"export",TOK_EXPORT},{NULL,TOK_UNKNOWN}};
-        for(int k=0;kws[k].kw;k++)if(strcmp(tk->text,kws[k].kw)==0){tk->type=kws[k].t;return;} tk->type=TOK_IDENT;return;
+#define KW(w,t) if(n==(int)sizeof(w)-1&&memcmp(s,w,n)==0)return t
+static TokType lex_keyword(const char *s,int n) {
+    switch(s[0]){
+        case 'a':KW("as",TOK_AS);break;
+        case 'b':KW("break",TOK_BREAK);break;
+        case 'c':KW("case",TOK_CASE);KW("class",TOK_CLASS);KW("const",TOK_CONST);KW("continue",TOK_CONTINUE);break;
+        case 'd':KW("default",TOK_DEFAULT);break;
+        case 'e':KW("else",TOK_ELSE);KW("extends",TOK_EXTENDS);KW("export",TOK_EXPORT);break;
+        case 'f':KW("for",TOK_FOR);KW("fn",TOK_FUNC);KW("func",TOK_FUNC);KW("function",TOK_FUNC);KW("false",TOK_FALSE);break;
+        case 'i':KW("if",TOK_IF);KW("in",TOK_IN);KW("import",TOK_IMPORT);break;
+        case 'l':KW("let",TOK_CONST);break;
+        case 'n':KW("null",TOK_NULL);KW("nil",TOK_NULL);KW("new",TOK_NEW);break;
+        case 'r':KW("return",TOK_RETURN);break;
+        case 's':KW("super",TOK_SUPER);break;
+        case 't':KW("true",TOK_TRUE);KW("this",TOK_THIS);break;
+        case 'u':KW("undefined",TOK_NULL);break;
+        case 'w':KW("while",TOK_WHILE);break;
+        case 'y':KW("yield",TOK_YIELD);break;
     }
+    return TOK_IDENT;
+}
+#undef KW
+
+static void lex_op(Token *tk,char c) {
     char c2=(g_pos+1<g_len)?g_src[g_pos+1]:'\0';
-    if(c=='='&&c2=='>'){g_pos+=2;tk->type=TOK_ARROW;strcpy(tk->text,"=>");return;}
+    if(c=='='&&c2=='>'){g_pos+=2;tk->type=TOK_ARROW;return;}
     if(c=='.'&&c2=='.'){g_pos+=2;tk->type=TOK_RANGE;return;}
     if(c=='='&&c2=='='){g_pos+=2;tk->type=TOK_EQ;return;} if(c=='!'&&c2=='='){g_pos+=2;tk->type=TOK_NEQ;return;}
     if(c=='<'&&c2=='='){g_pos+=2;tk->type=TOK_LE;return;} if(c=='>'&&c2=='='){g_pos+=2;tk->type=TOK_GE;return;}
@@ -284,56 +650,77 @@ static void next_tok(Token *tk) {
     if(c=='/'&&c2=='='){g_pos+=2;tk->type=TOK_DIVEQ;return;} if(c=='%'&&c2=='='){g_pos+=2;tk->type=TOK_MODEQ;return;}
     g_pos++;
     switch(c){case'(':tk->type=TOK_LPAREN;return;case')':tk->type=TOK_RPAREN;return;case'{':tk->type=TOK_LBRACE;return;case'}':tk->type=TOK_RBRACE;return;case'[':tk->type=TOK_LBRACKET;return;case']':tk->type=TOK_RBRACKET;return;case',':tk->type=TOK_COMMA;return;case':':tk->type=TOK_COLON;return;case';':tk->type=TOK_SEMICOLON;return;case'.':tk->type=TOK_DOT;return;case'?':tk->type=TOK_QUESTION;return;case'+':tk->type=TOK_PLUS;return;case'-':tk->type=TOK_MINUS;return;case'*':tk->type=TOK_MUL;return;case'/':tk->type=TOK_DIV;return;case'%':tk->type=TOK_MOD;return;case'=':tk->type=TOK_ASSIGN;return;case'<':tk->type=TOK_LT;return;case'>':tk->type=TOK_GT;return;case'!':tk->type=TOK_NOT;return;}
-    tk->type=TOK_UNKNOWN;tk->text[0]=c;tk->text[1]='\0';
+    tk->type=TOK_UNKNOWN;
+}
+
+static void next_tok(Token *tk) {
+    skip_ws(); tk->line=g_line; tk->text=g_src+g_pos; tk->len=0; tk->num=0; tk->tpl=NULL; tk->tpl_n=0;
+    if(g_pos>=g_len){tk->type=TOK_EOF;return;}
+    char c=g_src[g_pos];
+    if(c=='"'||c=='\''||c=='`'){lex_template(tk,c);return;}
+    if(isdigit((unsigned char)c)){lex_number(tk);return;}
+    if(isalpha((unsigned char)c)||c=='_') {
+        while(g_pos<g_len&&(isalnum((unsigned char)g_src[g_pos])||g_src[g_pos]=='_'))g_pos++;
+        tk->len=g_src+g_pos-tk->text; tk->type=lex_keyword(tk->text,tk->len); return;
+    }
+    lex_op(tk,c); tk->len=g_src+g_pos-tk->text;
 }
 
 static void advance(void){next_tok(&g_tok);}
+static char *tok_dup(void){return xstrndup(g_tok.text,g_tok.len);}
 static int tok_accept(TokType t){if(g_tok.type==t){advance();return 1;}return 0;}
 static void expect(TokType t,const char *msg){if(g_tok.type!=t)error(g_tok.line,"%s",msg);advance();}
 
 /* Parser */
 static AST *parse_expr(void);
+/* Parse an embedded expression (template part) without disturbing the main lexer */
+static AST *parse_fragment(char *text,int line){char *saved_src=g_src;int saved_pos=g_pos,saved_len=g_len,saved_line=g_line;Token saved_tok=g_tok;g_src=text;g_len=strlen(text);g_pos=0;g_line=line;advance();AST *expr=parse_expr();g_src=saved_src;g_pos=saved_pos;g_len=saved_len;g_line=saved_line;g_tok=saved_tok;return expr;}
 static AST *parse_stmt(void);
 static AST *parse_block(void);
-static AST *ast_new(ASTType type){AST *n=xmalloc(sizeof(AST));memset(n,0,sizeof(AST));n->type=type;n->line=g_tok.line;return n;}
+/* Set while parsing a function body once it contains `yield`, which makes it a generator */
+static int g_parse_gen=0;
+static int g_module=0,g_module_n=0; static const char *g_parse_fn=NULL; /* named function whose body is being parsed */
+static AST *parse_fn_body(void){int outer=g_parse_gen;g_parse_gen=0;AST *body=parse_block();body->is_gen=g_parse_gen;g_parse_gen=outer;return body;}
+static AST *ast_new(ASTType type){AST *n=arena_alloc(sizeof(AST));g_ast_n++;memset(n,0,sizeof(AST));n->type=type;n->line=g_tok.line;n->mod=g_module;return n;}
 static void ast_add_child(AST *p,AST *c){p->children=xrealloc(p->children,sizeof(AST*)*(p->child_n+1));p->children[p->child_n++]=c;}
 
-static int is_arrow_function(void) {
-    if(g_tok.type==TOK_LPAREN){int sp=g_pos,sl=g_line;Token st=g_tok;advance();int d=1;while(g_tok.type!=TOK_EOF&&d>0){if(g_tok.type==TOK_LPAREN)d++;else if(g_tok.type==TOK_RPAREN)d--;advance();}int r=(g_tok.type==TOK_ARROW);g_pos=sp;g_line=sl;g_tok=st;return r;}
-    if(g_tok.type==TOK_IDENT){int sp=g_pos,sl=g_line;Token st=g_tok;advance();int r=(g_tok.type==TOK_ARROW);g_pos=sp;g_line=sl;g_tok=st;return r;}
-    return 0;
-}
-
-static AST *parse_arrow_function(void) {
-    AST *fn=ast_new(AST_ARROW);fn->is_arrow=1;
-    if(g_tok.type==TOK_IDENT){fn->params=xmalloc(sizeof(char*));fn->params[0]=xstrdup(g_tok.text);fn->param_n=1;advance();}
-    else{expect(TOK_LPAREN,"expected '('");while(g_tok.type!=TOK_RPAREN&&g_tok.type!=TOK_EOF){if(g_tok.type!=TOK_IDENT)error(g_tok.line,"expected parameter");fn->params=xrealloc(fn->params,sizeof(char*)*(fn->param_n+1));fn->params[fn->param_n++]=xstrdup(g_tok.text);advance();if(!tok_accept(TOK_COMMA))break;}expect(TOK_RPAREN,"expected ')'");}
+/* Arrow functions are recognised once the parameter list is behind us: `x =>` after an
+   identifier, or `=>` after a parenthesised list that turns out to hold only names */
+static AST *parse_arrow_body(AST *fn) {
     expect(TOK_ARROW,"expected '=>'");
-    if(g_tok.type==TOK_LBRACE)fn->body=parse_block();
+    if(g_tok.type==TOK_LBRACE)fn->body=parse_fn_body();
     else{AST *ret=ast_new(AST_RETURN);ret->left=parse_expr();fn->body=ret;}
     return fn;
 }
+static AST *parse_paren(void) {
+    int line=g_tok.line;advance();AST **items=NULL;int n=0;
+    while(g_tok.type!=TOK_RPAREN&&g_tok.type!=TOK_EOF){items=xrealloc(items,sizeof(AST*)*(n+1));items[n++]=parse_expr();if(!tok_accept(TOK_COMMA))break;}
+    if(g_tok.type==TOK_RPAREN&&n==1){advance();if(g_tok.type!=TOK_ARROW){AST *e=items[0];free(items);return e;}}
+    else{expect(TOK_RPAREN,"expected ')'");if(g_tok.type!=TOK_ARROW)error(n?line:g_tok.line,n?"expected ')'":"expected '=>'");}
+    AST *fn=ast_new(AST_ARROW);fn->is_arrow=1;fn->line=line;fn->param_n=n;fn->params=n?xmalloc(sizeof(char*)*n):NULL;
+    for(int i=0;i<n;i++){if(items[i]->type!=AST_VAR)error(items[i]->line,"expected parameter");fn->params[i]=items[i]->name;}
+    free(items);return parse_arrow_body(fn);
+}
 
 static AST *parse_primary(void) {
-    if(is_arrow_function())return parse_arrow_function();
     if(g_tok.type==TOK_NUMBER){AST *n=ast_new(AST_LITERAL);double v=g_tok.num;n->lit=(v==(long long)v&&v>=LLONG_MIN&&v<=LLONG_MAX)?val_int((long long)v):val_float(v);advance();return n;}
-    if(g_tok.type==TOK_STRING){AST *n=ast_new(AST_LITERAL);n->lit=val_string(g_tok.text);advance();return n;}
-    if(g_tok.type==TOK_TEMPLATE){AST *n=ast_new(AST_TEMPLATE);n->tpl=g_tok.tpl;n->tpl_n=g_tok.tpl_n;advance();return n;}
+    if(g_tok.type==TOK_STRING){AST *n=ast_new(AST_LITERAL);n->lit=val_string_n(g_tok.text,g_tok.len);advance();return n;}
+    if(g_tok.type==TOK_TEMPLATE){AST *n=ast_new(AST_TEMPLATE);n->tpl=g_tok.tpl;n->tpl_n=g_tok.tpl_n;for(int i=0;i<n->tpl_n;i++)if(n->tpl[i].is_expr)ast_add_child(n,parse_fragment(n->tpl[i].text,g_tok.line));advance();return n;}
     if(g_tok.type==TOK_TRUE){AST *n=ast_new(AST_LITERAL);n->lit=val_bool(1);advance();return n;}
     if(g_tok.type==TOK_FALSE){AST *n=ast_new(AST_LITERAL);n->lit=val_bool(0);advance();return n;}
     if(g_tok.type==TOK_NULL){AST *n=ast_new(AST_LITERAL);n->lit=val_null();advance();return n;}
-    if(g_tok.type==TOK_IDENT){AST *n=ast_new(AST_VAR);n->name=xstrdup(g_tok.text);advance();return n;}
-    if(g_tok.type==TOK_LPAREN){advance();AST *e=parse_expr();expect(TOK_RPAREN,"expected ')'");return e;}
+    if(g_tok.type==TOK_IDENT){AST *n=ast_new(AST_VAR);n->name=tok_dup();advance();if(g_tok.type!=TOK_ARROW)return n;AST *fn=ast_new(AST_ARROW);fn->is_arrow=1;fn->line=n->line;fn->params=xmalloc(sizeof(char*));fn->params[0]=n->name;fn->param_n=1;return parse_arrow_body(fn);}
+    if(g_tok.type==TOK_LPAREN)return parse_paren();
     if(g_tok.type==TOK_LBRACKET){advance();AST *arr=ast_new(AST_ARRAY);while(g_tok.type!=TOK_RBRACKET&&g_tok.type!=TOK_EOF){ast_add_child(arr,parse_expr());if(!tok_accept(TOK_COMMA))break;}expect(TOK_RBRACKET,"expected ']'");return arr;}
-    if(g_tok.type==TOK_LBRACE){advance();AST *obj=ast_new(AST_OBJECT);while(g_tok.type!=TOK_RBRACE&&g_tok.type!=TOK_EOF){char *key=NULL;if(g_tok.type==TOK_STRING||g_tok.type==TOK_IDENT){key=xstrdup(g_tok.text);advance();}else error(g_tok.line,"expected object key");expect(TOK_COLON,"expected ':'");obj->keys=xrealloc(obj->keys,sizeof(char*)*(obj->child_n+1));obj->keys[obj->child_n]=key;ast_add_child(obj,parse_expr());if(!tok_accept(TOK_COMMA))break;}expect(TOK_RBRACE,"expected '}'");return obj;}
-    if(g_tok.type==TOK_FUNC){advance();AST *fn=ast_new(AST_FUNC);fn->name=NULL;expect(TOK_LPAREN,"expected '('");while(g_tok.type!=TOK_RPAREN&&g_tok.type!=TOK_EOF){if(g_tok.type!=TOK_IDENT)error(g_tok.line,"expected parameter");fn->params=xrealloc(fn->params,sizeof(char*)*(fn->param_n+1));fn->params[fn->param_n++]=xstrdup(g_tok.text);advance();if(!tok_accept(TOK_COMMA))break;}expect(TOK_RPAREN,"expected ')'");fn->body=parse_block();return fn;}
-    if(g_tok.type==TOK_NEW){advance();AST *n=ast_new(AST_NEW);if(g_tok.type!=TOK_IDENT)error(g_tok.line,"expected class name");n->name=xstrdup(g_tok.text);advance();expect(TOK_LPAREN,"expected '('");while(g_tok.type!=TOK_RPAREN&&g_tok.type!=TOK_EOF){ast_add_child(n,parse_expr());if(!tok_accept(TOK_COMMA))break;}expect(TOK_RPAREN,"expected ')'");return n;}
+    if(g_tok.type==TOK_LBRACE){advance();AST *obj=ast_new(AST_OBJECT);while(g_tok.type!=TOK_RBRACE&&g_tok.type!=TOK_EOF){char *key=NULL;if(g_tok.type==TOK_STRING||g_tok.type==TOK_IDENT){key=tok_dup();advance();}else error(g_tok.line,"expected object key");expect(TOK_COLON,"expected ':'");obj->keys=xrealloc(obj->keys,sizeof(char*)*(obj->child_n+1));obj->keys[obj->child_n]=key;ast_add_child(obj,parse_expr());if(!tok_accept(TOK_COMMA))break;}expect(TOK_RBRACE,"expected '}'");return obj;}
+    if(g_tok.type==TOK_FUNC){advance();AST *fn=ast_new(AST_FUNC);fn->name=NULL;expect(TOK_LPAREN,"expected '('");while(g_tok.type!=TOK_RPAREN&&g_tok.type!=TOK_EOF){if(g_tok.type!=TOK_IDENT)error(g_tok.line,"expected parameter");fn->params=xrealloc(fn->params,sizeof(char*)*(fn->param_n+1));fn->params[fn->param_n++]=tok_dup();advance();if(!tok_accept(TOK_COMMA))break;}expect(TOK_RPAREN,"expected ')'");fn->body=parse_fn_body();return fn;}
+    if(g_tok.type==TOK_NEW){advance();AST *n=ast_new(AST_NEW);if(g_tok.type!=TOK_IDENT)error(g_tok.line,"expected class name");n->name=tok_dup();advance();expect(TOK_LPAREN,"expected '('");while(g_tok.type!=TOK_RPAREN&&g_tok.type!=TOK_EOF){ast_add_child(n,parse_expr());if(!tok_accept(TOK_COMMA))break;}expect(TOK_RPAREN,"expected ')'");return n;}
     if(g_tok.type==TOK_THIS){AST *n=ast_new(AST_THIS);advance();return n;}
     if(g_tok.type==TOK_SUPER){AST *n=ast_new(AST_SUPER);advance();return n;}
-    error(g_tok.line,"unexpected token '%s'",g_tok.text);return NULL;
+    error(g_tok.line,"unexpected token '%.*s'",g_tok.len,g_tok.text);return NULL;
 }
 
-static AST *parse_postfix(void) { AST *node=parse_primary(); while(1){if(g_tok.type==TOK_LBRACKET){advance();AST *idx=ast_new(AST_INDEX);idx->left=node;idx->right=parse_expr();expect(TOK_RBRACKET,"expected ']'");node=idx;}else if(g_tok.type==TOK_DOT){advance();if(g_tok.type!=TOK_IDENT)error(g_tok.line,"expected identifier");AST *mem=ast_new(AST_MEMBER);mem->left=node;mem->name=xstrdup(g_tok.text);advance();node=mem;}else if(g_tok.type==TOK_LPAREN){advance();AST *call=ast_new(AST_CALL);call->left=node;while(g_tok.type!=TOK_RPAREN&&g_tok.type!=TOK_EOF){ast_add_child(call,parse_expr());if(!tok_accept(TOK_COMMA))break;}expect(TOK_RPAREN,"expected ')'");node=call;}else if(g_tok.type==TOK_PLUSPLUS||g_tok.type==TOK_MINUSMINUS){AST *post=ast_new(AST_UNARY);strcpy(post->op,g_tok.type==TOK_PLUSPLUS?"++p":"--p");post->left=node;advance();node=post;}else break;} return node; }
+static AST *parse_postfix(void) { AST *node=parse_primary(); while(1){if(g_tok.type==TOK_LBRACKET){advance();AST *idx=ast_new(AST_INDEX);idx->left=node;idx->right=parse_expr();expect(TOK_RBRACKET,"expected ']'");node=idx;}else if(g_tok.type==TOK_DOT){advance();if(g_tok.type!=TOK_IDENT)error(g_tok.line,"expected identifier");AST *mem=ast_new(AST_MEMBER);mem->left=node;mem->name=tok_dup();advance();node=mem;}else if(g_tok.type==TOK_LPAREN){advance();AST *call=ast_new(AST_CALL);call->left=node;if(node->type==AST_VAR){call->bi=builtin_find(node->name);if(call->bi&&g_parse_fn&&!strcmp(g_parse_fn,node->name))call->mod=-1;}else if(node->type==AST_MEMBER)call->mid=method_id(node->name);while(g_tok.type!=TOK_RPAREN&&g_tok.type!=TOK_EOF){ast_add_child(call,parse_expr());if(!tok_accept(TOK_COMMA))break;}expect(TOK_RPAREN,"expected ')'");node=call;}else if(g_tok.type==TOK_PLUSPLUS||g_tok.type==TOK_MINUSMINUS){AST *post=ast_new(AST_UNARY);strcpy(post->op,g_tok.type==TOK_PLUSPLUS?"++p":"--p");post->left=node;advance();node=post;}else break;} return node; }
 static AST *parse_unary(void) { if(g_tok.type==TOK_MINUS||g_tok.type==TOK_NOT||g_tok.type==TOK_PLUS||g_tok.type==TOK_PLUSPLUS||g_tok.type==TOK_MINUSMINUS){AST *n=ast_new(AST_UNARY);switch(g_tok.type){case TOK_MINUS:strcpy(n->op,"-");break;case TOK_NOT:strcpy(n->op,"!");break;case TOK_PLUS:strcpy(n->op,"+");break;case TOK_PLUSPLUS:strcpy(n->op,"++");break;case TOK_MINUSMINUS:strcpy(n->op,"--");break;default:break;}advance();n->right=parse_unary();return n;} return parse_postfix(); }
 static AST *parse_power(void){AST *node=parse_unary();if(g_tok.type==TOK_POW){AST *n=ast_new(AST_BINOP);strcpy(n->op,"**");advance();n->left=node;n->right=parse_power();return n;}return node;}
 static AST *parse_mul(void){AST *node=parse_power();while(g_tok.type==TOK_MUL||g_tok.type==TOK_DIV||g_tok.type==TOK_MOD){AST *n=ast_new(AST_BINOP);strcpy(n->op,g_tok.type==TOK_MUL?"*":g_tok.type==TOK_DIV?"/":"%");advance();n->left=node;n->right=parse_power();node=n;}return node;}
@@ -348,15 +735,16 @@ static AST *parse_block(void){expect(TOK_LBRACE,"expected '{'");AST *blk=ast_new
 
 static AST *parse_stmt(void) {
     while(tok_accept(TOK_SEMICOLON));
-    if(g_tok.type==TOK_IMPORT){advance();AST *imp=ast_new(AST_IMPORT);if(g_tok.type!=TOK_STRING)error(g_tok.line,"expected import path");imp->imp_path=xstrdup(g_tok.text);advance();if(g_tok.type==TOK_AS){advance();if(g_tok.type!=TOK_IDENT)error(g_tok.line,"expected alias");imp->imp_alias=xstrdup(g_tok.text);advance();}else{char *slash=strrchr(imp->imp_path,'/');if(!slash)slash=strrchr(imp->imp_path,'\\');char *name=slash?slash+1:imp->imp_path;char *dot=strrchr(name,'.');int len=dot?(int)(dot-name):(int)strlen(name);imp->imp_alias=xmalloc(len+1);strncpy(imp->imp_alias,name,len);imp->imp_alias[len]='\0';}tok_accept(TOK_SEMICOLON);return imp;}
+    if(g_tok.type==TOK_IMPORT){advance();AST *imp=ast_new(AST_IMPORT);if(g_tok.type!=TOK_STRING)error(g_tok.line,"expected import path");imp->imp_path=tok_dup();advance();if(g_tok.type==TOK_AS){advance();if(g_tok.type!=TOK_IDENT)error(g_tok.line,"expected alias");imp->imp_alias=tok_dup();advance();}else{char *slash=strrchr(imp->imp_path,'/');if(!slash)slash=strrchr(imp->imp_path,'\\');char *name=slash?slash+1:imp->imp_path;char *dot=strrchr(name,'.');int len=dot?(int)(dot-name):(int)strlen(name);imp->imp_alias=xmalloc(len+1);strncpy(imp->imp_alias,name,len);imp->imp_alias[len]='\0';}tok_accept(TOK_SEMICOLON);return imp;}
     if(g_tok.type==TOK_EXPORT){advance();return parse_stmt();}
     if(g_tok.type==TOK_IF){advance();expect(TOK_LPAREN,"expected '('");AST *n=ast_new(AST_IF);n->cond=parse_expr();expect(TOK_RPAREN,"expected ')'");n->body=parse_block();if(g_tok.type==TOK_ELSE){advance();if(g_tok.type==TOK_IF){AST *eb=ast_new(AST_BLOCK);ast_add_child(eb,parse_stmt());n->right=eb;}else n->right=parse_block();}return n;}
     if(g_tok.type==TOK_WHILE){advance();expect(TOK_LPAREN,"expected '('");AST *n=ast_new(AST_WHILE);n->cond=parse_expr();expect(TOK_RPAREN,"expected ')'");n->body=parse_block();return n;}
-    if(g_tok.type==TOK_FOR){advance();int has_parens=tok_accept(TOK_LPAREN);if(g_tok.type==TOK_IDENT){char *first=xstrdup(g_tok.text);advance();if(g_tok.type==TOK_IN||g_tok.type==TOK_COMMA){AST *n=ast_new(AST_FOR);n->iter_var=first;if(g_tok.type==TOK_COMMA){advance();if(g_tok.type!=TOK_IDENT)error(g_tok.line,"expected index var");n->idx_var=xstrdup(g_tok.text);advance();}else n->idx_var=xstrdup("_idx");expect(TOK_IN,"expected 'in'");n->iter_expr=parse_expr();if(has_parens)expect(TOK_RPAREN,"expected ')'");n->body=parse_block();return n;}else{AST *n=ast_new(AST_FOR_C);if(g_tok.type==TOK_ASSIGN){advance();AST *asgn=ast_new(AST_ASSIGN);asgn->name=xstrdup(first);asgn->left=parse_expr();n->init=asgn;}else{AST *var=ast_new(AST_VAR);var->name=first;n->init=var;}expect(TOK_SEMICOLON,"expected ';'");n->cond=parse_expr();expect(TOK_SEMICOLON,"expected ';'");n->update=parse_stmt();if(has_parens)expect(TOK_RPAREN,"expected ')'");n->body=parse_block();return n;}}else error(g_tok.line,"expected identifier in for");}
-    if(g_tok.type==TOK_CLASS){advance();AST *n=ast_new(AST_CLASS);if(g_tok.type!=TOK_IDENT)error(g_tok.line,"expected class name");n->name=xstrdup(g_tok.text);advance();if(g_tok.type==TOK_EXTENDS){advance();if(g_tok.type!=TOK_IDENT)error(g_tok.line,"expected parent class");n->parent=xstrdup(g_tok.text);advance();}expect(TOK_LBRACE,"expected '{'");while(g_tok.type!=TOK_RBRACE&&g_tok.type!=TOK_EOF){if(g_tok.type==TOK_FUNC||g_tok.type==TOK_IDENT){AST *m=ast_new(AST_FUNC);if(g_tok.type==TOK_FUNC)advance();if(g_tok.type!=TOK_IDENT)error(g_tok.line,"expected method name");m->name=xstrdup(g_tok.text);advance();expect(TOK_LPAREN,"expected '('");while(g_tok.type!=TOK_RPAREN&&g_tok.type!=TOK_EOF){if(g_tok.type!=TOK_IDENT)error(g_tok.line,"expected parameter");m->params=xrealloc(m->params,sizeof(char*)*(m->param_n+1));m->params[m->param_n++]=xstrdup(g_tok.text);advance();if(!tok_accept(TOK_COMMA))break;}expect(TOK_RPAREN,"expected ')'");m->body=parse_block();n->methods=xrealloc(n->methods,sizeof(AST*)*(n->method_n+1));n->methods[n->method_n++]=m;}else error(g_tok.line,"expected method in class");}expect(TOK_RBRACE,"expected '}'");return n;}
-    if(g_tok.type==TOK_FUNC){advance();AST *n=ast_new(AST_FUNC);if(g_tok.type!=TOK_IDENT)error(g_tok.line,"expected function name");n->name=xstrdup(g_tok.text);advance();expect(TOK_LPAREN,"expected '('");while(g_tok.type!=TOK_RPAREN&&g_tok.type!=TOK_EOF){if(g_tok.type!=TOK_IDENT)error(g_tok.line,"expected parameter");n->params=xrealloc(n->params,sizeof(char*)*(n->param_n+1));n->params[n->param_n++]=xstrdup(g_tok.text);advance();if(!tok_accept(TOK_COMMA))break;}expect(TOK_RPAREN,"expected ')'");n->body=parse_block();return n;}
-    if(g_tok.type==TOK_CONST){advance();if(g_tok.type!=TOK_IDENT)error(g_tok.line,"expected identifier");AST *n=ast_new(AST_ASSIGN);n->name=xstrdup(g_tok.text);n->is_const=1;advance();expect(TOK_ASSIGN,"expected '='");n->left=parse_expr();return n;}
+    if(g_tok.type==TOK_FOR){advance();int has_parens=tok_accept(TOK_LPAREN);if(g_tok.type==TOK_IDENT){char *first=tok_dup();advance();if(g_tok.type==TOK_IN||g_tok.type==TOK_COMMA){AST *n=ast_new(AST_FOR);n->iter_var=first;if(g_tok.type==TOK_COMMA){advance();if(g_tok.type!=TOK_IDENT)error(g_tok.line,"expected index var");n->idx_var=tok_dup();advance();}else n->idx_var=xstrdup("_idx");expect(TOK_IN,"expected 'in'");n->iter_expr=parse_expr();if(n->iter_expr->type==AST_CALL&&n->iter_expr->left->type==AST_VAR&&!strcmp(n->iter_expr->left->name,"range")&&n->iter_expr->bi)n->iter_expr->bi=builtin_find("iterRange");if(has_parens)expect(TOK_RPAREN,"expected ')'");n->body=parse_block();return n;}else{AST *n=ast_new(AST_FOR_C);if(g_tok.type==TOK_ASSIGN){advance();AST *asgn=ast_new(AST_ASSIGN);asgn->name=xstrdup(first);asgn->left=parse_expr();n->init=asgn;}else{AST *var=ast_new(AST_VAR);var->name=first;n->init=var;}expect(TOK_SEMICOLON,"expected ';'");n->cond=parse_expr();expect(TOK_SEMICOLON,"expected ';'");n->update=parse_stmt();if(has_parens)expect(TOK_RPAREN,"expected ')'");n->body=parse_block();return n;}}else error(g_tok.line,"expected identifier in for");}
+    if(g_tok.type==TOK_CLASS){advance();AST *n=ast_new(AST_CLASS);if(g_tok.type!=TOK_IDENT)error(g_tok.line,"expected class name");n->name=tok_dup();advance();if(g_tok.type==TOK_EXTENDS){advance();if(g_tok.type!=TOK_IDENT)error(g_tok.line,"expected parent class");n->parent=tok_dup();advance();}expect(TOK_LBRACE,"expected '{'");while(g_tok.type!=TOK_RBRACE&&g_tok.type!=TOK_EOF){if(g_tok.type==TOK_FUNC||g_tok.type==TOK_IDENT){AST *m=ast_new(AST_FUNC);if(g_tok.type==TOK_FUNC)advance();if(g_tok.type!=TOK_IDENT)error(g_tok.line,"expected method name");m->name=tok_dup();advance();expect(TOK_LPAREN,"expected '('");while(g_tok.type!=TOK_RPAREN&&g_tok.type!=TOK_EOF){if(g_tok.type!=TOK_IDENT)error(g_tok.line,"expected parameter");m->params=xrealloc(m->params,sizeof(char*)*(m->param_n+1));m->params[m->param_n++]=tok_dup();advance();if(!tok_accept(TOK_COMMA))break;}expect(TOK_RPAREN,"expected ')'");m->body=parse_fn_body();n->methods=xrealloc(n->methods,sizeof(AST*)*(n->method_n+1));n->methods[n->method_n++]=m;}else error(g_tok.line,"expected method in class");}expect(TOK_RBRACE,"expected '}'");return n;}
+    if(g_tok.type==TOK_FUNC){advance();AST *n=ast_new(AST_FUNC);if(g_tok.type!=TOK_IDENT)error(g_tok.line,"expected function name");n->name=tok_dup();advance();expect(TOK_LPAREN,"expected '('");while(g_tok.type!=TOK_RPAREN&&g_tok.type!=TOK_EOF){if(g_tok.type!=TOK_IDENT)error(g_tok.line,"expected parameter");n->params=xrealloc(n->params,sizeof(char*)*(n->param_n+1));n->params[n->param_n++]=tok_dup();advance();if(!tok_accept(TOK_COMMA))break;}expect(TOK_RPAREN,"expected ')'");const char *outer=g_parse_fn;g_parse_fn=n->name;n->body=parse_fn_body();g_parse_fn=outer;return n;}
+    if(g_tok.type==TOK_CONST){advance();if(g_tok.type!=TOK_IDENT)error(g_tok.line,"expected identifier");AST *n=ast_new(AST_ASSIGN);n->name=tok_dup();n->is_const=1;advance();expect(TOK_ASSIGN,"expected '='");n->left=parse_expr();return n;}
     if(g_tok.type==TOK_RETURN){advance();AST *n=ast_new(AST_RETURN);if(g_tok.type!=TOK_RBRACE&&g_tok.type!=TOK_SEMICOLON&&g_tok.type!=TOK_EOF)n->left=parse_expr();tok_accept(TOK_SEMICOLON);return n;}
+    if(g_tok.type==TOK_YIELD){advance();AST *n=ast_new(AST_YIELD);if(g_tok.type!=TOK_RBRACE&&g_tok.type!=TOK_SEMICOLON&&g_tok.type!=TOK_EOF)n->left=parse_expr();tok_accept(TOK_SEMICOLON);g_parse_gen=1;return n;}
     if(g_tok.type==TOK_BREAK){AST *n=ast_new(AST_BREAK);advance();tok_accept(TOK_SEMICOLON);return n;}
     if(g_tok.type==TOK_CONTINUE){AST *n=ast_new(AST_CONTINUE);advance();tok_accept(TOK_SEMICOLON);return n;}
     if(g_tok.type==TOK_CASE){advance();expect(TOK_LPAREN,"expected '('");AST *n=ast_new(AST_CASE);n->cond=parse_expr();expect(TOK_RPAREN,"expected ')'");expect(TOK_LBRACE,"expected '{'");while(g_tok.type!=TOK_RBRACE&&g_tok.type!=TOK_EOF){AST *c=ast_new(AST_BLOCK);if(tok_accept(TOK_DEFAULT)){c->cond=NULL;expect(TOK_COLON,"expected ':'");}else{AST *matches=ast_new(AST_ARRAY);do{AST *val=parse_primary();if(g_tok.type==TOK_RANGE){advance();AST *rng=ast_new(AST_BINOP);strcpy(rng->op,"..");rng->left=val;rng->right=parse_primary();ast_add_child(matches,rng);}else{ast_add_child(matches,val);}}while(tok_accept(TOK_COMMA));c->cond=matches;expect(TOK_COLON,"expected ':'");}while(g_tok.type!=TOK_RBRACE&&g_tok.type!=TOK_EOF&&g_tok.type!=TOK_DEFAULT){int sp=g_pos,sl=g_line;Token st=g_tok;if(g_tok.type==TOK_NUMBER||g_tok.type==TOK_STRING||g_tok.type==TOK_IDENT||g_tok.type==TOK_MINUS){advance();if(g_tok.type==TOK_NUMBER)advance();if(g_tok.type==TOK_COLON||g_tok.type==TOK_RANGE||g_tok.type==TOK_COMMA){g_pos=sp;g_line=sl;g_tok=st;break;}g_pos=sp;g_line=sl;g_tok=st;}AST *s=parse_stmt();if(s)ast_add_child(c,s);}ast_add_child(n,c);}expect(TOK_RBRACE,"expected '}'");return n;}
@@ -367,12 +755,498 @@ static AST *parse_stmt(void) {
 }
 static AST *parse_program(void){AST *prog=ast_new(AST_BLOCK);while(g_tok.type!=TOK_EOF){AST *s=parse_stmt();if(s)ast_add_child(prog,s);}return prog;}
 
+/* Binary operator codes, shared by the evaluator, the VM and the typed-array kernels */
+enum { BOP_ADD,BOP_SUB,BOP_MUL,BOP_DIV,BOP_MOD,BOP_POW,BOP_LT,BOP_GT,BOP_LE,BOP_GE,BOP_EQ,BOP_NE };
+
+/* Typed arrays
+   Float64Array/Int64Array keep numbers unboxed in one contiguous buffer. The kernels are
+   plain loops over restrict pointers with independent accumulators, which the compiler
+   turns into SIMD code; they stay correct scalar code everywhere else. */
+#if defined(__GNUC__)&&!defined(__clang__)
+#define VEC_KERNEL __attribute__((optimize("O3")))
+#else
+#define VEC_KERNEL
+#endif
+static Value *ta_new(int kind,int len) { Value *v=val_new(V_TYPED); TypedArr *t=xmalloc(sizeof(TypedArr)); t->kind=kind; t->len=len; t->cap=len>8?len:8; t->d.p=calloc(t->cap,8); if(!t->d.p)error(g_line,"out of memory"); v->as.ta=t; return v; }
+static double ta_num(TypedArr *t,int i) { return t->kind==TA_F64?t->d.f[i]:(double)t->d.i[i]; }
+static Value *ta_box(TypedArr *t,int i) { return t->kind==TA_F64?val_float(t->d.f[i]):val_int(t->d.i[i]); }
+static void ta_store(TypedArr *t,int i,Value *x) { if(t->kind==TA_F64)t->d.f[i]=val_tonum(x); else t->d.i[i]=x->type==V_INT?x->as.i:(long long)val_tonum(x); }
+static void ta_push(TypedArr *t,Value *x) { if(t->len>=t->cap){t->cap*=2;t->d.p=xrealloc(t->d.p,(size_t)t->cap*8);} ta_store(t,t->len++,x); }
+/* Float64Array(n | array | typed) and Int64Array(...) */
+static Value *ta_from(int kind,Value **a,int n) {
+    if(n<1)return ta_new(kind,0);
+    if(a[0]->type==V_INT||a[0]->type==V_FLOAT){long long len=(long long)val_tonum(a[0]);if(len<0||len>INT_MAX/8)error(g_line,"invalid typed array length");return ta_new(kind,(int)len);}
+    if(a[0]->type==V_ARRAY){Array *src=a[0]->as.arr;Value *v=ta_new(kind,src->len);for(int i=0;i<src->len;i++)ta_store(v->as.ta,i,src->items[i]);return v;}
+    if(a[0]->type==V_TYPED){TypedArr *src=a[0]->as.ta;Value *v=ta_new(kind,src->len);TypedArr *t=v->as.ta;for(int i=0;i<src->len;i++){if(kind==TA_F64)t->d.f[i]=ta_num(src,i);else t->d.i[i]=src->kind==TA_I64?src->d.i[i]:(long long)src->d.f[i];}return v;}
+    return ta_new(kind,0);
+}
+static Value *bi_Float64Array(Value **a,int n){return ta_from(TA_F64,a,n);}
+static Value *bi_Int64Array(Value **a,int n){return ta_from(TA_I64,a,n);}
+
+VEC_KERNEL static double kern_sum(const double *restrict a,int n) { double s0=0,s1=0,s2=0,s3=0; int i=0; for(;i+4<=n;i+=4){s0+=a[i];s1+=a[i+1];s2+=a[i+2];s3+=a[i+3];} for(;i<n;i++)s0+=a[i]; return (s0+s1)+(s2+s3); }
+VEC_KERNEL static long long kern_isum(const long long *restrict a,int n) { long long s=0; for(int i=0;i<n;i++)s+=a[i]; return s; }
+VEC_KERNEL static double kern_dot(const double *restrict a,const double *restrict b,int n) { double s0=0,s1=0,s2=0,s3=0; int i=0; for(;i+4<=n;i+=4){s0+=a[i]*b[i];s1+=a[i+1]*b[i+1];s2+=a[i+2]*b[i+2];s3+=a[i+3]*b[i+3];} for(;i<n;i++)s0+=a[i]*b[i]; return (s0+s1)+(s2+s3); }
+VEC_KERNEL static double kern_sqdev(const double *restrict a,int n,double m) { double s0=0,s1=0,s2=0,s3=0; int i=0; for(;i+4<=n;i+=4){double d0=a[i]-m,d1=a[i+1]-m,d2=a[i+2]-m,d3=a[i+3]-m;s0+=d0*d0;s1+=d1*d1;s2+=d2*d2;s3+=d3*d3;} for(;i<n;i++){double d=a[i]-m;s0+=d*d;} return (s0+s1)+(s2+s3); }
+VEC_KERNEL static double kern_min(const double *restrict a,int n) { double m0=a[0],m1=a[0],m2=a[0],m3=a[0]; int i=0; for(;i+4<=n;i+=4){m0=a[i]<m0?a[i]:m0;m1=a[i+1]<m1?a[i+1]:m1;m2=a[i+2]<m2?a[i+2]:m2;m3=a[i+3]<m3?a[i+3]:m3;} for(;i<n;i++)m0=a[i]<m0?a[i]:m0; m0=m1<m0?m1:m0; m2=m3<m2?m3:m2; return m2<m0?m2:m0; }
+VEC_KERNEL static double kern_max(const double *restrict a,int n) { double m0=a[0],m1=a[0],m2=a[0],m3=a[0]; int i=0; for(;i+4<=n;i+=4){m0=a[i]>m0?a[i]:m0;m1=a[i+1]>m1?a[i+1]:m1;m2=a[i+2]>m2?a[i+2]:m2;m3=a[i+3]>m3?a[i+3]:m3;} for(;i<n;i++)m0=a[i]>m0?a[i]:m0; m0=m1>m0?m1:m0; m2=m3>m2?m3:m2; return m2>m0?m2:m0; }
+VEC_KERNEL static long long kern_imin(const long long *restrict a,int n) { long long m=a[0]; for(int i=1;i<n;i++)m=a[i]<m?a[i]:m; return m; }
+VEC_KERNEL static long long kern_imax(const long long *restrict a,int n) { long long m=a[0]; for(int i=1;i<n;i++)m=a[i]>m?a[i]:m; return m; }
+/* Element-wise a op b; sb/ib say whether b is a scalar broadcast to every element */
+VEC_KERNEL static void kern_fop(int op,double *restrict o,const double *restrict a,const double *restrict b,int sb,int n) {
+    double s=b[0];
+    switch(op){
+        case BOP_ADD:if(sb)for(int i=0;i<n;i++)o[i]=a[i]+s;else for(int i=0;i<n;i++)o[i]=a[i]+b[i];break;
+        case BOP_SUB:if(sb)for(int i=0;i<n;i++)o[i]=a[i]-s;else for(int i=0;i<n;i++)o[i]=a[i]-b[i];break;
+        case BOP_MUL:if(sb)for(int i=0;i<n;i++)o[i]=a[i]*s;else for(int i=0;i<n;i++)o[i]=a[i]*b[i];break;
+        case BOP_DIV:if(sb)for(int i=0;i<n;i++)o[i]=a[i]/s;else for(int i=0;i<n;i++)o[i]=a[i]/b[i];break;
+        case BOP_MOD:for(int i=0;i<n;i++)o[i]=fmod(a[i],sb?s:b[i]);break;
+        case BOP_POW:for(int i=0;i<n;i++)o[i]=pow(a[i],sb?s:b[i]);break;
+    }
+}
+VEC_KERNEL static void kern_iop(int op,long long *restrict o,const long long *restrict a,const long long *restrict b,int sb,int n) {
+    long long s=b[0];
+    switch(op){
+        case BOP_ADD:if(sb)for(int i=0;i<n;i++)o[i]=a[i]+s;else for(int i=0;i<n;i++)o[i]=a[i]+b[i];break;
+        case BOP_SUB:if(sb)for(int i=0;i<n;i++)o[i]=a[i]-s;else for(int i=0;i<n;i++)o[i]=a[i]-b[i];break;
+        case BOP_MUL:if(sb)for(int i=0;i<n;i++)o[i]=a[i]*s;else for(int i=0;i<n;i++)o[i]=a[i]*b[i];break;
+        case BOP_MOD:for(int i=0;i<n;i++){long long d=sb?s:b[i];if(!d)error(g_line,"modulo by zero");o[i]=d==-1?0:a[i]%d;}break;
+    }
+}
+/* Comparison masks come back as Int64Array of 0/1 */
+VEC_KERNEL static void kern_cmp(int op,long long *restrict o,const double *restrict a,const double *restrict b,int sb,int n) {
+    double s=b[0];
+    switch(op){
+        case BOP_LT:for(int i=0;i<n;i++)o[i]=a[i]<(sb?s:b[i]);break;
+        case BOP_GT:for(int i=0;i<n;i++)o[i]=a[i]>(sb?s:b[i]);break;
+        case BOP_LE:for(int i=0;i<n;i++)o[i]=a[i]<=(sb?s:b[i]);break;
+        case BOP_GE:for(int i=0;i<n;i++)o[i]=a[i]>=(sb?s:b[i]);break;
+        case BOP_EQ:for(int i=0;i<n;i++)o[i]=a[i]==(sb?s:b[i]);break;
+        case BOP_NE:for(int i=0;i<n;i++)o[i]=a[i]!=(sb?s:b[i]);break;
+    }
+}
+/* Operand as doubles: typed arrays are widened into tmp when they hold ints */
+static const double *ta_f64(Value *v,double *one,double **tmp) {
+    if(v->type!=V_TYPED){*one=val_tonum(v);return one;}
+    TypedArr *t=v->as.ta; if(t->kind==TA_F64)return t->d.f;
+    *tmp=xmalloc((size_t)(t->len?t->len:1)*sizeof(double)); for(int i=0;i<t->len;i++)(*tmp)[i]=(double)t->d.i[i]; return *tmp;
+}
+static int ta_numeric(Value *v){return v->type==V_TYPED||v->type==V_INT||v->type==V_FLOAT;}
+/* Binary operator with at least one typed-array operand; scalars broadcast. NULL means not applicable */
+static Value *ta_binop(int op,Value *l,Value *r) {
+    if(!ta_numeric(l)||!ta_numeric(r))return NULL;
+    Value *arr=l->type==V_TYPED?l:r; int n=arr->as.ta->len;
+    if(l->type==V_TYPED&&r->type==V_TYPED&&r->as.ta->len!=n)error(g_line,"typed array length mismatch (%d vs %d)",n,r->as.ta->len);
+    /* A scalar on the left is broadcast into an array of the kind it would combine with, so an
+       int scalar and an Int64Array still give Int64 results and the same / and % semantics */
+    if(l->type!=V_TYPED){
+        Value *b=ta_new(l->type==V_INT&&r->as.ta->kind==TA_I64?TA_I64:TA_F64,n);TypedArr *t=b->as.ta;
+        if(t->kind==TA_I64)for(int i=0;i<n;i++)t->d.i[i]=l->as.i;else{double x=val_tonum(l);for(int i=0;i<n;i++)t->d.f[i]=x;}
+        Value *res=ta_binop(op,b,r);val_decref(b);return res;
+    }
+    int ints=l->as.ta->kind==TA_I64&&(r->type==V_INT||(r->type==V_TYPED&&r->as.ta->kind==TA_I64));
+    if(ints&&(op==BOP_ADD||op==BOP_SUB||op==BOP_MUL||op==BOP_MOD)){
+        Value *out=ta_new(TA_I64,n);long long one=r->type==V_INT?r->as.i:0;
+        kern_iop(op,out->as.ta->d.i,l->as.ta->d.i,r->type==V_TYPED?r->as.ta->d.i:&one,r->type!=V_TYPED,n);return out;
+    }
+    double one,*ta=NULL,*tb=NULL;const double *a=ta_f64(l,&one,&ta),*b=ta_f64(r,&one,&tb);Value *out;
+    if(op>=BOP_LT){out=ta_new(TA_I64,n);kern_cmp(op,out->as.ta->d.i,a,b,r->type!=V_TYPED,n);}
+    else{out=ta_new(TA_F64,n);kern_fop(op,out->as.ta->d.f,a,b,r->type!=V_TYPED,n);}
+    free(ta);free(tb);return out;
+}
+static int ta_cmp_f(const void *x,const void *y){double a=*(const double*)x,b=*(const double*)y;return (a>b)-(a<b);}
+static int ta_cmp_i(const void *x,const void *y){long long a=*(const long long*)x,b=*(const long long*)y;return (a>b)-(a<b);}
+/* Stable argsort: bottom-up merge sort of indices by value */
+static Value *ta_argsort(TypedArr *t) {
+    int n=t->len; Value *out=ta_new(TA_I64,n); long long *idx=out->as.ta->d.i,*buf=xmalloc(sizeof(long long)*(n?n:1));
+    for(int i=0;i<n;i++)idx[i]=i;
+    for(int w=1;w<n;w*=2){for(int lo=0;lo<n;lo+=2*w){int mid=lo+w<n?lo+w:n,hi=lo+2*w<n?lo+2*w:n,i=lo,j=mid,k=lo;while(i<mid&&j<hi)buf[k++]=ta_num(t,idx[j])<ta_num(t,idx[i])?idx[j++]:idx[i++];while(i<mid)buf[k++]=idx[i++];while(j<hi)buf[k++]=idx[j++];}memcpy(idx,buf,sizeof(long long)*n);}
+    free(buf); return out;
+}
+static Value *ta_method(Value *obj,int mid,Value **args,int argc) {
+    TypedArr *t=obj->as.ta; int n=t->len;
+    switch(mid){
+        case M_len:case M_length:return val_int(n);
+        case M_push:for(int i=0;i<argc;i++)ta_push(t,args[i]);return val_int(t->len);
+        case M_sum:return t->kind==TA_F64?val_float(kern_sum(t->d.f,n)):val_int(kern_isum(t->d.i,n));
+        case M_mean:if(!n)return val_null();return val_float((t->kind==TA_F64?kern_sum(t->d.f,n):(double)kern_isum(t->d.i,n))/n);
+        case M_min:if(!n)return val_null();return t->kind==TA_F64?val_float(kern_min(t->d.f,n)):val_int(kern_imin(t->d.i,n));
+        case M_max:if(!n)return val_null();return t->kind==TA_F64?val_float(kern_max(t->d.f,n)):val_int(kern_imax(t->d.i,n));
+        case M_std:{int ddof=argc>=1?(int)val_tonum(args[0]):0;if(n-ddof<=0)return val_null();double one,*tmp=NULL;const double *a=ta_f64(obj,&one,&tmp);double m=kern_sum(a,n)/n,v=kern_sqdev(a,n,m)/(n-ddof);free(tmp);return val_float(sqrt(v));}
+        case M_dot:{if(argc<1||args[0]->type!=V_TYPED)error(g_line,"dot() expects a typed array");if(args[0]->as.ta->len!=n)error(g_line,"typed array length mismatch (%d vs %d)",n,args[0]->as.ta->len);
+            double one,*ta=NULL,*tb=NULL;const double *a=ta_f64(obj,&one,&ta),*b=ta_f64(args[0],&one,&tb);double d=kern_dot(a,b,n);free(ta);free(tb);return val_float(d);}
+        case M_cumsum:{Value *out=ta_new(t->kind,n);if(t->kind==TA_F64){double s=0;for(int i=0;i<n;i++)out->as.ta->d.f[i]=s+=t->d.f[i];}else{long long s=0;for(int i=0;i<n;i++)out->as.ta->d.i[i]=s+=t->d.i[i];}return out;}
+        case M_argsort:return ta_argsort(t);
+        case M_sort:qsort(t->d.p,n,8,t->kind==TA_F64?ta_cmp_f:ta_cmp_i);val_incref(obj);return obj;
+        case M_slice:{int s=argc>=1?(int)val_tonum(args[0]):0,e=argc>=2?(int)val_tonum(args[1]):n;if(s<0)s+=n;if(e<0)e+=n;if(s<0)s=0;if(e>n)e=n;if(e<s)e=s;Value *out=ta_new(t->kind,e-s);memcpy(out->as.ta->d.p,(char*)t->d.p+(size_t)s*8,(size_t)(e-s)*8);return out;}
+        case M_select:{if(argc<1)return ta_new(t->kind,0);Value *m=args[0];Value *out=ta_new(t->kind,0);
+            for(int i=0;i<n;i++){int keep=m->type==V_TYPED?(i<m->as.ta->len&&ta_num(m->as.ta,i)!=0):m->type==V_ARRAY?(i<m->as.arr->len&&val_truthy(m->as.arr->items[i])):0;if(keep){Value *x=ta_box(t,i);ta_push(out->as.ta,x);val_decref(x);}}return out;}
+        case M_toArray:{Value *out=val_array(n);for(int i=0;i<n;i++){Value *x=ta_box(t,i);arr_push(out,x);val_decref(x);}return out;}
+        default:return val_null();
+    }
+}
+
+/* Map, Set and Deque
+   Map and Set share an insertion-ordered hash table: entries are appended to a dense
+   array (deleted ones keep a NULL key until the next rebuild) and an open-addressing
+   slot table maps hashes to entry indexes, so lookups are O(1) and iteration follows
+   insertion order. Any value can be a key: numbers compare by value (1 and 1.0 are the
+   same key), strings by content, containers by identity. Deque is a ring buffer. */
+static uint64_t hash_mix(uint64_t x) { x^=x>>33; x*=0xff51afd7ed558ccdULL; x^=x>>33; x*=0xc4ceb9fe1a85ec53ULL; return x^(x>>33); }
+static uint64_t key_hash(Value *k) {
+    switch(k->type){
+        case V_INT: return hash_mix((uint64_t)k->as.i);
+        case V_FLOAT: {double f=k->as.f;if(f==(double)(long long)f&&fabs(f)<9e18)return hash_mix((uint64_t)(long long)f);uint64_t b;memcpy(&b,&f,8);return hash_mix(b);}
+        case V_STRING: return str_hash(k->as.s);
+        case V_NULL: return 0x51ed27;
+        case V_BOOL: return 0x9e3779+k->as.b;
+        default: return hash_mix((uint64_t)(uintptr_t)k->as.arr);
+    }
+}
+static int key_eq(Value *a,Value *b) {
+    if(a==b)return 1;
+    if(a->type==V_INT&&b->type==V_INT)return a->as.i==b->as.i;
+    if((a->type==V_INT||a->type==V_FLOAT)&&(b->type==V_INT||b->type==V_FLOAT))return val_tonum(a)==val_tonum(b);
+    if(a->type!=b->type)return 0;
+    switch(a->type){case V_STRING:return str_len(a)==str_len(b)&&memcmp(a->as.s,b->as.s,str_len(a))==0;case V_NULL:return 1;case V_BOOL:return a->as.b==b->as.b;default:return a->as.arr==b->as.arr;}
+}
+static Value *hmap_new(ValueType t) { Value *v=val_new(t); v->as.map=xmalloc(sizeof(HMap)); memset(v->as.map,0,sizeof(HMap)); return v; }
+/* Rebuild the slot table for cap entries, dropping deleted entries on the way */
+static void hmap_rebuild(HMap *m,int cap) {
+    int n=0;for(int i=0;i<m->n;i++)if(m->ents[i].key)m->ents[n++]=m->ents[i];
+    m->n=n;m->cap=cap;m->ents=xrealloc(m->ents,sizeof(MapEnt)*cap);
+    free(m->slots);m->mask=cap*2-1;m->slots=calloc(cap*2,sizeof(int));if(!m->slots)error(g_line,"out of memory");
+    for(int i=0;i<n;i++){uint64_t j=m->ents[i].hash&m->mask;while(m->slots[j])j=(j+1)&m->mask;m->slots[j]=i+1;}
+}
+static int hmap_find(HMap *m,Value *key,uint64_t h) {
+    if(!m->slots)return -1;
+    for(uint64_t j=h&m->mask;m->slots[j];j=(j+1)&m->mask){int e=m->slots[j]-1;if(e>=0&&m->ents[e].hash==h&&key_eq(m->ents[e].key,key))return e;}
+    return -1;
+}
+static Value *hmap_get(HMap *m,Value *key) { int e=hmap_find(m,key,key_hash(key)); return e>=0?m->ents[e].val:NULL; }
+static void hmap_set(HMap *m,Value *key,Value *val) {
+    uint64_t h=key_hash(key);int e=hmap_find(m,key,h);
+    if(e>=0){if(val){val_incref(val);val_decref(m->ents[e].val);m->ents[e].val=val;}return;}
+    if(m->n>=m->cap)hmap_rebuild(m,m->live*2<m->cap?m->cap:(m->cap?m->cap*2:8));
+    uint64_t j=h&m->mask;while(m->slots[j]>0)j=(j+1)&m->mask;
+    m->slots[j]=m->n+1;val_incref(key);if(val)val_incref(val);m->ents[m->n++]=(MapEnt){key,val,h};m->live++;
+}
+static int hmap_del(HMap *m,Value *key) {
+    uint64_t h=key_hash(key);if(!m->slots)return 0;
+    for(uint64_t j=h&m->mask;m->slots[j];j=(j+1)&m->mask){int e=m->slots[j]-1;if(e>=0&&m->ents[e].hash==h&&key_eq(m->ents[e].key,key)){
+        m->slots[j]=-1;val_decref(m->ents[e].key);val_decref(m->ents[e].val);m->ents[e].key=m->ents[e].val=NULL;m->live--;return 1;}}
+    return 0;
+}
+static void hmap_clear(HMap *m) { for(int i=0;i<m->n;i++)if(m->ents[i].key){val_decref(m->ents[i].key);val_decref(m->ents[i].val);} free(m->ents);free(m->slots);memset(m,0,sizeof(HMap)); }
+static Value *dq_new(int cap) { Value *v=val_new(V_DEQUE); Deque *d=xmalloc(sizeof(Deque)); d->cap=8; while(d->cap<cap)d->cap*=2; d->head=d->len=0; d->items=xmalloc(sizeof(Value*)*d->cap); v->as.dq=d; return v; }
+static void dq_grow(Deque *d) { if(d->len<d->cap)return; Value **items=xmalloc(sizeof(Value*)*d->cap*2); for(int i=0;i<d->len;i++)items[i]=DQ_AT(d,i); free(d->items); d->items=items; d->head=0; d->cap*=2; }
+static void dq_push(Deque *d,Value *x,int front) { dq_grow(d); val_incref(x); if(front){d->head=(d->head-1)&(d->cap-1);d->items[d->head]=x;}else DQ_AT(d,d->len)=x; d->len++; }
+static Value *dq_pop(Deque *d,int front) { if(!d->len)return val_null(); Value *x; if(front){x=d->items[d->head];d->head=(d->head+1)&(d->cap-1);}else x=DQ_AT(d,d->len-1); d->len--; return x; }
+static int coll_len(Value *v) { return v->type==V_DEQUE?v->as.dq->len:v->as.map->live; }
+/* Keys of a Map, members of a Set or items of a Deque as a new array (also what for-in walks) */
+static Value *coll_to_array(Value *v) {
+    if(v->type==V_PQ)return pq_method(v,M_toArray,NULL,0);
+    Value *arr=val_array(coll_len(v));
+    if(v->type==V_DEQUE){for(int i=0;i<v->as.dq->len;i++)arr_push(arr,DQ_AT(v->as.dq,i));return arr;}
+    HMap *m=v->as.map;for(int i=0;i<m->n;i++)if(m->ents[i].key)arr_push(arr,m->ents[i].key);return arr;
+}
+static void coll_sprint(Value *v,char *buf,int size) {
+    int pos=snprintf(buf,size,"%s",v->type==V_MAP?"Map{":v->type==V_SET?"Set{":"Deque["),shown=0,n=v->type==V_DEQUE?v->as.dq->len:v->as.map->n;char t[256];
+    for(int i=0;i<n&&pos<size-50;i++){
+        Value *item=v->type==V_DEQUE?DQ_AT(v->as.dq,i):v->as.map->ents[i].key;if(!item)continue;if(shown==20){pos+=snprintf(buf+pos,size-pos,", ...");break;}
+        if(shown++)pos+=snprintf(buf+pos,size-pos,", ");
+        if(item->type==V_STRING)pos+=snprintf(buf+pos,size-pos,"\"%s\"",item->as.s);else{val_sprint(item,t,256);pos+=snprintf(buf+pos,size-pos,"%s",t);}
+        if(v->type==V_MAP){Value *val=v->as.map->ents[i].val;if(val->type==V_STRING)pos+=snprintf(buf+pos,size-pos,": \"%s\"",val->as.s);else{val_sprint(val,t,256);pos+=snprintf(buf+pos,size-pos,": %s",t);}}
+    }
+    snprintf(buf+pos,size-pos,"%s",v->type==V_DEQUE?"]":"}");
+}
+/* Add every item of an array, Set, Deque or typed array to a Set, or every pair of an
+   object, Map or array of [key, value] arrays to a Map */
+static void coll_fill(Value *c,Value *src) {
+    if(src->type==V_NULL)return;
+    if(c->type==V_MAP){
+        if(src->type==V_MAP){HMap *m=src->as.map;for(int i=0;i<m->n;i++)if(m->ents[i].key)hmap_set(c->as.map,m->ents[i].key,m->ents[i].val);}
+        else if(src->type==V_OBJECT){for(int i=0;i<src->as.obj->count;i++){Value *k=val_string(src->as.obj->pairs[i].key);hmap_set(c->as.map,k,src->as.obj->pairs[i].val);val_decref(k);}}
+        else if(src->type==V_ARRAY){for(int i=0;i<src->as.arr->len;i++){Value *p=src->as.arr->items[i];if(p->type!=V_ARRAY||p->as.arr->len<2)runtime_error(g_line,"Map() expects [key, value] pairs");hmap_set(c->as.map,p->as.arr->items[0],p->as.arr->items[1]);}}
+        else runtime_error(g_line,"Map() expects an object, a Map or an array of pairs");
+        return;
+    }
+    Value *arr=src->type==V_ARRAY?src:src->type==V_SET||src->type==V_DEQUE?coll_to_array(src):NULL;
+    if(src->type==V_TYPED){arr=val_array(src->as.ta->len);for(int i=0;i<src->as.ta->len;i++){Value *x=ta_box(src->as.ta,i);arr_push(arr,x);val_decref(x);}}
+    if(!arr)runtime_error(g_line,"%s() expects an array",c->type==V_SET?"Set":"Deque");
+    for(int i=0;i<arr->as.arr->len;i++){if(c->type==V_SET)hmap_set(c->as.map,arr->as.arr->items[i],NULL);else dq_push(c->as.dq,arr->as.arr->items[i],0);}
+    if(arr!=src)val_decref(arr);
+}
+static Value *bi_Map(Value **a,int n){Value *m=hmap_new(V_MAP);if(n>=1)coll_fill(m,a[0]);return m;}
+static Value *bi_Set(Value **a,int n){Value *s=hmap_new(V_SET);if(n>=1)coll_fill(s,a[0]);return s;}
+static Value *bi_Deque(Value **a,int n){Value *d=dq_new(n>=1&&a[0]->type==V_ARRAY?a[0]->as.arr->len:8);if(n>=1)coll_fill(d,a[0]);return d;}
+/* union/intersection/difference: keep members of s that are (or are not) in o, or add all of o */
+static Value *set_combine(Value *s,Value *o,int mid) {
+    if(o->type!=V_SET)runtime_error(g_line,"%s() expects a Set",g_method_names[mid]);
+    Value *r=hmap_new(V_SET);HMap *a=s->as.map,*b=o->as.map;
+    for(int i=0;i<a->n;i++){Value *k=a->ents[i].key;if(k&&(mid==M_union||(hmap_find(b,k,a->ents[i].hash)>=0)==(mid==M_intersection)))hmap_set(r->as.map,k,NULL);}
+    if(mid==M_union)for(int i=0;i<b->n;i++)if(b->ents[i].key)hmap_set(r->as.map,b->ents[i].key,NULL);
+    return r;
+}
+static Value *coll_method(Value *obj,int mid,Value **args,int argc) {
+    switch(mid){
+        case M_len:case M_length:case M_size:return val_int(coll_len(obj));
+        case M_toArray:return coll_to_array(obj);
+        default:break;
+    }
+    if(obj->type==V_DEQUE){
+        Deque *d=obj->as.dq;
+        switch(mid){
+            case M_push:case M_pushBack:case M_pushFront:for(int i=0;i<argc;i++)dq_push(d,args[i],mid==M_pushFront);return val_int(d->len);
+            case M_pop:case M_popBack:return dq_pop(d,0);
+            case M_popFront:return dq_pop(d,1);
+            case M_peekFront:return d->len?val_copy(DQ_AT(d,0)):val_null();
+            case M_peekBack:return d->len?val_copy(DQ_AT(d,d->len-1)):val_null();
+            case M_clear:while(d->len)val_decref(dq_pop(d,0));d->head=0;val_incref(obj);return obj;
+            default:return val_null();
+        }
+    }
+    HMap *m=obj->as.map;Value *k=argc>=1?args[0]:val_null();
+    switch(mid){
+        case M_has:return val_bool(hmap_find(m,k,key_hash(k))>=0);
+        case M_delete:return val_bool(hmap_del(m,k));
+        case M_clear:hmap_clear(m);val_incref(obj);return obj;
+        case M_keys:case M_values:if(obj->type==V_SET||mid==M_keys)return coll_to_array(obj);
+            {Value *arr=val_array(m->live);for(int i=0;i<m->n;i++)if(m->ents[i].key)arr_push(arr,m->ents[i].val);return arr;}
+        default:break;
+    }
+    if(obj->type==V_SET){
+        switch(mid){
+            case M_add:for(int i=0;i<argc;i++)hmap_set(m,args[i],NULL);val_incref(obj);return obj;
+            case M_union:case M_intersection:case M_difference:return set_combine(obj,k,mid);
+            case M_isSubset:{if(k->type!=V_SET)runtime_error(g_line,"isSubset() expects a Set");for(int i=0;i<m->n;i++)if(m->ents[i].key&&hmap_find(k->as.map,m->ents[i].key,m->ents[i].hash)<0)return val_bool(0);return val_bool(1);}
+            default:return val_null();
+        }
+    }
+    switch(mid){
+        case M_get:{Value *v=hmap_get(m,k);return v?val_copy(v):argc>=2?val_copy(args[1]):val_null();}
+        case M_set:if(argc<2)runtime_error(g_line,"set() expects a key and a value");hmap_set(m,k,args[1]);val_incref(obj);return obj;
+        case M_entries:{Value *arr=val_array(m->live);for(int i=0;i<m->n;i++)if(m->ents[i].key){Value *p=val_array(2);arr_push(p,m->ents[i].key);arr_push(p,m->ents[i].val);arr_push(arr,p);val_decref(p);}return arr;}
+        default:return val_null();
+    }
+}
+
+/* PriorityQueue
+   A binary heap of entry ids. Entries keep their slot when the heap reorders, so the
+   item -> entry index that update() needs is only built on its first use and then kept
+   current by push and pop. Equal priorities pop in insertion order. */
+static int pq_less(PQueue *q,int a,int b) {
+    Value *x=q->ents[a].pri,*y=q->ents[b].pri;int c;
+    if(x->type==V_INT&&y->type==V_INT)c=(x->as.i>y->as.i)-(x->as.i<y->as.i);
+    else if((x->type==V_INT||x->type==V_FLOAT)&&(y->type==V_INT||y->type==V_FLOAT)){double f=val_tonum(x),g=val_tonum(y);c=(f>g)-(f<g);}
+    else c=val_order(x,y);
+    if(q->max)c=-c;
+    return c?c<0:q->ents[a].seq<q->ents[b].seq;
+}
+static PQueue *g_pq_sorting;
+static int pq_qsort_cmp(const void *a,const void *b) { int x=*(const int*)a,y=*(const int*)b; return pq_less(g_pq_sorting,x,y)?-1:pq_less(g_pq_sorting,y,x); }
+static void pq_place(PQueue *q,int i,int e) { q->heap[i]=e; q->ents[e].pos=i; }
+static void pq_up(PQueue *q,int i) { int e=q->heap[i]; while(i>0){int p=(i-1)/2;if(!pq_less(q,e,q->heap[p]))break;pq_place(q,i,q->heap[p]);i=p;} pq_place(q,i,e); }
+static void pq_down(PQueue *q,int i) {
+    int e=q->heap[i];
+    for(;;){int c=2*i+1;if(c>=q->n)break;if(c+1<q->n&&pq_less(q,q->heap[c+1],q->heap[c]))c++;if(!pq_less(q,q->heap[c],e))break;pq_place(q,i,q->heap[c]);i=c;}
+    pq_place(q,i,e);
+}
+static Value *pq_priority(PQueue *q,Value *item,Value **args,int argc) {
+    if(argc>=2)return val_copy(args[1]);
+    if(q->key){Value *a[1]={item};return call_closure(q->key,a,1);}
+    return val_copy(item);
+}
+static void pq_index_put(PQueue *q,int e) { if(q->indexed){Value *id=val_int(e);hmap_set(&q->index,q->ents[e].item,id);val_decref(id);} }
+static void pq_push(PQueue *q,Value *item,Value *pri) {
+    if(q->n>=q->cap){q->cap=q->cap?q->cap*2:16;q->ents=xrealloc(q->ents,sizeof(PQEnt)*q->cap);q->heap=xrealloc(q->heap,sizeof(int)*q->cap);}
+    int e=q->n; /* live entries always occupy ids 0..n-1: pop moves the last id into the freed one */
+    val_incref(item);q->ents[e]=(PQEnt){item,pri,q->seq++,0};q->heap[q->n++]=e;pq_index_put(q,e);pq_up(q,q->n-1);
+}
+static Value *pq_pop(PQueue *q) {
+    if(!q->n)return val_null();
+    int e=q->heap[0];Value *item=q->ents[e].item;val_decref(q->ents[e].pri);
+    if(q->indexed){Value *cur=hmap_get(&q->index,item);if(cur&&cur->as.i==e)hmap_del(&q->index,item);}
+    int last=--q->n;
+    if(last>0){pq_place(q,0,q->heap[last]);pq_down(q,0);}
+    if(e!=last){q->ents[e]=q->ents[last];q->heap[q->ents[e].pos]=e;if(q->indexed){Value *cur=hmap_get(&q->index,q->ents[e].item);if(cur&&cur->as.i==last)pq_index_put(q,e);}}
+    return item;
+}
+static Value *bi_PriorityQueue(Value **a,int n) {
+    Value *v=val_new(V_PQ);PQueue *q=xmalloc(sizeof(PQueue));memset(q,0,sizeof(PQueue));v->as.pq=q;
+    if(n>=1){
+        if(a[0]->type==V_CLOSURE||a[0]->type==V_FUNC)q->key=a[0];
+        else if(a[0]->type==V_OBJECT){Value *m=obj_get(a[0],"max"),*k=obj_get(a[0],"key");q->max=m&&val_truthy(m);if(k&&(k->type==V_CLOSURE||k->type==V_FUNC))q->key=k;}
+        else q->max=val_truthy(a[0]);
+        if(q->key)val_incref(q->key);
+    }
+    return v;
+}
+static Value *pq_method(Value *obj,int mid,Value **args,int argc) {
+    PQueue *q=obj->as.pq;
+    switch(mid){
+        case M_len:case M_length:case M_size:return val_int(q->n);
+        case M_push:if(argc<1)runtime_error(g_line,"push() expects an item");pq_push(q,args[0],pq_priority(q,args[0],args,argc));return val_int(q->n);
+        case M_pop:return pq_pop(q);
+        case M_peek:return q->n?val_copy(q->ents[q->heap[0]].item):val_null();
+        case M_peekPriority:return q->n?val_copy(q->ents[q->heap[0]].pri):val_null();
+        case M_has:case M_update:{
+            if(argc<1)runtime_error(g_line,"%s() expects an item",g_method_names[mid]);
+            if(!q->indexed){q->indexed=1;for(int e=0;e<q->n;e++)pq_index_put(q,e);}
+            Value *id=hmap_get(&q->index,args[0]);
+            if(mid==M_has)return val_bool(id!=NULL);
+            Value *pri=pq_priority(q,args[0],args,argc);
+            if(!id){pq_push(q,args[0],pri);return val_bool(0);}
+            PQEnt *en=&q->ents[id->as.i];val_decref(en->pri);en->pri=pri;pq_up(q,en->pos);pq_down(q,q->ents[id->as.i].pos);return val_bool(1);
+        }
+        case M_clear:while(q->n){Value *it=pq_pop(q);val_decref(it);}q->seq=0;val_incref(obj);return obj;
+        case M_toArray:{ /* items in pop order, without consuming the queue */
+            int *ord=xmalloc(sizeof(int)*(q->n+1));for(int i=0;i<q->n;i++)ord[i]=i;
+            g_pq_sorting=q;qsort(ord,q->n,sizeof(int),pq_qsort_cmp);
+            Value *arr=val_array(q->n);for(int i=0;i<q->n;i++)arr_push(arr,q->ents[ord[i]].item);free(ord);return arr;
+        }
+        default:return val_null();
+    }
+}
+/* CsrGraph
+   Compressed sparse row adjacency: the out-edges of node i are adj[off[i]..off[i+1]) with
+   weights in w, in the order the edges were given. Node ids are arbitrary values mapped to
+   dense indexes; the kernels below work on indexes and translate back at the end. */
+static int csr_intern(CsrGraph *g,Value *id,int *cap) {
+    Value *ix=hmap_get(&g->index,id);if(ix)return (int)ix->as.i;
+    if(g->n>=*cap){*cap=*cap?*cap*2:64;g->ids=xrealloc(g->ids,sizeof(Value*)*(*cap));}
+    val_incref(id);g->ids[g->n]=id;Value *v=val_int(g->n);hmap_set(&g->index,id,v);val_decref(v);return g->n++;
+}
+static int csr_find(CsrGraph *g,Value *id) { Value *ix=hmap_get(&g->index,id); return ix?(int)ix->as.i:-1; }
+/* CsrGraph(nodes, edges [, directed]): nodes may be null; edges are [from, to, weight?] or {from, to, weight} */
+static Value *bi_CsrGraph(Value **a,int n) {
+    if(n<2||(a[0]->type!=V_ARRAY&&a[0]->type!=V_NULL)||a[1]->type!=V_ARRAY)runtime_error(g_line,"CsrGraph() expects (nodes, edges [, directed])");
+    Value *v=val_new(V_GRAPH);CsrGraph *g=xmalloc(sizeof(CsrGraph));memset(g,0,sizeof(CsrGraph));v->as.graph=g;
+    g->directed=n<3||val_truthy(a[2]);int cap=0;
+    if(a[0]->type==V_ARRAY)for(int i=0;i<a[0]->as.arr->len;i++)csr_intern(g,a[0]->as.arr->items[i],&cap);
+    Array *es=a[1]->as.arr;int m=es->len*(g->directed?1:2),k=0;
+    int *src=xmalloc(sizeof(int)*(m+1)),*dst=xmalloc(sizeof(int)*(m+1));double *wt=xmalloc(sizeof(double)*(m+1));
+    for(int i=0;i<es->len;i++){
+        Value *e=es->items[i],*f=NULL,*t=NULL,*w=NULL;
+        if(e->type==V_ARRAY&&e->as.arr->len>=2){f=e->as.arr->items[0];t=e->as.arr->items[1];if(e->as.arr->len>2)w=e->as.arr->items[2];}
+        else if(e->type==V_OBJECT){f=obj_get(e,"from");t=obj_get(e,"to");w=obj_get(e,"weight");}
+        if(!f||!t){free(src);free(dst);free(wt);runtime_error(g_line,"CsrGraph() edge %d must be [from, to, weight] or {from, to, weight}",i);}
+        int fi=csr_intern(g,f,&cap),ti=csr_intern(g,t,&cap);double wv=w&&w->type!=V_NULL?val_tonum(w):1;
+        src[k]=fi;dst[k]=ti;wt[k++]=wv;if(!g->directed){src[k]=ti;dst[k]=fi;wt[k++]=wv;}
+    }
+    g->m=k;g->off=calloc(g->n+1,sizeof(int));g->adj=xmalloc(sizeof(int)*(k+1));g->w=xmalloc(sizeof(double)*(k+1));
+    for(int i=0;i<k;i++)g->off[src[i]+1]++;
+    for(int i=0;i<g->n;i++)g->off[i+1]+=g->off[i];
+    int *fill=xmalloc(sizeof(int)*(g->n+1));memcpy(fill,g->off,sizeof(int)*(g->n+1));
+    for(int i=0;i<k;i++){int p=fill[src[i]]++;g->adj[p]=dst[i];g->w[p]=wt[i];}
+    free(fill);free(src);free(dst);free(wt);return v;
+}
+static Value *csr_ids(CsrGraph *g,int *ix,int n) { Value *arr=val_array(n); for(int i=0;i<n;i++)arr_push(arr,g->ids[ix[i]]); return arr; }
+static Value *num_box(double d) { return d==(double)(long long)d&&fabs(d)<9e15?val_int((long long)d):val_float(d); }
+/* Breadth-first order from s; when rev is set, edges are also followed backwards (weak connectivity) */
+static int csr_bfs(CsrGraph *g,int s,char *seen,int *out,int *roff,int *radj) {
+    int head=0,tail=0;seen[s]=1;out[tail++]=s;
+    while(head<tail){int u=out[head++];
+        for(int p=g->off[u];p<g->off[u+1];p++){int x=g->adj[p];if(!seen[x]){seen[x]=1;out[tail++]=x;}}
+        if(roff)for(int p=roff[u];p<roff[u+1];p++){int x=radj[p];if(!seen[x]){seen[x]=1;out[tail++]=x;}}}
+    return tail;
+}
+/* Dijkstra with a binary heap ordered by (distance, node index), so ties settle in node order.
+   Stops once t (if >= 0) is settled. */
+static void csr_dijkstra(CsrGraph *g,int s,int t,double *dist,int *prev) {
+    int n=g->n,hn=0;for(int i=0;i<n;i++){dist[i]=INFINITY;prev[i]=-1;}
+    char *done=calloc(n+1,1);double *hd=xmalloc(sizeof(double)*(g->m+2));int *hv=xmalloc(sizeof(int)*(g->m+2));
+    #define CSR_LESS(i,j) (hd[i]<hd[j]||(hd[i]==hd[j]&&hv[i]<hv[j]))
+    #define CSR_SWAP(i,j) do{double td=hd[i];hd[i]=hd[j];hd[j]=td;int tv=hv[i];hv[i]=hv[j];hv[j]=tv;}while(0)
+    dist[s]=0;hd[0]=0;hv[hn++]=s;
+    while(hn){
+        int u=hv[0];double d=hd[0];hn--;hd[0]=hd[hn];hv[0]=hv[hn];
+        for(int i=0;;){int c=2*i+1;if(c>=hn)break;if(c+1<hn&&CSR_LESS(c+1,c))c++;if(!CSR_LESS(c,i))break;CSR_SWAP(i,c);i=c;}
+        if(done[u]||d>dist[u])continue;
+        done[u]=1;if(u==t)break;
+        for(int p=g->off[u];p<g->off[u+1];p++){int x=g->adj[p];double alt=d+g->w[p];
+            if(alt<dist[x]){dist[x]=alt;prev[x]=u;int i=hn++;hd[i]=alt;hv[i]=x;while(i>0&&CSR_LESS(i,(i-1)/2)){CSR_SWAP(i,(i-1)/2);i=(i-1)/2;}}}
+    }
+    #undef CSR_LESS
+    #undef CSR_SWAP
+    free(done);free(hd);free(hv);
+}
+/* Depth-first postorder, reversed; NULL when a cycle is found */
+static Value *csr_toposort(CsrGraph *g) {
+    int n=g->n,k=0,sp=0;char *color=calloc(n+1,1);int *cur=xmalloc(sizeof(int)*(n+1)),*stack=xmalloc(sizeof(int)*(n+1)),*order=xmalloc(sizeof(int)*(n+1));
+    Value *res=NULL;memcpy(cur,g->off,sizeof(int)*n);
+    for(int r=0;r<n;r++){
+        if(color[r])continue;
+        color[r]=1;stack[sp++]=r;
+        while(sp){int u=stack[sp-1];
+            if(cur[u]<g->off[u+1]){int x=g->adj[cur[u]++];if(color[x]==1)goto done;if(!color[x]){color[x]=1;stack[sp++]=x;}}
+            else{sp--;color[u]=2;order[k++]=u;}}
+    }
+    for(int i=0;i<k/2;i++){int t=order[i];order[i]=order[k-1-i];order[k-1-i]=t;}
+    res=csr_ids(g,order,k);
+done:
+    free(color);free(cur);free(stack);free(order);return res?res:val_null();
+}
+static Value *csr_components(CsrGraph *g) {
+    int n=g->n,*roff=NULL,*radj=NULL;
+    if(g->directed){roff=calloc(n+1,sizeof(int));radj=xmalloc(sizeof(int)*(g->m+1));
+        for(int u=0;u<n;u++)for(int p=g->off[u];p<g->off[u+1];p++)roff[g->adj[p]+1]++;
+        for(int i=0;i<n;i++)roff[i+1]+=roff[i];
+        int *fill=xmalloc(sizeof(int)*(n+1));memcpy(fill,roff,sizeof(int)*(n+1));
+        for(int u=0;u<n;u++)for(int p=g->off[u];p<g->off[u+1];p++)radj[fill[g->adj[p]]++]=u;
+        free(fill);}
+    char *seen=calloc(n+1,1);int *buf=xmalloc(sizeof(int)*(n+1));Value *res=val_array(8);
+    for(int s=0;s<n;s++)if(!seen[s]){int c=csr_bfs(g,s,seen,buf,roff,radj);Value *comp=csr_ids(g,buf,c);arr_push(res,comp);val_decref(comp);}
+    free(seen);free(buf);free(roff);free(radj);return res;
+}
+static Value *csr_method(Value *obj,int mid,Value **args,int argc) {
+    CsrGraph *g=obj->as.graph;int s=argc>=1?csr_find(g,args[0]):-1;
+    switch(mid){
+        case M_len:case M_length:case M_size:return val_int(g->n);
+        case M_has:return val_bool(s>=0);
+        case M_neighbors:return s<0?val_array(0):csr_ids(g,g->adj+g->off[s],g->off[s+1]-g->off[s]);
+        case M_bfs:{if(s<0)return val_array(0);char *seen=calloc(g->n+1,1);int *buf=xmalloc(sizeof(int)*(g->n+1));int c=csr_bfs(g,s,seen,buf,NULL,NULL);Value *r=csr_ids(g,buf,c);free(seen);free(buf);return r;}
+        case M_dijkstra:case M_shortestPath:{
+            int t=argc>=2&&args[1]->type!=V_NULL?csr_find(g,args[1]):-1;
+            if(s<0||(mid==M_shortestPath&&t<0))return mid==M_dijkstra?bi_Map(NULL,0):val_null();
+            for(int p=0;p<g->m;p++)if(g->w[p]<0)runtime_error(g_line,"%s() needs non-negative weights",g_method_names[mid]);
+            double *dist=xmalloc(sizeof(double)*(g->n+1));int *prev=xmalloc(sizeof(int)*(g->n+1));csr_dijkstra(g,s,t,dist,prev);Value *r;
+            if(mid==M_shortestPath){
+                if(dist[t]==INFINITY)r=val_null();
+                else{int k=0;for(int x=t;x>=0;x=prev[x])k++;int *path=xmalloc(sizeof(int)*k);int i=k;for(int x=t;x>=0;x=prev[x])path[--i]=x;r=csr_ids(g,path,k);free(path);}
+            }else{
+                Value *d=bi_Map(NULL,0),*pv=bi_Map(NULL,0);r=val_object();
+                for(int i=0;i<g->n;i++){if(dist[i]==INFINITY)continue;Value *x=num_box(dist[i]);hmap_set(d->as.map,g->ids[i],x);val_decref(x);if(prev[i]>=0)hmap_set(pv->as.map,g->ids[i],g->ids[prev[i]]);}
+                obj_set(r,"distances",d);obj_set(r,"previous",pv);val_decref(d);val_decref(pv);
+            }
+            free(dist);free(prev);return r;
+        }
+        case M_topologicalSort:return csr_toposort(g);
+        case M_components:return csr_components(g);
+        default:return val_null();
+    }
+}
 /* Builtins */
 static Value *bi_print(AST **args,int argc){for(int i=0;i<argc;i++){Value *v=eval(args[i]);printf("%s",val_tostr(v));if(i<argc-1)printf(" ");val_decref(v);}printf("\n");return val_null();}
 static Value *bi_len(Value **a,int n){if(n!=1)return val_int(0);switch(a[0]->type){case V_STRING:return val_int(strlen(a[0]->as.s));case V_ARRAY:return val_int(a[0]->as.arr->len);case V_OBJECT:return val_int(a[0]->as.obj->count);default:return val_int(0);}}
-static Value *bi_typeof(Value **a,int n){if(n!=1)return val_string("undefined");const char *t[]={"null","boolean","integer","float","string","array","object","function","class","instance","module","closure"};return val_string(t[a[0]->type]);}
-static Value *bi_keys(Value **a,int n){if(n!=1||(a[0]->type!=V_OBJECT&&a[0]->type!=V_MODULE))return val_array(0);Value *arr=val_array(a[0]->as.obj->count);for(int i=0;i<a[0]->as.obj->count;i++){Value *k=val_string(a[0]->as.obj->pairs[i].key);arr_push(arr,k);val_decref(k);}return arr;}
-static Value *bi_values(Value **a,int n){if(n!=1||(a[0]->type!=V_OBJECT&&a[0]->type!=V_MODULE))return val_array(0);Value *arr=val_array(a[0]->as.obj->count);for(int i=0;i<a[0]->as.obj->count;i++){Value *v=val_copy(a[0]->as.obj->pairs[i].val);arr_push(arr,v);val_decref(v);}return arr;}
+static const char *g_type_names[]={"null","boolean","integer","float","string","array","object","function","class","instance","module","closure","builder","typedarray","map","set","deque","priorityqueue","csrgraph","iterator","file","worker"};
+static Value *bi_typeof(Value **a,int n){if(n!=1)return val_string("undefined");if(a[0]->type==V_TYPED)return val_string(a[0]->as.ta->kind==TA_F64?"float64array":"int64array");return val_string(g_type_names[a[0]->type]);}
+static void stat_set(Value *obj,const char *key,long n){Value *v=val_int(n);obj_set(obj,key,v);val_decref(v);}
+/* StringBuilder(initial?) - mutable string for building large text */
+static Value *bi_StringBuilder(Value **a,int n){Value *v=val_new(V_BUILDER);v->as.s=str_alloc(256);if(n>=1)str_append_val(v,a[0]);return v;}
+static Value *bi_memStats(Value **a,int n){(void)a;(void)n;Value *r=val_object(),*live=val_object(),*peak=val_object(),*types=val_object();long reserved=g_arena_bytes;
+    for(int i=0;i<POOL_COUNT;i++){stat_set(live,g_pools[i].name,g_pools[i].live);stat_set(peak,g_pools[i].name,g_pools[i].peak);reserved+=g_pools[i].slabs*POOL_SLAB*(long)g_pools[i].size;}
+    for(int t=0;t<=V_WORKER;t++)if(g_val_live[t])stat_set(types,g_type_names[t],g_val_live[t]);
+    obj_set(r,"live",live);obj_set(r,"peak",peak);obj_set(r,"types",types);val_decref(live);val_decref(peak);val_decref(types);
+    stat_set(r,"bytes",g_pool_bytes);stat_set(r,"peakBytes",g_pool_peak);stat_set(r,"reservedBytes",reserved);stat_set(r,"astNodes",g_ast_n);stat_set(r,"astBytes",g_arena_bytes);stat_set(r,"gcRuns",g_gc_runs);stat_set(r,"gcFreed",g_gc_freed);return r;}
+/* gc() collects now and returns the number of nodes freed; gc({threshold: n}) also sets how many
+   buffered candidates trigger an automatic collection (0 turns automatic collection off) */
+static Value *bi_gc(Value **a,int n){if(n>=1&&a[0]->type==V_OBJECT){Value *t=obj_get(a[0],"threshold");if(t)g_gc_threshold=(int)val_tonum(t);}return val_int(gc_collect());}
+static void mem_report(void){long reserved=g_arena_bytes;fflush(stdout);fprintf(stderr,"\n--- memory ---\n%-10s %10s %10s %10s\n","pool","live","peak","bytes");
+    for(int i=0;i<POOL_COUNT;i++){Pool *p=&g_pools[i];reserved+=p->slabs*POOL_SLAB*(long)p->size;fprintf(stderr,"%-10s %10ld %10ld %10ld\n",p->name,p->live,p->peak,p->live*(long)p->size);}
+    fprintf(stderr,"live values by type:");for(int t=0;t<=V_WORKER;t++)if(g_val_live[t])fprintf(stderr," %s=%ld",g_type_names[t],g_val_live[t]);
+    fprintf(stderr,"\nbytes %ld, peak %ld, reserved %ld\nast nodes %ld in %ld arena bytes\ngc runs %ld, freed %ld\n",g_pool_bytes,g_pool_peak,reserved,g_ast_n,g_arena_bytes,g_gc_runs,g_gc_freed);}
+static Value *bi_keys(Value **a,int n){if(n==1&&(a[0]->type==V_MAP||a[0]->type==V_SET))return coll_method(a[0],M_keys,NULL,0);if(n!=1||(a[0]->type!=V_OBJECT&&a[0]->type!=V_MODULE))return val_array(0);Value *arr=val_array(a[0]->as.obj->count);for(int i=0;i<a[0]->as.obj->count;i++){Value *k=val_string(a[0]->as.obj->pairs[i].key);arr_push(arr,k);val_decref(k);}return arr;}
+static Value *bi_values(Value **a,int n){if(n==1&&(a[0]->type==V_MAP||a[0]->type==V_SET||a[0]->type==V_DEQUE))return a[0]->type==V_DEQUE?coll_to_array(a[0]):coll_method(a[0],M_values,NULL,0);if(n!=1||(a[0]->type!=V_OBJECT&&a[0]->type!=V_MODULE))return val_array(0);Value *arr=val_array(a[0]->as.obj->count);for(int i=0;i<a[0]->as.obj->count;i++){Value *v=val_copy(a[0]->as.obj->pairs[i].val);arr_push(arr,v);val_decref(v);}return arr;}
 static Value *bi_push(Value **a,int n){if(n!=2||a[0]->type!=V_ARRAY)return val_null();arr_push(a[0],a[1]);return val_int(a[0]->as.arr->len);}
 static Value *bi_pop(Value **a,int n){if(n!=1||a[0]->type!=V_ARRAY)return val_null();return arr_pop(a[0]);}
 static Value *bi_input(Value **a,int n){if(n>0&&a[0]->type==V_STRING){printf("%s",a[0]->as.s);fflush(stdout);}char buf[4096];if(!fgets(buf,sizeof(buf),stdin))return val_string("");buf[strcspn(buf,"\n")]='\0';return val_string(buf);}
@@ -382,8 +1256,8 @@ static Value *bi_float_fn(Value **a,int n){return n==1?val_float(val_tonum(a[0])
 static Value *bi_chr(Value **a,int n){if(n!=1)return val_string("");int code=(int)val_tonum(a[0]);if(code<0||code>0x10FFFF)return val_string("");if(code<128){char buf[2]={(char)code,'\0'};return val_string(buf);}else if(code<0x800){char buf[3]={(char)(0xC0|(code>>6)),(char)(0x80|(code&0x3F)),'\0'};return val_string(buf);}else if(code<0x10000){char buf[4]={(char)(0xE0|(code>>12)),(char)(0x80|((code>>6)&0x3F)),(char)(0x80|(code&0x3F)),'\0'};return val_string(buf);}else{char buf[5]={(char)(0xF0|(code>>18)),(char)(0x80|((code>>12)&0x3F)),(char)(0x80|((code>>6)&0x3F)),(char)(0x80|(code&0x3F)),'\0'};return val_string(buf);}}
 static Value *bi_ord(Value **a,int n){if(n!=1||a[0]->type!=V_STRING||!a[0]->as.s[0])return val_int(0);unsigned char *s=(unsigned char*)a[0]->as.s;if(s[0]<128)return val_int(s[0]);if((s[0]&0xE0)==0xC0&&s[1])return val_int(((s[0]&0x1F)<<6)|(s[1]&0x3F));if((s[0]&0xF0)==0xE0&&s[1]&&s[2])return val_int(((s[0]&0x0F)<<12)|((s[1]&0x3F)<<6)|(s[2]&0x3F));if((s[0]&0xF8)==0xF0&&s[1]&&s[2]&&s[3])return val_int(((s[0]&0x07)<<18)|((s[1]&0x3F)<<12)|((s[2]&0x3F)<<6)|(s[3]&0x3F));return val_int(s[0]);}
 static Value *bi_range(Value **a,int n){long long start=0,stop=0,step=1;if(n==1)stop=(long long)val_tonum(a[0]);else if(n==2){start=(long long)val_tonum(a[0]);stop=(long long)val_tonum(a[1]);}else if(n>=3){start=(long long)val_tonum(a[0]);stop=(long long)val_tonum(a[1]);step=(long long)val_tonum(a[2]);}if(step==0)step=1;Value *arr=val_array(16);if(step>0)for(long long i=start;i<stop;i+=step){Value *v=val_int(i);arr_push(arr,v);val_decref(v);}else for(long long i=start;i>stop;i+=step){Value *v=val_int(i);arr_push(arr,v);val_decref(v);}return arr;}
-static Value *bi_join(Value **a,int n){if(n<1||a[0]->type!=V_ARRAY)return val_string("");const char *sep=(n>=2&&a[1]->type==V_STRING)?a[1]->as.s:"";char buf[MAX_STR];int pos=0;for(int i=0;i<a[0]->as.arr->len&&pos<MAX_STR-100;i++){if(i>0){int sl=strlen(sep);memcpy(buf+pos,sep,sl);pos+=sl;}const char *s=val_tostr(a[0]->as.arr->items[i]);int sl=strlen(s);if(pos+sl<MAX_STR-1){memcpy(buf+pos,s,sl);pos+=sl;}}buf[pos]='\0';return val_string(buf);}
-static Value *bi_split(Value **a,int n){if(n<1||a[0]->type!=V_STRING)return val_array(0);const char *sep=(n>=2&&a[1]->type==V_STRING)?a[1]->as.s:" ";Value *arr=val_array(8);char *str=xstrdup(a[0]->as.s);if(strlen(sep)==0){for(size_t i=0;i<strlen(a[0]->as.s);i++){char c[2]={a[0]->as.s[i],'\0'};Value *v=val_string(c);arr_push(arr,v);val_decref(v);}}else{char *tok=strtok(str,sep);while(tok){Value *v=val_string(tok);arr_push(arr,v);val_decref(v);tok=strtok(NULL,sep);}}free(str);return arr;}
+static Value *bi_join(Value **a,int n){if(n<1||a[0]->type!=V_ARRAY)return val_string("");const char *sep=(n>=2&&a[1]->type==V_STRING)?a[1]->as.s:"";int sl=strlen(sep);StrBuf sb;sb_init(&sb);for(int i=0;i<a[0]->as.arr->len;i++){if(i>0)sb_append(&sb,sep,sl);sb_append_val(&sb,a[0]->as.arr->items[i]);}return sb_value(&sb);}
+static Value *bi_split(Value **a,int n){if(n<1||a[0]->type!=V_STRING)return val_array(0);const char *sep=(n>=2&&a[1]->type==V_STRING)?a[1]->as.s:" ";Value *arr=val_array(8);char *str=xstrdup(a[0]->as.s);if(!sep[0]){size_t len=str_len(a[0]);for(size_t i=0;i<len;i++){char c[2]={a[0]->as.s[i],'\0'};Value *v=val_string(c);arr_push(arr,v);val_decref(v);}}else{char *tok=strtok(str,sep);while(tok){Value *v=val_string(tok);arr_push(arr,v);val_decref(v);tok=strtok(NULL,sep);}}free(str);return arr;}
 static Value *bi_trim(Value **a,int n){if(n!=1||a[0]->type!=V_STRING)return val_string("");char *s=a[0]->as.s;while(*s&&isspace((unsigned char)*s))s++;if(!*s)return val_string("");char *e=s+strlen(s)-1;while(e>s&&isspace((unsigned char)*e))e--;int len=e-s+1;char *r=xmalloc(len+1);memcpy(r,s,len);r[len]='\0';Value *v=val_string(r);free(r);return v;}
 static Value *bi_upper(Value **a,int n){if(n!=1||a[0]->type!=V_STRING)return val_string("");char *r=xstrdup(a[0]->as.s);for(char *p=r;*p;p++)*p=toupper((unsigned char)*p);Value *v=val_string(r);free(r);return v;}
 static Value *bi_lower(Value **a,int n){if(n!=1||a[0]->type!=V_STRING)return val_string("");char *r=xstrdup(a[0]->as.s);for(char *p=r;*p;p++)*p=tolower((unsigned char)*p);Value *v=val_string(r);free(r);return v;}
@@ -391,11 +1265,92 @@ static Value *bi_replace(Value **a,int n){if(n<3||a[0]->type!=V_STRING||a[1]->ty
 static Value *bi_indexOf(Value **a,int n){if(n<2)return val_int(-1);if(a[0]->type==V_STRING&&a[1]->type==V_STRING){char *found=strstr(a[0]->as.s,a[1]->as.s);return val_int(found?(found-a[0]->as.s):-1);}if(a[0]->type==V_ARRAY){for(int i=0;i<a[0]->as.arr->len;i++){Value *item=a[0]->as.arr->items[i];if(item->type==a[1]->type){if(item->type==V_INT&&item->as.i==a[1]->as.i)return val_int(i);if(item->type==V_STRING&&strcmp(item->as.s,a[1]->as.s)==0)return val_int(i);}}return val_int(-1);}return val_int(-1);}
 static Value *bi_slice(Value **a,int n){if(n<1)return val_null();int start=(n>=2)?(int)val_tonum(a[1]):0;int end=(n>=3)?(int)val_tonum(a[2]):INT_MAX;if(a[0]->type==V_STRING){int len=strlen(a[0]->as.s);if(start<0)start=len+start;if(end<0)end=len+end;if(start<0)start=0;if(end>len)end=len;if(start>=end)return val_string("");int sl=end-start;char *r=xmalloc(sl+1);memcpy(r,a[0]->as.s+start,sl);r[sl]='\0';Value *v=val_string(r);free(r);return v;}if(a[0]->type==V_ARRAY){int len=a[0]->as.arr->len;if(start<0)start=len+start;if(end<0)end=len+end;if(start<0)start=0;if(end>len)end=len;if(start>=end)return val_array(0);Value *arr=val_array(end-start);for(int i=start;i<end;i++){Value *item=val_copy(a[0]->as.arr->items[i]);arr_push(arr,item);val_decref(item);}return arr;}return val_null();}
 static Value *bi_reverse(Value **a,int n){if(n!=1)return val_null();if(a[0]->type==V_STRING){int len=strlen(a[0]->as.s);char *r=xmalloc(len+1);for(int i=0;i<len;i++)r[i]=a[0]->as.s[len-1-i];r[len]='\0';Value *v=val_string(r);free(r);return v;}if(a[0]->type==V_ARRAY){Array *ar=a[0]->as.arr;for(int i=0;i<ar->len/2;i++){Value *tmp=ar->items[i];ar->items[i]=ar->items[ar->len-1-i];ar->items[ar->len-1-i]=tmp;}val_incref(a[0]);return a[0];}return val_null();}
-static int cmp_vals(const void *x,const void *y){Value *va=*(Value**)x,*vb=*(Value**)y;if(va->type==V_INT&&vb->type==V_INT)return(va->as.i>vb->as.i)-(va->as.i<vb->as.i);if(va->type==V_FLOAT||vb->type==V_FLOAT){double fa=val_tonum(va),fb=val_tonum(vb);return(fa>fb)-(fa<fb);}if(va->type==V_STRING&&vb->type==V_STRING)return strcmp(va->as.s,vb->as.s);return 0;}
-static Value *bi_sort(Value **a,int n){if(n!=1||a[0]->type!=V_ARRAY)return val_null();qsort(a[0]->as.arr->items,a[0]->as.arr->len,sizeof(Value*),cmp_vals);val_incref(a[0]);return a[0];}
+/* Sorting: a stable run-aware merge sort (TimSort-style) over an index permutation.
+   Keys are extracted once and classified so the hot compare works on raw ints,
+   doubles or C strings; a user comparator or mixed keys fall back to val_order. */
+/* Mixed types order as null < bool < number < string < array < everything else. */
+static int sort_rank(Value *v){switch(v->type){case V_NULL:return 0;case V_BOOL:return 1;case V_INT:case V_FLOAT:return 2;case V_STRING:return 3;case V_ARRAY:return 4;default:return 5;}}
+static int val_order(Value *va,Value *vb){if(va->type==V_INT&&vb->type==V_INT)return(va->as.i>vb->as.i)-(va->as.i<vb->as.i);if((va->type==V_INT||va->type==V_FLOAT)&&(vb->type==V_INT||vb->type==V_FLOAT)){double fa=val_tonum(va),fb=val_tonum(vb);return(fa>fb)-(fa<fb);}if(va->type==V_STRING&&vb->type==V_STRING){int c=strcmp(va->as.s,vb->as.s);return(c>0)-(c<0);}if(va->type==V_ARRAY&&vb->type==V_ARRAY){Array *x=va->as.arr,*y=vb->as.arr;for(int i=0;i<x->len&&i<y->len;i++){int c=val_order(x->items[i],y->items[i]);if(c)return c;}return(x->len>y->len)-(x->len<y->len);}int ra=sort_rank(va),rb=sort_rank(vb);if(ra!=rb)return(ra>rb)-(ra<rb);if(va->type==V_BOOL)return va->as.b-vb->as.b;return 0;}
+enum { SK_INT,SK_NUM,SK_STR,SK_VAL,SK_FN };
+typedef struct { int kind,rev; Value *fn; Value **v; long long *i; double *f; const char **s; } SortCtx;
+static inline int sort_cmp(SortCtx *c,int a,int b){int r;switch(c->kind){
+    case SK_INT:r=(c->i[a]>c->i[b])-(c->i[a]<c->i[b]);break;
+    case SK_NUM:r=(c->f[a]>c->f[b])-(c->f[a]<c->f[b]);break;
+    case SK_STR:r=strcmp(c->s[a],c->s[b]);r=(r>0)-(r<0);break;
+    case SK_FN:{Value *args[2]={c->v[a],c->v[b]};Value *res=call_closure(c->fn,args,2);double d=val_tonum(res);val_decref(res);r=(d>0)-(d<0);break;}
+    default:r=val_order(c->v[a],c->v[b]);break;}
+    return c->rev?-r:r;}
+#define SORT_MINRUN 32
+static void sort_insert(SortCtx *c,int *ix,int lo,int start,int hi){for(int i=start;i<hi;i++){int x=ix[i],l=lo,r=i;while(l<r){int m=(l+r)>>1;if(sort_cmp(c,x,ix[m])<0)r=m;else l=m+1;}memmove(ix+l+1,ix+l,(i-l)*sizeof(int));ix[l]=x;}}
+static void sort_merge(SortCtx *c,int *ix,int *tmp,int lo,int mid,int hi){
+    if(sort_cmp(c,ix[mid],ix[mid-1])>=0)return; /* runs already in order */
+    int n1=mid-lo,i=0,j=mid,k=lo;memcpy(tmp,ix+lo,n1*sizeof(int));
+    while(i<n1&&j<hi)ix[k++]=sort_cmp(c,ix[j],tmp[i])<0?ix[j++]:tmp[i++];
+    while(i<n1)ix[k++]=tmp[i++];
+}
+static int *sort_perm(SortCtx *c,int n){
+    int *ix=xmalloc(sizeof(int)*(n+1)),*tmp=xmalloc(sizeof(int)*(n+1)),rb[64],rl[64],rn=0;for(int i=0;i<n;i++)ix[i]=i;
+    #define SORT_MERGE_AT(k) do{sort_merge(c,ix,tmp,rb[k],rb[(k)+1],rb[(k)+1]+rl[(k)+1]);rl[k]+=rl[(k)+1];if((k)+2<rn){rb[(k)+1]=rb[(k)+2];rl[(k)+1]=rl[(k)+2];}rn--;}while(0)
+    for(int lo=0;lo<n;){
+        int hi=lo+1;
+        if(hi<n){int desc=sort_cmp(c,ix[hi],ix[lo])<0;hi++;while(hi<n&&(sort_cmp(c,ix[hi],ix[hi-1])<0)==desc)hi++;if(desc)for(int a=lo,b=hi-1;a<b;a++,b--){int t=ix[a];ix[a]=ix[b];ix[b]=t;}}
+        if(hi-lo<SORT_MINRUN){int e=lo+SORT_MINRUN<n?lo+SORT_MINRUN:n;sort_insert(c,ix,lo,hi,e);hi=e;}
+        rb[rn]=lo;rl[rn++]=hi-lo;lo=hi;
+        while(rn>1){int k=rn-2;if((k>0&&rl[k-1]<=rl[k]+rl[k+1])||(k>1&&rl[k-2]<=rl[k-1]+rl[k])){if(rl[k-1]<rl[k+1])k--;}else if(rl[k]>rl[k+1])break;SORT_MERGE_AT(k);}
+    }
+    while(rn>1){int k=rn-2;if(k>0&&rl[k-1]<rl[k+1])k--;SORT_MERGE_AT(k);}
+    #undef SORT_MERGE_AT
+    free(tmp);return ix;
+}
+/* Pick the cheapest comparison the keys allow. */
+static void sort_keys(SortCtx *c,Value **k,int n){
+    int ints=1,nums=1,strs=1;for(int i=0;i<n;i++){int t=k[i]->type;if(t!=V_INT)ints=0;if(t!=V_INT&&t!=V_FLOAT)nums=0;if(t!=V_STRING)strs=0;}
+    c->v=k;c->kind=SK_VAL;
+    if(ints){c->kind=SK_INT;c->i=xmalloc(sizeof(long long)*(n+1));for(int i=0;i<n;i++)c->i[i]=k[i]->as.i;}
+    else if(nums){c->kind=SK_NUM;c->f=xmalloc(sizeof(double)*(n+1));for(int i=0;i<n;i++)c->f[i]=val_tonum(k[i]);}
+    else if(strs){c->kind=SK_STR;c->s=xmalloc(sizeof(char*)*(n+1));for(int i=0;i<n;i++)c->s[i]=k[i]->as.s;}
+}
+/* Sort a snapshot of arr's items. key is a function, a field name or an array of field names
+   (compared lexicographically); cmp is a two-argument comparator. Returns the items in sorted
+   order, each holding a reference. */
+static Value **sort_items(Value *arr,Value *cmp,Value *key,int rev){
+    int n=arr->as.arr->len;Value **items=xmalloc(sizeof(Value*)*(n+1)),**keys=NULL;
+    for(int i=0;i<n;i++){items[i]=arr->as.arr->items[i];val_incref(items[i]);}
+    SortCtx c={0};c.rev=rev;
+    if(cmp){c.kind=SK_FN;c.fn=cmp;c.v=items;}
+    else if(key&&key->type!=V_NULL){
+        keys=xmalloc(sizeof(Value*)*(n+1));
+        for(int i=0;i<n;i++){
+            if(key->type==V_CLOSURE||key->type==V_FUNC){Value *args[1]={items[i]};keys[i]=call_closure(key,args,1);}
+            else if(key->type==V_STRING){Value *f=obj_get(items[i],key->as.s);keys[i]=f?f:val_null();val_incref(keys[i]);}
+            else if(key->type==V_ARRAY){Array *ka=key->as.arr;keys[i]=val_array(ka->len);for(int j=0;j<ka->len;j++){Value *f=ka->items[j]->type==V_STRING?obj_get(items[i],ka->items[j]->as.s):NULL;arr_push(keys[i],f?f:val_null());}}
+            else runtime_error(g_line,"sortBy() key must be a function, field name or array of field names");
+        }
+        sort_keys(&c,keys,n);
+    }
+    else sort_keys(&c,items,n);
+    int *ix=sort_perm(&c,n);Value **out=xmalloc(sizeof(Value*)*(n+1));for(int i=0;i<n;i++)out[i]=items[ix[i]];
+    if(keys){for(int i=0;i<n;i++)val_decref(keys[i]);free(keys);}
+    free(c.i);free(c.f);free(c.s);free(ix);free(items);return out;
+}
+/* sort(arr [, cmp] [, reverse]) sorts in place */
+static Value *bi_sort(Value **a,int n){
+    if(n<1||a[0]->type!=V_ARRAY)return val_null();Value *cmp=NULL;int rev=0;
+    for(int i=1;i<n;i++){if(a[i]->type==V_CLOSURE||a[i]->type==V_FUNC)cmp=a[i];else rev=val_truthy(a[i]);}
+    int len=a[0]->as.arr->len;Value **out=sort_items(a[0],cmp,NULL,rev);Array *arr=a[0]->as.arr;
+    if(arr->len==len){for(int i=0;i<len;i++){Value *old=arr->items[i];arr->items[i]=out[i];val_decref(old);}}
+    else for(int i=0;i<len;i++)val_decref(out[i]); /* comparator resized the array; leave it alone */
+    free(out);val_incref(a[0]);return a[0];
+}
+/* sortBy(arr, key [, reverse]) returns a new stably sorted array */
+static Value *bi_sortBy(Value **a,int n){
+    if(n<1||a[0]->type!=V_ARRAY)return val_array(0);
+    int len=a[0]->as.arr->len;Value **out=sort_items(a[0],NULL,n>=2?a[1]:NULL,n>=3&&val_truthy(a[2]));
+    Value *r=val_array(len);for(int i=0;i<len;i++){arr_push(r,out[i]);val_decref(out[i]);}free(out);return r;
+}
 static Value *bi_abs(Value **a,int n){if(n!=1)return val_int(0);if(a[0]->type==V_INT)return val_int(llabs(a[0]->as.i));return val_float(fabs(val_tonum(a[0])));}
-static Value *bi_min(Value **a,int n){if(n==0)return val_null();if(n==1&&a[0]->type==V_ARRAY){if(a[0]->as.arr->len==0)return val_null();double m=val_tonum(a[0]->as.arr->items[0]);for(int i=1;i<a[0]->as.arr->len;i++){double v=val_tonum(a[0]->as.arr->items[i]);if(v<m)m=v;}return val_float(m);}double m=val_tonum(a[0]);for(int i=1;i<n;i++){double v=val_tonum(a[i]);if(v<m)m=v;}return val_float(m);}
-static Value *bi_max(Value **a,int n){if(n==0)return val_null();if(n==1&&a[0]->type==V_ARRAY){if(a[0]->as.arr->len==0)return val_null();double m=val_tonum(a[0]->as.arr->items[0]);for(int i=1;i<a[0]->as.arr->len;i++){double v=val_tonum(a[0]->as.arr->items[i]);if(v>m)m=v;}return val_float(m);}double m=val_tonum(a[0]);for(int i=1;i<n;i++){double v=val_tonum(a[i]);if(v>m)m=v;}return val_float(m);}
+static Value *bi_min(Value **a,int n){if(n==0)return val_null();if(n==1&&a[0]->type==V_TYPED){TypedArr *t=a[0]->as.ta;if(!t->len)return val_null();return val_float(t->kind==TA_F64?kern_min(t->d.f,t->len):(double)kern_imin(t->d.i,t->len));}if(n==1&&a[0]->type==V_ARRAY){if(a[0]->as.arr->len==0)return val_null();Value **it=a[0]->as.arr->items;double m=VAL_NUM(it[0]);for(int i=1;i<a[0]->as.arr->len;i++){double v=VAL_NUM(it[i]);if(v<m)m=v;}return val_float(m);}double m=val_tonum(a[0]);for(int i=1;i<n;i++){double v=val_tonum(a[i]);if(v<m)m=v;}return val_float(m);}
+static Value *bi_max(Value **a,int n){if(n==0)return val_null();if(n==1&&a[0]->type==V_TYPED){TypedArr *t=a[0]->as.ta;if(!t->len)return val_null();return val_float(t->kind==TA_F64?kern_max(t->d.f,t->len):(double)kern_imax(t->d.i,t->len));}if(n==1&&a[0]->type==V_ARRAY){if(a[0]->as.arr->len==0)return val_null();Value **it=a[0]->as.arr->items;double m=VAL_NUM(it[0]);for(int i=1;i<a[0]->as.arr->len;i++){double v=VAL_NUM(it[i]);if(v>m)m=v;}return val_float(m);}double m=val_tonum(a[0]);for(int i=1;i<n;i++){double v=val_tonum(a[i]);if(v>m)m=v;}return val_float(m);}
 static Value *bi_floor(Value **a,int n){return n==1?val_int((long long)floor(val_tonum(a[0]))):val_int(0);}
 static Value *bi_ceil(Value **a,int n){return n==1?val_int((long long)ceil(val_tonum(a[0]))):val_int(0);}
 static Value *bi_round(Value **a,int n){return n==1?val_int((long long)round(val_tonum(a[0]))):val_int(0);}
@@ -403,8 +1358,8 @@ static Value *bi_sqrt(Value **a,int n){return n==1?val_float(sqrt(val_tonum(a[0]
 static Value *bi_pow_fn(Value **a,int n){return n==2?val_float(pow(val_tonum(a[0]),val_tonum(a[1]))):val_float(0);}
 static Value *bi_random(Value **a,int n){(void)a;(void)n;if(!g_rand_init){srand((unsigned)time(NULL));g_rand_init=1;}return val_float((double)rand()/RAND_MAX);}
 static Value *bi_randomInt(Value **a,int n){if(!g_rand_init){srand((unsigned)time(NULL));g_rand_init=1;}if(n==1)return val_int(rand()%(int)val_tonum(a[0]));if(n>=2){int mn=(int)val_tonum(a[0]),mx=(int)val_tonum(a[1]);return val_int(mn+rand()%(mx-mn));}return val_int(rand());}
-static Value *bi_hasKey(Value **a,int n){if(n!=2||(a[0]->type!=V_OBJECT&&a[0]->type!=V_MODULE)||a[1]->type!=V_STRING)return val_bool(0);return val_bool(obj_has(a[0],a[1]->as.s));}
-static Value *bi_delete(Value **a,int n){if(n!=2||(a[0]->type!=V_OBJECT&&a[0]->type!=V_MODULE)||a[1]->type!=V_STRING)return val_null();obj_del(a[0],a[1]->as.s);return val_null();}
+static Value *bi_hasKey(Value **a,int n){if(n==2&&(a[0]->type==V_MAP||a[0]->type==V_SET))return coll_method(a[0],M_has,a+1,1);if(n!=2||(a[0]->type!=V_OBJECT&&a[0]->type!=V_MODULE)||a[1]->type!=V_STRING)return val_bool(0);return val_bool(obj_has(a[0],a[1]->as.s));}
+static Value *bi_delete(Value **a,int n){if(n==2&&(a[0]->type==V_MAP||a[0]->type==V_SET)){hmap_del(a[0]->as.map,a[1]);return val_null();}if(n!=2||(a[0]->type!=V_OBJECT&&a[0]->type!=V_MODULE)||a[1]->type!=V_STRING)return val_null();obj_del(a[0],a[1]->as.s);return val_null();}
 static Value *bi_clone(Value **a,int n){return n==1?val_clone(a[0]):val_null();}
 static Value *bi_isArray(Value **a,int n){return n==1?val_bool(a[0]->type==V_ARRAY):val_bool(0);}
 static Value *bi_isObject(Value **a,int n){return n==1?val_bool(a[0]->type==V_OBJECT||a[0]->type==V_MODULE):val_bool(0);}
@@ -415,42 +1370,63 @@ static Value *bi_assert(Value **a,int n){if(n<1)return val_null();if(!val_truthy
 static Value *bi_sleep(Value **a,int n){if(n!=1)return val_null();long long ms=(long long)val_tonum(a[0]);if(ms>0)sleep_ms((unsigned)ms);return val_null();}
 
 /* Timer functions */
+/* Monotonic milliseconds for timers and timeouts; unaffected by changes to the wall clock */
 static long long current_time_ms(void) {
 #ifdef _WIN32
-    FILETIME ft;GetSystemTimeAsFileTime(&ft);ULARGE_INTEGER uli;uli.LowPart=ft.dwLowDateTime;uli.HighPart=ft.dwHighDateTime;return (long long)(uli.QuadPart/10000ULL-11644473600000ULL);
+    return (long long)GetTickCount64();
 #else
-    struct timespec ts;clock_gettime(CLOCK_REALTIME,&ts);return (long long)ts.tv_sec*1000LL+(long long)ts.tv_nsec/1000000LL;
+    struct timespec ts;clock_gettime(CLOCK_MONOTONIC,&ts);return (long long)ts.tv_sec*1000LL+(long long)ts.tv_nsec/1000000LL;
 #endif
 }
-static int add_timer(Value *callback, int delay_ms, int interval) {
+static int timer_less(Timer *a,Timer *b) { return a->fire_at<b->fire_at||(a->fire_at==b->fire_at&&a->id<b->id); }
+static void timer_up(int i) {
+    Timer t=g_timers[i];
+    while(i>0){int p=(i-1)/2;if(!timer_less(&t,&g_timers[p]))break;g_timers[i]=g_timers[p];i=p;}
+    g_timers[i]=t;
+}
+static void timer_down(int i) {
+    Timer t=g_timers[i];
+    for(;;){int c=2*i+1;if(c>=g_timer_n)break;if(c+1<g_timer_n&&timer_less(&g_timers[c+1],&g_timers[c]))c++;if(!timer_less(&g_timers[c],&t))break;g_timers[i]=g_timers[c];i=c;}
+    g_timers[i]=t;
+}
+static void timer_push(Timer t) {
     if(g_timer_n>=g_timer_cap){g_timer_cap=g_timer_cap?g_timer_cap*2:16;g_timers=xrealloc(g_timers,sizeof(Timer)*g_timer_cap);}
-    int id=g_timer_next_id++;
-    g_timers[g_timer_n].id=id;
-    g_timers[g_timer_n].fire_at=current_time_ms()+delay_ms;
-    g_timers[g_timer_n].interval=interval;
-    g_timers[g_timer_n].active=1;
-    val_incref(callback);
-    g_timers[g_timer_n].callback=callback;
-    g_timer_n++;
-    return id;
+    g_timers[g_timer_n]=t;timer_up(g_timer_n++);
+}
+/* Take entry i out of the heap and return it */
+static Timer timer_remove(int i) {
+    Timer t=g_timers[i];g_timer_n--;
+    if(i<g_timer_n){g_timers[i]=g_timers[g_timer_n];timer_up(i);timer_down(i);}
+    return t;
+}
+static int add_timer(Value *callback, int delay_ms, int interval) {
+    Timer t;t.id=g_timer_next_id++;t.fire_at=current_time_ms()+(delay_ms>0?delay_ms:0);t.interval=interval;
+    val_incref(callback);t.callback=callback;timer_push(t);
+    return t.id;
 }
 static Value *bi_setTimeout(Value **a,int n){if(n<2||(a[0]->type!=V_CLOSURE&&a[0]->type!=V_FUNC))return val_int(0);int ms=(int)val_tonum(a[1]);return val_int(add_timer(a[0],ms,0));}
 static Value *bi_setInterval(Value **a,int n){if(n<2||(a[0]->type!=V_CLOSURE&&a[0]->type!=V_FUNC))return val_int(0);int ms=(int)val_tonum(a[1]);return val_int(add_timer(a[0],ms,ms));}
-static Value *bi_clearTimeout(Value **a,int n){if(n<1)return val_bool(0);int id=(int)val_tonum(a[0]);for(int i=0;i<g_timer_n;i++){if(g_timers[i].id==id){g_timers[i].active=0;return val_bool(1);}}return val_bool(0);}
+static Value *bi_clearTimeout(Value **a,int n){if(n<1)return val_bool(0);int id=(int)val_tonum(a[0]);for(int i=0;i<g_timer_n;i++){if(g_timers[i].id==id){val_decref(timer_remove(i).callback);return val_bool(1);}}return val_bool(0);}
 static Value *bi_clearInterval(Value **a,int n){return bi_clearTimeout(a,n);}
+/* Fire every timer that is due. An interval goes back into the heap before its callback
+   runs, so the callback can clear it; the callback is held for the duration of the call. */
 static void process_timers(void) {
     long long now=current_time_ms();
-    for(int i=0;i<g_timer_n;i++) {
-        if(g_timers[i].active && now>=g_timers[i].fire_at) {
-            Value *cb=g_timers[i].callback;
-            if(g_timers[i].interval>0) g_timers[i].fire_at=now+g_timers[i].interval;
-            else g_timers[i].active=0;
-            call_closure(cb,NULL,0);
-        }
+    while(g_timer_n&&g_timers[0].fire_at<=now) {
+        Value *cb=g_timers[0].callback;val_incref(cb);
+        if(g_timers[0].interval>0){g_timers[0].fire_at=now+g_timers[0].interval;timer_down(0);}
+        else val_decref(timer_remove(0).callback);
+        val_decref(call_closure(cb,NULL,0));val_decref(cb);
     }
 }
-static int has_active_timers(void) { for(int i=0;i<g_timer_n;i++)if(g_timers[i].active)return 1; return 0; }
-static Value *bi_runTimers(Value **a,int n){(void)a;(void)n;while(has_active_timers()){process_timers();sleep_ms(10);}return val_null();}
+static int has_active_timers(void) { return g_timer_n>0; }
+/* Milliseconds until the next timer is due, at most cap; the wait primitive for every loop */
+static int timer_wait_ms(int cap) { if(!g_timer_n)return cap; long long w=g_timers[0].fire_at-current_time_ms(); return w<0?0:w<cap?(int)w:cap; }
+/* Sleep until each deadline in turn and fire it, until no timers are left */
+/* Waits are capped at about 17 minutes so sleep_ms's microsecond count fits an int; a longer
+   timer just takes a few more passes round the loop */
+static void run_timers(void) { while(has_active_timers()){int w=timer_wait_ms(1<<20);if(w>0)sleep_ms(w);process_timers();} }
+static Value *bi_runTimers(Value **a,int n){(void)a;(void)n;run_timers();return val_null();}
 static Value *bi_time(Value **a,int n){(void)a;(void)n;return val_int((long long)time(NULL));}
 static Value *bi_now(Value **a,int n){(void)a;(void)n;
 #ifdef _WIN32
@@ -460,8 +1436,8 @@ struct timespec ts;clock_gettime(CLOCK_REALTIME,&ts);return val_float((double)ts
 #endif
 }
 static Value *bi_readFile(Value **a,int n){if(n!=1||a[0]->type!=V_STRING)return val_null();FILE *f=fopen(a[0]->as.s,"rb");if(!f)return val_null();fseek(f,0,SEEK_END);long sz=ftell(f);fseek(f,0,SEEK_SET);char *buf=xmalloc(sz+1);size_t rd=fread(buf,1,sz,f);buf[rd]='\0';fclose(f);Value *v=val_string(buf);free(buf);return v;}
-static Value *bi_writeFile(Value **a,int n){if(n!=2||a[0]->type!=V_STRING)return val_bool(0);FILE *f=fopen(a[0]->as.s,"wb");if(!f)return val_bool(0);const char *c=val_tostr(a[1]);size_t len=strlen(c),written=fwrite(c,1,len,f);fclose(f);return val_bool(written==len);}
-static Value *bi_appendFile(Value **a,int n){if(n!=2||a[0]->type!=V_STRING)return val_bool(0);FILE *f=fopen(a[0]->as.s,"ab");if(!f)return val_bool(0);const char *c=val_tostr(a[1]);size_t len=strlen(c),written=fwrite(c,1,len,f);fclose(f);return val_bool(written==len);}
+static Value *bi_writeFile(Value **a,int n){if(n!=2||a[0]->type!=V_STRING)return val_bool(0);FILE *f=fopen(a[0]->as.s,"wb");if(!f)return val_bool(0);const char *c=val_tostr(a[1]);size_t len=a[1]->type==V_STRING||a[1]->type==V_BUILDER?(size_t)str_len(a[1]):strlen(c),written=fwrite(c,1,len,f);fclose(f);return val_bool(written==len);}
+static Value *bi_appendFile(Value **a,int n){if(n!=2||a[0]->type!=V_STRING)return val_bool(0);FILE *f=fopen(a[0]->as.s,"ab");if(!f)return val_bool(0);const char *c=val_tostr(a[1]);size_t len=a[1]->type==V_STRING||a[1]->type==V_BUILDER?(size_t)str_len(a[1]):strlen(c),written=fwrite(c,1,len,f);fclose(f);return val_bool(written==len);}
 static Value *bi_fileExists(Value **a,int n){if(n!=1||a[0]->type!=V_STRING)return val_bool(0);FILE *f=fopen(a[0]->as.s,"r");if(f){fclose(f);return val_bool(1);}return val_bool(0);}
 static Value *bi_remove(Value **a,int n){if(n!=1||a[0]->type!=V_STRING)return val_bool(0);return val_bool(remove(a[0]->as.s)==0);}
 static Value *bi_mkdir(Value **a,int n){if(n!=1||a[0]->type!=V_STRING)return val_bool(0);
@@ -473,19 +1449,632 @@ return val_bool(mkdir(a[0]->as.s,0755)==0);
 }
 static Value *bi_rename(Value **a,int n){if(n!=2||a[0]->type!=V_STRING||a[1]->type!=V_STRING)return val_bool(0);return val_bool(rename(a[0]->as.s,a[1]->as.s)==0);}
 
-/* JSON */
+/* JSON
+   Strings and numbers are decoded straight from the source: plain strings are one copy,
+   integers are accumulated without a scratch buffer and only fractions/exponents go
+   through strtod. The serializer appends runs of safe bytes at once. */
 static Value *parse_json(const char **p);
 static void json_skip_ws(const char **p){while(**p&&isspace((unsigned char)**p))(*p)++;}
-static Value *parse_json_str(const char **p){(*p)++;char buf[MAX_TOK];int i=0;while(**p&&**p!='"'&&i<MAX_TOK-1){if(**p=='\\'&&*(*p+1)){(*p)++;switch(**p){case 'n':buf[i++]='\n';break;case 't':buf[i++]='\t';break;case 'r':buf[i++]='\r';break;case '"':case '\\':buf[i++]=**p;break;default:buf[i++]=**p;}}else buf[i++]=**p;(*p)++;}buf[i]='\0';if(**p=='"')(*p)++;return val_string(buf);}
-static Value *parse_json_num(const char **p){char buf[64];int i=0,has_dot=0;if(**p=='-')buf[i++]=*(*p)++;while(**p&&(isdigit((unsigned char)**p)||**p=='.'||**p=='e'||**p=='E'||**p=='+'||**p=='-')){if(**p=='.')has_dot=1;if(i<63)buf[i++]=**p;(*p)++;}buf[i]='\0';return(has_dot||strchr(buf,'e')||strchr(buf,'E'))?val_float(atof(buf)):val_int(atoll(buf));}
+static int json_hex4(const char *s){int v=0;for(int i=0;i<4;i++){int c=s[i],d=c>='0'&&c<='9'?c-'0':c>='a'&&c<='f'?c-'a'+10:c>='A'&&c<='F'?c-'A'+10:-1;if(d<0)return -1;v=v*16+d;}return v;}
+static void json_utf8(StrBuf *sb,unsigned cp){char u[4];int n;if(cp<0x80){u[0]=cp;n=1;}else if(cp<0x800){u[0]=0xC0|cp>>6;u[1]=0x80|(cp&0x3F);n=2;}else if(cp<0x10000){u[0]=0xE0|cp>>12;u[1]=0x80|(cp>>6&0x3F);u[2]=0x80|(cp&0x3F);n=3;}else{u[0]=0xF0|cp>>18;u[1]=0x80|(cp>>12&0x3F);u[2]=0x80|(cp>>6&0x3F);u[3]=0x80|(cp&0x3F);n=4;}sb_append(sb,u,n);}
+static Value *parse_json_str(const char **p){
+    const char *s=++(*p),*q=s;while(*q&&*q!='"'&&*q!='\\')q++;
+    if(*q!='\\'){*p=*q?q+1:q;return val_string_n(s,(int)(q-s));}
+    StrBuf sb;sb_init(&sb);sb_append(&sb,s,(int)(q-s));
+    while(*q&&*q!='"'){
+        if(*q!='\\'){const char *r=q;while(*r&&*r!='"'&&*r!='\\')r++;sb_append(&sb,q,(int)(r-q));q=r;continue;}
+        char c=*++q;if(!c)break;q++;
+        switch(c){case 'n':sb_append(&sb,"\n",1);break;case 't':sb_append(&sb,"\t",1);break;case 'r':sb_append(&sb,"\r",1);break;
+            case 'b':sb_append(&sb,"\b",1);break;case 'f':sb_append(&sb,"\f",1);break;
+            case 'u':{int cp=json_hex4(q);if(cp<0){sb_append(&sb,"u",1);break;}q+=4;
+                if(cp>=0xD800&&cp<0xDC00&&q[0]=='\\'&&q[1]=='u'){int lo=json_hex4(q+2);if(lo>=0xDC00&&lo<0xE000){cp=0x10000+((cp-0xD800)<<10)+(lo-0xDC00);q+=6;}}
+                json_utf8(&sb,(unsigned)cp);break;}
+            default:sb_append(&sb,&c,1);}
+    }
+    *p=*q?q+1:q;return sb_value(&sb);
+}
+static Value *parse_json_num(const char **p){
+    const char *s=*p,*q=s;int neg=*q=='-';if(neg)q++;
+    unsigned long long u=0;int digits=0;while(isdigit((unsigned char)*q)&&digits<19){u=u*10+(*q-'0');q++;digits++;}
+    if(*q!='.'&&*q!='e'&&*q!='E'&&!isdigit((unsigned char)*q)&&digits&&u<=(unsigned long long)LLONG_MAX+neg){*p=q;return val_int((long long)(neg?0-u:u));}
+    char *end;double d=strtod(s,&end);if(end==s){*p=s+1;return val_null();}*p=end;return val_float(d);
+}
 static Value *parse_json_arr(const char **p){(*p)++;Value *arr=val_array(8);json_skip_ws(p);while(**p&&**p!=']'){Value *item=parse_json(p);if(item){arr_push(arr,item);val_decref(item);}json_skip_ws(p);if(**p==',')(*p)++;json_skip_ws(p);}if(**p==']')(*p)++;return arr;}
 static Value *parse_json_obj(const char **p){(*p)++;Value *obj=val_object();json_skip_ws(p);while(**p&&**p!='}'){json_skip_ws(p);if(**p!='"')break;Value *key=parse_json_str(p);json_skip_ws(p);if(**p==':')(*p)++;json_skip_ws(p);Value *val=parse_json(p);if(key&&val&&key->type==V_STRING)obj_set(obj,key->as.s,val);if(key)val_decref(key);if(val)val_decref(val);json_skip_ws(p);if(**p==',')(*p)++;}if(**p=='}')(*p)++;return obj;}
-static Value *parse_json(const char **p){json_skip_ws(p);if(**p=='"')return parse_json_str(p);if(**p=='[')return parse_json_arr(p);if(**p=='{')return parse_json_obj(p);if(**p=='-'||isdigit((unsigned char)**p))return parse_json_num(p);if(strncmp(*p,"true",4)==0){*p+=4;return val_bool(1);}if(strncmp(*p,"false",5)==0){*p+=5;return val_bool(0);}if(strncmp(*p,"null",4)==0){*p+=4;return val_null();}return val_null();}
-static Value *bi_jsonParse(Value **a,int n){if(n!=1||a[0]->type!=V_STRING)return val_null();const char *p=a[0]->as.s;return parse_json(&p);}
-static void json_stringify(Value *v,char *buf,int *pos,int size,int indent,int cur);
-static void json_indent(char *buf,int *pos,int size,int n){for(int i=0;i<n&&*pos<size-1;i++)buf[(*pos)++]=' ';}
-static void json_stringify(Value *v,char *buf,int *pos,int size,int indent,int cur){if(*pos>=size-100)return;switch(v->type){case V_NULL:*pos+=snprintf(buf+*pos,size-*pos,"null");break;case V_BOOL:*pos+=snprintf(buf+*pos,size-*pos,"%s",v->as.b?"true":"false");break;case V_INT:*pos+=snprintf(buf+*pos,size-*pos,"%lld",v->as.i);break;case V_FLOAT:*pos+=snprintf(buf+*pos,size-*pos,"%g",v->as.f);break;case V_STRING:buf[(*pos)++]='"';for(char *s=v->as.s;*s&&*pos<size-10;s++){if(*s=='"'||*s=='\\')buf[(*pos)++]='\\';else if(*s=='\n'){buf[(*pos)++]='\\';buf[(*pos)++]='n';continue;}else if(*s=='\t'){buf[(*pos)++]='\\';buf[(*pos)++]='t';continue;}buf[(*pos)++]=*s;}buf[(*pos)++]='"';break;case V_ARRAY:buf[(*pos)++]='[';for(int i=0;i<v->as.arr->len&&*pos<size-100;i++){if(i>0)buf[(*pos)++]=',';if(indent>0){buf[(*pos)++]='\n';json_indent(buf,pos,size,cur+indent);}json_stringify(v->as.arr->items[i],buf,pos,size,indent,cur+indent);}if(indent>0&&v->as.arr->len>0){buf[(*pos)++]='\n';json_indent(buf,pos,size,cur);}buf[(*pos)++]=']';break;case V_OBJECT:case V_MODULE:buf[(*pos)++]='{';for(int i=0;i<v->as.obj->count&&*pos<size-100;i++){if(i>0)buf[(*pos)++]=',';if(indent>0){buf[(*pos)++]='\n';json_indent(buf,pos,size,cur+indent);}buf[(*pos)++]='"';for(char *s=v->as.obj->pairs[i].key;*s&&*pos<size-10;s++)buf[(*pos)++]=*s;buf[(*pos)++]='"';buf[(*pos)++]=':';if(indent>0)buf[(*pos)++]=' ';json_stringify(v->as.obj->pairs[i].val,buf,pos,size,indent,cur+indent);}if(indent>0&&v->as.obj->count>0){buf[(*pos)++]='\n';json_indent(buf,pos,size,cur);}buf[(*pos)++]='}';break;default:*pos+=snprintf(buf+*pos,size-*pos,"null");}}
-static Value *bi_jsonStringify(Value **a,int n){if(n<1)return val_string("");int indent=(n>=2)?(int)val_tonum(a[1]):0;char buf[MAX_STR];int pos=0;json_stringify(a[0],buf,&pos,sizeof(buf),indent,0);buf[pos]='\0';return val_string(buf);}
+static Value *parse_json(const char **p){json_skip_ws(p);if(**p=='"')return parse_json_str(p);if(**p=='[')return parse_json_arr(p);if(**p=='{')return parse_json_obj(p);if(**p=='-'||isdigit((unsigned char)**p))return parse_json_num(p);if(strncmp(*p,"true",4)==0){*p+=4;return val_bool(1);}if(strncmp(*p,"false",5)==0){*p+=5;return val_bool(0);}if(strncmp(*p,"null",4)==0){*p+=4;return val_null();}if(**p)(*p)++;return val_null();}
+static Value *bi_jsonParse(Value **a,int n){if(n!=1||(a[0]->type!=V_STRING&&a[0]->type!=V_BUILDER))return val_null();const char *p=a[0]->as.s;return parse_json(&p);}
+static void json_indent(StrBuf *sb,int n){for(int i=0;i<n;i++)sb_append(sb," ",1);}
+static void json_str(StrBuf *sb,const char *s){
+    sb_append(sb,"\"",1);
+    for(;;){const char *r=s;while((unsigned char)*r>=0x20&&*r!='"'&&*r!='\\')r++;if(r>s)sb_append(sb,s,(int)(r-s));if(!*r)break;
+        char e[8];unsigned char c=*r;
+        if(c=='"'||c=='\\'){e[0]='\\';e[1]=c;sb_append(sb,e,2);}else if(c=='\n')sb_append(sb,"\\n",2);else if(c=='\t')sb_append(sb,"\\t",2);else if(c=='\r')sb_append(sb,"\\r",2);
+        else{snprintf(e,sizeof(e),"\\u%04x",c);sb_append(sb,e,6);}
+        s=r+1;}
+    sb_append(sb,"\"",1);
+}
+/* Shortest %g form that reads back as the same double */
+static void json_num(StrBuf *sb,double d){char num[32];if(!isfinite(d)){sb_puts(sb,"null");return;}for(int prec=15;prec<=17;prec++){snprintf(num,sizeof(num),"%.*g",prec,d);if(strtod(num,NULL)==d)break;}sb_puts(sb,num);}
+static void json_stringify(Value *v,StrBuf *sb,int indent,int cur){char num[64];switch(v->type){
+    case V_NULL:sb_puts(sb,"null");break;case V_BOOL:sb_puts(sb,v->as.b?"true":"false");break;
+    case V_INT:snprintf(num,sizeof(num),"%lld",v->as.i);sb_puts(sb,num);break;case V_FLOAT:json_num(sb,v->as.f);break;
+    case V_STRING:case V_BUILDER:json_str(sb,v->as.s);break;
+    case V_TYPED:sb_append(sb,"[",1);for(int i=0;i<v->as.ta->len;i++){if(i>0)sb_append(sb,",",1);if(v->as.ta->kind==TA_F64)json_num(sb,v->as.ta->d.f[i]);else{snprintf(num,sizeof(num),"%lld",v->as.ta->d.i[i]);sb_puts(sb,num);}}sb_append(sb,"]",1);break;
+    case V_SET:case V_DEQUE:case V_PQ:{Value *arr=coll_to_array(v);json_stringify(arr,sb,indent,cur);val_decref(arr);break;}
+    case V_MAP:{Value *obj=val_object();HMap *m=v->as.map;for(int i=0;i<m->n;i++)if(m->ents[i].key){char *k=xstrdup(val_tostr(m->ents[i].key));obj_set(obj,k,m->ents[i].val);free(k);}json_stringify(obj,sb,indent,cur);val_decref(obj);break;}
+    case V_ARRAY:sb_append(sb,"[",1);for(int i=0;i<v->as.arr->len;i++){if(i>0)sb_append(sb,",",1);if(indent>0){sb_append(sb,"\n",1);json_indent(sb,cur+indent);}json_stringify(v->as.arr->items[i],sb,indent,cur+indent);}if(indent>0&&v->as.arr->len>0){sb_append(sb,"\n",1);json_indent(sb,cur);}sb_append(sb,"]",1);break;
+    case V_OBJECT:case V_MODULE:sb_append(sb,"{",1);for(int i=0;i<v->as.obj->count;i++){if(i>0)sb_append(sb,",",1);if(indent>0){sb_append(sb,"\n",1);json_indent(sb,cur+indent);}json_str(sb,v->as.obj->pairs[i].key);sb_append(sb,":",1);if(indent>0)sb_append(sb," ",1);json_stringify(v->as.obj->pairs[i].val,sb,indent,cur+indent);}if(indent>0&&v->as.obj->count>0){sb_append(sb,"\n",1);json_indent(sb,cur);}sb_append(sb,"}",1);break;
+    default:sb_puts(sb,"null");}}
+static Value *bi_jsonStringify(Value **a,int n){if(n<1)return val_string("");int indent=(n>=2)?(int)val_tonum(a[1]):0;StrBuf sb;sb_init(&sb);json_stringify(a[0],&sb,indent,0);return sb_value(&sb);}
+
+/* Iterators
+   A native lazy sequence. next() hands out new references and returns NULL once the
+   source is exhausted; the source's resources are released at that point, not at free. */
+static Value *iter_new(Value *(*next)(Iter*),void (*drop)(Iter*),void *st) { Value *v=val_new(V_ITER); Iter *t=xmalloc(sizeof(Iter)); t->next=next; t->drop=drop; t->st=st; t->done=0; v->as.it=t; return v; }
+static void iter_close(Iter *t) { if(!t->done){t->done=1;if(t->drop)t->drop(t);} }
+static Value *iter_next(Value *v) { Iter *t=v->as.it; if(t->done)return NULL; Value *x=t->next(t); if(!x)iter_close(t); return x; }
+/* Sequences walked by position (arrays, typed arrays, strings, object keys) */
+typedef struct { Value *src; long long i; } SeqIt;
+static Value *seq_next(Iter *t) {
+    SeqIt *q=t->st;Value *v=q->src;long long i=q->i++;
+    switch(v->type){
+        case V_ARRAY:return i<v->as.arr->len?val_copy(v->as.arr->items[i]):NULL;
+        case V_TYPED:return i<v->as.ta->len?ta_box(v->as.ta,(int)i):NULL;
+        case V_STRING:{if(i>=(long long)str_len(v))return NULL;char c[2]={v->as.s[i],'\0'};return val_string(c);}
+        default:return i<v->as.obj->count?val_string(v->as.obj->pairs[i].key):NULL;
+    }
+}
+static void seq_drop(Iter *t) { SeqIt *q=t->st; val_decref(q->src); free(q); }
+/* An instance whose next() method returns null at the end */
+typedef struct { Value *inst; Method *m; } InstIt;
+static Value *inst_next(Iter *t) { InstIt *q=t->st; Value *x=call_method_body(q->inst,q->m,NULL,0); if(x->type==V_NULL){val_decref(x);return NULL;} return x; }
+static void inst_drop(Iter *t) { InstIt *q=t->st; val_decref(q->inst); free(q); }
+/* Any iterable as an iterator (a new reference): iterators themselves, arrays, typed arrays,
+   strings, object keys, collections, and instances with an iter() or next() method */
+static Value *iter_from(Value *v) {
+    if(v->type==V_ITER){val_incref(v);return v;}
+    if(v->type==V_INSTANCE){Method *m=method_find(v->as.inst->cd,"iter");
+        if(m){Value *r=call_method_body(v,m,NULL,0),*it=iter_from(r);val_decref(r);return it;}
+        m=method_find(v->as.inst->cd,"next");
+        if(!m)runtime_error(g_line,"instance of '%s' is not iterable",v->as.inst->cd->name);
+        InstIt *q=xmalloc(sizeof(InstIt));val_incref(v);q->inst=v;q->m=m;return iter_new(inst_next,inst_drop,q);}
+    SeqIt *q=xmalloc(sizeof(SeqIt));q->i=0;
+    if(v->type==V_MAP||v->type==V_SET||v->type==V_DEQUE||v->type==V_PQ)q->src=coll_to_array(v);
+    else if(v->type==V_ARRAY||v->type==V_TYPED||v->type==V_STRING||v->type==V_OBJECT||v->type==V_MODULE){val_incref(v);q->src=v;}
+    else{free(q);runtime_error(g_line,"value is not iterable");}
+    return iter_new(seq_next,seq_drop,q);
+}
+/* iterRange(start, end, step): range() counted lazily; `for i in range(...)` uses it */
+typedef struct { long long i,stop,step; } RangeIt;
+static Value *range_next(Iter *t) { RangeIt *q=t->st; if(q->step>0?q->i>=q->stop:q->i<=q->stop)return NULL; Value *v=val_int(q->i); q->i+=q->step; return v; }
+static void range_drop(Iter *t) { free(t->st); }
+static Value *bi_iterRange(Value **a,int n){RangeIt *q=xmalloc(sizeof(RangeIt));q->i=0;q->stop=0;q->step=1;
+    if(n==1)q->stop=(long long)val_tonum(a[0]);else if(n>=2){q->i=(long long)val_tonum(a[0]);q->stop=(long long)val_tonum(a[1]);}
+    if(n>=3)q->step=(long long)val_tonum(a[2]);
+    if(q->step==0)q->step=1;
+    return iter_new(range_next,range_drop,q);}
+/* Lazy combinators. Each stage pulls from its sources one item at a time, so a pipeline
+   never holds more than the item in flight. */
+typedef struct { Value **src; int n,cur; Value *fn; long long k; } IterOp;
+static void iter_op_drop(Iter *t) { IterOp *q=t->st; for(int i=0;i<q->n;i++)val_decref(q->src[i]); free(q->src); if(q->fn)val_decref(q->fn); free(q); }
+static Value *iter_op(Value *(*next)(Iter*),Value **src,int n,Value *fn,long long k) {
+    if(fn&&fn->type!=V_CLOSURE&&fn->type!=V_FUNC)runtime_error(g_line,"expected a function");
+    IterOp *q=xmalloc(sizeof(IterOp));q->src=xmalloc(sizeof(Value*)*(n+1));q->n=n;q->cur=0;q->k=k;q->fn=fn;if(fn)val_incref(fn);
+    for(int i=0;i<n;i++)q->src[i]=iter_from(src[i]);
+    return iter_new(next,iter_op_drop,q);
+}
+static Value *take_next(Iter *t) { IterOp *q=t->st; if(q->k<=0)return NULL; q->k--; return iter_next(q->src[0]); }
+static Value *skip_next(Iter *t) { IterOp *q=t->st; for(;q->k>0;q->k--){Value *x=iter_next(q->src[0]);if(!x)return NULL;val_decref(x);} return iter_next(q->src[0]); }
+static Value *map_next(Iter *t) { IterOp *q=t->st; Value *x=iter_next(q->src[0]); if(!x)return NULL; Value *r=call_closure(q->fn,&x,1); val_decref(x); return r; }
+static Value *filter_next(Iter *t) {
+    IterOp *q=t->st;Value *x;
+    while((x=iter_next(q->src[0]))){Value *r=call_closure(q->fn,&x,1);int keep=val_truthy(r);val_decref(r);if(keep)return x;val_decref(x);}
+    return NULL;
+}
+static Value *zip_next(Iter *t) {
+    IterOp *q=t->st;Value *row=val_array(q->n);
+    for(int i=0;i<q->n;i++){Value *x=iter_next(q->src[i]);if(!x){val_decref(row);return NULL;}arr_push(row,x);val_decref(x);}
+    return row;
+}
+static Value *chain_next(Iter *t) { IterOp *q=t->st; for(;q->cur<q->n;q->cur++){Value *x=iter_next(q->src[q->cur]);if(x)return x;} return NULL; }
+static Value *bi_iter(Value **a,int n){if(n<1)runtime_error(g_line,"iter() expects an iterable");return iter_from(a[0]);}
+static Value *bi_take(Value **a,int n){if(n<2)runtime_error(g_line,"take() expects (iterable, n)");return iter_op(take_next,a,1,NULL,(long long)val_tonum(a[1]));}
+static Value *bi_skip(Value **a,int n){if(n<2)runtime_error(g_line,"skip() expects (iterable, n)");return iter_op(skip_next,a,1,NULL,(long long)val_tonum(a[1]));}
+static Value *bi_zip(Value **a,int n){return iter_op(zip_next,a,n,NULL,0);}
+static Value *bi_chain(Value **a,int n){return iter_op(chain_next,a,n,NULL,0);}
+static Value *bi_mapIter(Value **a,int n){if(n<2)runtime_error(g_line,"mapIter() expects (iterable, fn)");return iter_op(map_next,a,1,a[1],0);}
+static Value *bi_filterIter(Value **a,int n){if(n<2)runtime_error(g_line,"filterIter() expects (iterable, fn)");return iter_op(filter_next,a,1,a[1],0);}
+static Value *iter_each(Value *it,Value *fn);
+static Value *iter_method(Value *obj,int mid,Value **args,int argc) {
+    switch(mid){
+        case M_next:{Value *x=iter_next(obj);return x?x:val_null();}
+        case M_toArray:{Value *arr=val_array(16),*x;while((x=iter_next(obj))){arr_push(arr,x);val_decref(x);}return arr;}
+        case M_close:iter_close(obj->as.it);return val_null();
+        case M_map:return argc<1?val_null():iter_op(map_next,&obj,1,args[0],0);
+        case M_filter:return argc<1?val_null():iter_op(filter_next,&obj,1,args[0],0);
+        case M_take:return iter_op(take_next,&obj,1,NULL,argc<1?0:(long long)val_tonum(args[0]));
+        case M_skip:return iter_op(skip_next,&obj,1,NULL,argc<1?0:(long long)val_tonum(args[0]));
+        case M_forEach:return argc<1?val_null():iter_each(obj,args[0]);
+        default:return val_null();
+    }
+}
+/* Drain it into fn(item, index) until fn returns false; returns the number of items seen */
+static Value *iter_each(Value *it,Value *fn) {
+    long long n=0;Value *x;
+    while((x=iter_next(it))){Value *i=val_int(n++),*args[2]={x,i};Value *r=call_closure(fn,args,2);int stop=r->type==V_BOOL&&!r->as.b;val_decref(r);val_decref(i);val_decref(x);if(stop){iter_close(it->as.it);break;}}
+    return val_int(n);
+}
+
+/* Streaming JSON
+   Files are read through a window that only grows to fit the largest single record.
+   readJsonLines() parses one line at a time; jsonStream() finds the extent of each
+   top-level value (or each element of a top-level array) and hands it to parse_json. */
+typedef struct { FILE *f; char *buf; size_t pos,len,cap; int eof,started,in_array; } JsonReader;
+static void jr_fill(JsonReader *r) {
+    if(r->pos){memmove(r->buf,r->buf+r->pos,r->len-r->pos);r->len-=r->pos;r->pos=0;}
+    if(r->len+1>=r->cap){r->cap*=2;r->buf=xrealloc(r->buf,r->cap);}
+    size_t got=fread(r->buf+r->len,1,r->cap-r->len-1,r->f);r->len+=got;r->buf[r->len]='\0';if(!got)r->eof=1;
+}
+static void jr_drop(Iter *t) { JsonReader *r=t->st; if(r->f)fclose(r->f); free(r->buf); free(r); t->st=NULL; }
+static Value *jr_parse(JsonReader *r,size_t end) { char c=r->buf[end]; r->buf[end]='\0'; const char *p=r->buf+r->pos; Value *v=parse_json(&p); r->buf[end]=c; r->pos=end; return v; }
+static Value *jr_next_line(Iter *t) {
+    JsonReader *r=t->st;size_t from=r->pos;
+    for(;;){
+        char *nl=memchr(r->buf+from,'\n',r->len-from);
+        if(!nl&&!r->eof){size_t off=r->len-r->pos;jr_fill(r);from=r->pos+off;continue;}
+        size_t end=nl?(size_t)(nl-r->buf):r->len;const char *s=r->buf+r->pos;
+        while(s<r->buf+end&&isspace((unsigned char)*s))s++;
+        if(s==r->buf+end){if(!nl)return NULL;r->pos=from=end+1;continue;}
+        Value *v=jr_parse(r,end);if(nl)r->pos++;return v;
+    }
+}
+/* End of the value starting at pos, or 0 when the window ends first */
+static size_t jr_extent(JsonReader *r) {
+    const char *b=r->buf;size_t i=r->pos;int depth=0;
+    if(b[i]!='{'&&b[i]!='['&&b[i]!='"'){while(i<r->len&&!isspace((unsigned char)b[i])&&b[i]!=','&&b[i]!=']'&&b[i]!='}')i++;return i<r->len||r->eof?i:0;}
+    for(;i<r->len;i++){
+        char c=b[i];
+        if(c=='"'){for(i++;i<r->len&&b[i]!='"';i++)if(b[i]=='\\')i++;if(i>=r->len)return 0;if(!depth)return i+1;}
+        else if(c=='{'||c=='[')depth++;
+        else if((c=='}'||c==']')&&--depth==0)return i+1;
+    }
+    return 0;
+}
+static Value *jr_next_value(Iter *t) {
+    JsonReader *r=t->st;
+    for(;;){
+        while(r->pos<r->len&&(isspace((unsigned char)r->buf[r->pos])||(r->in_array&&r->buf[r->pos]==',')))r->pos++;
+        if(r->pos>=r->len){if(r->eof)return NULL;jr_fill(r);continue;}
+        if(!r->started){r->started=1;if(r->buf[r->pos]=='['){r->in_array=1;r->pos++;continue;}}
+        if(r->in_array&&r->buf[r->pos]==']'){r->pos=r->len;r->eof=1;return NULL;}
+        size_t end=jr_extent(r);
+        if(!end){if(r->eof)end=r->len;else{jr_fill(r);continue;}}
+        if(end==r->pos)end++; /* stray closer: skip it */
+        return jr_parse(r,end);
+    }
+}
+static Value *json_reader(Value **a,int n,Value *(*next)(Iter*)) {
+    if(n<1||a[0]->type!=V_STRING)return val_null();
+    FILE *f=fopen(a[0]->as.s,"rb");if(!f)return val_null();
+    JsonReader *r=xmalloc(sizeof(JsonReader));memset(r,0,sizeof(JsonReader));r->f=f;r->cap=1<<16;r->buf=xmalloc(r->cap);r->buf[0]='\0';
+    Value *it=iter_new(next,jr_drop,r);
+    if(n>=2&&(a[1]->type==V_CLOSURE||a[1]->type==V_FUNC)){Value *cnt=iter_each(it,a[1]);val_decref(it);return cnt;}
+    return it;
+}
+/* jsonStream(path[, fn]): elements of a top-level array, or each of a run of top-level values */
+static Value *bi_jsonStream(Value **a,int n) { return json_reader(a,n,jr_next_value); }
+/* readJsonLines(path[, fn]): one value per non-blank line */
+static Value *bi_readJsonLines(Value **a,int n) { return json_reader(a,n,jr_next_line); }
+
+/* File handles
+   open() keeps a FILE* (with a large stdio buffer) across calls, so per-line writes and
+   reads cost a buffered copy instead of an open/close. Mode "m" maps the file read-only
+   instead; reads then slice straight out of the mapping. Line reads strip "\n"/"\r\n". */
+static char *file_map(const char *path,size_t *size) {
+#ifdef _WIN32
+    FILE *f=fopen(path,"rb");if(!f)return NULL;fseek(f,0,SEEK_END);long sz=ftell(f);fseek(f,0,SEEK_SET);char *buf=xmalloc(sz+1);*size=fread(buf,1,sz,f);buf[*size]='\0';fclose(f);return buf;
+#else
+    int fd=open(path,O_RDONLY);if(fd<0)return NULL;struct stat st;if(fstat(fd,&st)<0){close(fd);return NULL;}
+    *size=(size_t)st.st_size;if(!*size){close(fd);return xmalloc(1);}
+    char *m=mmap(NULL,*size,PROT_READ,MAP_PRIVATE,fd,0);close(fd);if(m==MAP_FAILED)return NULL;
+    madvise(m,*size,MADV_SEQUENTIAL);return m;
+#endif
+}
+static void file_unmap(char *m,size_t size) {
+#ifdef _WIN32
+    (void)size;free(m);
+#else
+    if(size)munmap(m,size);else free(m);
+#endif
+}
+static void file_close(FileH *h) { if(h->closed)return; h->closed=1; if(h->mapped)file_unmap(h->map,h->size); else if(h->f)fclose(h->f); }
+static FileH *file_check(Value *v) { FileH *h=v->as.fh; if(h->closed)runtime_error(g_line,"file '%s' is closed",h->path); return h; }
+/* Next line as a new string, or NULL at end of file */
+static Value *file_readline(FileH *h) {
+    size_t n=0;
+    if(h->mapped){
+        if(h->pos>=h->size)return NULL;
+        const char *s=h->map+h->pos,*nl=memchr(s,'\n',h->size-h->pos);n=nl?(size_t)(nl-s):h->size-h->pos;h->pos+=n+(nl!=NULL);
+        if(n&&s[n-1]=='\r')n--;
+        return val_string_n(s,(int)n);
+    }
+    for(;;){
+        if(h->line_cap-n<2){h->line_cap=h->line_cap?h->line_cap*2:256;h->line=xrealloc(h->line,h->line_cap);}
+        if(!fgets(h->line+n,(int)(h->line_cap-n),h->f)){if(!n)return NULL;break;}
+        n+=strlen(h->line+n);if(h->line[n-1]=='\n'){n--;break;}
+    }
+    if(n&&h->line[n-1]=='\r')n--;
+    return val_string_n(h->line,(int)n);
+}
+static Value *bi_open(Value **a,int n) {
+    if(n<1||a[0]->type!=V_STRING)return val_null();
+    const char *mode=n>=2&&a[1]->type==V_STRING?a[1]->as.s:"r";FileH h;memset(&h,0,sizeof(h));
+    if(strcmp(mode,"m")==0){h.map=file_map(a[0]->as.s,&h.size);if(!h.map)return val_null();h.mapped=1;}
+    else{
+        if(strlen(mode)>3||!strchr("rwa",mode[0]))runtime_error(g_line,"open() mode must be r, w, a, r+, w+, a+ or m");
+        char fm[8];snprintf(fm,sizeof(fm),"%sb",mode);h.f=fopen(a[0]->as.s,fm);if(!h.f)return val_null();setvbuf(h.f,NULL,_IOFBF,1<<16);
+    }
+    Value *v=val_new(V_FILE);v->as.fh=xmalloc(sizeof(FileH));*v->as.fh=h;v->as.fh->path=xstrdup(a[0]->as.s);return v;
+}
+static Value *file_lines_next(Iter *t) { FileH *h=((Value*)t->st)->as.fh; return h->closed?NULL:file_readline(h); }
+static void file_lines_drop(Iter *t) { val_decref(t->st); t->st=NULL; }
+/* lines(path): lazy iteration over a file's lines; the file is closed at the end */
+static Value *bi_lines(Value **a,int n) { Value *f=bi_open(a,n>0?1:0); if(f->type!=V_FILE){val_decref(f);return val_null();} return iter_new(file_lines_next,file_lines_drop,f); }
+static Value *file_method(Value *obj,int mid,Value **args,int argc) {
+    FileH *h=obj->as.fh;
+    switch(mid){
+        case M_close:file_close(h);return val_null();
+        case M_readLine:{Value *l=file_readline(file_check(obj));return l?l:val_null();}
+        case M_lines:file_check(obj);val_incref(obj);return iter_new(file_lines_next,file_lines_drop,obj);
+        case M_read:{
+            file_check(obj);size_t want=argc>=1&&args[0]->type!=V_NULL?(size_t)val_tonum(args[0]):(size_t)-1;
+            if(h->mapped){size_t k=h->size-h->pos;if(want<k)k=want;Value *s=val_string_n(h->map+h->pos,(int)k);h->pos+=k;return s;}
+            StrBuf sb;sb_init(&sb);char buf[1<<14];
+            while(want){size_t k=want<sizeof(buf)?want:sizeof(buf),got=fread(buf,1,k,h->f);if(!got)break;sb_append(&sb,buf,(int)got);want-=got;}
+            return sb_value(&sb);
+        }
+        case M_write:{
+            file_check(obj);if(h->mapped)runtime_error(g_line,"file '%s' is mapped read-only",h->path);
+            for(int i=0;i<argc;i++){Value *x=args[i];size_t len;const char *s;if(x->type==V_STRING||x->type==V_BUILDER){s=x->as.s;len=str_len(x);}else{s=val_tostr(x);len=strlen(s);}
+                if(fwrite(s,1,len,h->f)!=len)runtime_error(g_line,"write to '%s' failed: %s",h->path,strerror(errno));}
+            val_incref(obj);return obj;
+        }
+        case M_flush:file_check(obj);if(h->f)fflush(h->f);val_incref(obj);return obj;
+        case M_eof:{file_check(obj);if(h->mapped)return val_bool(h->pos>=h->size);int c=getc(h->f);if(c==EOF)return val_bool(1);ungetc(c,h->f);return val_bool(0);}
+        case M_size:case M_len:{file_check(obj);if(h->mapped)return val_int((long long)h->size);fflush(h->f);long cur=ftell(h->f);fseek(h->f,0,SEEK_END);long end=ftell(h->f);fseek(h->f,cur,SEEK_SET);return val_int(end);}
+        case M_slice:{ /* mapped files: bytes [start, end) without moving the read position */
+            file_check(obj);if(!h->mapped)runtime_error(g_line,"slice() needs a file opened with mode \"m\"");
+            long long s=argc>=1?(long long)val_tonum(args[0]):0,e=argc>=2?(long long)val_tonum(args[1]):(long long)h->size;
+            if(s<0)s+=h->size;
+            if(e<0)e+=h->size;
+            if(s<0)s=0;
+            if(e>(long long)h->size)e=h->size;
+            return e>s?val_string_n(h->map+s,(int)(e-s)):val_string("");
+        }
+        default:return val_null();
+    }
+}
+
+/* CSV
+   RFC 4180 fields (quotes, "" escapes, separators and newlines inside quotes, CRLF) are
+   cut straight from the source text, which for readCSV is a read-only mapping of the
+   file. Each column infers its type as it fills: integers until a fraction or an empty
+   cell (which becomes NaN), then floats, then a plain array once a non-numeric cell
+   appears. Numeric columns come back as Int64Array/Float64Array. */
+enum { CSV_INT,CSV_FLOAT,CSV_ANY };
+typedef struct { int kind,n,cap; union { long long *i; double *f; Value **v; } d; } CsvCol;
+typedef struct { char sep; int header,infer,typed,trim; } CsvOpts;
+static CsvOpts csv_opts(Value **a,int n,int at) {
+    CsvOpts o={',',1,1,1,1};Value *x=n>at?a[at]:NULL;
+    if(x&&x->type==V_STRING&&x->as.s[0])o.sep=x->as.s[0];
+    if(x&&x->type==V_OBJECT){Value *v;
+        if((v=obj_get(x,"sep"))&&v->type==V_STRING&&v->as.s[0])o.sep=v->as.s[0];
+        if((v=obj_get(x,"header")))o.header=val_truthy(v);
+        if((v=obj_get(x,"infer")))o.infer=val_truthy(v);
+        if((v=obj_get(x,"typed")))o.typed=val_truthy(v);
+        if((v=obj_get(x,"trim")))o.trim=val_truthy(v);}
+    return o;
+}
+/* 1 for an integer, 2 for a float, 0 otherwise. Leading zeros ("007") are not numbers. */
+static int csv_num(const char *s,int n,long long *iv,double *dv) {
+    int i=0,digits=0,isf=0;if(i<n&&(s[i]=='-'||s[i]=='+'))i++;
+    int lead=i;while(i<n&&isdigit((unsigned char)s[i])){i++;digits++;}
+    if(digits>1&&s[lead]=='0')return 0;
+    if(i<n&&s[i]=='.'){isf=1;i++;while(i<n&&isdigit((unsigned char)s[i])){i++;digits++;}}
+    if(!digits)return 0;
+    if(i<n&&(s[i]=='e'||s[i]=='E')){isf=1;i++;if(i<n&&(s[i]=='-'||s[i]=='+'))i++;int e=i;while(i<n&&isdigit((unsigned char)s[i]))i++;if(i==e)return 0;}
+    if(i!=n||n>=64)return 0;
+    if(!isf&&digits<=18){long long v=0;for(int k=lead;k<n;k++)v=v*10+(s[k]-'0');*iv=s[0]=='-'?-v:v;return 1;}
+    char buf[64];memcpy(buf,s,n);buf[n]='\0';*dv=strtod(buf,NULL);return 2;
+}
+static void csv_grow(CsvCol *c) { if(c->n<c->cap)return; c->cap=c->cap?c->cap*2:1024; c->d.v=xrealloc(c->d.v,(size_t)c->cap*8); }
+static Value *csv_box(CsvCol *c,int i) { if(c->kind==CSV_INT)return val_int(c->d.i[i]); return isnan(c->d.f[i])?val_string(""):val_float(c->d.f[i]); }
+static void csv_add(CsvCol *c,const char *s,int n,const CsvOpts *o) {
+    long long iv=0;double dv=0;int k=o->infer&&n?csv_num(s,n,&iv,&dv):0;
+    if(c->kind==CSV_INT&&(k==2||!n)){for(int i=0;i<c->n;i++)c->d.f[i]=(double)c->d.i[i];c->kind=CSV_FLOAT;}
+    if(c->kind!=CSV_ANY&&((n&&!k)||!o->infer)){for(int i=0;i<c->n;i++)c->d.v[i]=csv_box(c,i);c->kind=CSV_ANY;}
+    csv_grow(c);
+    if(c->kind==CSV_INT)c->d.i[c->n++]=iv;
+    else if(c->kind==CSV_FLOAT)c->d.f[c->n++]=!n?NAN:k==1?(double)iv:dv;
+    else c->d.v[c->n++]=k==1?val_int(iv):k==2?val_float(dv):val_string_n(s,n);
+}
+/* Quoted field body with "" collapsed; points into the source when there is nothing to collapse */
+static const char *csv_unquote(const char *f,int *n,char **tmp,int *tmp_cap) {
+    if(!memchr(f,'"',*n))return f;
+    if(*n>=*tmp_cap){*tmp_cap=*n*2+16;*tmp=xrealloc(*tmp,*tmp_cap);}
+    int k=0;for(int i=0;i<*n;i++){(*tmp)[k++]=f[i];if(f[i]=='"'&&i+1<*n&&f[i+1]=='"')i++;}
+    *n=k;return *tmp;
+}
+static Value *csv_column(CsvCol *c,const CsvOpts *o) {
+    if(c->kind==CSV_ANY||!o->typed){
+        Value *arr=val_array(c->n);
+        for(int i=0;i<c->n;i++){Value *x=c->kind==CSV_ANY?c->d.v[i]:csv_box(c,i);arr_push(arr,x);val_decref(x);}
+        free(c->d.v);return arr;
+    }
+    Value *v=val_new(V_TYPED);TypedArr *t=xmalloc(sizeof(TypedArr));t->kind=c->kind==CSV_INT?TA_I64:TA_F64;t->len=c->n;t->cap=c->cap?c->cap:1;
+    t->d.p=c->d.v?(void*)c->d.v:calloc(1,8);v->as.ta=t;return v;
+}
+static Value *csv_parse(const char *s,size_t len,const CsvOpts *o) {
+    const char *end=s+len;int ncol=0,cap=0,row=0,tmp_cap=0;CsvCol *cols=NULL;Value **names=NULL;char *tmp=NULL;
+    if(len>=3&&memcmp(s,"\xEF\xBB\xBF",3)==0)s+=3; /* UTF-8 BOM */
+    while(s<end){
+        int col=0,blank=1;
+        for(;;){ /* one field */
+            const char *f=s;int n,quoted=0;
+            if(o->trim)while(f<end&&(*f==' '||*f=='\t'))f++;
+            if(f<end&&*f=='"'){quoted=1;const char *q=++f;for(;q<end;q++){if(*q=='"'){if(q+1<end&&q[1]=='"')q++;else break;}}n=(int)(q-f);s=q<end?q+1:q;while(s<end&&*s!=o->sep&&*s!='\n'&&*s!='\r')s++;}
+            else{s=f;while(s<end&&*s!=o->sep&&*s!='\n'&&*s!='\r')s++;n=(int)(s-f);if(o->trim)while(n&&(f[n-1]==' '||f[n-1]=='\t'))n--;}
+            if(n||quoted||(s<end&&*s==o->sep))blank=0;
+            if(quoted)f=csv_unquote(f,&n,&tmp,&tmp_cap);
+            if(!blank){
+                if(row==0){
+                    if(col>=cap){cap=cap?cap*2:16;cols=xrealloc(cols,sizeof(CsvCol)*cap);names=xrealloc(names,sizeof(Value*)*cap);}
+                    memset(&cols[col],0,sizeof(CsvCol));ncol=col+1;
+                    if(o->header)names[col]=val_string_n(f,n);
+                    else{char b[24];snprintf(b,sizeof(b),"c%d",col);names[col]=val_string(b);}
+                }
+                if((row>0||!o->header)&&col<ncol)csv_add(&cols[col],f,n,o);
+            }
+            col++;
+            if(s<end&&*s==o->sep){s++;continue;}
+            break;
+        }
+        if(s<end&&*s=='\r')s++;
+        if(s<end&&*s=='\n')s++;
+        if(blank)continue;
+        for(;col<ncol;col++)if(row>0||!o->header)csv_add(&cols[col],"",0,o); /* short rows */
+        row++;
+    }
+    Value *res=val_object();
+    for(int c=0;c<ncol;c++){
+        Value *colv=csv_column(&cols[c],o);const char *name=names[c]->as.s;char alt[64];
+        if(obj_get(res,name)){snprintf(alt,sizeof(alt),"%.50s_%d",name,c);name=alt;}
+        obj_set(res,name,colv);val_decref(colv);val_decref(names[c]);
+    }
+    free(cols);free(names);free(tmp);return res;
+}
+/* parseCSV(text | mapped file, opts): {column: values} */
+static Value *bi_parseCSV(Value **a,int n) {
+    if(n<1)return val_null();
+    CsvOpts o=csv_opts(a,n,1);
+    if(a[0]->type==V_STRING||a[0]->type==V_BUILDER)return csv_parse(a[0]->as.s,str_len(a[0]),&o);
+    if(a[0]->type==V_FILE&&a[0]->as.fh->mapped&&!a[0]->as.fh->closed){FileH *h=a[0]->as.fh;return csv_parse(h->map+h->pos,h->size-h->pos,&o);}
+    runtime_error(g_line,"parseCSV() expects a string or a file opened with mode \"m\"");return NULL;
+}
+/* readCSV(path, opts): parseCSV over a read-only mapping of the file */
+static Value *bi_readCSV(Value **a,int n) {
+    if(n<1||a[0]->type!=V_STRING)return val_null();
+    size_t size;char *m=file_map(a[0]->as.s,&size);if(!m)return val_null();
+    CsvOpts o=csv_opts(a,n,1);Value *r=csv_parse(m,size,&o);file_unmap(m,size);return r;
+}
+static void csv_put_int(StrBuf *sb,long long v) { char b[24];int k=24;unsigned long long u=v<0?0-(unsigned long long)v:(unsigned long long)v;do{b[--k]='0'+u%10;u/=10;}while(u);if(v<0)b[--k]='-';sb_append(sb,b+k,24-k); }
+static void csv_put_float(StrBuf *sb,double d) { if(d==(double)(long long)d&&fabs(d)<1e15){csv_put_int(sb,(long long)d);return;} if(!isnan(d))json_num(sb,d); }
+static void csv_put(StrBuf *sb,Value *v,char sep) {
+    switch(v->type){
+        case V_NULL:return;
+        case V_INT:csv_put_int(sb,v->as.i);return;
+        case V_FLOAT:csv_put_float(sb,v->as.f);return;
+        default:break;
+    }
+    const char *s=val_tostr(v);size_t n=v->type==V_STRING||v->type==V_BUILDER?(size_t)str_len(v):strlen(s);
+    int q=0;for(size_t i=0;i<n&&!q;i++)q=s[i]==sep||s[i]=='"'||s[i]=='\n'||s[i]=='\r';
+    if(!q){sb_append(sb,s,(int)n);return;}
+    sb_append(sb,"\"",1);for(size_t i=0;i<n;i++){if(s[i]=='"')sb_append(sb,"\"",1);sb_append(sb,s+i,1);}sb_append(sb,"\"",1);
+}
+/* Cell i of a column; typed columns are written without boxing */
+static void csv_put_cell(StrBuf *sb,Value *col,int i,char sep) {
+    if(col->type==V_TYPED){TypedArr *t=col->as.ta;if(i<t->len){if(t->kind==TA_I64)csv_put_int(sb,t->d.i[i]);else csv_put_float(sb,t->d.f[i]);}}
+    else if(col->type==V_ARRAY&&i<col->as.arr->len)csv_put(sb,col->as.arr->items[i],sep);
+}
+/* Rows are formatted into sb and handed to stdio in 64KB blocks */
+static void csv_flush(StrBuf *sb,FILE *f,int force) { int n=STR_HDR(sb->s)->len; if(n<(1<<16)&&!force)return; fwrite(sb->s,1,n,f); STR_HDR(sb->s)->len=0; }
+/* writeCSV(path | file, data, opts): data is {column: values}, an array of records or an
+   array of arrays; opts.columns picks and orders columns. Returns the number of rows. */
+static Value *bi_writeCSV(Value **a,int n) {
+    if(n<2)runtime_error(g_line,"writeCSV() expects (path, data [, opts])");
+    CsvOpts o=csv_opts(a,n,2);Value *data=a[1],*cols=n>2&&a[2]->type==V_OBJECT?obj_get(a[2],"columns"):NULL;
+    FILE *f;int own=a[0]->type==V_STRING;
+    if(own){f=fopen(a[0]->as.s,"wb");if(!f)return val_null();setvbuf(f,NULL,_IOFBF,1<<16);}
+    else if(a[0]->type==V_FILE&&!a[0]->as.fh->closed&&!a[0]->as.fh->mapped)f=a[0]->as.fh->f;
+    else{runtime_error(g_line,"writeCSV() expects a path or a writable file");return NULL;}
+    Value *names=cols&&cols->type==V_ARRAY?val_copy(cols):NULL;int rows=0;StrBuf sb;sb_init(&sb);
+    int columnar=data->type==V_OBJECT,records=data->type==V_ARRAY&&data->as.arr->len&&data->as.arr->items[0]->type==V_OBJECT;
+    if(!names&&columnar)names=bi_keys(&data,1);
+    if(!names&&records)names=bi_keys(&data->as.arr->items[0],1);
+    if(names&&o.header){for(int c=0;c<names->as.arr->len;c++){if(c)sb_append(&sb,&o.sep,1);csv_put(&sb,names->as.arr->items[c],o.sep);}sb_append(&sb,"\n",1);csv_flush(&sb,f,0);}
+    if(columnar){
+        int nc=names->as.arr->len;Value **cv=xmalloc(sizeof(Value*)*(nc+1));
+        for(int c=0;c<nc;c++){cv[c]=obj_get(data,val_tostr(names->as.arr->items[c]));int len=!cv[c]?0:cv[c]->type==V_TYPED?cv[c]->as.ta->len:cv[c]->type==V_ARRAY?cv[c]->as.arr->len:0;if(len>rows)rows=len;}
+        for(int r=0;r<rows;r++){for(int c=0;c<nc;c++){if(c)sb_append(&sb,&o.sep,1);if(cv[c])csv_put_cell(&sb,cv[c],r,o.sep);}sb_append(&sb,"\n",1);csv_flush(&sb,f,0);}
+        free(cv);
+    }else if(data->type==V_ARRAY){
+        for(int r=0;r<data->as.arr->len;r++,rows++){Value *row=data->as.arr->items[r];
+            if(row->type==V_OBJECT&&names){for(int c=0;c<names->as.arr->len;c++){if(c)sb_append(&sb,&o.sep,1);Value *x=obj_get(row,val_tostr(names->as.arr->items[c]));if(x)csv_put(&sb,x,o.sep);}}
+            else if(row->type==V_ARRAY||row->type==V_TYPED){int len=row->type==V_ARRAY?row->as.arr->len:row->as.ta->len;for(int c=0;c<len;c++){if(c)sb_append(&sb,&o.sep,1);csv_put_cell(&sb,row,c,o.sep);}}
+            else csv_put(&sb,row,o.sep);
+            sb_append(&sb,"\n",1);csv_flush(&sb,f,0);}
+    }
+    csv_flush(&sb,f,1);str_free(sb.s);
+    if(names)val_decref(names);
+    if(own)fclose(f);
+    return val_int(rows);
+}
+
+/* Relational kernels over tables: {column: values} objects as returned by readCSV and held in
+   DataFrame.data. Rows are hashed on their key cells with Map key semantics (1 and 1.0 match,
+   strings by content, NaN counts as null), so joins, group-by and distinct are linear. */
+typedef struct { Value **cols; int nk; } RowKey;
+typedef struct { RowKey *k; int *slots,*rep,mask,n; uint64_t *h; } GroupIdx;
+static int tbl_len(Value *col) { return !col?0:col->type==V_TYPED?col->as.ta->len:col->type==V_ARRAY?col->as.arr->len:0; }
+static int tbl_rows(Value *t) { int r=0; for(int i=0;i<t->as.obj->count;i++){int l=tbl_len(t->as.obj->pairs[i].val);if(l>r)r=l;} return r; }
+/* Cell i as a borrowed value; typed cells are written into *tmp instead of boxed */
+static Value *tbl_cell(Value *col,int i,Value *tmp) {
+    tmp->type=V_NULL;
+    if(col->type==V_ARRAY)return i<col->as.arr->len?col->as.arr->items[i]:tmp;
+    if(col->type==V_TYPED&&i<col->as.ta->len){TypedArr *t=col->as.ta;
+        if(t->kind==TA_I64){tmp->type=V_INT;tmp->as.i=t->d.i[i];}
+        else if(!isnan(t->d.f[i])){tmp->type=V_FLOAT;tmp->as.f=t->d.f[i];}}
+    return tmp;
+}
+static Value *tbl_box(Value *col,int i) { if(!col||i<0||i>=tbl_len(col))return val_null(); if(col->type==V_TYPED)return ta_box(col->as.ta,i); val_incref(col->as.arr->items[i]); return col->as.arr->items[i]; }
+static uint64_t row_hash(RowKey *k,int i) { uint64_t h=0x9e3779b97f4a7c15ULL; Value tmp; for(int c=0;c<k->nk;c++)h=hash_mix(h^key_hash(tbl_cell(k->cols[c],i,&tmp))); return h; }
+static int row_eq(RowKey *a,int i,RowKey *b,int j) { Value x,y; for(int c=0;c<a->nk;c++)if(!key_eq(tbl_cell(a->cols[c],i,&x),tbl_cell(b->cols[c],j,&y)))return 0; return 1; }
+static void grp_init(GroupIdx *g,RowKey *k,int rows) { int cap=16; while(cap<rows*2)cap*=2; g->k=k; g->n=0; g->mask=cap-1; g->slots=calloc(cap,sizeof(int)); if(!g->slots)error(g_line,"out of memory"); g->rep=xmalloc(sizeof(int)*(rows+1)); g->h=xmalloc(sizeof(uint64_t)*(rows+1)); }
+static void grp_free(GroupIdx *g) { free(g->slots); free(g->rep); free(g->h); }
+/* Group holding row i of the table keyed by p (columns line up with g's); -1 if absent and !add */
+static int grp_find(GroupIdx *g,RowKey *p,int i,int add) {
+    uint64_t h=row_hash(p,i),j=h&g->mask;
+    for(;g->slots[j];j=(j+1)&g->mask){int e=g->slots[j]-1;if(g->h[e]==h&&row_eq(g->k,g->rep[e],p,i))return e;}
+    if(!add)return -1;
+    g->slots[j]=g->n+1; g->rep[g->n]=i; g->h[g->n]=h; return g->n++;
+}
+/* Key columns of t named by spec (a column name or an array of them; NULL means every column) */
+static void tbl_key(RowKey *k,Value *t,Value *spec,const char *fn) {
+    if(!spec||spec->type==V_NULL){k->nk=t->as.obj->count;k->cols=xmalloc(sizeof(Value*)*(k->nk+1));for(int c=0;c<k->nk;c++)k->cols[c]=t->as.obj->pairs[c].val;return;}
+    int n=spec->type==V_ARRAY?spec->as.arr->len:1; k->nk=n; k->cols=xmalloc(sizeof(Value*)*(n+1));
+    for(int c=0;c<n;c++){const char *name=val_tostr(spec->type==V_ARRAY?spec->as.arr->items[c]:spec);Value *col=obj_get(t,name);
+        if(!col||(col->type!=V_ARRAY&&col->type!=V_TYPED)){free(k->cols);runtime_error(g_line,"%s(): no column '%s'",fn,name);}
+        k->cols[c]=col;}
+}
+/* New column with row ia[r] of a, or row ib[r] of b where ia[r] is -1 (-1 in both gives null).
+   Typed columns stay typed unless that would need a null in an Int64Array. */
+static Value *tbl_gather(Value *a,int *ia,Value *b,int *ib,int n) {
+    int kind=a&&a->type==V_TYPED?a->as.ta->kind:-1,typed=kind>=0;
+    for(int r=0;r<n&&typed;r++){Value *src=ia[r]>=0?a:ib?b:NULL;int i=ia[r]>=0?ia[r]:ib?ib[r]:-1;
+        if(i<0||!src)typed=kind==TA_F64;else if(src->type!=V_TYPED||src->as.ta->kind!=kind)typed=0;}
+    if(typed){Value *v=ta_new(kind,n);TypedArr *t=v->as.ta;
+        for(int r=0;r<n;r++){Value *src=ia[r]>=0?a:ib?b:NULL;int i=ia[r]>=0?ia[r]:ib?ib[r]:-1;TypedArr *s=src&&i>=0&&i<src->as.ta->len?src->as.ta:NULL;
+            if(kind==TA_F64)t->d.f[r]=s?s->d.f[i]:NAN;else t->d.i[r]=s?s->d.i[i]:0;}
+        return v;}
+    Value *v=val_array(n);
+    for(int r=0;r<n;r++){Value *x=ia[r]>=0?tbl_box(a,ia[r]):ib?tbl_box(b,ib[r]):val_null();arr_push(v,x);val_decref(x);}
+    return v;
+}
+static Value *tbl_arg(Value **a,int n,int i,const char *fn) { if(i>=n||a[i]->type!=V_OBJECT)runtime_error(g_line,"%s() expects a table ({column: values})",fn); return a[i]; }
+static int key_has(RowKey *k,Value *col) { for(int c=0;c<k->nk;c++)if(k->cols[c]==col)return 1; return 0; }
+/* hashJoin(left, right, on, how): on is a column name or an array of names present in both
+   tables; how is "inner" (default), "left" or "outer". Builds a hash index on right and probes
+   it with left, so rows come out in left order, with unmatched right rows last for "outer".
+   Right columns whose name is taken on the left get a "_right" suffix. */
+static Value *bi_hashJoin(Value **a,int n) {
+    Value *l=tbl_arg(a,n,0,"hashJoin"),*rt=tbl_arg(a,n,1,"hashJoin");
+    if(n<3)runtime_error(g_line,"hashJoin() expects (left, right, on [, how])");
+    const char *how=n>3&&a[3]->type==V_STRING?a[3]->as.s:"inner";int left=!strcmp(how,"left"),outer=!strcmp(how,"outer");
+    if(!left&&!outer&&strcmp(how,"inner"))runtime_error(g_line,"hashJoin(): unknown join '%s'",how);
+    RowKey lk,rk;tbl_key(&lk,l,a[2],"hashJoin");tbl_key(&rk,rt,a[2],"hashJoin");
+    int ln=tbl_rows(l),rn=tbl_rows(rt),cap=ln+rn+16,m=0;
+    GroupIdx g;grp_init(&g,&rk,rn);int *head=xmalloc(sizeof(int)*(rn+1)),*tail=xmalloc(sizeof(int)*(rn+1)),*next=xmalloc(sizeof(int)*(rn+1));char *hit=calloc(rn+1,1);
+    for(int j=0;j<rn;j++){int e=grp_find(&g,&rk,j,1);next[j]=-1;if(g.rep[e]==j)head[e]=j;else next[tail[e]]=j;tail[e]=j;}
+    int *li=xmalloc(sizeof(int)*cap),*ri=xmalloc(sizeof(int)*cap);
+    #define JOIN_EMIT(x,y) do{if(m>=cap){cap*=2;li=xrealloc(li,sizeof(int)*cap);ri=xrealloc(ri,sizeof(int)*cap);}li[m]=(x);ri[m++]=(y);}while(0)
+    for(int i=0;i<ln;i++){int e=grp_find(&g,&lk,i,0);
+        if(e>=0){hit[e]=1;for(int j=head[e];j>=0;j=next[j])JOIN_EMIT(i,j);}else if(left||outer)JOIN_EMIT(i,-1);}
+    if(outer)for(int e=0;e<g.n;e++)if(!hit[e])for(int j=head[e];j>=0;j=next[j])JOIN_EMIT(-1,j);
+    #undef JOIN_EMIT
+    Value *out=val_object();Object *lo=l->as.obj,*ro=rt->as.obj;
+    for(int c=0;c<lo->count;c++){Value *col=lo->pairs[c].val,*rcol=NULL;
+        for(int k=0;k<lk.nk;k++)if(lk.cols[k]==col)rcol=rk.cols[k];
+        Value *v=tbl_gather(col,li,rcol,rcol?ri:NULL,m);obj_set(out,lo->pairs[c].key,v);val_decref(v);}
+    for(int c=0;c<ro->count;c++){Value *col=ro->pairs[c].val;if(key_has(&rk,col))continue;
+        const char *name=ro->pairs[c].key;char *alt=NULL;
+        if(obj_get(out,name)){alt=xmalloc(strlen(name)+7);sprintf(alt,"%s_right",name);}
+        Value *v=tbl_gather(col,ri,NULL,NULL,m);obj_set(out,alt?alt:name,v);val_decref(v);free(alt);}
+    grp_free(&g);free(head);free(tail);free(next);free(hit);free(li);free(ri);free(lk.cols);free(rk.cols);
+    return out;
+}
+/* groupAgg(table, by, aggs): one row per distinct key of the by column(s), in order of first
+   appearance. aggs maps a column to "sum", "mean", "min", "max", "count", "first" or "last"
+   (or an array of those, naming the results column_fn); without aggs the result has a count.
+   Missing cells (null, NaN) are skipped by sum/mean/min/max. */
+static Value *bi_groupAgg(Value **a,int n) {
+    Value *t=tbl_arg(a,n,0,"groupAgg");
+    if(n<2)runtime_error(g_line,"groupAgg() expects (table, by [, aggs])");
+    RowKey k;tbl_key(&k,t,a[1],"groupAgg");int rows=tbl_rows(t);
+    GroupIdx g;grp_init(&g,&k,rows);int *gof=xmalloc(sizeof(int)*(rows+1));
+    for(int i=0;i<rows;i++)gof[i]=grp_find(&g,&k,i,1);
+    int ng=g.n,*cnt=calloc(ng+1,sizeof(int)),*sel=xmalloc(sizeof(int)*(ng+1));
+    for(int i=0;i<rows;i++)cnt[gof[i]]++;
+    Value *out=val_object();
+    for(int c=0;c<k.nk;c++){Value *v=tbl_gather(k.cols[c],g.rep,NULL,NULL,ng);
+        const char *name=val_tostr(a[1]->type==V_ARRAY?a[1]->as.arr->items[c]:a[1]);obj_set(out,name,v);val_decref(v);}
+    Value *aggs=n>2&&a[2]->type==V_OBJECT?a[2]:NULL;
+    if(!aggs){Value *v=ta_new(TA_I64,ng);for(int e=0;e<ng;e++)v->as.ta->d.i[e]=cnt[e];obj_set(out,"count",v);val_decref(v);}
+    for(int p=0;aggs&&p<aggs->as.obj->count;p++){
+        const char *cname=aggs->as.obj->pairs[p].key;Value *fns=aggs->as.obj->pairs[p].val,*col=obj_get(t,cname);
+        if(!col||(col->type!=V_ARRAY&&col->type!=V_TYPED))runtime_error(g_line,"groupAgg(): no column '%s'",cname);
+        int nf=fns->type==V_ARRAY?fns->as.arr->len:1;
+        for(int f=0;f<nf;f++){
+            const char *fn=val_tostr(fns->type==V_ARRAY?fns->as.arr->items[f]:fns);Value *v,tmp;
+            if(!strcmp(fn,"count")){v=ta_new(TA_I64,ng);for(int e=0;e<ng;e++)v->as.ta->d.i[e]=cnt[e];}
+            else if(!strcmp(fn,"first"))v=tbl_gather(col,g.rep,NULL,NULL,ng);
+            else if(!strcmp(fn,"last")){for(int i=0;i<rows;i++)sel[gof[i]]=i;v=tbl_gather(col,sel,NULL,NULL,ng);}
+            else if(!strcmp(fn,"min")||!strcmp(fn,"max")){int dir=fn[1]=='i'?-1:1;Value tb;
+                for(int e=0;e<ng;e++)sel[e]=-1;
+                for(int i=0;i<rows;i++){Value *x=tbl_cell(col,i,&tmp);if(x->type==V_NULL)continue;int e=gof[i];
+                    if(sel[e]<0||val_order(x,tbl_cell(col,sel[e],&tb))*dir>0)sel[e]=i;}
+                v=tbl_gather(col,sel,NULL,NULL,ng);}
+            else if(!strcmp(fn,"sum")||!strcmp(fn,"mean")||!strcmp(fn,"avg")){
+                int mean=fn[0]!='s',ints=!mean;double *sum=calloc(ng+1,sizeof(double));long long *isum=calloc(ng+1,sizeof(long long));int *num=calloc(ng+1,sizeof(int));
+                for(int i=0;i<rows;i++){Value *x=tbl_cell(col,i,&tmp);int e=gof[i];
+                    if(x->type==V_INT){isum[e]+=x->as.i;sum[e]+=(double)x->as.i;}
+                    else if(x->type==V_FLOAT){ints=0;sum[e]+=x->as.f;}
+                    else if(x->type==V_NULL)continue;
+                    else{free(sum);free(isum);free(num);runtime_error(g_line,"groupAgg(): %s of non-numeric column '%s'",fn,cname);}
+                    num[e]++;}
+                v=ta_new(ints?TA_I64:TA_F64,ng);
+                for(int e=0;e<ng;e++){if(ints)v->as.ta->d.i[e]=isum[e];else v->as.ta->d.f[e]=mean?(num[e]?sum[e]/num[e]:NAN):sum[e];}
+                free(sum);free(isum);free(num);}
+            else{runtime_error(g_line,"groupAgg(): unknown aggregation '%s'",fn);return NULL;}
+            if(fns->type==V_ARRAY){char *name=xmalloc(strlen(cname)+strlen(fn)+2);sprintf(name,"%s_%s",cname,fn);obj_set(out,name,v);free(name);}
+            else obj_set(out,cname,v);
+            val_decref(v);}
+    }
+    grp_free(&g);free(gof);free(cnt);free(sel);free(k.cols);
+    return out;
+}
+/* distinct(column) -> unique values in order of first appearance, same kind of array;
+   distinct(table [, cols]) -> the first row of each distinct key (cols defaults to all columns) */
+static Value *bi_distinct(Value **a,int n) {
+    if(n<1||(a[0]->type!=V_ARRAY&&a[0]->type!=V_TYPED&&a[0]->type!=V_OBJECT))runtime_error(g_line,"distinct() expects an array or a table");
+    int col=a[0]->type!=V_OBJECT,rows=col?tbl_len(a[0]):tbl_rows(a[0]);RowKey k;
+    if(col){k.nk=1;k.cols=xmalloc(sizeof(Value*));k.cols[0]=a[0];}else tbl_key(&k,a[0],n>1?a[1]:NULL,"distinct");
+    GroupIdx g;grp_init(&g,&k,rows);for(int i=0;i<rows;i++)grp_find(&g,&k,i,1);
+    Value *out;
+    if(col)out=tbl_gather(a[0],g.rep,NULL,NULL,g.n);
+    else{out=val_object();Object *o=a[0]->as.obj;for(int c=0;c<o->count;c++){Value *v=tbl_gather(o->pairs[c].val,g.rep,NULL,NULL,g.n);obj_set(out,o->pairs[c].key,v);val_decref(v);}}
+    grp_free(&g);free(k.cols);
+    return out;
+}
+/* countValues(column) -> Map of value -> count, in order of first appearance */
+static Value *bi_countValues(Value **a,int n) {
+    if(n<1||(a[0]->type!=V_ARRAY&&a[0]->type!=V_TYPED))runtime_error(g_line,"countValues() expects an array");
+    int rows=tbl_len(a[0]);RowKey k={&a[0],1};GroupIdx g;grp_init(&g,&k,rows);
+    int *cnt=calloc(rows+1,sizeof(int));for(int i=0;i<rows;i++)cnt[grp_find(&g,&k,i,1)]++;
+    Value *out=hmap_new(V_MAP);
+    for(int e=0;e<g.n;e++){Value *key=tbl_box(a[0],g.rep[e]),*c=val_int(cnt[e]);hmap_set(out->as.map,key,c);val_decref(key);val_decref(c);}
+    grp_free(&g);free(cnt);
+    return out;
+}
 
 /* HTTP Client */
 static void init_sockets(void){
@@ -493,53 +2082,762 @@ static void init_sockets(void){
 if(!g_ws_init){WSADATA wsa;WSAStartup(MAKEWORD(2,2),&wsa);g_ws_init=1;}
 #endif
 }
-static Value *http_request(const char *method, char *url, const char *body, const char *contentType){
-    init_sockets();char host[256]={0},path[1024]="/";int port=80;
-    if(strncmp(url,"http://",7)==0)url+=7;else if(strncmp(url,"https://",8)==0){url+=8;port=443;}
-    char *slash=strchr(url,'/');if(slash){strncpy(host,url,slash-url);strcpy(path,slash);}else strcpy(host,url);
-    char *colon=strchr(host,':');if(colon){*colon='\0';port=atoi(colon+1);}
-    struct hostent *he=gethostbyname(host);if(!he)return val_null();
-    SOCKET sock=socket(AF_INET,SOCK_STREAM,0);if(sock==INVALID_SOCKET)return val_null();
-    struct sockaddr_in addr;addr.sin_family=AF_INET;addr.sin_port=htons(port);memcpy(&addr.sin_addr,he->h_addr,he->h_length);
-    if(connect(sock,(struct sockaddr*)&addr,sizeof(addr))<0){close(sock);return val_null();}
-    char req[HTTP_BUF];
-    if(body&&strlen(body)>0){
-        snprintf(req,sizeof(req),"%s %s HTTP/1.1\r\nHost: %s\r\nContent-Type: %s\r\nContent-Length: %d\r\nConnection: close\r\n\r\n%s",method,path,host,contentType,(int)strlen(body),body);
-    }else{
-        snprintf(req,sizeof(req),"%s %s HTTP/1.1\r\nHost: %s\r\nConnection: close\r\nUser-Agent: Jeem/3.0\r\n\r\n",method,path,host);
-    }
-    send(sock,req,strlen(req),0);
-    char *resp=xmalloc(HTTP_BUF);int total=0,bytes;
-    while((bytes=recv(sock,resp+total,HTTP_BUF-total-1,0))>0){total+=bytes;if(total>=HTTP_BUF-1)break;}
-    resp[total]='\0';close(sock);
-    Value *result=val_object();
-    char *respBody=strstr(resp,"\r\n\r\n");if(respBody){respBody+=4;Value *bv=val_string(respBody);obj_set(result,"body",bv);val_decref(bv);}
-    int status=0;sscanf(resp,"HTTP/%*s %d",&status);Value *sv=val_int(status);obj_set(result,"status",sv);val_decref(sv);
-    free(resp);return result;
-}
-static Value *bi_httpGet(Value **a,int n){if(n<1||a[0]->type!=V_STRING)return val_null();return http_request("GET",a[0]->as.s,NULL,NULL);}
-static Value *bi_httpPost(Value **a,int n){if(n<1||a[0]->type!=V_STRING)return val_null();const char *body=(n>=2)?val_tostr(a[1]):"";const char *ct=(n>=3&&a[2]->type==V_STRING)?a[2]->as.s:"application/json";return http_request("POST",a[0]->as.s,body,ct);}
-static Value *bi_httpPut(Value **a,int n){if(n<1||a[0]->type!=V_STRING)return val_null();const char *body=(n>=2)?val_tostr(a[1]):"";const char *ct=(n>=3&&a[2]->type==V_STRING)?a[2]->as.s:"application/json";return http_request("PUT",a[0]->as.s,body,ct);}
-static Value *bi_httpDelete(Value **a,int n){if(n<1||a[0]->type!=V_STRING)return val_null();return http_request("DELETE",a[0]->as.s,NULL,NULL);}
-static Value *bi_httpPatch(Value **a,int n){if(n<1||a[0]->type!=V_STRING)return val_null();const char *body=(n>=2)?val_tostr(a[1]):"";const char *ct=(n>=3&&a[2]->type==V_STRING)?a[2]->as.s:"application/json";return http_request("PATCH",a[0]->as.s,body,ct);}
-static Value *bi_http(Value **a,int n){if(n<2||a[0]->type!=V_STRING||a[1]->type!=V_STRING)return val_null();const char *method=a[0]->as.s;const char *body=(n>=3)?val_tostr(a[2]):"";const char *ct=(n>=4&&a[3]->type==V_STRING)?a[3]->as.s:"application/json";return http_request(method,a[1]->as.s,body,ct);}
+static void sock_nonblock(SOCKET fd) {
+#ifdef _WIN32
+    u_long on=1;ioctlsocket(fd,FIONBIO,&on);
+#else
+    fcntl(fd,F_SETFL,fcntl(fd,F_GETFL,0)|O_NONBLOCK);
+#endif
+}
+static int sock_again(void) {
+#ifdef _WIN32
+    return WSAGetLastError()==WSAEWOULDBLOCK;
+#else
+    return errno==EAGAIN||errno==EWOULDBLOCK||errno==EINTR;
+#endif
+}
+/* Header lines "Name: value\r\n..." as an object with lower-case names */
+static Value *http_header_obj(const char *p,int n) {
+    Value *h=val_object();const char *end=p+n;char key[256];
+    while(p<end){const char *e=memchr(p,'\r',end-p),*colon;if(!e)e=end;colon=memchr(p,':',e-p);
+        if(colon&&colon-p<(int)sizeof(key)){const char *v=colon+1,*ve=e;int kn=(int)(colon-p);
+            for(int i=0;i<kn;i++)key[i]=tolower((unsigned char)p[i]);
+            key[kn]='\0';
+            while(v<ve&&(*v==' '||*v=='\t'))v++;
+            while(ve>v&&(ve[-1]==' '||ve[-1]=='\t'))ve--;
+            Value *hv=val_string_n(v,(int)(ve-v));obj_set(h,key,hv);val_decref(hv);}
+        p=e+2;}
+    return h;
+}
+/* Resolved addresses are cached for HTTP_DNS_TTL; idle keep-alive sockets wait in a pool
+   (HTTP_POOL_MAX in all, HTTP_POOL_IDLE_MS at most) keyed by host and port */
+#define HTTP_DNS_TTL 60000
+#define HTTP_POOL_MAX 64
+#define HTTP_POOL_IDLE_MS 30000
+typedef struct { char host[256]; int port; long long expires; struct sockaddr_storage addr; socklen_t len; } DnsEnt;
+typedef struct { char host[256]; int port; SOCKET fd; long long since; } PoolEnt;
+static DnsEnt g_dns[32]; static int g_dns_n=0;
+static PoolEnt g_pool[HTTP_POOL_MAX]; static int g_pool_n=0;
+static int dns_lookup(const char *host,int port,struct sockaddr_storage *addr,socklen_t *len) {
+    long long now=current_time_ms();DnsEnt *slot=NULL;
+    for(int i=0;i<g_dns_n;i++)if(g_dns[i].port==port&&!strcmp(g_dns[i].host,host)){if(g_dns[i].expires>now){*addr=g_dns[i].addr;*len=g_dns[i].len;return 1;}slot=&g_dns[i];}
+    struct addrinfo hints,*res=NULL;char ps[16];memset(&hints,0,sizeof(hints));hints.ai_family=AF_UNSPEC;hints.ai_socktype=SOCK_STREAM;snprintf(ps,sizeof(ps),"%d",port);
+    if(getaddrinfo(host,ps,&hints,&res)!=0||!res)return 0;
+    if(!slot){if(g_dns_n<32)slot=&g_dns[g_dns_n++];else{slot=&g_dns[0];for(int i=1;i<32;i++)if(g_dns[i].expires<slot->expires)slot=&g_dns[i];}}
+    snprintf(slot->host,sizeof(slot->host),"%s",host);slot->port=port;slot->expires=now+HTTP_DNS_TTL;
+    memcpy(&slot->addr,res->ai_addr,res->ai_addrlen);slot->len=(socklen_t)res->ai_addrlen;freeaddrinfo(res);
+    *addr=slot->addr;*len=slot->len;return 1;
+}
+/* An idle pooled socket for host:port; ones the server has closed (or that sent stray bytes) are dropped */
+static SOCKET pool_take(const char *host,int port) {
+    long long now=current_time_ms();
+    for(int i=g_pool_n-1;i>=0;i--){if(g_pool[i].port!=port||strcmp(g_pool[i].host,host))continue;
+        SOCKET fd=g_pool[i].fd;int stale=now-g_pool[i].since>HTTP_POOL_IDLE_MS;g_pool[i]=g_pool[--g_pool_n];
+        char c;if(!stale&&recv(fd,&c,1,MSG_PEEK)<0&&sock_again())return fd;
+        close(fd);}
+    return INVALID_SOCKET;
+}
+static void pool_put(const char *host,int port,SOCKET fd) {
+    if(g_pool_n>=HTTP_POOL_MAX){close(g_pool[0].fd);g_pool[0]=g_pool[--g_pool_n];}
+    PoolEnt *e=&g_pool[g_pool_n++];snprintf(e->host,sizeof(e->host),"%s",host);e->port=port;e->fd=fd;e->since=current_time_ms();
+}
+/* One request in flight. Calls are driven together by http_run over non-blocking sockets:
+   connect, send the request, then read until the response is framed by Content-Length,
+   chunked encoding or EOF. A pooled socket that turns out dead is retried once on a new one. */
+enum { HC_CONNECT,HC_SEND,HC_RECV,HC_DONE };
+typedef struct { char host[256]; int port,state,reused,retried,status,hdr_len,chunked,keep,no_body; long long clen,deadline; SOCKET fd; StrBuf out,in,body; size_t sent,cpos; Value *headers,*result; } HttpCall;
+static int hc_init(HttpCall *c,const char *method,const char *url,const char *body,int blen,const char *type,Value *hdrs,int timeout) {
+    memset(c,0,sizeof(*c));c->fd=INVALID_SOCKET;c->state=HC_DONE;c->port=80;c->deadline=current_time_ms()+(timeout>0?timeout:30000);
+    if(!strncmp(url,"http://",7))url+=7;else if(!strncmp(url,"https://",8)){url+=8;c->port=443;}
+    const char *slash=strchr(url,'/'),*hend=slash?slash:url+strlen(url),*colon=memchr(url,':',hend-url);
+    int hn=(int)((colon?colon:hend)-url);if(hn<=0||hn>=(int)sizeof(c->host))return 0;
+    memcpy(c->host,url,hn);c->host[hn]='\0';if(colon)c->port=atoi(colon+1);
+    sb_init(&c->out);sb_init(&c->in);
+    char line[512];int k=snprintf(line,sizeof(line),"%s ",method);sb_append(&c->out,line,k);sb_puts(&c->out,slash?slash:"/");
+    k=snprintf(line,sizeof(line)," HTTP/1.1\r\nHost: %s\r\nUser-Agent: Jeem/3.0\r\nConnection: keep-alive\r\n",c->host);sb_append(&c->out,line,k);
+    if(blen>0){k=snprintf(line,sizeof(line),"Content-Type: %s\r\nContent-Length: %d\r\n",type?type:"application/json",blen);sb_append(&c->out,line,k);}
+    for(int i=0;hdrs&&hdrs->type==V_OBJECT&&i<hdrs->as.obj->count;i++){sb_puts(&c->out,hdrs->as.obj->pairs[i].key);sb_append(&c->out,": ",2);sb_append_val(&c->out,hdrs->as.obj->pairs[i].val);sb_append(&c->out,"\r\n",2);}
+    sb_append(&c->out,"\r\n",2);if(blen>0)sb_append(&c->out,body,blen);
+    c->no_body=!strcmp(method,"HEAD");c->state=HC_CONNECT;return 1;
+}
+static void hc_start(HttpCall *c) {
+    c->fd=pool_take(c->host,c->port);
+    if(c->fd!=INVALID_SOCKET){c->reused=1;c->state=HC_SEND;return;}
+    struct sockaddr_storage addr;socklen_t len;
+    if(!dns_lookup(c->host,c->port,&addr,&len)){c->state=HC_DONE;return;}
+    c->fd=socket(addr.ss_family,SOCK_STREAM,0);if(c->fd==INVALID_SOCKET){c->state=HC_DONE;return;}
+    sock_nonblock(c->fd);int one=1;setsockopt(c->fd,IPPROTO_TCP,TCP_NODELAY,(char*)&one,sizeof(one));
+    if(connect(c->fd,(struct sockaddr*)&addr,len)==0)c->state=HC_SEND;
+#ifdef _WIN32
+    else if(WSAGetLastError()==WSAEWOULDBLOCK)c->state=HC_CONNECT;
+#else
+    else if(errno==EINPROGRESS)c->state=HC_CONNECT;
+#endif
+    else{close(c->fd);c->fd=INVALID_SOCKET;c->state=HC_DONE;}
+}
+static void hc_end(HttpCall *c) {
+    if(c->fd!=INVALID_SOCKET)close(c->fd);
+    c->fd=INVALID_SOCKET;c->state=HC_DONE;
+}
+static void hc_fail(HttpCall *c) {
+    if(c->reused&&!c->retried&&!STR_HDR(c->in.s)->len){close(c->fd);c->retried=1;c->reused=0;c->sent=0;hc_start(c);return;}
+    hc_end(c);
+}
+static void hc_finish(HttpCall *c,const char *body,int n) {
+    Value *r=val_object(),*v=val_int(c->status);obj_set(r,"status",v);val_decref(v);
+    obj_set(r,"headers",c->headers);v=val_string_n(body,n);obj_set(r,"body",v);val_decref(v);c->result=r;
+    if(c->keep&&(c->clen>=0||c->chunked)){pool_put(c->host,c->port,c->fd);c->fd=INVALID_SOCKET;}
+    hc_end(c);
+}
+/* Try to complete the response from what has been read; eof means the server closed */
+static void hc_parse(HttpCall *c,int eof) {
+    char *s=c->in.s;size_t n=STR_HDR(s)->len;
+    if(!c->hdr_len){char *e=NULL;for(size_t i=0;i+3<n;i++)if(s[i]=='\r'&&s[i+1]=='\n'&&s[i+2]=='\r'&&s[i+3]=='\n'){e=s+i;break;}
+        if(!e){if(eof)hc_fail(c);return;}
+        c->hdr_len=(int)(e-s)+4;c->status=0;sscanf(s,"HTTP/%*s %d",&c->status);
+        char *le=memchr(s,'\r',e-s+1);c->headers=http_header_obj(le+2,(int)(e-le));
+        Value *cl=obj_get(c->headers,"content-length"),*te=obj_get(c->headers,"transfer-encoding"),*cn=obj_get(c->headers,"connection");
+        c->keep=!strncmp(s,"HTTP/1.1",8)?!(cn&&!strcmp(cn->as.s,"close")):(cn&&!strcmp(cn->as.s,"keep-alive"));
+        c->chunked=te&&strstr(te->as.s,"chunked")!=NULL;c->clen=cl?strtoll(cl->as.s,NULL,10):-1;
+        if(c->no_body||c->status==204||c->status==304||(c->status>=100&&c->status<200)){c->chunked=0;c->clen=0;}
+        c->cpos=c->hdr_len;if(c->chunked)sb_init(&c->body);}
+    if(c->chunked){
+        for(;;){char *p=s+c->cpos,*e=NULL;for(char *q=p;q+1<s+n;q++)if(q[0]=='\r'&&q[1]=='\n'){e=q;break;}
+            if(!e)break;
+            long long k=strtoll(p,NULL,16);
+            if(k<=0){for(char *q=e;q+3<s+n;q++)if(q[0]=='\r'&&q[1]=='\n'&&q[2]=='\r'&&q[3]=='\n'){hc_finish(c,c->body.s,STR_HDR(c->body.s)->len);return;}break;}
+            if((size_t)(e+2-s)+k+2>n)break;
+            sb_append(&c->body,e+2,(int)k);c->cpos=e+2-s+k+2;}
+        if(eof)hc_end(c);
+    }else if(c->clen>=0){if(n-c->hdr_len>=(size_t)c->clen)hc_finish(c,s+c->hdr_len,(int)c->clen);else if(eof)hc_end(c);}
+    else if(eof){c->keep=0;hc_finish(c,s+c->hdr_len,(int)(n-c->hdr_len));}
+}
+static void hc_io(HttpCall *c) {
+    if(c->state==HC_CONNECT){int err=0;socklen_t el=sizeof(err);getsockopt(c->fd,SOL_SOCKET,SO_ERROR,(char*)&err,&el);if(err){hc_end(c);return;}c->state=HC_SEND;}
+    if(c->state==HC_SEND){size_t len=STR_HDR(c->out.s)->len;
+        while(c->sent<len){int k=send(c->fd,c->out.s+c->sent,(int)(len-c->sent),0);if(k<0&&sock_again())return;if(k<=0){hc_fail(c);return;}c->sent+=k;}
+        c->state=HC_RECV;return;}
+    if(c->state==HC_RECV){
+        for(;;){int len=STR_HDR(c->in.s)->len;c->in.s=str_reserve(c->in.s,len+16385);
+            int k=recv(c->fd,c->in.s+len,16384,0);
+            if(k<0&&sock_again())break;
+            if(k<=0){hc_parse(c,1);return;}
+            STR_HDR(c->in.s)->len=len+k;c->in.s[len+k]='\0';}
+        hc_parse(c,0);}
+}
+/* Drive n calls to completion, at most limit of them in flight at once */
+static void http_run(HttpCall *calls,int n,int limit) {
+    struct pollfd *pf=xmalloc(sizeof(struct pollfd)*(n+1));int *idx=xmalloc(sizeof(int)*(n+1)),next=0;
+    for(;;){int active=0,np=0;long long now=current_time_ms(),wait=1000;
+        for(int i=0;i<n;i++){HttpCall *c=&calls[i];
+            if(c->state!=HC_DONE&&c->fd==INVALID_SOCKET){if(i>=next){if(active>=limit)continue;next=i+1;}hc_start(c);}
+            if(c->state==HC_DONE)continue;
+            if(now>=c->deadline){hc_end(c);continue;}
+            active++;if(c->deadline-now<wait)wait=c->deadline-now;
+            pf[np].fd=c->fd;pf[np].events=c->state==HC_RECV?POLLIN:POLLOUT;pf[np].revents=0;idx[np++]=i;}
+        if(!np)break;
+        if(poll(pf,np,(int)wait)<=0)continue;
+        for(int k=0;k<np;k++)if(pf[k].revents)hc_io(&calls[idx[k]]);}
+    for(int i=0;i<n;i++){str_free(calls[i].out.s);str_free(calls[i].in.s);if(calls[i].body.s)str_free(calls[i].body.s);if(calls[i].headers)val_decref(calls[i].headers);}
+    free(pf);free(idx);
+}
+static Value *http_request(const char *method,const char *url,Value *body,const char *type,Value *opts) {
+    init_sockets();HttpCall c;
+    Value *tv=opts&&opts->type==V_OBJECT?obj_get(opts,"timeout"):NULL,*hv=opts&&opts->type==V_OBJECT?obj_get(opts,"headers"):NULL;
+    const char *b=body&&body->type!=V_NULL?val_tostr(body):"";int bl=body&&body->type==V_STRING?str_len(body):(int)strlen(b);
+    if(!hc_init(&c,method,url,b,bl,type,hv,tv?(int)val_tonum(tv):0)){return val_null();}
+    http_run(&c,1,1);
+    return c.result?c.result:val_null();
+}
+static Value *bi_httpGet(Value **a,int n){if(n<1||a[0]->type!=V_STRING)return val_null();return http_request("GET",a[0]->as.s,NULL,NULL,n>=2?a[1]:NULL);}
+static Value *bi_httpPost(Value **a,int n){if(n<1||a[0]->type!=V_STRING)return val_null();const char *ct=(n>=3&&a[2]->type==V_STRING)?a[2]->as.s:"application/json";return http_request("POST",a[0]->as.s,n>=2?a[1]:NULL,ct,n>=4?a[3]:NULL);}
+static Value *bi_httpPut(Value **a,int n){if(n<1||a[0]->type!=V_STRING)return val_null();const char *ct=(n>=3&&a[2]->type==V_STRING)?a[2]->as.s:"application/json";return http_request("PUT",a[0]->as.s,n>=2?a[1]:NULL,ct,n>=4?a[3]:NULL);}
+static Value *bi_httpDelete(Value **a,int n){if(n<1||a[0]->type!=V_STRING)return val_null();return http_request("DELETE",a[0]->as.s,NULL,NULL,n>=2?a[1]:NULL);}
+static Value *bi_httpPatch(Value **a,int n){if(n<1||a[0]->type!=V_STRING)return val_null();const char *ct=(n>=3&&a[2]->type==V_STRING)?a[2]->as.s:"application/json";return http_request("PATCH",a[0]->as.s,n>=2?a[1]:NULL,ct,n>=4?a[3]:NULL);}
+static Value *bi_http(Value **a,int n){if(n<2||a[0]->type!=V_STRING||a[1]->type!=V_STRING)return val_null();const char *ct=(n>=4&&a[3]->type==V_STRING)?a[3]->as.s:"application/json";return http_request(a[0]->as.s,a[1]->as.s,n>=3?a[2]:NULL,ct,n>=5?a[4]:NULL);}
+/* httpAll(requests [, {concurrency, timeout}]): requests are URLs (GET) or
+   {method, url, body, contentType, headers, timeout}; results come back in the same order,
+   null for a request that failed or timed out */
+static Value *bi_httpAll(Value **a,int n){
+    if(n<1||a[0]->type!=V_ARRAY)runtime_error(g_line,"httpAll() expects an array of requests");
+    init_sockets();Array *rq=a[0]->as.arr;Value *opts=n>=2&&a[1]->type==V_OBJECT?a[1]:NULL,*cv=opts?obj_get(opts,"concurrency"):NULL,*tv=opts?obj_get(opts,"timeout"):NULL;
+    int limit=cv?(int)val_tonum(cv):32,timeout=tv?(int)val_tonum(tv):0;HttpCall *calls=xmalloc(sizeof(HttpCall)*(rq->len+1));
+    for(int i=0;i<rq->len;i++){Value *r=rq->items[i];
+        if(r->type==V_STRING){hc_init(&calls[i],"GET",r->as.s,"",0,NULL,NULL,timeout);continue;}
+        if(r->type!=V_OBJECT){memset(&calls[i],0,sizeof(HttpCall));calls[i].state=HC_DONE;calls[i].fd=INVALID_SOCKET;sb_init(&calls[i].out);sb_init(&calls[i].in);continue;}
+        Value *m=obj_get(r,"method"),*u=obj_get(r,"url"),*b=obj_get(r,"body"),*ct=obj_get(r,"contentType"),*h=obj_get(r,"headers"),*t=obj_get(r,"timeout");
+        const char *bs=b&&b->type!=V_NULL?val_tostr(b):"";int bl=b&&b->type==V_STRING?str_len(b):(int)strlen(bs);
+        if(!u||!hc_init(&calls[i],m?val_tostr(m):"GET",u?val_tostr(u):"",bs,bl,ct&&ct->type==V_STRING?ct->as.s:NULL,h,t?(int)val_tonum(t):timeout)){
+            if(!calls[i].out.s){sb_init(&calls[i].out);sb_init(&calls[i].in);}calls[i].state=HC_DONE;}}
+    http_run(calls,rq->len,limit>0?limit:1);
+    Value *out=val_array(rq->len);
+    for(int i=0;i<rq->len;i++){Value *r=calls[i].result?calls[i].result:val_null();arr_push(out,r);val_decref(r);}
+    free(calls);return out;
+}
 
 
 /* HTTP Server */
-static Value *bi_createServer(Value **a,int n){int port=(n>=1)?(int)val_tonum(a[0]):8080;init_sockets();HttpServer *srv=xmalloc(sizeof(HttpServer));memset(srv,0,sizeof(HttpServer));srv->port=port;srv->route_cap=32;srv->routes=xmalloc(sizeof(HttpRoute)*srv->route_cap);srv->sock=socket(AF_INET,SOCK_STREAM,0);if(srv->sock==INVALID_SOCKET){free(srv->routes);free(srv);return val_null();}int opt=1;setsockopt(srv->sock,SOL_SOCKET,SO_REUSEADDR,(char*)&opt,sizeof(opt));struct sockaddr_in addr;addr.sin_family=AF_INET;addr.sin_addr.s_addr=INADDR_ANY;addr.sin_port=htons(port);if(bind(srv->sock,(struct sockaddr*)&addr,sizeof(addr))<0){close(srv->sock);free(srv->routes);free(srv);return val_null();}listen(srv->sock,10);g_server=srv;Value *obj=val_object();Value *pv=val_int(port);obj_set(obj,"port",pv);val_decref(pv);return obj;}
-
-static Value *bi_serverRoute(Value **a,int n){if(n<3||!g_server)return val_bool(0);if(a[0]->type!=V_STRING||a[1]->type!=V_STRING)return val_bool(0);if(a[2]->type!=V_CLOSURE&&a[2]->type!=V_FUNC)return val_bool(0);if(g_server->route_n>=g_server->route_cap){g_server->route_cap*=2;g_server->routes=xrealloc(g_server->routes,sizeof(HttpRoute)*g_server->route_cap);}g_server->routes[g_server->route_n].method=xstrdup(a[0]->as.s);g_server->routes[g_server->route_n].path=xstrdup(a[1]->as.s);val_incref(a[2]);g_server->routes[g_server->route_n].handler=a[2];g_server->route_n++;return val_bool(1);}
+/* Listening socket on port; SO_REUSEPORT lets each prefork worker bind its own */
+static SOCKET server_socket(int port) {
+    SOCKET fd=socket(AF_INET,SOCK_STREAM,0);if(fd==INVALID_SOCKET)return fd;
+    int opt=1;setsockopt(fd,SOL_SOCKET,SO_REUSEADDR,(char*)&opt,sizeof(opt));
+#ifdef SO_REUSEPORT
+    setsockopt(fd,SOL_SOCKET,SO_REUSEPORT,(char*)&opt,sizeof(opt));
+#endif
+    struct sockaddr_in addr;memset(&addr,0,sizeof(addr));addr.sin_family=AF_INET;addr.sin_addr.s_addr=INADDR_ANY;addr.sin_port=htons(port);
+    if(bind(fd,(struct sockaddr*)&addr,sizeof(addr))<0){close(fd);return INVALID_SOCKET;}
+    listen(fd,SOMAXCONN);return fd;
+}
+static Value *bi_createServer(Value **a,int n){int port=(n>=1)?(int)val_tonum(a[0]):8080;init_sockets();
+#ifndef _WIN32
+signal(SIGPIPE,SIG_IGN);
+#endif
+SOCKET fd=server_socket(port);if(fd==INVALID_SOCKET)return val_null();HttpServer *srv=xmalloc(sizeof(HttpServer));memset(srv,0,sizeof(HttpServer));srv->sock=fd;srv->port=port;srv->ep=-1;g_server=srv;Value *obj=val_object();Value *pv=val_int(port);obj_set(obj,"port",pv);val_decref(pv);return obj;}
 
-static void http_send(SOCKET client,int status,const char *type,const char *body){const char *st=status==200?"OK":status==404?"Not Found":"Error";char hdr[1024];snprintf(hdr,sizeof(hdr),"HTTP/1.1 %d %s\r\nContent-Type: %s\r\nContent-Length: %d\r\nConnection: close\r\n\r\n",status,st,type,(int)strlen(body));send(client,hdr,strlen(hdr),0);send(client,body,strlen(body),0);}
+/* Watch slot i (tag i+1, 0 is the listener) for input, plus output while a write is pending */
+static void ev_watch(HttpServer *s,SOCKET fd,int tag,int write,int add) {
+#ifdef __linux__
+    if(s->ep<0)return;
+    struct epoll_event ev;ev.events=EPOLLIN|(write?EPOLLOUT:0);ev.data.u32=tag;epoll_ctl(s->ep,add?EPOLL_CTL_ADD:EPOLL_CTL_MOD,fd,&ev);
+#else
+    (void)s;(void)fd;(void)tag;(void)write;(void)add;
+#endif
+}
+static const char *http_status_text(int st) {
+    switch(st){case 200:return "OK";case 201:return "Created";case 202:return "Accepted";case 204:return "No Content";
+        case 301:return "Moved Permanently";case 302:return "Found";case 304:return "Not Modified";
+        case 400:return "Bad Request";case 401:return "Unauthorized";case 403:return "Forbidden";case 404:return "Not Found";case 405:return "Method Not Allowed";
+        case 413:return "Payload Too Large";case 431:return "Request Header Fields Too Large";case 500:return "Internal Server Error";case 503:return "Service Unavailable";
+        default:return st<400?"OK":"Error";}
+}
+/* Queue a response on c; the body is sent as-is (binary safe) */
+static void http_respond(HttpConn *c,int status,const char *type,const char *body,int len) {
+    char hdr[512];if(status==204||status==304)len=0;
+    int h=snprintf(hdr,sizeof(hdr),"HTTP/1.1 %d %s\r\nContent-Type: %s\r\nContent-Length: %d\r\nConnection: %s\r\n\r\n",status,http_status_text(status),type,len,c->keep?"keep-alive":"close");
+    sb_append(&c->out,hdr,h);sb_append(&c->out,body,len);
+}
+static void conn_close(HttpServer *s,int i) {
+    HttpConn *c=s->conns[i];close(c->fd);str_free(c->in.s);str_free(c->out.s);free(c);
+    s->conns[i]=NULL;s->free_slots[s->free_n++]=i;
+}
+/* Send what the socket takes; returns 0 if the connection was closed */
+static int conn_flush(HttpServer *s,int i) {
+    HttpConn *c=s->conns[i];size_t len=STR_HDR(c->out.s)->len;
+    while(c->out_pos<len){int k=send(c->fd,c->out.s+c->out_pos,(int)(len-c->out_pos),0);
+        if(k<0&&sock_again()){if(!c->want_write){c->want_write=1;ev_watch(s,c->fd,i+1,1,0);}return 1;}
+        if(k<=0){conn_close(s,i);return 0;}
+        c->out_pos+=k;}
+    STR_HDR(c->out.s)->len=0;c->out_pos=0;
+    if(c->want_write){c->want_write=0;ev_watch(s,c->fd,i+1,0,0);}
+    if(!c->keep){conn_close(s,i);return 0;}
+    return 1;
+}
+static int mem_ieq(const char *a,const char *b,int n) { for(int i=0;i<n;i++)if(tolower((unsigned char)a[i])!=tolower((unsigned char)b[i]))return 0; return 1; }
+static int hdr_is(const char *s,int n,const char *lit) { return (int)strlen(lit)==n&&mem_ieq(s,lit,n); }
+/* A parsed request: spans into the connection's input buffer, plus the decoded body of a
+   chunked request. Headers stay raw until the request is dispatched to a handler. */
+typedef struct { const char *method,*target,*hdr,*body; int method_n,target_n,hdr_n,body_n; StrBuf chunked; } HttpReq;
+/* Parse one request from the front of c->in. Returns the bytes it covers, 0 if more input
+   is needed, or -status for a bad request. */
+static long http_parse(HttpConn *c,HttpReq *r) {
+    char *s=c->in.s,*hend=NULL;size_t n=STR_HDR(s)->len;
+    for(size_t i=c->scan;i+3<n;i++)if(s[i]=='\r'&&s[i+1]=='\n'&&s[i+2]=='\r'&&s[i+3]=='\n'){hend=s+i;break;}
+    if(!hend){c->scan=n>3?n-3:0;return n>HTTP_BUF?-431:0;}
+    size_t hlen=hend-s+4;if(hlen>HTTP_BUF)return -431;
+    char *le=memchr(s,'\r',hend-s+1),*sp1=memchr(s,' ',le-s),*sp2=sp1?memchr(sp1+1,' ',le-sp1-1):NULL;
+    if(!sp1||!sp2||sp1-s>15||sp2==sp1+1)return -400;
+    int keep=le-sp2-1==8&&!memcmp(sp2+1,"HTTP/1.1",8),chunked=0;long long clen=0;
+    for(char *p=le+2;p<hend;){char *e=memchr(p,'\r',hend-p+1),*colon=memchr(p,':',e-p);
+        if(colon){char *v=colon+1,*ve=e;int kn=(int)(colon-p);while(v<ve&&(*v==' '||*v=='\t'))v++;while(ve>v&&(ve[-1]==' '||ve[-1]=='\t'))ve--;
+            if(hdr_is(p,kn,"content-length")){char *end;if(v==ve||!isdigit((unsigned char)*v))return -400;clen=strtoll(v,&end,10);if(end!=ve)return -400;}
+            else if(hdr_is(p,kn,"transfer-encoding"))chunked=ve-v>=7&&mem_ieq(ve-7,"chunked",7);
+            else if(hdr_is(p,kn,"connection"))keep=hdr_is(v,(int)(ve-v),"close")?0:hdr_is(v,(int)(ve-v),"keep-alive")?1:keep;}
+        p=e+2;}
+    memset(r,0,sizeof(*r));size_t used=hlen;
+    if(chunked){sb_init(&r->chunked);
+        for(;;){char *p=s+used,*e=NULL;for(char *q=p;q+1<s+n;q++)if(q[0]=='\r'&&q[1]=='\n'){e=q;break;}
+            if(!e)goto more;
+            char *end;if(!isxdigit((unsigned char)*p)){str_free(r->chunked.s);return -400;}
+            long long k=strtoll(p,&end,16);if(end!=e&&*end!=';'&&*end!=' '&&*end!='\t'){str_free(r->chunked.s);return -400;}
+            if(k>HTTP_MAX_BODY||STR_HDR(r->chunked.s)->len+k>HTTP_MAX_BODY){str_free(r->chunked.s);return -413;}
+            if(k==0){/* trailers end with an empty line */
+                for(char *q=e;q+3<s+n;q++)if(q[0]=='\r'&&q[1]=='\n'&&q[2]=='\r'&&q[3]=='\n'){used=q+4-s;goto done;}
+                goto more;}
+            if((size_t)(e+2-s)+k+2>n)goto more;
+            if(e[2+k]!='\r'||e[3+k]!='\n'){str_free(r->chunked.s);return -400;}
+            sb_append(&r->chunked,e+2,(int)k);used=e+2-s+k+2;}
+    }else if(clen>0){
+        if(clen>HTTP_MAX_BODY)return -413;
+        if(hlen+clen>n)return 0;
+        r->body=s+hlen;r->body_n=(int)clen;used=hlen+clen;}
+done:
+    c->keep=keep;
+    r->method=s;r->method_n=(int)(sp1-s);r->target=sp1+1;r->target_n=(int)(sp2-sp1-1);r->hdr=le+2;r->hdr_n=(int)(hend-le);
+    if(r->chunked.s){r->body=r->chunked.s;r->body_n=STR_HDR(r->chunked.s)->len;}
+    return (long)used;
+more:
+    if(r->chunked.s)str_free(r->chunked.s);
+    return 0;
+}
+static Value *http_headers(HttpReq *r) { return http_header_obj(r->hdr,r->hdr_n); }
+/* %XX and (in queries) '+' decoding */
+static Value *url_decode(const char *s,int n,int plus) {
+    Value *v=val_string_n(s,n);char *d=v->as.s;int k=0;
+    for(int i=0;i<n;i++){if(s[i]=='%'&&i+2<n&&isxdigit((unsigned char)s[i+1])&&isxdigit((unsigned char)s[i+2])){char hx[3]={s[i+1],s[i+2],0};d[k++]=(char)strtol(hx,NULL,16);i+=2;}
+        else d[k++]=plus&&s[i]=='+'?' ':s[i];}
+    d[k]='\0';STR_HDR(d)->len=k;return v;
+}
+/* a=1&b=x%20y&a=2 -> {a: ["1", "2"], b: "x y"}; a key without '=' maps to "" */
+static Value *http_query(const char *q,int n) {
+    Value *obj=val_object();
+    for(const char *p=q,*end=q+n;p<end;){const char *amp=memchr(p,'&',end-p);if(!amp)amp=end;const char *eq=memchr(p,'=',amp-p);
+        if(amp>p){Value *k=url_decode(p,(int)((eq?eq:amp)-p),1),*v=eq?url_decode(eq+1,(int)(amp-eq-1),1):val_string(""),*old=obj_get(obj,k->as.s);
+            if(!old)obj_set(obj,k->as.s,v);
+            else if(old->type==V_ARRAY)arr_push(old,v);
+            else{Value *arr=val_array(4);arr_push(arr,old);arr_push(arr,v);obj_set(obj,k->as.s,arr);val_decref(arr);}
+            val_decref(k);val_decref(v);}
+        p=amp+1;}
+    return obj;
+}
 
-static int server_handle_one(int timeout_ms){if(!g_server||!g_server->running)return 0;struct sockaddr_in ca;socklen_t al=sizeof(ca);struct timeval tv;tv.tv_sec=timeout_ms/1000;tv.tv_usec=(timeout_ms%1000)*1000;fd_set fds;FD_ZERO(&fds);FD_SET(g_server->sock,&fds);if(select(g_server->sock+1,&fds,NULL,NULL,&tv)<=0)return 0;SOCKET client=accept(g_server->sock,(struct sockaddr*)&ca,&al);if(client==INVALID_SOCKET)return 0;char buf[HTTP_BUF];int bytes=recv(client,buf,sizeof(buf)-1,0);if(bytes<=0){close(client);return 0;}buf[bytes]='\0';char method[16],path[1024],ver[16];sscanf(buf,"%15s %1023s %15s",method,path,ver);char *body=strstr(buf,"\r\n\r\n");if(body)body+=4;HttpRoute *route=NULL;for(int i=0;i<g_server->route_n;i++){if(strcmp(g_server->routes[i].method,method)==0&&strcmp(g_server->routes[i].path,path)==0){route=&g_server->routes[i];break;}}if(route&&route->handler){Value *req=val_object();Value *mv=val_string(method);Value *pv=val_string(path);Value *bv=val_string(body?body:"");obj_set(req,"method",mv);obj_set(req,"path",pv);obj_set(req,"body",bv);val_decref(mv);val_decref(pv);val_decref(bv);Value *args[1]={req};Value *result=call_closure(route->handler,args,1);if(result&&result->type==V_OBJECT){Value *sv=obj_get(result,"status");Value *bodv=obj_get(result,"body");Value *tv=obj_get(result,"contentType");int st=sv?(int)val_tonum(sv):200;const char *rb=bodv?val_tostr(bodv):"";const char *rt=(tv&&tv->type==V_STRING)?tv->as.s:"text/html";http_send(client,st,rt,rb);}else{const char *rb=result?val_tostr(result):"";http_send(client,200,"text/html",rb);}val_decref(req);if(result)val_decref(result);}else{http_send(client,404,"text/html","Not Found");}close(client);return 1;}
-static Value *bi_serverHandle(Value **a,int n){int timeout=(n>=1)?(int)val_tonum(a[0]):100;return val_bool(server_handle_one(timeout));}
-static Value *bi_serverListen(Value **a,int n){(void)a;(void)n;if(!g_server)return val_null();printf("Server listening on port %d (Ctrl+C to stop)\n",g_server->port);g_server->running=1;while(g_server->running){server_handle_one(100);process_timers();}return val_null();}
+/* Router: one tree per method, one node per path segment. A node's children are static
+   segments (sorted, binary searched), one ":param" child and one "*" wildcard that takes the
+   rest of the path. Matching prefers static over param over wildcard and backtracks, so a
+   lookup costs O(path length) however many routes there are. Method "*" matches any method. */
+static int route_seg_cmp(const char *a,int an,const char *b) { int c=strncmp(a,b,an); return c?c:-(b[an]!='\0'); }
+static RouteNode *route_child(RouteNode *nd,const char *seg,int n,int add) {
+    int lo=0,hi=nd->kid_n;
+    while(lo<hi){int mid=(lo+hi)/2,c=route_seg_cmp(seg,n,nd->kids[mid]->seg);if(!c)return nd->kids[mid];if(c<0)hi=mid;else lo=mid+1;}
+    if(!add)return NULL;
+    RouteNode *k=xmalloc(sizeof(RouteNode));memset(k,0,sizeof(RouteNode));k->seg=xstrndup(seg,n);
+    nd->kids=xrealloc(nd->kids,sizeof(RouteNode*)*(nd->kid_n+1));memmove(nd->kids+lo+1,nd->kids+lo,sizeof(RouteNode*)*(nd->kid_n-lo));nd->kids[lo]=k;nd->kid_n++;
+    return k;
+}
+static void route_add(HttpServer *s,const char *method,const char *path,Value *handler) {
+    RouteNode *nd=NULL;
+    for(int i=0;i<s->tree_n;i++)if(!strcmp(s->trees[i].method,method))nd=s->trees[i].root;
+    if(!nd){s->trees=xrealloc(s->trees,sizeof(RouteTree)*(s->tree_n+1));nd=xmalloc(sizeof(RouteNode));memset(nd,0,sizeof(RouteNode));
+        s->trees[s->tree_n].method=xstrdup(method);s->trees[s->tree_n++].root=nd;}
+    for(const char *p=path;*p;){
+        while(*p=='/')p++;
+        if(!*p)break;
+        const char *q=p;while(*q&&*q!='/')q++;int n=(int)(q-p);
+        if(*p==':'){if(!nd->param){nd->param=xmalloc(sizeof(RouteNode));memset(nd->param,0,sizeof(RouteNode));nd->param->seg=xstrndup(p+1,n-1);}
+            else if((int)strlen(nd->param->seg)!=n-1||strncmp(nd->param->seg,p+1,n-1))runtime_error(g_line,"serverRoute(): ':%.*s' conflicts with ':%s' in %s",n-1,p+1,nd->param->seg,path);
+            nd=nd->param;}
+        else if(*p=='*'){if(*q)runtime_error(g_line,"serverRoute(): '*' must be the last segment of %s",path);
+            if(!nd->wild){nd->wild=xmalloc(sizeof(RouteNode));memset(nd->wild,0,sizeof(RouteNode));nd->wild->seg=xstrndup(n>1?p+1:"*",n>1?n-1:1);}
+            nd=nd->wild;}
+        else nd=route_child(nd,p,n,1);
+        p=q;}
+    val_incref(handler);if(nd->handler)val_decref(nd->handler);nd->handler=handler;
+}
+/* Match path[p, end); captured param/wildcard nodes and spans go to caps */
+typedef struct { RouteNode *node; const char *s; int n; } RouteCap;
+static RouteNode *route_match(RouteNode *nd,const char *p,const char *end,RouteCap *caps,int *cap_n) {
+    while(p<end&&*p=='/')p++;
+    if(p==end){if(nd->handler)return nd;if(nd->wild&&nd->wild->handler&&*cap_n<32){caps[(*cap_n)++]=(RouteCap){nd->wild,p,0};return nd->wild;}return NULL;}
+    const char *q=p;while(q<end&&*q!='/')q++;
+    RouteNode *k=route_child(nd,p,(int)(q-p),0),*r;int mark=*cap_n;
+    if(k&&(r=route_match(k,q,end,caps,cap_n)))return r;
+    if(nd->param&&*cap_n<32){caps[(*cap_n)++]=(RouteCap){nd->param,p,(int)(q-p)};if((r=route_match(nd->param,q,end,caps,cap_n)))return r;*cap_n=mark;}
+    if(nd->wild&&nd->wild->handler&&*cap_n<32){caps[(*cap_n)++]=(RouteCap){nd->wild,p,(int)(end-p)};return nd->wild;}
+    return NULL;
+}
+static RouteNode *route_find(HttpServer *s,const char *method,int mn,const char *path,int pn,RouteCap *caps,int *cap_n) {
+    for(int pass=0;pass<2;pass++)for(int i=0;i<s->tree_n;i++){const char *m=s->trees[i].method;
+        if(pass?strcmp(m,"*"):(int)strlen(m)!=mn||strncmp(m,method,mn))continue;
+        *cap_n=0;RouteNode *r=route_match(s->trees[i].root,path,path+pn,caps,cap_n);if(r)return r;}
+    return NULL;
+}
+/* serverRoute(method, pattern, handler): pattern segments can be ":name" (req.params.name)
+   or a trailing "*" / "*name" that matches the rest of the path; method "*" matches any */
+static Value *bi_serverRoute(Value **a,int n){if(n<3||!g_server)return val_bool(0);if(a[0]->type!=V_STRING||a[1]->type!=V_STRING)return val_bool(0);if(a[2]->type!=V_CLOSURE&&a[2]->type!=V_FUNC)return val_bool(0);route_add(g_server,a[0]->as.s,a[1]->as.s,a[2]);return val_bool(1);}
+/* req: {method, path, url, query, params, headers, body} */
+static void server_dispatch(HttpConn *c,HttpReq *r) {
+    const char *qm=memchr(r->target,'?',r->target_n);int pn=qm?(int)(qm-r->target):r->target_n;
+    RouteCap caps[32];int cap_n=0;RouteNode *route=route_find(g_server,r->method,r->method_n,r->target,pn,caps,&cap_n);
+    if(!route){int other=0;for(int i=0;i<g_server->tree_n&&!other;i++){RouteCap tmp[32];int tn=0;other=route_match(g_server->trees[i].root,r->target,r->target+pn,tmp,&tn)!=NULL;}
+        if(other)http_respond(c,405,"text/plain","Method Not Allowed",18);else http_respond(c,404,"text/html","Not Found",9);
+        return;}
+    Value *req=val_object(),*params=val_object(),*f;
+    for(int i=0;i<cap_n;i++){Value *v=url_decode(caps[i].s,caps[i].n,0);obj_set(params,caps[i].node->seg,v);val_decref(v);}
+    f=val_string_n(r->method,r->method_n);obj_set(req,"method",f);val_decref(f);
+    f=val_string_n(r->target,pn);obj_set(req,"path",f);val_decref(f);
+    f=val_string_n(r->target,r->target_n);obj_set(req,"url",f);val_decref(f);
+    f=qm?http_query(qm+1,r->target_n-pn-1):val_object();obj_set(req,"query",f);val_decref(f);
+    obj_set(req,"params",params);val_decref(params);
+    f=http_headers(r);obj_set(req,"headers",f);val_decref(f);
+    f=val_string_n(r->body?r->body:"",r->body_n);obj_set(req,"body",f);val_decref(f);
+    Value *args[1]={req};Value *result=call_closure(route->handler,args,1);
+    if(result&&result->type==V_OBJECT){Value *sv=obj_get(result,"status"),*bodv=obj_get(result,"body"),*tv=obj_get(result,"contentType");
+        int st=sv?(int)val_tonum(sv):200;const char *rt=(tv&&tv->type==V_STRING)?tv->as.s:"text/html";
+        if(bodv&&bodv->type==V_STRING)http_respond(c,st,rt,bodv->as.s,str_len(bodv));
+        else{const char *rb=bodv?val_tostr(bodv):"";http_respond(c,st,rt,rb,(int)strlen(rb));}}
+    else{const char *rb=result?val_tostr(result):"";
+        if(result&&result->type==V_STRING)http_respond(c,200,"text/html",rb,str_len(result));else http_respond(c,200,"text/html",rb,(int)strlen(rb));}
+    if(result)val_decref(result);
+    val_decref(req);
+}
+/* Read what has arrived on slot i and answer every complete request (pipelining included) */
+static int conn_read(HttpServer *s,int i) {
+    HttpConn *c=s->conns[i];int handled=0;
+    for(;;){int len=STR_HDR(c->in.s)->len;c->in.s=str_reserve(c->in.s,len+16385);
+        int k=recv(c->fd,c->in.s+len,16384,0);
+        if(k<0&&sock_again())break;
+        if(k<=0){conn_close(s,i);return handled;}
+        STR_HDR(c->in.s)->len=len+k;c->in.s[len+k]='\0';}
+    c->last=current_time_ms();
+    for(;;){HttpReq r;long used=http_parse(c,&r);
+        if(used<0){c->keep=0;const char *msg=http_status_text((int)-used);http_respond(c,(int)-used,"text/plain",msg,(int)strlen(msg));break;}
+        if(!used)break;
+        if(s->draining)c->keep=0;
+        server_dispatch(c,&r);handled++;
+        if(r.chunked.s)str_free(r.chunked.s);
+        if(s->conns[i]!=c)return handled;
+        int rest=STR_HDR(c->in.s)->len-(int)used;memmove(c->in.s,c->in.s+used,rest+1);STR_HDR(c->in.s)->len=rest;c->scan=0;
+        if(!c->keep)break;}
+    if(STR_HDR(c->out.s)->len)conn_flush(s,i);
+    return handled;
+}
+static void server_accept(HttpServer *s) {
+    for(;;){struct sockaddr_in ca;socklen_t al=sizeof(ca);SOCKET fd=accept(s->sock,(struct sockaddr*)&ca,&al);if(fd==INVALID_SOCKET)return;
+        sock_nonblock(fd);int one=1;setsockopt(fd,IPPROTO_TCP,TCP_NODELAY,(char*)&one,sizeof(one));
+        int i;if(s->free_n)i=s->free_slots[--s->free_n];
+        else{if(s->conn_n>=s->conn_cap){s->conn_cap=s->conn_cap?s->conn_cap*2:64;s->conns=xrealloc(s->conns,sizeof(HttpConn*)*s->conn_cap);s->free_slots=xrealloc(s->free_slots,sizeof(int)*s->conn_cap);}i=s->conn_n++;}
+        HttpConn *c=xmalloc(sizeof(HttpConn));memset(c,0,sizeof(HttpConn));c->fd=fd;c->keep=1;c->last=current_time_ms();sb_init(&c->in);sb_init(&c->out);
+        s->conns[i]=c;ev_watch(s,fd,i+1,0,1);}
+}
+/* One turn of the event loop: wait up to timeout_ms (less if a timer is due), then accept,
+   read and write whatever is ready. Returns the number of requests answered. */
+static int server_poll(int timeout_ms) {
+    HttpServer *s=g_server;if(!s)return 0;int handled=0,nready=0,tags[256],evs[256];
+    if(!s->conns){if(s->sock!=INVALID_SOCKET)sock_nonblock(s->sock);
+#ifdef __linux__
+        s->ep=epoll_create1(0);ev_watch(s,s->sock,0,0,1);
+#endif
+        s->conn_cap=64;s->conns=xmalloc(sizeof(HttpConn*)*s->conn_cap);s->free_slots=xmalloc(sizeof(int)*s->conn_cap);}
+    int wait=timer_wait_ms(timeout_ms);
+#ifdef __linux__
+    if(s->ep>=0){struct epoll_event ev[256];nready=epoll_wait(s->ep,ev,256,wait);
+        for(int k=0;k<nready;k++){tags[k]=ev[k].data.u32;evs[k]=(ev[k].events&(EPOLLIN|EPOLLHUP|EPOLLERR)?1:0)|(ev[k].events&EPOLLOUT?2:0);}}
+    else
+#endif
+    {int np=0;struct pollfd *pf=xmalloc(sizeof(struct pollfd)*(s->conn_n+1));int *slot=xmalloc(sizeof(int)*(s->conn_n+1));
+        if(s->sock!=INVALID_SOCKET){pf[np].fd=s->sock;pf[np].events=POLLIN;pf[np].revents=0;slot[np++]=0;}
+        for(int i=0;i<s->conn_n;i++)if(s->conns[i]){pf[np].fd=s->conns[i]->fd;pf[np].events=POLLIN|(s->conns[i]->want_write?POLLOUT:0);pf[np].revents=0;slot[np++]=i+1;}
+        if(poll(pf,np,wait)>0)for(int k=0;k<np&&nready<256;k++)if(pf[k].revents){tags[nready]=slot[k];evs[nready++]=(pf[k].revents&(POLLIN|POLLHUP|POLLERR)?1:0)|(pf[k].revents&POLLOUT?2:0);}
+        free(pf);free(slot);}
+    int listener=0;
+    for(int k=0;k<nready;k++){int i=tags[k]-1;
+        if(i<0){listener=1;continue;}
+        if(!s->conns[i])continue;
+        if(evs[k]&2&&!conn_flush(s,i))continue;
+        if(evs[k]&1)handled+=conn_read(s,i);}
+    if(listener&&s->sock!=INVALID_SOCKET)server_accept(s);
+    long long now=current_time_ms();
+    if(now-s->swept>1000){s->swept=now;for(int i=0;i<s->conn_n;i++)if(s->conns[i]&&now-s->conns[i]->last>HTTP_IDLE_MS)conn_close(s,i);}
+    return handled;
+}
+static Value *bi_serverHandle(Value **a,int n){int timeout=(n>=1)?(int)val_tonum(a[0]):100;return val_bool(server_poll(timeout)>0);}
+/* SIGTERM drains: stop accepting, finish the requests in flight, close idle connections */
+static volatile sig_atomic_t g_server_term=0;
+static void server_on_term(int sig) { g_server_term=sig; }
+static void server_drain(HttpServer *s) {
+    s->draining=1;if(s->sock!=INVALID_SOCKET){close(s->sock);s->sock=INVALID_SOCKET;}
+    for(int i=0;i<s->conn_n;i++){HttpConn *c=s->conns[i];if(!c)continue;c->keep=0;if(!STR_HDR(c->in.s)->len&&!STR_HDR(c->out.s)->len)conn_close(s,i);}
+}
+/* Serve until serverStop(), or until a drain after SIGTERM is done (at most 10s) */
+static void server_run(HttpServer *s) {
+    long long until=0;s->running=1;
+    while(s->running){
+        if(g_server_term&&!until){until=current_time_ms()+10000;server_drain(s);}
+        server_poll(1000);process_timers();
+        if(until&&(s->conn_n==s->free_n||current_time_ms()>until))break;}
+}
+#ifndef _WIN32
+/* Prefork: each worker is a copy of this process with the routes already registered. With
+   SO_REUSEPORT every worker binds its own socket and the kernel spreads connections over them;
+   otherwise they share the inherited one. The supervisor restarts workers that crash (exit
+   status 0 means serverStop() and is left alone) and forwards SIGTERM/SIGINT for a drain. */
+static pid_t server_spawn(HttpServer *s) {
+    fflush(stdout);fflush(stderr);pid_t pid=fork();if(pid)return pid;
+#ifdef __linux__
+    prctl(PR_SET_PDEATHSIG,SIGTERM);
+#endif
+#ifdef SO_REUSEPORT
+    SOCKET fd=server_socket(s->port);if(fd!=INVALID_SOCKET){if(s->sock!=INVALID_SOCKET)close(s->sock);s->sock=fd;}
+#endif
+    server_run(s);fflush(stdout);exit(0);
+}
+static void server_supervise(HttpServer *s,int n) {
+    pid_t *pids=xmalloc(sizeof(pid_t)*n);long long *born=xmalloc(sizeof(long long)*n);int live=0,stopping=0;
+    for(int i=0;i<n;i++){pids[i]=server_spawn(s);born[i]=current_time_ms();if(pids[i]>0)live++;}
+#ifdef SO_REUSEPORT
+    close(s->sock);s->sock=INVALID_SOCKET;
+#endif
+    while(live>0){
+        int st;pid_t pid=waitpid(-1,&st,0);
+        if(pid<0){if(errno!=EINTR)break;if(g_server_term&&!stopping){stopping=1;for(int i=0;i<n;i++)if(pids[i]>0)kill(pids[i],SIGTERM);}continue;}
+        int i=0;while(i<n&&pids[i]!=pid)i++;if(i==n)continue;
+        pids[i]=0;live--;
+        if(stopping||(WIFEXITED(st)&&WEXITSTATUS(st)==0))continue;
+        fprintf(stderr,"worker %d (pid %d) %s %d, restarting\n",i,(int)pid,WIFSIGNALED(st)?"killed by signal":"exited with",WIFSIGNALED(st)?WTERMSIG(st):WEXITSTATUS(st));
+        if(current_time_ms()-born[i]<1000)sleep_ms(1000);
+        pids[i]=server_spawn(s);born[i]=current_time_ms();if(pids[i]>0)live++;}
+    free(pids);free(born);
+}
+#endif
+/* serverListen([{workers: N}]): N > 1 preforks N worker processes (0 means one per CPU) */
+static Value *bi_serverListen(Value **a,int n){
+    if(!g_server)return val_null();
+    Value *wv=n>=1&&a[0]->type==V_OBJECT?obj_get(a[0],"workers"):NULL;int workers=wv?(int)val_tonum(wv):1;
+#ifndef _WIN32
+    if(workers<=0)workers=(int)sysconf(_SC_NPROCESSORS_ONLN);
+    /* The drain handlers last only while serving; a signal that started a drain is raised again
+       under the old disposition once it is done, so the process still ends as asked */
+    struct sigaction sa,old_term,old_int;memset(&sa,0,sizeof(sa));sa.sa_handler=server_on_term;
+    g_server_term=0;sigaction(SIGTERM,&sa,&old_term);if(workers>1)sigaction(SIGINT,&sa,&old_int);
+    if(workers>1){printf("Server listening on port %d with %d workers (Ctrl+C to stop)\n",g_server->port,workers);server_supervise(g_server,workers);}
+    else{printf("Server listening on port %d (Ctrl+C to stop)\n",g_server->port);fflush(stdout);server_run(g_server);}
+    sigaction(SIGTERM,&old_term,NULL);if(workers>1)sigaction(SIGINT,&old_int,NULL);
+    int sig=g_server_term;g_server_term=0;if(sig){fflush(stdout);raise(sig);}
+    return val_null();
+#else
+    printf("Server listening on port %d (Ctrl+C to stop)\n",g_server->port);fflush(stdout);
+    server_run(g_server);return val_null();
+#endif
+}
 
 static Value *bi_serverStop(Value **a,int n){(void)a;(void)n;if(g_server)g_server->running=0;return val_bool(1);}
 
+/* Workers
+   A worker is a forked copy of the interpreter: it starts with every function, class and
+   global the parent had, and runs on its own core without sharing anything mutable with the
+   parent. Values cross over a socketpair deep-copied, one frame per message:
+   u32 length, a kind byte ('M' message, 'R' result, 'C' chunk, 'Q' quit), the packed value. */
+static void pack_u32(StrBuf *b,uint32_t x) { sb_append(b,(char*)&x,4); }
+static void pack_str(StrBuf *b,const char *s,uint32_t n) { pack_u32(b,n); sb_append(b,s,n); }
+static void val_pack(Value *v,StrBuf *b) {
+    switch(v->type){
+        case V_NULL:sb_append(b,"n",1);return;
+        case V_BOOL:sb_append(b,v->as.b?"t":"f",1);return;
+        case V_INT:sb_append(b,"i",1);sb_append(b,(char*)&v->as.i,8);return;
+        case V_FLOAT:sb_append(b,"d",1);sb_append(b,(char*)&v->as.f,8);return;
+        case V_STRING:sb_append(b,"s",1);pack_str(b,v->as.s,str_len(v));return;
+        case V_ARRAY:sb_append(b,"a",1);pack_u32(b,v->as.arr->len);for(int i=0;i<v->as.arr->len;i++)val_pack(v->as.arr->items[i],b);return;
+        case V_OBJECT:case V_INSTANCE:{Object *o=v->type==V_OBJECT?v->as.obj:v->as.inst->props;
+            if(v->type==V_INSTANCE){sb_append(b,"c",1);pack_str(b,v->as.inst->cd->name,strlen(v->as.inst->cd->name));}
+            else sb_append(b,"o",1);
+            pack_u32(b,o->count);for(int i=0;i<o->count;i++){pack_str(b,o->pairs[i].key,strlen(o->pairs[i].key));val_pack(o->pairs[i].val,b);}return;}
+        case V_TYPED:sb_append(b,v->as.ta->kind==TA_F64?"F":"I",1);pack_u32(b,v->as.ta->len);sb_append(b,v->as.ta->d.p,v->as.ta->len*8);return;
+        case V_MAP:case V_SET:{HMap *m=v->as.map;sb_append(b,v->type==V_MAP?"M":"S",1);pack_u32(b,m->live);
+            for(int i=0;i<m->n;i++)if(m->ents[i].key){val_pack(m->ents[i].key,b);if(v->type==V_MAP)val_pack(m->ents[i].val,b);}
+            return;}
+        default:runtime_error(g_line,"cannot pass a %s to a worker",g_type_names[v->type]);
+    }
+}
+static uint32_t unpack_u32(const char **p) { uint32_t x; memcpy(&x,*p,4); *p+=4; return x; }
+static Value *val_unpack(const char **p) {
+    char t=*(*p)++;uint32_t n;Value *v;
+    switch(t){
+        case 't':case 'f':return val_bool(t=='t');
+        case 'i':{long long x;memcpy(&x,*p,8);*p+=8;return val_int(x);}
+        case 'd':{double x;memcpy(&x,*p,8);*p+=8;return val_float(x);}
+        case 's':n=unpack_u32(p);v=val_string_n(*p,n);*p+=n;return v;
+        case 'a':n=unpack_u32(p);v=val_array(n);for(uint32_t i=0;i<n;i++){Value *x=val_unpack(p);arr_push(v,x);val_decref(x);}return v;
+        case 'o':case 'c':{Object *o;
+            if(t=='c'){n=unpack_u32(p);char name[256];snprintf(name,sizeof(name),"%.*s",(int)n,*p);*p+=n;ClassDef *cd=class_find(name);v=cd?val_instance(cd):val_object();o=cd?v->as.inst->props:v->as.obj;}
+            else{v=val_object();o=v->as.obj;}
+            n=unpack_u32(p);for(uint32_t i=0;i<n;i++){uint32_t kn=unpack_u32(p);char *key=xstrndup(*p,kn);*p+=kn;Value *x=val_unpack(p);obj_put(o,key,x);val_decref(x);free(key);}
+            return v;}
+        case 'F':case 'I':n=unpack_u32(p);v=ta_new(t=='F'?TA_F64:TA_I64,n);memcpy(v->as.ta->d.p,*p,n*8);*p+=n*8;return v;
+        case 'M':case 'S':n=unpack_u32(p);v=hmap_new(t=='M'?V_MAP:V_SET);
+            for(uint32_t i=0;i<n;i++){Value *k=val_unpack(p),*x=t=='M'?val_unpack(p):val_null();hmap_set(v->as.map,k,x);val_decref(k);val_decref(x);}
+            return v;
+        default:return val_null();
+    }
+}
+static int frame_send(int fd,char kind,Value *v) {
+    StrBuf b;sb_init(&b);pack_u32(&b,0);sb_append(&b,&kind,1);if(v)val_pack(v,&b);
+    uint32_t len=STR_HDR(b.s)->len-4;memcpy(b.s,&len,4);
+    size_t off=0,total=len+4;int ok=1;
+    while(off<total){ssize_t k=write(fd,b.s+off,total-off);if(k<0&&errno==EINTR)continue;if(k<=0){ok=0;break;}off+=k;}
+    str_free(b.s);return ok;
+}
+static int read_full(int fd,char *p,size_t n) {
+    while(n){ssize_t k=read(fd,p,n);if(k<0&&errno==EINTR)continue;if(k<=0)return 0;p+=k;n-=k;}
+    return 1;
+}
+/* Next frame from fd; NULL at EOF (the other side exited or closed its end) */
+static Value *frame_recv(int fd,char *kind) {
+    uint32_t len;if(!read_full(fd,(char*)&len,4)||!len)return NULL;
+    char *buf=xmalloc(len);if(!read_full(fd,buf,len)){free(buf);return NULL;}
+    const char *p=buf+1;*kind=buf[0];Value *v=len>1?val_unpack(&p):val_null();free(buf);return v;
+}
+static int g_worker_fd=-1; /* in a worker: its end of the channel to the parent */
+#ifndef _WIN32
+/* fds of this process's own workers, closed in children so a closed channel reads as EOF */
+static int *g_worker_fds=NULL,g_worker_fd_n=0;
+static void worker_fd_track(int fd,int add) {
+    if(add){g_worker_fds=xrealloc(g_worker_fds,sizeof(int)*(g_worker_fd_n+1));g_worker_fds[g_worker_fd_n++]=fd;return;}
+    for(int i=0;i<g_worker_fd_n;i++)if(g_worker_fds[i]==fd){g_worker_fds[i]=g_worker_fds[--g_worker_fd_n];return;}
+}
+/* Fork a child joined to the parent by a socketpair; returns the pid, and the parent's end in *fd */
+static pid_t worker_fork(int *fd) {
+    int sv[2];if(socketpair(AF_UNIX,SOCK_STREAM,0,sv)<0)return -1;
+    signal(SIGPIPE,SIG_IGN);fflush(stdout);fflush(stderr);
+    pid_t pid=fork();
+    if(pid<0){close(sv[0]);close(sv[1]);return -1;}
+    if(pid==0){
+#ifdef __linux__
+        prctl(PR_SET_PDEATHSIG,SIGTERM);
+#endif
+        for(int i=0;i<g_worker_fd_n;i++)close(g_worker_fds[i]);
+        g_worker_fd_n=0;close(sv[0]);g_worker_fd=sv[1];return 0;}
+    close(sv[1]);*fd=sv[0];worker_fd_track(sv[0],1);return pid;
+}
+static void worker_exit(void) { fflush(stdout); fflush(stderr); _exit(0); }
+#endif
+
+/* Worker(fn, ...args) runs fn(...args) in a worker; Worker("script.jm") runs a script there.
+   Inside, workerRecv()/workerSend(v) talk to the parent; in the parent, w.send(v)/w.recv()
+   talk to the worker and w.join() waits for fn's return value. */
+static Value *bi_Worker(Value **a,int n){
+    if(n<1||(a[0]->type!=V_CLOSURE&&a[0]->type!=V_FUNC&&a[0]->type!=V_STRING))runtime_error(g_line,"Worker() expects a function or a script path");
+#ifdef _WIN32
+    runtime_error(g_line,"Worker() needs fork(), which this platform lacks");return val_null();
+#else
+    int fd;pid_t pid=worker_fork(&fd);if(pid<0)return val_null();
+    if(pid==0){Value *r;
+        if(a[0]->type==V_STRING){char *path=resolve_path(a[0]->as.s,g_dir);r=do_import(path,"worker");free(path);val_decref(r);r=val_null();}
+        else r=call_closure(a[0],a+1,n-1);
+        frame_send(g_worker_fd,'R',r);worker_exit();}
+    Value *v=val_new(V_WORKER);v->as.wk=xmalloc(sizeof(WorkerH));v->as.wk->pid=pid;v->as.wk->fd=fd;v->as.wk->alive=1;v->as.wk->result=NULL;return v;
+#endif
+}
+static void worker_close(WorkerH *w,int kill_it) {
+#ifndef _WIN32
+    if(w->fd>=0){close(w->fd);worker_fd_track(w->fd,0);w->fd=-1;}
+    if(w->alive){if(kill_it)kill(w->pid,SIGTERM);waitpid(w->pid,NULL,0);w->alive=0;}
+#else
+    (void)w;(void)kill_it;
+#endif
+}
+/* Wait up to ms (-1: forever) for fd to become readable */
+static int fd_wait(int fd,int ms) { struct pollfd pf;pf.fd=fd;pf.events=POLLIN;pf.revents=0; return ms<0||poll(&pf,1,ms)>0; }
+/* Next message from the worker, or null once it has finished (its result is kept for join) */
+static Value *worker_recv(WorkerH *w,int ms) {
+    if(w->fd<0||!fd_wait(w->fd,ms))return val_null();
+    char kind;Value *v=frame_recv(w->fd,&kind);
+    if(!v){worker_close(w,0);return val_null();}
+    if(kind=='R'){w->result=v;worker_close(w,0);return val_null();}
+    return v;
+}
+static Value *worker_method(Value *obj,int mid,Value **args,int argc) {
+    WorkerH *w=obj->as.wk;
+    switch(mid){
+        case M_send:return val_bool(argc>=1&&w->fd>=0&&frame_send(w->fd,'M',args[0]));
+        case M_recv:return worker_recv(w,argc>=1?(int)val_tonum(args[0]):-1);
+        case M_join:while(w->fd>=0)val_decref(worker_recv(w,-1));
+            if(w->result){val_incref(w->result);return w->result;}
+            return val_null();
+        case M_close:worker_close(w,1);return val_null();
+        default:return val_null();
+    }
+}
+static Value *bi_workerSend(Value **a,int n){if(g_worker_fd<0)runtime_error(g_line,"workerSend() outside of a worker");return val_bool(n>=1&&frame_send(g_worker_fd,'M',a[0]));}
+static Value *bi_workerRecv(Value **a,int n){
+    if(g_worker_fd<0)runtime_error(g_line,"workerRecv() outside of a worker");
+    if(!fd_wait(g_worker_fd,n>=1?(int)val_tonum(a[0]):-1))return val_null();
+    char kind;Value *v=frame_recv(g_worker_fd,&kind);return v?v:val_null();
+}
+
+/* parallelMap(arr, fn, {threads, chunk}) / parallelFor(n | arr, fn, {threads, chunk})
+   fn(item, index) (fn(index) for a count) runs in `threads` workers, one per CPU by default.
+   Work goes out in chunks that shrink as it runs out (a quarter of the remainder per worker,
+   at least `chunk`), each to whichever worker is idle, so uneven items still balance. */
+static Value *parallel_call(Value *src,long long i,Value *fn) {
+    if(src->type!=V_ARRAY){Value *x=val_int(i),*r=call_closure(fn,&x,1);val_decref(x);return r;}
+    Value *x=val_int(i),*args[2]={src->as.arr->items[i],x},*r=call_closure(fn,args,2);val_decref(x);return r;
+}
+#ifndef _WIN32
+typedef struct { int *fds,threads,busy,failed; long long *lo,next,len,min_chunk; } ParRun;
+/* Send worker w its next chunk, or tell it to quit when the work is all handed out */
+static void par_dispatch(ParRun *p,int w) {
+    if(p->next>=p->len){frame_send(p->fds[w],'Q',NULL);p->lo[w]=-1;return;}
+    long long k=(p->len-p->next)/(p->threads*4);
+    if(k<p->min_chunk)k=p->min_chunk;
+    if(k>p->len-p->next)k=p->len-p->next;
+    Value *m=val_array(2),*x=val_int(p->next),*y=val_int(p->next+k);arr_push(m,x);arr_push(m,y);val_decref(x);val_decref(y);
+    p->lo[w]=p->next;p->next+=k;p->busy++;if(!frame_send(p->fds[w],'C',m))p->failed=1;
+    val_decref(m);
+}
+#endif
+static Value *parallel_run(Value **a,int n,int keep,const char *name) {
+    if(n<2||(a[1]->type!=V_CLOSURE&&a[1]->type!=V_FUNC)||(a[0]->type!=V_ARRAY&&a[0]->type!=V_INT&&a[0]->type!=V_FLOAT))runtime_error(g_line,"%s() expects (%s, fn[, options])",name,keep?"array":"count or array");
+    Value *src=a[0],*fn=a[1],*opts=n>=3&&a[2]->type==V_OBJECT?a[2]:NULL,*tv=opts?obj_get(opts,"threads"):NULL,*cv=opts?obj_get(opts,"chunk"):NULL;
+    long long len=src->type==V_ARRAY?src->as.arr->len:(long long)val_tonum(src),min_chunk=cv?(long long)val_tonum(cv):1;
+    int threads=tv?(int)val_tonum(tv):0;
+    Value *out=val_array(keep&&len>0?(int)len:1);
+    if(keep)for(long long i=0;i<len;i++)arr_push(out,val_null());
+    /* fn always runs in a worker, even with one thread, so its side effects never depend on
+       the CPU count; only Windows, which has no fork(), runs it in-process */
+#ifdef _WIN32
+    int inproc=1;
+#else
+    if(threads<=0)threads=(int)sysconf(_SC_NPROCESSORS_ONLN);
+    int inproc=len<=0;
+#endif
+    if(threads>len)threads=(int)len;
+    if(min_chunk<1)min_chunk=1;
+    if(inproc){
+        for(long long i=0;i<len;i++){Value *r=parallel_call(src,i,fn);if(keep){val_decref(out->as.arr->items[i]);out->as.arr->items[i]=r;}else val_decref(r);}
+        if(keep)return out;
+        val_decref(out);return val_int(len);}
+#ifndef _WIN32
+    pid_t *pids=xmalloc(sizeof(pid_t)*threads);struct pollfd *pf=xmalloc(sizeof(struct pollfd)*threads);
+    ParRun p;p.fds=xmalloc(sizeof(int)*threads);p.lo=xmalloc(sizeof(long long)*threads);p.next=0;p.len=len;p.min_chunk=min_chunk;p.busy=p.failed=0;
+    for(int w=0;w<threads;w++){
+        pids[w]=worker_fork(&p.fds[w]);
+        if(pids[w]<0){threads=w;break;}
+        if(pids[w]>0)continue;
+        /* worker: run the chunks it is sent until told to quit */
+        char kind;Value *m;
+        while((m=frame_recv(g_worker_fd,&kind))&&kind=='C'){
+            long long from=m->as.arr->items[0]->as.i,to=m->as.arr->items[1]->as.i;val_decref(m);
+            Value *res=val_array(keep?(int)(to-from):1);
+            for(long long i=from;i<to;i++){Value *r=parallel_call(src,i,fn);if(keep)arr_push(res,r);val_decref(r);}
+            fflush(stdout);int ok=frame_send(g_worker_fd,'R',res);val_decref(res);
+            if(!ok)break;}
+        if(m)val_decref(m);
+        worker_exit();}
+    if(!threads)runtime_error(g_line,"%s(): cannot start workers",name);
+    p.threads=threads;
+    for(int w=0;w<threads;w++)par_dispatch(&p,w);
+    while(p.busy&&!p.failed){
+        for(int w=0;w<threads;w++){pf[w].fd=p.lo[w]>=0?p.fds[w]:-1;pf[w].events=POLLIN;pf[w].revents=0;}
+        if(poll(pf,threads,-1)<0){if(errno==EINTR)continue;p.failed=1;break;}
+        for(int w=0;w<threads&&!p.failed;w++){if(!pf[w].revents||p.lo[w]<0)continue;
+            char kind;Value *res=frame_recv(p.fds[w],&kind);p.busy--;
+            if(!res||kind!='R'){if(res)val_decref(res);p.failed=1;break;}
+            if(keep)for(int j=0;j<res->as.arr->len;j++){Value **slot=&out->as.arr->items[p.lo[w]+j];val_decref(*slot);*slot=res->as.arr->items[j];val_incref(*slot);}
+            val_decref(res);par_dispatch(&p,w);}}
+    for(int w=0;w<threads;w++){close(p.fds[w]);worker_fd_track(p.fds[w],0);if(p.failed)kill(pids[w],SIGTERM);waitpid(pids[w],NULL,0);}
+    free(pids);free(pf);free(p.fds);free(p.lo);
+    if(p.failed){val_decref(out);runtime_error(g_line,"%s(): a worker failed",name);}
+    if(keep)return out;
+    val_decref(out);return val_int(len);
+#endif
+    return out;
+}
+static Value *bi_parallelMap(Value **a,int n){return parallel_run(a,n,1,"parallelMap");}
+static Value *bi_parallelFor(Value **a,int n){return parallel_run(a,n,0,"parallelFor");}
+
 /* Closure calling */
-static Value *call_closure(Value *closure,Value **args,int argc){if(!closure)return val_null();if(closure->type==V_FUNC){FuncDef *fn=func_find(closure->as.s);if(!fn)return val_null();Scope *fn_scope=scope_new(fn->closure?fn->closure:g_global);Scope *prev=g_scope;g_scope=fn_scope;for(int i=0;i<fn->param_n;i++)scope_def(fn_scope,fn->params[i],(i<argc)?args[i]:val_null(),0);g_return=0;g_retval=NULL;eval(fn->body);Value *result=g_retval?g_retval:val_null();g_return=0;g_retval=NULL;g_scope=prev;scope_free(fn_scope);return result;}if(closure->type==V_CLOSURE){Closure *cl=closure->as.cl;Scope *fn_scope=scope_new(cl->env?cl->env:g_global);Scope *prev=g_scope;g_scope=fn_scope;for(int i=0;i<cl->param_n;i++)scope_def(fn_scope,cl->params[i],(i<argc)?args[i]:val_null(),0);g_return=0;g_retval=NULL;eval(cl->body);Value *result=g_retval?g_retval:val_null();g_return=0;g_retval=NULL;g_scope=prev;scope_free(fn_scope);return result;}return val_null();}
+static Value *call_funcdef(FuncDef *fn,Value **args,int argc){if(fn->body->is_gen&&!g_gen_enter){Value *f=val_func(fn->name),*g=gen_new(f,NULL,NULL,args,argc);val_decref(f);return g;}g_gen_enter=0;if(g_use_vm)return vm_call(fn->body,fn->params,fn->param_n,args,argc);Scope *fn_scope=scope_new(fn->closure?fn->closure:g_global);Scope *prev=g_scope;g_scope=fn_scope;for(int i=0;i<fn->param_n;i++)scope_def(fn_scope,fn->params[i],(i<argc)?args[i]:val_null(),0);Value *result=run_body(fn->body);g_scope=prev;scope_free(fn_scope);return result;}
+static Value *call_closure(Value *closure,Value **args,int argc){if(!closure)return val_null();if(closure->type==V_FUNC){FuncDef *fn=func_find(closure->as.s);if(!fn)return val_null();return call_funcdef(fn,args,argc);}if(closure->type==V_CLOSURE){Closure *cl=closure->as.cl;if(cl->body->is_gen&&!g_gen_enter)return gen_new(closure,NULL,NULL,args,argc);g_gen_enter=0;if(g_use_vm){Scope *prev=g_scope;g_scope=g_global;Value *result=vm_exec(cl->body->chunk,args,argc,cl->upvals);g_scope=prev;return result;}Scope *fn_scope=scope_new(cl->env?cl->env:g_global);Scope *prev=g_scope;g_scope=fn_scope;for(int i=0;i<cl->param_n;i++)scope_def(fn_scope,cl->params[i],(i<argc)?args[i]:val_null(),0);Value *result=run_body(cl->body);g_scope=prev;scope_free(fn_scope);return result;}return val_null();}
+static Value *call_method_body(Value *inst,Method *m,Value **args,int argc){if(m->body->is_gen&&!g_gen_enter)return gen_new(NULL,inst,m,args,argc);g_gen_enter=0;Value *saved_this=g_this;g_this=inst;if(g_use_vm){Value *result=vm_call(m->body,m->params,m->param_n,args,argc);g_this=saved_this;return result;}Scope *meth_scope=scope_new(g_global);Scope *prev=g_scope;g_scope=meth_scope;for(int i=0;i<m->param_n;i++)scope_def(meth_scope,m->params[i],(i<argc)?args[i]:val_null(),0);Value *result=run_body(m->body);g_scope=prev;scope_free(meth_scope);g_this=saved_this;return result;}
 
 /* Array methods */
 static Value *array_map(Value *arr,Value **args,int argc){if(argc<1||(args[0]->type!=V_CLOSURE&&args[0]->type!=V_FUNC))return val_array(0);Value *result=val_array(arr->as.arr->len);for(int i=0;i<arr->as.arr->len;i++){Value *item=arr->as.arr->items[i];Value *idx=val_int(i);Value *cbArgs[3]={item,idx,arr};Value *mapped=call_closure(args[0],cbArgs,3);arr_push(result,mapped);val_decref(mapped);val_decref(idx);}return result;}
@@ -553,62 +2851,102 @@ static Value *array_some(Value *arr,Value **args,int argc){if(argc<1||(args[0]->
 static Value *array_includes(Value *arr,Value **args,int argc){if(argc<1)return val_bool(0);for(int i=0;i<arr->as.arr->len;i++){Value *item=arr->as.arr->items[i];if(item->type==args[0]->type){if(item->type==V_INT&&item->as.i==args[0]->as.i)return val_bool(1);if(item->type==V_STRING&&strcmp(item->as.s,args[0]->as.s)==0)return val_bool(1);if(item->type==V_FLOAT&&item->as.f==args[0]->as.f)return val_bool(1);if(item->type==V_BOOL&&item->as.b==args[0]->as.b)return val_bool(1);}}return val_bool(0);}
 
 /* Method dispatcher */
-static Value *call_method(Value *obj,const char *method,Value **args,int argc){
-    if(obj->type==V_ARRAY){
-        if(strcmp(method,"map")==0)return array_map(obj,args,argc);
-        if(strcmp(method,"filter")==0)return array_filter(obj,args,argc);
-        if(strcmp(method,"reduce")==0)return array_reduce(obj,args,argc);
-        if(strcmp(method,"forEach")==0)return array_forEach(obj,args,argc);
-        if(strcmp(method,"find")==0)return array_find(obj,args,argc);
-        if(strcmp(method,"findIndex")==0)return array_findIndex(obj,args,argc);
-        if(strcmp(method,"every")==0)return array_every(obj,args,argc);
-        if(strcmp(method,"some")==0)return array_some(obj,args,argc);
-        if(strcmp(method,"includes")==0)return array_includes(obj,args,argc);
-        if(strcmp(method,"push")==0&&argc>=1){arr_push(obj,args[0]);return val_int(obj->as.arr->len);}
-        if(strcmp(method,"pop")==0)return arr_pop(obj);
-        if(strcmp(method,"len")==0)return val_int(obj->as.arr->len);
-        if(strcmp(method,"join")==0){Value *a[2]={obj,(argc>=1)?args[0]:val_string(",")};return bi_join(a,2);}
-        if(strcmp(method,"reverse")==0){Value *a[1]={obj};return bi_reverse(a,1);}
-        if(strcmp(method,"sort")==0){Value *a[1]={obj};return bi_sort(a,1);}
-        if(strcmp(method,"slice")==0){Value *a[3]={obj,(argc>=1)?args[0]:val_int(0),(argc>=2)?args[1]:val_int(INT_MAX)};return bi_slice(a,argc+1);}
-        if(strcmp(method,"indexOf")==0&&argc>=1){Value *a[2]={obj,args[0]};return bi_indexOf(a,2);}
-    }
-    if(obj->type==V_STRING){
-        if(strcmp(method,"upper")==0){Value *a[1]={obj};return bi_upper(a,1);}
-        if(strcmp(method,"lower")==0){Value *a[1]={obj};return bi_lower(a,1);}
-        if(strcmp(method,"trim")==0){Value *a[1]={obj};return bi_trim(a,1);}
-        if(strcmp(method,"split")==0){Value *a[2]={obj,(argc>=1)?args[0]:val_string(" ")};return bi_split(a,2);}
-        if(strcmp(method,"replace")==0&&argc>=2){Value *a[3]={obj,args[0],args[1]};return bi_replace(a,3);}
-        if(strcmp(method,"substring")==0||strcmp(method,"slice")==0){Value *a[3]={obj,(argc>=1)?args[0]:val_int(0),(argc>=2)?args[1]:val_int(INT_MAX)};return bi_slice(a,argc+1);}
-        if(strcmp(method,"indexOf")==0&&argc>=1){Value *a[2]={obj,args[0]};return bi_indexOf(a,2);}
-        if(strcmp(method,"includes")==0&&argc>=1){char *found=strstr(obj->as.s,val_tostr(args[0]));return val_bool(found!=NULL);}
-        if(strcmp(method,"startsWith")==0&&argc>=1){return val_bool(strncmp(obj->as.s,val_tostr(args[0]),strlen(val_tostr(args[0])))==0);}
-        if(strcmp(method,"endsWith")==0&&argc>=1){int sl=strlen(obj->as.s),suffl=strlen(val_tostr(args[0]));if(suffl>sl)return val_bool(0);return val_bool(strcmp(obj->as.s+sl-suffl,val_tostr(args[0]))==0);}
-        if(strcmp(method,"charAt")==0&&argc>=1){int idx=(int)val_tonum(args[0]);if(idx<0||(size_t)idx>=strlen(obj->as.s))return val_string("");char c[2]={obj->as.s[idx],'\0'};return val_string(c);}
-        if(strcmp(method,"len")==0)return val_int(strlen(obj->as.s));
-    }
-    if(obj->type==V_OBJECT||obj->type==V_MODULE){
-        if(strcmp(method,"keys")==0){Value *a[1]={obj};return bi_keys(a,1);}
-        if(strcmp(method,"values")==0){Value *a[1]={obj};return bi_values(a,1);}
-        if(strcmp(method,"entries")==0){Value *arr=val_array(obj->as.obj->count);for(int i=0;i<obj->as.obj->count;i++){Value *pair=val_array(2);Value *k=val_string(obj->as.obj->pairs[i].key);Value *v=val_copy(obj->as.obj->pairs[i].val);arr_push(pair,k);arr_push(pair,v);val_decref(k);val_decref(v);arr_push(arr,pair);val_decref(pair);}return arr;}
-        if(strcmp(method,"hasOwnProperty")==0&&argc>=1){return val_bool(obj_has(obj,val_tostr(args[0])));}
-        if(strcmp(method,"len")==0)return val_int(obj->as.obj->count);
+static Value *call_method_id(Value *obj,int mid,Value **args,int argc){
+    if(obj->type==V_ARRAY)switch(mid){
+        case M_map:return array_map(obj,args,argc);
+        case M_filter:return array_filter(obj,args,argc);
+        case M_reduce:return array_reduce(obj,args,argc);
+        case M_forEach:return array_forEach(obj,args,argc);
+        case M_find:return array_find(obj,args,argc);
+        case M_findIndex:return array_findIndex(obj,args,argc);
+        case M_every:return array_every(obj,args,argc);
+        case M_some:return array_some(obj,args,argc);
+        case M_includes:return array_includes(obj,args,argc);
+        case M_push:if(argc>=1){arr_push(obj,args[0]);return val_int(obj->as.arr->len);} break;
+        case M_pop:return arr_pop(obj);
+        case M_len:return val_int(obj->as.arr->len);
+        case M_join:{Value *a[2]={obj,(argc>=1)?args[0]:val_string(",")};return bi_join(a,2);}
+        case M_reverse:{Value *a[1]={obj};return bi_reverse(a,1);}
+        case M_sort:{Value *a[3]={obj,argc>=1?args[0]:val_null(),argc>=2?args[1]:val_null()};return bi_sort(a,argc+1>3?3:argc+1);}
+        case M_sortBy:{Value *a[3]={obj,argc>=1?args[0]:val_null(),argc>=2?args[1]:val_null()};return bi_sortBy(a,argc+1>3?3:argc+1);}
+        case M_slice:{Value *a[3]={obj,(argc>=1)?args[0]:val_int(0),(argc>=2)?args[1]:val_int(INT_MAX)};return bi_slice(a,argc+1);}
+        case M_indexOf:if(argc>=1){Value *a[2]={obj,args[0]};return bi_indexOf(a,2);} break;
+        default:break;
+    }
+    if(obj->type==V_STRING)switch(mid){
+        case M_upper:{Value *a[1]={obj};return bi_upper(a,1);}
+        case M_lower:{Value *a[1]={obj};return bi_lower(a,1);}
+        case M_trim:{Value *a[1]={obj};return bi_trim(a,1);}
+        case M_split:{Value *a[2]={obj,(argc>=1)?args[0]:val_string(" ")};return bi_split(a,2);}
+        case M_replace:if(argc>=2){Value *a[3]={obj,args[0],args[1]};return bi_replace(a,3);} break;
+        case M_substring:case M_slice:{Value *a[3]={obj,(argc>=1)?args[0]:val_int(0),(argc>=2)?args[1]:val_int(INT_MAX)};return bi_slice(a,argc+1);}
+        case M_indexOf:if(argc>=1){Value *a[2]={obj,args[0]};return bi_indexOf(a,2);} break;
+        case M_includes:if(argc>=1){char *found=strstr(obj->as.s,val_tostr(args[0]));return val_bool(found!=NULL);} break;
+        case M_startsWith:if(argc>=1){return val_bool(strncmp(obj->as.s,val_tostr(args[0]),strlen(val_tostr(args[0])))==0);} break;
+        case M_endsWith:if(argc>=1){int sl=strlen(obj->as.s),suffl=strlen(val_tostr(args[0]));if(suffl>sl)return val_bool(0);return val_bool(strcmp(obj->as.s+sl-suffl,val_tostr(args[0]))==0);} break;
+        case M_charAt:if(argc>=1){int idx=(int)val_tonum(args[0]);if(idx<0||(size_t)idx>=strlen(obj->as.s))return val_string("");char c[2]={obj->as.s[idx],'\0'};return val_string(c);} break;
+        case M_len:return val_int(str_len(obj));
+        default:break;
+    }
+    if(obj->type==V_TYPED)return ta_method(obj,mid,args,argc);
+    if(obj->type==V_MAP||obj->type==V_SET||obj->type==V_DEQUE)return coll_method(obj,mid,args,argc);
+    if(obj->type==V_PQ)return pq_method(obj,mid,args,argc);
+    if(obj->type==V_GRAPH)return csr_method(obj,mid,args,argc);
+    if(obj->type==V_ITER)return iter_method(obj,mid,args,argc);
+    if(obj->type==V_FILE)return file_method(obj,mid,args,argc);
+    if(obj->type==V_WORKER)return worker_method(obj,mid,args,argc);
+    if(obj->type==V_BUILDER)switch(mid){
+        case M_append:case M_appendLine:{for(int i=0;i<argc;i++)str_append_val(obj,args[i]);if(mid==M_appendLine)str_append(obj,"\n",1);val_incref(obj);return obj;}
+        case M_length:case M_len:return val_int(str_len(obj));
+        case M_toString:return val_string_n(obj->as.s,str_len(obj));
+        case M_clear:{STR_HDR(obj->as.s)->len=0;obj->as.s[0]='\0';val_incref(obj);return obj;}
+        default:break;
+    }
+    if(obj->type==V_OBJECT||obj->type==V_MODULE)switch(mid){
+        case M_keys:{Value *a[1]={obj};return bi_keys(a,1);}
+        case M_values:{Value *a[1]={obj};return bi_values(a,1);}
+        case M_entries:{Value *arr=val_array(obj->as.obj->count);for(int i=0;i<obj->as.obj->count;i++){Value *pair=val_array(2);Value *k=val_string(obj->as.obj->pairs[i].key);Value *v=val_copy(obj->as.obj->pairs[i].val);arr_push(pair,k);arr_push(pair,v);val_decref(k);val_decref(v);arr_push(arr,pair);val_decref(pair);}return arr;}
+        case M_hasOwnProperty:if(argc>=1){return val_bool(obj_has(obj,val_tostr(args[0])));} break;
+        case M_len:return val_int(obj->as.obj->count);
+        default:break;
     }
     return val_null();
 }
 
-typedef struct{const char *name;Value *(*func)(Value**,int);}Builtin;
-static Builtin builtins[]={{"typeof",bi_typeof},{"keys",bi_keys},{"values",bi_values},{"push",bi_push},{"pop",bi_pop},{"input",bi_input},{"str",bi_str},{"int",bi_int_fn},{"float",bi_float_fn},{"chr",bi_chr},{"ord",bi_ord},{"range",bi_range},{"join",bi_join},{"split",bi_split},{"replace",bi_replace},{"indexOf",bi_indexOf},{"slice",bi_slice},{"reverse",bi_reverse},{"sort",bi_sort},{"abs",bi_abs},{"min",bi_min},{"max",bi_max},{"floor",bi_floor},{"ceil",bi_ceil},{"round",bi_round},{"sqrt",bi_sqrt},{"pow",bi_pow_fn},{"random",bi_random},{"randomInt",bi_randomInt},{"hasKey",bi_hasKey},{"delete",bi_delete},{"clone",bi_clone},{"isArray",bi_isArray},{"isObject",bi_isObject},{"isString",bi_isString},{"isNumber",bi_isNumber},{"isFunc",bi_isFunc},{"assert",bi_assert},{"sleep",bi_sleep},{"setTimeout",bi_setTimeout},{"setInterval",bi_setInterval},{"clearTimeout",bi_clearTimeout},{"clearInterval",bi_clearInterval},{"time",bi_time},{"now",bi_now},{"readFile",bi_readFile},{"writeFile",bi_writeFile},{"appendFile",bi_appendFile},{"fileExists",bi_fileExists},{"remove",bi_remove},{"mkdir",bi_mkdir},{"rename",bi_rename},{"jsonParse",bi_jsonParse},{"jsonStringify",bi_jsonStringify},{"httpGet",bi_httpGet},{"httpPost",bi_httpPost},{"httpPut",bi_httpPut},{"httpDelete",bi_httpDelete},{"httpPatch",bi_httpPatch},{"http",bi_http},{"createServer",bi_createServer},{"serverRoute",bi_serverRoute},{"serverListen",bi_serverListen},{"serverHandle",bi_serverHandle},{"serverStop",bi_serverStop},{NULL,NULL}};
+typedef struct{const char *name;BuiltinFn func;}Builtin;
+static Builtin builtins[]={{"typeof",bi_typeof},{"memStats",bi_memStats},{"StringBuilder",bi_StringBuilder},{"Float64Array",bi_Float64Array},{"Int64Array",bi_Int64Array},{"Map",bi_Map},{"Set",bi_Set},{"Deque",bi_Deque},{"PriorityQueue",bi_PriorityQueue},{"CsrGraph",bi_CsrGraph},{"gc",bi_gc},{"keys",bi_keys},{"values",bi_values},{"push",bi_push},{"pop",bi_pop},{"input",bi_input},{"str",bi_str},{"int",bi_int_fn},{"float",bi_float_fn},{"chr",bi_chr},{"ord",bi_ord},{"range",bi_range},{"join",bi_join},{"split",bi_split},{"replace",bi_replace},{"indexOf",bi_indexOf},{"slice",bi_slice},{"reverse",bi_reverse},{"sort",bi_sort},{"sortBy",bi_sortBy},{"abs",bi_abs},{"min",bi_min},{"max",bi_max},{"floor",bi_floor},{"ceil",bi_ceil},{"round",bi_round},{"sqrt",bi_sqrt},{"pow",bi_pow_fn},{"random",bi_random},{"randomInt",bi_randomInt},{"hasKey",bi_hasKey},{"delete",bi_delete},{"clone",bi_clone},{"isArray",bi_isArray},{"isObject",bi_isObject},{"isString",bi_isString},{"isNumber",bi_isNumber},{"isFunc",bi_isFunc},{"assert",bi_assert},{"sleep",bi_sleep},{"setTimeout",bi_setTimeout},{"setInterval",bi_setInterval},{"clearTimeout",bi_clearTimeout},{"clearInterval",bi_clearInterval},{"time",bi_time},{"now",bi_now},{"readFile",bi_readFile},{"open",bi_open},{"lines",bi_lines},{"iter",bi_iter},{"iterRange",bi_iterRange},{"take",bi_take},{"skip",bi_skip},{"zip",bi_zip},{"chain",bi_chain},{"mapIter",bi_mapIter},{"filterIter",bi_filterIter},{"parseCSV",bi_parseCSV},{"readCSV",bi_readCSV},{"writeCSV",bi_writeCSV},{"hashJoin",bi_hashJoin},{"groupAgg",bi_groupAgg},{"distinct",bi_distinct},{"countValues",bi_countValues},{"writeFile",bi_writeFile},{"appendFile",bi_appendFile},{"fileExists",bi_fileExists},{"remove",bi_remove},{"mkdir",bi_mkdir},{"rename",bi_rename},{"jsonParse",bi_jsonParse},{"jsonStringify",bi_jsonStringify},{"jsonStream",bi_jsonStream},{"readJsonLines",bi_readJsonLines},{"httpGet",bi_httpGet},{"httpPost",bi_httpPost},{"httpPut",bi_httpPut},{"httpDelete",bi_httpDelete},{"httpPatch",bi_httpPatch},{"http",bi_http},{"httpAll",bi_httpAll},{"createServer",bi_createServer},{"serverRoute",bi_serverRoute},{"serverListen",bi_serverListen},{"serverHandle",bi_serverHandle},{"serverStop",bi_serverStop},{"Worker",bi_Worker},{"workerSend",bi_workerSend},{"workerRecv",bi_workerRecv},{"parallelMap",bi_parallelMap},{"parallelFor",bi_parallelFor},{NULL,NULL}};
 
-static Value *call_func(const char *name,AST **args,int argc){
-    if(strcmp(name,"print")==0)return bi_print(args,argc);
-    Value **vals=xmalloc(sizeof(Value*)*(argc+1));for(int i=0;i<argc;i++)vals[i]=eval(args[i]);Value *result=NULL;
-    for(int i=0;builtins[i].name;i++){if(strcmp(name,builtins[i].name)==0){result=builtins[i].func(vals,argc);goto cleanup;}}
-    FuncDef *fn=func_find(name);if(!fn)runtime_error(g_line,"undefined function '%s'",name);
-    Scope *fn_scope=scope_new(fn->closure?fn->closure:g_global);Scope *prev=g_scope;g_scope=fn_scope;
-    for(int i=0;i<fn->param_n;i++)scope_def(fn_scope,fn->params[i],(i<argc)?vals[i]:val_null(),0);
-    g_return=0;g_retval=NULL;eval(fn->body);result=g_retval?g_retval:val_null();g_return=0;g_retval=NULL;g_scope=prev;scope_free(fn_scope);
-cleanup:for(int i=0;i<argc;i++)val_decref(vals[i]);free(vals);return result?result:val_null();
+static short g_builtin_tab[512]; static int g_builtin_init=0;
+static BuiltinFn builtin_find(const char *name){
+    if(!g_builtin_init){g_builtin_init=1;for(int b=0;builtins[b].name;b++){uint64_t i=str_hash(builtins[b].name)&511;while(g_builtin_tab[i])i=(i+1)&511;g_builtin_tab[i]=b+1;}}
+    for(uint64_t i=str_hash(name)&511;g_builtin_tab[i];i=(i+1)&511)if(strcmp(builtins[g_builtin_tab[i]-1].name,name)==0)return builtins[g_builtin_tab[i]-1].func;
+    return NULL;
+}
+static Value *call_named(const char *name,Value **vals,int argc){
+    FuncDef *fn=func_find(name);if(fn)return call_funcdef(fn,vals,argc); /* user functions shadow builtins */
+    BuiltinFn bi=builtin_find(name);if(!bi)runtime_error(g_line,"undefined function '%s'",name);
+    return bi(vals,argc);
+}
+/* The latest definition of name made in module mod */
+static FuncDef *func_find_mod(const char *name,int mod){
+    FuncDef *fn=mod<0?NULL:func_find(name);if(!fn||fn->mod==mod)return fn;
+    for(int i=g_func_n-1;i>=0;i--)if(g_funcs[i].mod==mod&&strcmp(g_funcs[i].name,name)==0)return &g_funcs[i];
+    return NULL;
+}
+/* Call a builtin bound at parse time, unless a function of the same name defined in the calling
+   module shadows it. Functions from other modules never do, and a function calling its own name
+   reaches the builtin, so a wrapper can share its builtin's name. The miss is cached per call
+   site until another function is defined. */
+static Value *call_bound(const char *name,BuiltinFn bi,unsigned *epoch,int mod,Value **vals,int argc){
+    if(bi&&*epoch!=g_func_epoch){FuncDef *fn=func_find_mod(name,mod);if(fn)return call_funcdef(fn,vals,argc);*epoch=g_func_epoch;}
+    return bi?bi(vals,argc):call_named(name,vals,argc);
+}
+static Value *call_func(const char *name,AST *node,AST **args,int argc){
+    BuiltinFn bi=node?node->bi:NULL;
+    if(!bi&&strcmp(name,"print")==0)return bi_print(args,argc);
+    Value **vals=xmalloc(sizeof(Value*)*(argc+1));for(int i=0;i<argc;i++)vals[i]=eval(args[i]);
+    Value *result=node?call_bound(name,bi,&node->bi_epoch,node->mod,vals,argc):call_named(name,vals,argc);
+    for(int i=0;i<argc;i++)val_decref(vals[i]);free(vals);return result;
 }
 
 /* Import */
@@ -617,19 +2955,82 @@ static char *get_dir(const char *path){char *dir=xstrdup(path);char *sep=strrchr
 static char *resolve_path(const char *imp,const char *cur){if(imp[0]=='/'||(strlen(imp)>1&&imp[1]==':'))return xstrdup(imp);char resolved[4096];if(cur&&strlen(cur)>0)snprintf(resolved,sizeof(resolved),"%s%c%s",cur,PATH_SEP,imp);else snprintf(resolved,sizeof(resolved),"%s",imp);return xstrdup(resolved);}
 
 static Value *do_import(const char *path,const char *alias){
-    for(int i=0;i<g_import_n;i++){if(strcmp(g_imports[i].path,path)==0){Value *mod=val_copy(g_imports[i].module);scope_def(g_scope,alias,mod,0);return mod;}}
+    for(int i=0;i<g_import_n;i++){if(strcmp(g_imports[i].path,path)==0)return val_copy(g_imports[i].module);}
     char *source=read_file(path);if(!source)runtime_error(g_line,"cannot import '%s'",path);
-    char *saved_src=g_src;int saved_pos=g_pos,saved_len=g_len,saved_line=g_line;const char *saved_file=g_file;Token saved_tok=g_tok;Scope *saved_scope=g_scope;int saved_funcs=g_func_n;
-    Value *module=val_module();Scope *mod_scope=scope_new(g_global);g_scope=mod_scope;g_src=source;g_len=strlen(source);g_pos=0;g_line=1;g_file=path;advance();AST *prog=parse_program();Value *r=eval(prog);val_decref(r);
+    char *saved_src=g_src;int saved_pos=g_pos,saved_len=g_len,saved_line=g_line;const char *saved_file=g_file;Token saved_tok=g_tok;Scope *saved_scope=g_scope;int saved_funcs=g_func_n,saved_mod=g_module;
+    g_module=++g_module_n;Value *module=val_module();Scope *mod_scope=scope_new(g_global);g_scope=mod_scope;g_src=source;g_len=strlen(source);g_pos=0;g_line=1;g_file=path;advance();AST *prog=parse_program();Value *r=g_use_vm?vm_exec(vm_compile(prog,0),NULL,0,NULL):eval(prog);val_decref(r);
     for(int i=0;i<mod_scope->count;i++)obj_set(module,mod_scope->syms[i].name,mod_scope->syms[i].val);
     for(int i=saved_funcs;i<g_func_n;i++){Value *fn=val_func(g_funcs[i].name);obj_set(module,g_funcs[i].name,fn);val_decref(fn);}
-    g_src=saved_src;g_pos=saved_pos;g_len=saved_len;g_line=saved_line;g_file=saved_file;g_tok=saved_tok;g_scope=saved_scope;free(source);
+    g_src=saved_src;g_pos=saved_pos;g_len=saved_len;g_line=saved_line;g_file=saved_file;g_tok=saved_tok;g_scope=saved_scope;g_module=saved_mod;free(source);
     if(g_import_n<MAX_IMPORTS){g_imports[g_import_n].path=xstrdup(path);g_imports[g_import_n].alias=xstrdup(alias);val_incref(module);g_imports[g_import_n++].module=module;}
-    scope_def(g_scope,alias,module,0);return module;
+    return module;
+}
+
+/* Operations shared by the evaluator and the VM */
+static int binop_code(const char *op){switch(op[0]){case '+':return BOP_ADD;case '-':return BOP_SUB;case '*':return op[1]=='*'?BOP_POW:BOP_MUL;case '/':return BOP_DIV;case '%':return BOP_MOD;case '<':return op[1]=='='?BOP_LE:BOP_LT;case '>':return op[1]=='='?BOP_GE:BOP_GT;case '=':return BOP_EQ;case '!':return BOP_NE;}return -1;}
+static int val_equal(Value *left,Value *right){if((left->type==V_INT||left->type==V_FLOAT)&&(right->type==V_INT||right->type==V_FLOAT))return val_tonum(left)==val_tonum(right);if(left->type!=right->type)return 0;switch(left->type){case V_NULL:return 1;case V_BOOL:return left->as.b==right->as.b;case V_INT:return left->as.i==right->as.i;case V_FLOAT:return left->as.f==right->as.f;case V_STRING:return strcmp(left->as.s,right->as.s)==0;default:return left==right;}}
+static Value *binop_apply(int op,Value *left,Value *right,int line){
+    if(left->type==V_TYPED||right->type==V_TYPED){Value *r=ta_binop(op,left,right);if(r)return r;}
+    int fl=(left->type==V_FLOAT||right->type==V_FLOAT);
+    switch(op){
+        case BOP_ADD:if(left->type==V_STRING||right->type==V_STRING)return str_concat(left,right);return fl?val_float(val_tonum(left)+val_tonum(right)):val_int(left->as.i+right->as.i);
+        case BOP_SUB:return fl?val_float(val_tonum(left)-val_tonum(right)):val_int(left->as.i-right->as.i);
+        case BOP_MUL:return fl?val_float(val_tonum(left)*val_tonum(right)):val_int(left->as.i*right->as.i);
+        case BOP_DIV:{double rv=val_tonum(right);if(rv==0)runtime_error(line,"division by zero");return val_float(val_tonum(left)/rv);}
+        case BOP_MOD:{double rv=val_tonum(right);if(rv==0)runtime_error(line,"modulo by zero");return fl?val_float(fmod(val_tonum(left),rv)):val_int((long long)val_tonum(left)%(long long)rv);}
+        case BOP_POW:return val_float(pow(val_tonum(left),val_tonum(right)));
+        case BOP_LT:return val_bool(val_tonum(left)<val_tonum(right));
+        case BOP_GT:return val_bool(val_tonum(left)>val_tonum(right));
+        case BOP_LE:return val_bool(val_tonum(left)<=val_tonum(right));
+        case BOP_GE:return val_bool(val_tonum(left)>=val_tonum(right));
+        case BOP_EQ:return val_bool(val_equal(left,right));
+        case BOP_NE:return val_bool(!val_equal(left,right));
+    }
+    return val_null();
+}
+static Value *compound_apply(char op,Value *current,Value *rhs,int line){
+    if(current->type==V_TYPED||rhs->type==V_TYPED){Value *r=ta_binop(op=='+'?BOP_ADD:op=='-'?BOP_SUB:op=='*'?BOP_MUL:op=='/'?BOP_DIV:BOP_MOD,current,rhs);if(r)return r;}
+    int fl=(current->type==V_FLOAT||rhs->type==V_FLOAT);
+    switch(op){
+        case '+':if(current->type==V_STRING||rhs->type==V_STRING)return str_concat(current,rhs);return fl?val_float(val_tonum(current)+val_tonum(rhs)):val_int((long long)val_tonum(current)+(long long)val_tonum(rhs));
+        case '-':return fl?val_float(val_tonum(current)-val_tonum(rhs)):val_int((long long)val_tonum(current)-(long long)val_tonum(rhs));
+        case '*':return fl?val_float(val_tonum(current)*val_tonum(rhs)):val_int((long long)val_tonum(current)*(long long)val_tonum(rhs));
+        case '/':{double rv=val_tonum(rhs);if(rv==0)runtime_error(line,"division by zero");return val_float(val_tonum(current)/rv);}
+        case '%':{double rv=val_tonum(rhs);if(rv==0)runtime_error(line,"modulo by zero");return fl?val_float(fmod(val_tonum(current),rv)):val_int((long long)val_tonum(current)%(long long)rv);}
+    }
+    return val_null();
+}
+static Value *compound_target(const char *name,int line){Symbol *sym=scope_find(g_scope,name);if(!sym)runtime_error(line,"undefined '%s'",name);if(sym->is_const)runtime_error(line,"cannot modify constant");return val_copy(sym->val);}
+static Value *incdec_at(Value **p,int delta,int post){Value *old=post?val_copy(*p):NULL;Value *nv=val_int((long long)val_tonum(*p)+delta);val_decref(*p);*p=nv;if(post)return old;val_incref(nv);return nv;}
+static Value *incdec_var(const char *name,int delta,int post,int line){Symbol *sym=scope_find(g_scope,name);if(!sym)runtime_error(line,"undefined '%s'",name);if(sym->is_const)runtime_error(line,"cannot modify constant");return incdec_at(&sym->val,delta,post);}
+static void assign_var(const char *name,Value *val,int is_const,int line){
+    if(is_const){scope_def(g_scope,name,val,1);return;}
+    Symbol *local=scope_find_local(g_scope,name);
+    if(local){if(local->is_const)runtime_error(line,"cannot reassign constant '%s'",name);val_decref(local->val);val_incref(val);local->val=val;return;}
+    Symbol *outer=scope_find(g_scope->parent,name);
+    if(outer&&!outer->is_const){val_decref(outer->val);val_incref(val);outer->val=val;}else scope_def(g_scope,name,val,0);
+}
+static Value *index_get(Value *container,Value *index){
+    if(container->type==V_ARRAY){Value *item=arr_get(container,(int)val_tonum(index));return item?val_copy(item):val_null();}
+    if(container->type==V_TYPED){TypedArr *t=container->as.ta;int idx=(int)val_tonum(index);if(idx<0)idx+=t->len;return idx>=0&&idx<t->len?ta_box(t,idx):val_null();}
+    if(container->type==V_OBJECT||container->type==V_MODULE){Value *item=obj_get(container,val_tostr(index));return item?val_copy(item):val_null();}
+    if(container->type==V_MAP){Value *item=hmap_get(container->as.map,index);return item?val_copy(item):val_null();}
+    if(container->type==V_DEQUE){Deque *d=container->as.dq;int idx=(int)val_tonum(index);if(idx<0)idx+=d->len;return idx>=0&&idx<d->len?val_copy(DQ_AT(d,idx)):val_null();}
+    if(container->type==V_STRING){int idx=(int)val_tonum(index);int len=strlen(container->as.s);if(idx<0)idx=len+idx;if(idx>=0&&idx<len){char c[2]={container->as.s[idx],'\0'};return val_string(c);}return val_string("");}
+    return val_null();
 }
+static Value *member_get(Value *obj,const char *name){Value *item=NULL;if(obj->type==V_OBJECT||obj->type==V_MODULE)item=obj_get(obj,name);else if(obj->type==V_INSTANCE)item=inst_get(obj,name);return item?val_copy(item):val_null();}
+static void index_set(Value *container,Value *index,Value *val){if(container->type==V_ARRAY)arr_set(container,(int)val_tonum(index),val);else if(container->type==V_TYPED){TypedArr *t=container->as.ta;int idx=(int)val_tonum(index);if(idx<0)idx+=t->len;if(idx>=0&&idx<t->len)ta_store(t,idx,val);}else if(container->type==V_OBJECT||container->type==V_MODULE)obj_set(container,val_tostr(index),val);else if(container->type==V_MAP)hmap_set(container->as.map,index,val);else if(container->type==V_DEQUE){Deque *d=container->as.dq;int idx=(int)val_tonum(index);if(idx<0)idx+=d->len;if(idx>=0&&idx<d->len){val_incref(val);val_decref(DQ_AT(d,idx));DQ_AT(d,idx)=val;}}}
+static void member_set(Value *obj,const char *name,Value *val){if(obj->type==V_OBJECT||obj->type==V_MODULE)obj_set(obj,name,val);else if(obj->type==V_INSTANCE)inst_set(obj,name,val);}
+static int case_eq(Value *sw,Value *cv){if(sw->type!=cv->type)return 0;switch(sw->type){case V_INT:return sw->as.i==cv->as.i;case V_FLOAT:return sw->as.f==cv->as.f;case V_STRING:return strcmp(sw->as.s,cv->as.s)==0;case V_BOOL:return sw->as.b==cv->as.b;default:return 0;}}
+static Value *closure_new(AST *node){Closure *cl=xmalloc(sizeof(Closure));memset(cl,0,sizeof(Closure));cl->name=NULL;cl->params=xmalloc(sizeof(char*)*node->param_n);cl->param_n=node->param_n;for(int i=0;i<node->param_n;i++)cl->params[i]=xstrdup(node->params[i]);cl->body=node->body;cl->is_arrow=1;return val_closure_new(cl);}
+/* Eval-mode closures share the live scope chain they were created in */
+static Value *make_closure(AST *node){Value *v=closure_new(node);v->as.cl->env=g_scope;g_scope->refs++;return v;}
+static Value *define_class(AST *node){ClassDef cd={0};cd.name=xstrdup(node->name);cd.parent=node->parent?xstrdup(node->parent):NULL;cd.methods=xmalloc(sizeof(Method)*node->method_n);cd.method_n=node->method_n;cd.method_cap=node->method_n;for(int i=0;i<node->method_n;i++){AST *m=node->methods[i];cd.methods[i].name=xstrdup(m->name);cd.methods[i].params=xmalloc(sizeof(char*)*m->param_n);cd.methods[i].param_n=m->param_n;for(int j=0;j<m->param_n;j++)cd.methods[i].params[j]=xstrdup(m->params[j]);cd.methods[i].body=m->body;}class_register(&cd);Value *cls=val_new(V_CLASS);cls->as.s=xstrdup(node->name);return cls;}
 
 /* Evaluator */
-static Value *eval_template(AST *node){char buf[MAX_STR];int pos=0;for(int i=0;i<node->tpl_n&&pos<MAX_STR-100;i++){TemplatePart *part=&node->tpl[i];if(part->is_expr){char *saved_src=g_src;int saved_pos=g_pos,saved_len=g_len,saved_line=g_line;Token saved_tok=g_tok;g_src=part->text;g_len=strlen(part->text);g_pos=0;advance();AST *expr=parse_expr();Value *val=eval(expr);const char *s=val_tostr(val);int len=strlen(s);if(pos+len<MAX_STR-1){memcpy(buf+pos,s,len);pos+=len;}val_decref(val);g_src=saved_src;g_pos=saved_pos;g_len=saved_len;g_line=saved_line;g_tok=saved_tok;}else{int len=strlen(part->text);if(pos+len<MAX_STR-1){memcpy(buf+pos,part->text,len);pos+=len;}}}buf[pos]='\0';return val_string(buf);}
+/* Template expressions were parsed into node->children, in order, when the template was parsed */
+static Value *eval_template(AST *node){StrBuf sb;sb_init(&sb);for(int i=0,e=0;i<node->tpl_n;i++){TemplatePart *part=&node->tpl[i];if(part->is_expr){Value *val=eval(node->children[e++]);sb_append_val(&sb,val);val_decref(val);}else sb_append(&sb,part->text,strlen(part->text));}return sb_value(&sb);}
 
 static Value *eval(AST *node){
     if(!node)return val_null();if(g_return||g_break||g_continue)return val_null();g_line=node->line;
@@ -640,14 +3041,18 @@ static Value *eval(AST *node){
         case AST_ARRAY:{Value *arr=val_array(node->child_n);for(int i=0;i<node->child_n;i++){Value *v=eval(node->children[i]);arr_push(arr,v);val_decref(v);}return arr;}
         case AST_OBJECT:{Value *obj=val_object();for(int i=0;i<node->child_n;i++){Value *v=eval(node->children[i]);obj_set(obj,node->keys[i],v);val_decref(v);}return obj;}
         case AST_VAR:{Symbol *sym=scope_find(g_scope,node->name);if(!sym){FuncDef *fn=func_find(node->name);if(fn)return val_func(node->name);runtime_error(node->line,"undefined variable '%s'",node->name);}if(sym->val->type==V_ARRAY||sym->val->type==V_OBJECT||sym->val->type==V_MODULE||sym->val->type==V_INSTANCE||sym->val->type==V_CLOSURE){val_incref(sym->val);return sym->val;}return val_copy(sym->val);}
-        case AST_INDEX:{Value *container=eval(node->left);Value *index=eval(node->right);Value *result=NULL;if(container->type==V_ARRAY){Value *item=arr_get(container,(int)val_tonum(index));result=item?val_copy(item):val_null();}else if(container->type==V_OBJECT||container->type==V_MODULE){Value *item=obj_get(container,val_tostr(index));result=item?val_copy(item):val_null();}else if(container->type==V_STRING){int idx=(int)val_tonum(index);int len=strlen(container->as.s);if(idx<0)idx=len+idx;if(idx>=0&&idx<len){char c[2]={container->as.s[idx],'\0'};result=val_string(c);}else result=val_string("");}val_decref(container);val_decref(index);return result?result:val_null();}
-        case AST_MEMBER:{Value *obj=eval(node->left);Value *result=NULL;if(obj->type==V_OBJECT||obj->type==V_MODULE){Value *item=obj_get(obj,node->name);result=item?val_copy(item):val_null();}else if(obj->type==V_INSTANCE){Value *prop=inst_get(obj,node->name);result=prop?val_copy(prop):val_null();}val_decref(obj);return result?result:val_null();}
-        case AST_BINOP:{if(strcmp(node->op,"&&")==0){Value *left=eval(node->left);if(!val_truthy(left))return left;val_decref(left);return eval(node->right);}if(strcmp(node->op,"||")==0){Value *left=eval(node->left);if(val_truthy(left))return left;val_decref(left);return eval(node->right);}Value *left=eval(node->left);Value *right=eval(node->right);Value *result=NULL;if(strcmp(node->op,"+")==0&&(left->type==V_STRING||right->type==V_STRING)){char buf[MAX_STR];char *ls=xstrdup(val_tostr(left));char *rs=val_tostr(right);snprintf(buf,sizeof(buf),"%s%s",ls,rs);free(ls);result=val_string(buf);}else if(strcmp(node->op,"+")==0){if(left->type==V_FLOAT||right->type==V_FLOAT)result=val_float(val_tonum(left)+val_tonum(right));else result=val_int(left->as.i+right->as.i);}else if(strcmp(node->op,"-")==0){if(left->type==V_FLOAT||right->type==V_FLOAT)result=val_float(val_tonum(left)-val_tonum(right));else result=val_int(left->as.i-right->as.i);}else if(strcmp(node->op,"*")==0){if(left->type==V_FLOAT||right->type==V_FLOAT)result=val_float(val_tonum(left)*val_tonum(right));else result=val_int(left->as.i*right->as.i);}else if(strcmp(node->op,"/")==0){double rv=val_tonum(right);if(rv==0)runtime_error(node->line,"division by zero");result=val_float(val_tonum(left)/rv);}else if(strcmp(node->op,"%")==0){double rv=val_tonum(right);if(rv==0)runtime_error(node->line,"modulo by zero");if(left->type==V_FLOAT||right->type==V_FLOAT)result=val_float(fmod(val_tonum(left),rv));else result=val_int((long long)val_tonum(left)%(long long)rv);}else if(strcmp(node->op,"**")==0)result=val_float(pow(val_tonum(left),val_tonum(right)));else if(strcmp(node->op,"<")==0)result=val_bool(val_tonum(left)<val_tonum(right));else if(strcmp(node->op,">")==0)result=val_bool(val_tonum(left)>val_tonum(right));else if(strcmp(node->op,"<=")==0)result=val_bool(val_tonum(left)<=val_tonum(right));else if(strcmp(node->op,">=")==0)result=val_bool(val_tonum(left)>=val_tonum(right));else if(strcmp(node->op,"==")==0){if((left->type==V_INT||left->type==V_FLOAT)&&(right->type==V_INT||right->type==V_FLOAT))result=val_bool(val_tonum(left)==val_tonum(right));else if(left->type!=right->type)result=val_bool(0);else{switch(left->type){case V_NULL:result=val_bool(1);break;case V_BOOL:result=val_bool(left->as.b==right->as.b);break;case V_INT:result=val_bool(left->as.i==right->as.i);break;case V_FLOAT:result=val_bool(left->as.f==right->as.f);break;case V_STRING:result=val_bool(strcmp(left->as.s,right->as.s)==0);break;default:result=val_bool(left==right);}}}else if(strcmp(node->op,"!=")==0){if((left->type==V_INT||left->type==V_FLOAT)&&(right->type==V_INT||right->type==V_FLOAT))result=val_bool(val_tonum(left)!=val_tonum(right));else if(left->type!=right->type)result=val_bool(1);else{switch(left->type){case V_NULL:result=val_bool(0);break;case V_BOOL:result=val_bool(left->as.b!=right->as.b);break;case V_INT:result=val_bool(left->as.i!=right->as.i);break;case V_FLOAT:result=val_bool(left->as.f!=right->as.f);break;case V_STRING:result=val_bool(strcmp(left->as.s,right->as.s)!=0);break;default:result=val_bool(left!=right);}}}val_decref(left);val_decref(right);return result?result:val_null();}
-        case AST_UNARY:{if(strcmp(node->op,"-")==0){Value *v=eval(node->right);Value *r=(v->type==V_FLOAT)?val_float(-v->as.f):val_int(-(long long)val_tonum(v));val_decref(v);return r;}if(strcmp(node->op,"+")==0)return eval(node->right);if(strcmp(node->op,"!")==0){Value *v=eval(node->right);Value *r=val_bool(!val_truthy(v));val_decref(v);return r;}if(strcmp(node->op,"++")==0||strcmp(node->op,"--")==0){if(node->right->type==AST_VAR){Symbol *sym=scope_find(g_scope,node->right->name);if(!sym)runtime_error(node->line,"undefined '%s'",node->right->name);if(sym->is_const)runtime_error(node->line,"cannot modify constant");long long v=(long long)val_tonum(sym->val);v+=(node->op[0]=='+')?1:-1;Value *nv=val_int(v);val_decref(sym->val);sym->val=nv;val_incref(nv);return nv;}}if(strcmp(node->op,"++p")==0||strcmp(node->op,"--p")==0){if(node->left->type==AST_VAR){Symbol *sym=scope_find(g_scope,node->left->name);if(!sym)runtime_error(node->line,"undefined '%s'",node->left->name);if(sym->is_const)runtime_error(node->line,"cannot modify constant");Value *old=val_copy(sym->val);long long v=(long long)val_tonum(sym->val);v+=(node->op[0]=='+')?1:-1;Value *nv=val_int(v);val_decref(sym->val);sym->val=nv;return old;}}return val_null();}
+        case AST_INDEX:{Value *container=eval(node->left);Value *index=eval(node->right);Value *result=index_get(container,index);val_decref(container);val_decref(index);return result;}
+        case AST_MEMBER:{Value *obj=eval(node->left);Value *result=member_get(obj,node->name);val_decref(obj);return result;}
+        case AST_BINOP:{if(strcmp(node->op,"&&")==0){Value *left=eval(node->left);if(!val_truthy(left))return left;val_decref(left);return eval(node->right);}if(strcmp(node->op,"||")==0){Value *left=eval(node->left);if(val_truthy(left))return left;val_decref(left);return eval(node->right);}Value *left=eval(node->left);Value *right=eval(node->right);Value *result=binop_apply(binop_code(node->op),left,right,node->line);val_decref(left);val_decref(right);return result;}
+        case AST_UNARY:{if(strcmp(node->op,"-")==0){Value *v=eval(node->right);Value *r=(v->type==V_FLOAT)?val_float(-v->as.f):val_int(-(long long)val_tonum(v));val_decref(v);return r;}if(strcmp(node->op,"+")==0)return eval(node->right);if(strcmp(node->op,"!")==0){Value *v=eval(node->right);Value *r=val_bool(!val_truthy(v));val_decref(v);return r;}if(strcmp(node->op,"++")==0||strcmp(node->op,"--")==0){if(node->right->type==AST_VAR)return incdec_var(node->right->name,node->op[0]=='+'?1:-1,0,node->line);}if(strcmp(node->op,"++p")==0||strcmp(node->op,"--p")==0){if(node->left->type==AST_VAR)return incdec_var(node->left->name,node->op[0]=='+'?1:-1,1,node->line);}return val_null();}
         case AST_TERNARY:{Value *cond=eval(node->cond);int t=val_truthy(cond);val_decref(cond);return eval(t?node->left:node->right);}
-        case AST_ASSIGN:{Value *val=eval(node->left);if(node->is_const){scope_def(g_scope,node->name,val,1);}else{Symbol *local=scope_find_local(g_scope,node->name);if(local){if(local->is_const)runtime_error(node->line,"cannot reassign constant '%s'",node->name);val_decref(local->val);val_incref(val);local->val=val;}else{Symbol *outer=scope_find(g_scope->parent,node->name);if(outer&&!outer->is_const){val_decref(outer->val);val_incref(val);outer->val=val;}else{scope_def(g_scope,node->name,val,0);}}}return val;}
-        case AST_INDEX_ASSIGN:{Value *val=eval(node->right);AST *target=node->left;if(target->type==AST_INDEX){Value *container=eval(target->left);Value *index=eval(target->right);if(container->type==V_ARRAY)arr_set(container,(int)val_tonum(index),val);else if(container->type==V_OBJECT||container->type==V_MODULE)obj_set(container,val_tostr(index),val);val_decref(container);val_decref(index);}else if(target->type==AST_MEMBER){Value *obj=eval(target->left);if(obj->type==V_OBJECT||obj->type==V_MODULE)obj_set(obj,target->name,val);else if(obj->type==V_INSTANCE)inst_set(obj,target->name,val);val_decref(obj);}return val;}
-        case AST_COMPOUND:{Value *current=NULL;const char *name=NULL;if(node->left->type==AST_VAR){name=node->left->name;Symbol *sym=scope_find(g_scope,name);if(!sym)runtime_error(node->line,"undefined '%s'",name);if(sym->is_const)runtime_error(node->line,"cannot modify constant");current=val_copy(sym->val);}else runtime_error(node->line,"invalid compound assignment target");Value *rhs=eval(node->right);Value *result=NULL;if(strcmp(node->op,"+")==0){if(current->type==V_STRING||rhs->type==V_STRING){char buf[MAX_STR];char *cs=xstrdup(val_tostr(current));char *rs=val_tostr(rhs);snprintf(buf,sizeof(buf),"%s%s",cs,rs);free(cs);result=val_string(buf);}else if(current->type==V_FLOAT||rhs->type==V_FLOAT)result=val_float(val_tonum(current)+val_tonum(rhs));else result=val_int((long long)val_tonum(current)+(long long)val_tonum(rhs));}else if(strcmp(node->op,"-")==0){if(current->type==V_FLOAT||rhs->type==V_FLOAT)result=val_float(val_tonum(current)-val_tonum(rhs));else result=val_int((long long)val_tonum(current)-(long long)val_tonum(rhs));}else if(strcmp(node->op,"*")==0){if(current->type==V_FLOAT||rhs->type==V_FLOAT)result=val_float(val_tonum(current)*val_tonum(rhs));else result=val_int((long long)val_tonum(current)*(long long)val_tonum(rhs));}else if(strcmp(node->op,"/")==0){double rv=val_tonum(rhs);if(rv==0)runtime_error(node->line,"division by zero");result=val_float(val_tonum(current)/rv);}else if(strcmp(node->op,"%")==0){double rv=val_tonum(rhs);if(rv==0)runtime_error(node->line,"modulo by zero");if(current->type==V_FLOAT||rhs->type==V_FLOAT)result=val_float(fmod(val_tonum(current),rv));else result=val_int((long long)val_tonum(current)%(long long)rv);}scope_set(g_scope,name,result);val_decref(current);val_decref(rhs);return result;}
+        case AST_ASSIGN:{AST *e=node->left;
+            if(!node->is_const&&e->type==AST_BINOP&&strcmp(e->op,"+")==0&&e->left->type==AST_VAR&&strcmp(e->left->name,node->name)==0){Symbol *sym=scope_find(g_scope,node->name);
+                if(sym&&!sym->is_const&&sym->val->type==V_STRING){Value *cur=sym->val;val_incref(cur);Value *rhs=eval(e->right);sym=scope_find(g_scope,node->name);if(sym&&str_append_inplace(&sym->val,cur,rhs)){val_decref(rhs);return cur;}
+                    Value *val=binop_apply(BOP_ADD,cur,rhs,node->line);val_decref(cur);val_decref(rhs);assign_var(node->name,val,0,node->line);return val;}}
+            Value *val=eval(e);assign_var(node->name,val,node->is_const,node->line);return val;}
+        case AST_INDEX_ASSIGN:{Value *val=eval(node->right);AST *target=node->left;if(target->type==AST_INDEX){Value *container=eval(target->left);Value *index=eval(target->right);index_set(container,index,val);val_decref(container);val_decref(index);}else if(target->type==AST_MEMBER){Value *obj=eval(target->left);member_set(obj,target->name,val);val_decref(obj);}return val;}
+        case AST_COMPOUND:{if(node->left->type!=AST_VAR)runtime_error(node->line,"invalid compound assignment target");const char *name=node->left->name;Value *current=compound_target(name,node->line);Value *rhs=eval(node->right);Symbol *sym=node->op[0]=='+'?scope_find(g_scope,name):NULL;if(sym&&str_append_inplace(&sym->val,current,rhs)){val_decref(rhs);return current;}Value *result=compound_apply(node->op[0],current,rhs,node->line);scope_set(g_scope,name,result);val_decref(current);val_decref(rhs);return result;}
         case AST_CALL:{
             /* Check if it's a variable holding a closure first */
             if(node->left->type==AST_VAR){
@@ -660,17 +3065,17 @@ static Value *eval(AST *node){
                     free(args);
                     return result;
                 }
-                return call_func(node->left->name,node->children,node->child_n);
+                return call_func(node->left->name,node,node->children,node->child_n);
             }
             if(node->left->type==AST_MEMBER){Value *obj=eval(node->left->left);const char *method=node->left->name;
                 /* Check for method call on built-in types */
                 Value **args=xmalloc(sizeof(Value*)*(node->child_n+1));for(int i=0;i<node->child_n;i++)args[i]=eval(node->children[i]);
-                Value *result=call_method(obj,method,args,node->child_n);
+                Value *result=call_method_id(obj,node->mid,args,node->child_n);
                 if(result->type!=V_NULL||(obj->type!=V_OBJECT&&obj->type!=V_MODULE&&obj->type!=V_INSTANCE)){for(int i=0;i<node->child_n;i++)val_decref(args[i]);free(args);val_decref(obj);return result;}
                 val_decref(result);
                 /* Check for function property */
-                if(obj->type==V_MODULE||obj->type==V_OBJECT){Value *fn=obj_get(obj,method);if(fn&&fn->type==V_FUNC){result=call_func(fn->as.s,node->children,node->child_n);for(int i=0;i<node->child_n;i++)val_decref(args[i]);free(args);val_decref(obj);return result;}if(fn&&fn->type==V_CLOSURE){result=call_closure(fn,args,node->child_n);for(int i=0;i<node->child_n;i++)val_decref(args[i]);free(args);val_decref(obj);return result;}}
-                if(obj->type==V_INSTANCE){Method *m=method_find(obj->as.inst->cd,method);if(m){Value *saved_this=g_this;g_this=obj;Scope *meth_scope=scope_new(g_global);Scope *prev=g_scope;g_scope=meth_scope;for(int i=0;i<m->param_n;i++)scope_def(meth_scope,m->params[i],(i<node->child_n)?args[i]:val_null(),0);g_return=0;g_retval=NULL;eval(m->body);result=g_retval?g_retval:val_null();g_return=0;g_retval=NULL;g_scope=prev;scope_free(meth_scope);g_this=saved_this;for(int i=0;i<node->child_n;i++)val_decref(args[i]);free(args);val_decref(obj);return result;}}
+                if(obj->type==V_MODULE||obj->type==V_OBJECT){Value *fn=obj_get(obj,method);if(fn&&fn->type==V_FUNC){result=call_func(fn->as.s,NULL,node->children,node->child_n);for(int i=0;i<node->child_n;i++)val_decref(args[i]);free(args);val_decref(obj);return result;}if(fn&&fn->type==V_CLOSURE){result=call_closure(fn,args,node->child_n);for(int i=0;i<node->child_n;i++)val_decref(args[i]);free(args);val_decref(obj);return result;}}
+                if(obj->type==V_INSTANCE){Method *m=method_find(obj->as.inst->cd,method);if(m){result=call_method_body(obj,m,args,node->child_n);for(int i=0;i<node->child_n;i++)val_decref(args[i]);free(args);val_decref(obj);return result;}}
                 for(int i=0;i<node->child_n;i++)val_decref(args[i]);free(args);val_decref(obj);
             }
             /* Anonymous function/closure call */
@@ -679,34 +3084,583 @@ static Value *eval(AST *node){
             Value *fn=eval(node->left);if(fn->type==V_CLOSURE||fn->type==V_FUNC){Value **args=xmalloc(sizeof(Value*)*(node->child_n+1));for(int i=0;i<node->child_n;i++)args[i]=eval(node->children[i]);Value *result=call_closure(fn,args,node->child_n);for(int i=0;i<node->child_n;i++)val_decref(args[i]);free(args);val_decref(fn);return result;}
             val_decref(fn);runtime_error(node->line,"not a function");return val_null();
         }
-        case AST_BLOCK:{Scope *blk_scope=scope_new(g_scope);Scope *prev=g_scope;g_scope=blk_scope;Value *result=val_null();for(int i=0;i<node->child_n;i++){val_decref(result);result=eval(node->children[i]);if(g_return||g_break||g_continue)break;}g_scope=prev;scope_free(blk_scope);return result;}
+        case AST_BLOCK:{Scope *blk_scope=scope_new(g_scope);Scope *prev=g_scope;g_scope=blk_scope;Value *result=val_null();for(int i=0;i<node->child_n;i++){val_decref(result);GC_SAFEPOINT();result=eval(node->children[i]);if(g_return||g_break||g_continue)break;}g_scope=prev;scope_free(blk_scope);return result;}
         case AST_IF:{Value *cond=eval(node->cond);int t=val_truthy(cond);val_decref(cond);if(t)return eval(node->body);if(node->right)return eval(node->right);return val_null();}
         case AST_WHILE:{while(1){Value *cond=eval(node->cond);int t=val_truthy(cond);val_decref(cond);if(!t)break;Value *r=eval(node->body);val_decref(r);if(g_return)break;if(g_break){g_break=0;break;}if(g_continue){g_continue=0;continue;}}return val_null();}
-        case AST_FOR:{Value *iter=eval(node->iter_expr);int len=0;if(iter->type==V_ARRAY)len=iter->as.arr->len;else if(iter->type==V_OBJECT||iter->type==V_MODULE)len=iter->as.obj->count;else if(iter->type==V_STRING)len=strlen(iter->as.s);Scope *for_scope=scope_new(g_scope);Scope *prev=g_scope;g_scope=for_scope;for(int i=0;i<len;i++){Value *idx=val_int(i);scope_def(for_scope,node->idx_var,idx,0);val_decref(idx);Value *item=NULL;if(iter->type==V_ARRAY)item=val_copy(iter->as.arr->items[i]);else if(iter->type==V_OBJECT||iter->type==V_MODULE)item=val_string(iter->as.obj->pairs[i].key);else if(iter->type==V_STRING){char c[2]={iter->as.s[i],'\0'};item=val_string(c);}scope_def(for_scope,node->iter_var,item,0);val_decref(item);Value *r=eval(node->body);val_decref(r);if(g_return)break;if(g_break){g_break=0;break;}if(g_continue){g_continue=0;continue;}}g_scope=prev;scope_free(for_scope);val_decref(iter);return val_null();}
-        case AST_FOR_C:{Scope *for_scope=scope_new(g_scope);Scope *prev=g_scope;g_scope=for_scope;if(node->init){Value *r=eval(node->init);val_decref(r);}while(1){if(node->cond){Value *cond=eval(node->cond);int t=val_truthy(cond);val_decref(cond);if(!t)break;}Value *r=eval(node->body);val_decref(r);if(g_return)break;if(g_break){g_break=0;break;}if(g_continue)g_continue=0;if(node->update){Value *u=eval(node->update);val_decref(u);}}g_scope=prev;scope_free(for_scope);return val_null();}
+        case AST_FOR:{Value *iter=eval(node->iter_expr);int len=0;if(iter->type==V_INSTANCE){Value *it=iter_from(iter);val_decref(iter);iter=it;}if(iter->type==V_MAP||iter->type==V_SET||iter->type==V_DEQUE||iter->type==V_PQ){Value *arr=coll_to_array(iter);val_decref(iter);iter=arr;}if(iter->type==V_ARRAY)len=iter->as.arr->len;else if(iter->type==V_TYPED)len=iter->as.ta->len;else if(iter->type==V_OBJECT||iter->type==V_MODULE)len=iter->as.obj->count;else if(iter->type==V_STRING)len=strlen(iter->as.s);else if(iter->type==V_ITER)len=INT_MAX;Scope *prev=g_scope;for(int i=0;i<len;i++){Value *item=iter->type==V_ITER?iter_next(iter):NULL;if(iter->type==V_ITER&&!item)break;Scope *for_scope=scope_new(prev);g_scope=for_scope;Value *idx=val_int(i);scope_def(for_scope,node->idx_var,idx,0);val_decref(idx);if(iter->type==V_ARRAY)item=val_copy(iter->as.arr->items[i]);else if(iter->type==V_TYPED)item=ta_box(iter->as.ta,i);else if(iter->type==V_OBJECT||iter->type==V_MODULE)item=val_string(iter->as.obj->pairs[i].key);else if(iter->type==V_STRING){char c[2]={iter->as.s[i],'\0'};item=val_string(c);}scope_def(for_scope,node->iter_var,item,0);val_decref(item);Value *r=eval(node->body);val_decref(r);g_scope=prev;scope_free(for_scope);if(g_return)break;if(g_break){g_break=0;break;}if(g_continue){g_continue=0;continue;}}g_scope=prev;val_decref(iter);return val_null();}
+        case AST_FOR_C:{Scope *for_scope=scope_new(g_scope);Scope *prev=g_scope;g_scope=for_scope;if(node->init){Value *r=eval(node->init);val_decref(r);}while(1){if(node->cond){Value *cond=eval(node->cond);int t=val_truthy(cond);val_decref(cond);if(!t)break;}Value *r=eval(node->body);val_decref(r);if(g_return)break;if(g_break){g_break=0;break;}if(g_continue)g_continue=0;if(for_scope->refs>1){Scope *next=scope_new(prev);for(int i=0;i<for_scope->count;i++)scope_def(next,for_scope->syms[i].name,for_scope->syms[i].val,for_scope->syms[i].is_const);scope_free(for_scope);g_scope=for_scope=next;}if(node->update){Value *u=eval(node->update);val_decref(u);}}g_scope=prev;scope_free(for_scope);return val_null();}
         case AST_RETURN:g_retval=node->left?eval(node->left):val_null();g_return=1;return val_null();
         case AST_BREAK:g_break=1;return val_null();
+        case AST_YIELD:if(gen_yield(node->left?eval(node->left):val_null())){g_return=1;g_retval=NULL;}return val_null();
         case AST_CONTINUE:g_continue=1;return val_null();
-        case AST_CASE:{Value *sw=eval(node->cond);int matched=0;for(int i=0;i<node->child_n;i++){AST *c=node->children[i];if(!matched){if(c->cond&&c->cond->type==AST_ARRAY){for(int m=0;m<c->cond->child_n&&!matched;m++){AST *cond=c->cond->children[m];if(cond->type==AST_BINOP&&strcmp(cond->op,"..")==0){Value *lo=eval(cond->left);Value *hi=eval(cond->right);double swn=val_tonum(sw),lon=val_tonum(lo),hin=val_tonum(hi);if(swn>=lon&&swn<=hin)matched=1;val_decref(lo);val_decref(hi);}else{Value *cv=eval(cond);int eq=0;if(sw->type==cv->type){if(sw->type==V_INT)eq=(sw->as.i==cv->as.i);else if(sw->type==V_FLOAT)eq=(sw->as.f==cv->as.f);else if(sw->type==V_STRING)eq=(strcmp(sw->as.s,cv->as.s)==0);else if(sw->type==V_BOOL)eq=(sw->as.b==cv->as.b);}val_decref(cv);if(eq)matched=1;}}}else if(!c->cond)matched=1;}if(matched){for(int j=0;j<c->child_n;j++){Value *r=eval(c->children[j]);val_decref(r);if(g_break){g_break=0;val_decref(sw);return val_null();}if(g_return)break;}if(g_return)break;}}val_decref(sw);return val_null();}
-        case AST_FUNC:func_register(node);if(node->name){Value *fn=val_func(node->name);scope_def(g_scope,node->name,fn,0);return fn;}return val_null();
-        case AST_ARROW:{Closure *cl=xmalloc(sizeof(Closure));memset(cl,0,sizeof(Closure));cl->name=NULL;cl->params=xmalloc(sizeof(char*)*node->param_n);cl->param_n=node->param_n;for(int i=0;i<node->param_n;i++)cl->params[i]=xstrdup(node->params[i]);cl->body=node->body;cl->env=scope_clone(g_scope);cl->is_arrow=1;return val_closure_new(cl);}
-        case AST_CLASS:{ClassDef cd={0};cd.name=xstrdup(node->name);cd.parent=node->parent?xstrdup(node->parent):NULL;cd.methods=xmalloc(sizeof(Method)*node->method_n);cd.method_n=node->method_n;cd.method_cap=node->method_n;for(int i=0;i<node->method_n;i++){AST *m=node->methods[i];cd.methods[i].name=xstrdup(m->name);cd.methods[i].params=xmalloc(sizeof(char*)*m->param_n);cd.methods[i].param_n=m->param_n;for(int j=0;j<m->param_n;j++)cd.methods[i].params[j]=xstrdup(m->params[j]);cd.methods[i].body=m->body;}class_register(&cd);Value *cls=val_new(V_CLASS);cls->as.s=xstrdup(node->name);scope_def(g_scope,node->name,cls,0);return cls;}
-        case AST_NEW:{ClassDef *cd=class_find(node->name);if(!cd)runtime_error(node->line,"undefined class '%s'",node->name);Value *inst=val_instance(cd);Method *init=method_find(cd,"init");if(init){Value *saved_this=g_this;g_this=inst;Scope *meth_scope=scope_new(g_global);Scope *prev=g_scope;g_scope=meth_scope;for(int i=0;i<init->param_n;i++){Value *arg=(i<node->child_n)?eval(node->children[i]):val_null();scope_def(meth_scope,init->params[i],arg,0);val_decref(arg);}g_return=0;g_retval=NULL;eval(init->body);g_return=0;if(g_retval)val_decref(g_retval);g_retval=NULL;g_scope=prev;scope_free(meth_scope);g_this=saved_this;}return inst;}
+        case AST_CASE:{Value *sw=eval(node->cond);int matched=0;for(int i=0;i<node->child_n;i++){AST *c=node->children[i];if(!matched){if(c->cond&&c->cond->type==AST_ARRAY){for(int m=0;m<c->cond->child_n&&!matched;m++){AST *cond=c->cond->children[m];if(cond->type==AST_BINOP&&strcmp(cond->op,"..")==0){Value *lo=eval(cond->left);Value *hi=eval(cond->right);double swn=val_tonum(sw),lon=val_tonum(lo),hin=val_tonum(hi);if(swn>=lon&&swn<=hin)matched=1;val_decref(lo);val_decref(hi);}else{Value *cv=eval(cond);int eq=case_eq(sw,cv);val_decref(cv);if(eq)matched=1;}}}else if(!c->cond)matched=1;}if(matched){for(int j=0;j<c->child_n;j++){Value *r=eval(c->children[j]);val_decref(r);if(g_break){g_break=0;val_decref(sw);return val_null();}if(g_return)break;}if(g_return)break;}}val_decref(sw);return val_null();}
+        case AST_FUNC:if(!node->name)return make_closure(node);func_register(node);{Value *fn=val_func(node->name);scope_def(g_scope,node->name,fn,0);return fn;}
+        case AST_ARROW:return make_closure(node);
+        case AST_CLASS:{Value *cls=define_class(node);scope_def(g_scope,node->name,cls,0);return cls;}
+        case AST_NEW:{ClassDef *cd=class_find(node->name);if(!cd)runtime_error(node->line,"undefined class '%s'",node->name);Value *inst=val_instance(cd);Method *init=method_find(cd,"init");if(init){int n=node->child_n;Value **args=xmalloc(sizeof(Value*)*(n+1));for(int i=0;i<n;i++)args[i]=eval(node->children[i]);Value *r=call_method_body(inst,init,args,n);val_decref(r);for(int i=0;i<n;i++)val_decref(args[i]);free(args);}return inst;}
         case AST_THIS:if(!g_this)runtime_error(node->line,"'this' outside of method");val_incref(g_this);return g_this;
         case AST_SUPER:if(!g_this||g_this->type!=V_INSTANCE)runtime_error(node->line,"'super' outside of method");val_incref(g_this);return g_this;
-        case AST_IMPORT:{char *path=resolve_path(node->imp_path,g_dir);Value *mod=do_import(path,node->imp_alias);free(path);return mod;}
+        case AST_IMPORT:{char *path=resolve_path(node->imp_path,g_dir);Value *mod=do_import(path,node->imp_alias);free(path);scope_def(g_scope,node->imp_alias,mod,0);return mod;}
         case AST_EXPR_STMT:{Value *r=eval(node->left);val_decref(r);return val_null();}
         default:return val_null();
     }
 }
 
+/* Bytecode VM
+   Bodies of functions, closures, methods and modules are lowered once into a flat
+   instruction stream (cached on the body's AST node) and run by vm_exec(). The tree
+   walker above stays available through --no-vm and shares all runtime helpers.
+   Names are resolved while compiling: each block owns a range of frame slots for the
+   variables it may define, and a reference becomes the chain of candidate slots and
+   captured upvalues to try before falling back to the base scope by name. */
+#if defined(__GNUC__) && !defined(JEEM_NO_COMPUTED_GOTO)
+#define VM_COMPUTED_GOTO 1
+#endif
+#define VM_STACK (1<<20)
+#define VM_SLOTS (1<<18)
+#define VM_OPS(X) X(NOP) X(LINE) X(CONST) X(NULL) X(POP) \
+    X(GET_LOCAL) X(GET_NAME) X(SET_LOCAL) X(SET_NAME) X(DEF_NAME) X(GET_TARGET) X(COMPOUND) X(APPEND_SET) X(INC_VAR) X(POSTINC_VAR) X(LEAVE) X(RENEW) \
+    X(ADD) X(SUB) X(MUL) X(DIV) X(MOD) X(POW) X(LT) X(GT) X(LE) X(GE) X(EQ) X(NE) X(NEG) X(NOT) \
+    X(JUMP) X(JUMP_IF_FALSE) X(AND) X(OR) X(ARRAY) X(OBJECT) X(INDEX) X(MEMBER) X(SET_INDEX) X(SET_MEMBER) \
+    X(CALL) X(CALL_NAME) X(CALL_METHOD) X(PRINT) X(NEW) X(THIS) X(FOR_PREP) X(FOR_NEXT) X(CASE_EQ) X(CASE_RANGE) \
+    X(FUNC) X(CLOSURE) X(CLASS) X(IMPORT) X(CONCAT) X(ERROR) X(RETURN) X(YIELD)
+#define VM_ENUM(n) OP_##n,
+typedef enum { VM_OPS(VM_ENUM) OP_COUNT } OpCode;
+/* A name reference: candidate slots innermost first, the cached global slot (or a miss
+   valid until the next symbol is defined), and the builtin a call site was bound to */
+typedef struct { const char *name; int n,*locs; Scope *cache_scope; int cache_idx; unsigned epoch,bi_epoch; BuiltinFn bi; int mod; } VMRef;
+typedef struct { int from_local,index; } VMCapture;
+/* Inline cache for one member site: last shape seen and the key's slot in it,
+   the last key-adding transition, and the last instance method resolved */
+typedef struct { const char *key; Shape *shape,*from,*to; int index; ClassDef *cd; Method *m; int mid; } VMCache;
+struct Chunk { int *code; int len,cap,max_stack,slot_n,param_n; Value **consts; int const_n; AST **nodes; int node_n; VMRef *refs; int ref_n; VMCapture *caps; int cap_n; VMCache *caches; int cache_n; };
+typedef struct { Value *val; Upvalue *up; int is_const; } Slot;
+typedef struct { const char *name; int slot; } VMLocal;
+typedef struct { int local_start,slot_start; } VMBlock;
+typedef struct VMLoop { struct VMLoop *outer; int is_case,slots,depth; int *jumps[2]; int jump_n[2]; } VMLoop;
+typedef struct Compiler { Chunk *ch; int depth,line,slots; VMLoop *loop; struct Compiler *enclosing; VMLocal *locals; int local_n; VMBlock *blocks; int block_n; } Compiler;
+static Value **g_stack=NULL; static int g_sp=0,g_stack_cap=VM_STACK;
+static Slot *g_slots=NULL; static int g_slot_sp=0,g_slot_cap=VM_SLOTS;
+
+static void vm_emit(Compiler *c,int w){Chunk *ch=c->ch;if(ch->len>=ch->cap){ch->cap=ch->cap?ch->cap*2:64;ch->code=xrealloc(ch->code,sizeof(int)*ch->cap);}ch->code[ch->len++]=w;}
+static void vm_op(Compiler *c,int op,int effect){vm_emit(c,op);c->depth+=effect;if(c->depth>c->ch->max_stack)c->ch->max_stack=c->depth;}
+static void vm_op1(Compiler *c,int op,int effect,int a){vm_op(c,op,effect);vm_emit(c,a);}
+static int vm_jump(Compiler *c,int op,int effect){vm_op1(c,op,effect,-1);return c->ch->len-1;}
+static void vm_patch(Compiler *c,int at){c->ch->code[at]=c->ch->len;}
+static int vm_const(Compiler *c,Value *v){Chunk *ch=c->ch;ch->consts=xrealloc(ch->consts,sizeof(Value*)*(ch->const_n+1));ch->consts[ch->const_n]=v;return ch->const_n++;}
+static int vm_name(Compiler *c,const char *name){for(int i=0;i<c->ch->const_n;i++){Value *v=c->ch->consts[i];if(v->type==V_STRING&&strcmp(v->as.s,name)==0)return i;}return vm_const(c,val_string(name));}
+static int vm_cache(Compiler *c,const char *name){Chunk *ch=c->ch;ch->caches=xrealloc(ch->caches,sizeof(VMCache)*(ch->cache_n+1));VMCache *ic=&ch->caches[ch->cache_n];memset(ic,0,sizeof(VMCache));ic->key=intern(name);ic->mid=method_id(name);return ch->cache_n++;}
+static int vm_node(Compiler *c,AST *n){Chunk *ch=c->ch;ch->nodes=xrealloc(ch->nodes,sizeof(AST*)*(ch->node_n+1));ch->nodes[ch->node_n]=n;return ch->node_n++;}
+static void vm_loop_jump(VMLoop *l,int kind,int at){l->jumps[kind]=xrealloc(l->jumps[kind],sizeof(int)*(l->jump_n[kind]+1));l->jumps[kind][l->jump_n[kind]++]=at;}
+static void vm_loop_end(Compiler *c,VMLoop *l,int kind,int target){for(int i=0;i<l->jump_n[kind];i++)c->ch->code[l->jumps[kind][i]]=target;free(l->jumps[kind]);l->jumps[kind]=NULL;l->jump_n[kind]=0;}
+
+/* Resolver */
+static int vm_local(Compiler *c,const char *name){
+    c->locals=xrealloc(c->locals,sizeof(VMLocal)*(c->local_n+1));c->locals[c->local_n].name=name;c->locals[c->local_n++].slot=c->slots;
+    if(++c->slots>c->ch->slot_n)c->ch->slot_n=c->slots;return c->slots-1;
+}
+static int vm_declare(Compiler *c,const char *name){
+    if(!c->block_n)return -1;
+    for(int i=c->blocks[c->block_n-1].local_start;i<c->local_n;i++)if(strcmp(c->locals[i].name,name)==0)return c->locals[i].slot;
+    return vm_local(c,name);
+}
+static void vm_block_begin(Compiler *c){c->blocks=xrealloc(c->blocks,sizeof(VMBlock)*(c->block_n+1));c->blocks[c->block_n].local_start=c->local_n;c->blocks[c->block_n++].slot_start=c->slots;}
+static void vm_block_end(Compiler *c){VMBlock *b=&c->blocks[--c->block_n];if(c->slots>b->slot_start){vm_op1(c,OP_LEAVE,0,b->slot_start);vm_emit(c,c->slots-b->slot_start);}c->local_n=b->local_start;c->slots=b->slot_start;}
+/* Names a statement may bind in the enclosing block; case bodies share it */
+static void vm_scan(Compiler *c,AST *n){
+    if(!n)return;
+    switch(n->type){
+        case AST_ASSIGN:case AST_CLASS:vm_declare(c,n->name);break;
+        case AST_FUNC:if(n->name)vm_declare(c,n->name);break;
+        case AST_IMPORT:vm_declare(c,n->imp_alias);break;
+        case AST_CASE:for(int i=0;i<n->child_n;i++)for(int j=0;j<n->children[i]->child_n;j++)vm_scan(c,n->children[i]->children[j]);break;
+        default:break;
+    }
+}
+static int vm_capture(Compiler *c,int loc){
+    Chunk *ch=c->ch;int from_local=loc>=0,index=from_local?loc:-loc-1;
+    for(int i=0;i<ch->cap_n;i++)if(ch->caps[i].from_local==from_local&&ch->caps[i].index==index)return i;
+    ch->caps=xrealloc(ch->caps,sizeof(VMCapture)*(ch->cap_n+1));ch->caps[ch->cap_n].from_local=from_local;ch->caps[ch->cap_n].index=index;return ch->cap_n++;
+}
+static int *vm_chain(Compiler *c,const char *name,int *n){
+    int *locs=NULL;*n=0;
+    for(int i=c->local_n-1;i>=0;i--)if(strcmp(c->locals[i].name,name)==0){locs=xrealloc(locs,sizeof(int)*(*n+1));locs[(*n)++]=c->locals[i].slot;}
+    if(c->enclosing){int m;int *outer=vm_chain(c->enclosing,name,&m);for(int j=0;j<m;j++){locs=xrealloc(locs,sizeof(int)*(*n+1));locs[(*n)++]=-vm_capture(c,outer[j])-1;}free(outer);}
+    return locs;
+}
+static int vm_ref(Compiler *c,const char *name){
+    Chunk *ch=c->ch;int k=vm_name(c,name);ch->refs=xrealloc(ch->refs,sizeof(VMRef)*(ch->ref_n+1));VMRef *r=&ch->refs[ch->ref_n];
+    r->name=ch->consts[k]->as.s;r->locs=vm_chain(c,name,&r->n);r->cache_scope=NULL;r->cache_idx=0;r->epoch=r->bi_epoch=0;r->bi=NULL;return ch->ref_n++;
+}
+static void vm_get(Compiler *c,const char *name){int r=vm_ref(c,name);VMRef *ref=&c->ch->refs[r];if(ref->n&&ref->locs[0]>=0){vm_op1(c,OP_GET_LOCAL,1,ref->locs[0]);vm_emit(c,r);}else vm_op1(c,OP_GET_NAME,1,r);}
+static void vm_set(Compiler *c,const char *name){int own=vm_declare(c,name),r=vm_ref(c,name);if(own>=0){vm_op1(c,OP_SET_LOCAL,-1,own);vm_emit(c,r);}else vm_op1(c,OP_SET_NAME,-1,r);}
+static void vm_def(Compiler *c,const char *name,int is_const){vm_declare(c,name);vm_op1(c,OP_DEF_NAME,-1,vm_ref(c,name));vm_emit(c,is_const);}
+
+static void vm_expr(Compiler *c,AST *n);
+static void vm_stmt(Compiler *c,AST *n);
+static Chunk *vm_compile_fn(AST *body,char **params,int param_n,Compiler *enclosing);
+static void vm_args(Compiler *c,AST *n){for(int i=0;i<n->child_n;i++)vm_expr(c,n->children[i]);}
+static void vm_callexpr(Compiler *c,AST *n){
+    AST *f=n->left;int argc=n->child_n;
+    if(f->type==AST_VAR&&strcmp(f->name,"print")==0){if(!argc)vm_op1(c,OP_PRINT,0,2);for(int i=0;i<argc;i++){vm_expr(c,n->children[i]);vm_op1(c,OP_PRINT,-1,i==argc-1);}vm_op(c,OP_NULL,1);return;}
+    if(f->type==AST_VAR){vm_args(c,n);int r=vm_ref(c,f->name);c->ch->refs[r].bi=n->bi;c->ch->refs[r].mod=n->mod;vm_op1(c,OP_CALL_NAME,1-argc,r);vm_emit(c,argc);return;}
+    if(f->type==AST_MEMBER){vm_expr(c,f->left);vm_args(c,n);vm_op1(c,OP_CALL_METHOD,-argc,vm_cache(c,f->name));vm_emit(c,argc);return;}
+    vm_expr(c,f);vm_args(c,n);vm_op1(c,OP_CALL,-argc,argc);
+}
+static void vm_expr(Compiler *c,AST *n){
+    if(!n){vm_op(c,OP_NULL,1);return;}
+    if(n->line!=c->line){c->line=n->line;vm_op1(c,OP_LINE,0,n->line);}
+    switch(n->type){
+        case AST_LITERAL:val_incref(n->lit);vm_op1(c,OP_CONST,1,vm_const(c,n->lit));return;
+        case AST_TEMPLATE:
+            for(int i=0,e=0;i<n->tpl_n;i++){TemplatePart *part=&n->tpl[i];if(part->is_expr)vm_expr(c,n->children[e++]);else vm_op1(c,OP_CONST,1,vm_const(c,val_string(part->text)));}
+            vm_op1(c,OP_CONCAT,1-n->tpl_n,n->tpl_n);c->line=-1;return;
+        case AST_ARRAY:vm_args(c,n);vm_op1(c,OP_ARRAY,1-n->child_n,n->child_n);return;
+        case AST_OBJECT:vm_args(c,n);vm_op1(c,OP_OBJECT,1-n->child_n,vm_node(c,n));return;
+        case AST_VAR:vm_get(c,n->name);return;
+        case AST_INDEX:vm_expr(c,n->left);vm_expr(c,n->right);vm_op(c,OP_INDEX,-1);return;
+        case AST_MEMBER:vm_expr(c,n->left);vm_op1(c,OP_MEMBER,0,vm_cache(c,n->name));return;
+        case AST_BINOP:{
+            if(strcmp(n->op,"&&")==0||strcmp(n->op,"||")==0){vm_expr(c,n->left);int j=vm_jump(c,n->op[0]=='&'?OP_AND:OP_OR,-1);vm_expr(c,n->right);vm_patch(c,j);c->line=-1;return;}
+            int op=binop_code(n->op);vm_expr(c,n->left);vm_expr(c,n->right);
+            if(op<0){vm_op(c,OP_POP,-1);vm_op(c,OP_POP,-1);vm_op(c,OP_NULL,1);return;}
+            vm_op(c,OP_ADD+op,-1);return;
+        }
+        case AST_UNARY:
+            if(strcmp(n->op,"-")==0){vm_expr(c,n->right);vm_op(c,OP_NEG,0);return;}
+            if(strcmp(n->op,"+")==0){vm_expr(c,n->right);return;}
+            if(strcmp(n->op,"!")==0){vm_expr(c,n->right);vm_op(c,OP_NOT,0);return;}
+            if((strcmp(n->op,"++")==0||strcmp(n->op,"--")==0)&&n->right->type==AST_VAR){vm_op1(c,OP_INC_VAR,1,vm_ref(c,n->right->name));vm_emit(c,n->op[0]=='+'?1:-1);return;}
+            if((strcmp(n->op,"++p")==0||strcmp(n->op,"--p")==0)&&n->left->type==AST_VAR){vm_op1(c,OP_POSTINC_VAR,1,vm_ref(c,n->left->name));vm_emit(c,n->op[0]=='+'?1:-1);return;}
+            vm_op(c,OP_NULL,1);return;
+        case AST_TERNARY:{vm_expr(c,n->cond);int j=vm_jump(c,OP_JUMP_IF_FALSE,-1);vm_expr(c,n->left);int e=vm_jump(c,OP_JUMP,0);vm_patch(c,j);c->depth--;vm_expr(c,n->right);vm_patch(c,e);c->line=-1;return;}
+        case AST_CALL:vm_callexpr(c,n);return;
+        case AST_FUNC:case AST_ARROW:vm_compile_fn(n->body,n->params,n->param_n,c);vm_op1(c,OP_CLOSURE,1,vm_node(c,n));return;
+        case AST_NEW:vm_args(c,n);vm_op1(c,OP_NEW,1-n->child_n,vm_node(c,n));vm_emit(c,n->child_n);return;
+        case AST_THIS:vm_op1(c,OP_THIS,1,0);return;
+        case AST_SUPER:vm_op1(c,OP_THIS,1,1);return;
+        default:vm_stmt(c,n);vm_op(c,OP_NULL,1);return;
+    }
+}
+/* break/continue release the slots of the blocks they leave and the loop state above the target loop */
+static void vm_break(Compiler *c,int kind){
+    VMLoop *l=c->loop;if(kind)while(l&&l->is_case)l=l->outer;
+    if(!l){vm_op(c,OP_NULL,1);vm_op(c,OP_RETURN,-1);return;}
+    int depth=c->depth;if(c->slots>l->slots){vm_op1(c,OP_LEAVE,0,l->slots);vm_emit(c,c->slots-l->slots);}for(int i=c->depth;i>l->depth;i--)vm_op(c,OP_POP,-1);
+    vm_loop_jump(l,kind,vm_jump(c,OP_JUMP,0));c->depth=depth;
+}
+static void vm_case(Compiler *c,AST *n){
+    vm_expr(c,n->cond);VMLoop lp={c->loop,1,c->slots,c->depth,{NULL,NULL},{0,0}};c->loop=&lp;
+    int next_test=-1,body_end=-1;
+    for(int i=0;i<n->child_n;i++){
+        AST *b=n->children[i];int *hits=NULL,hit_n=0;
+        if(next_test>=0){vm_patch(c,next_test);next_test=-1;}
+        if(b->cond){
+            for(int m=0;m<b->cond->child_n;m++){AST *cond=b->cond->children[m];hits=xrealloc(hits,sizeof(int)*(hit_n+1));
+                if(cond->type==AST_BINOP&&strcmp(cond->op,"..")==0){vm_expr(c,cond->left);vm_expr(c,cond->right);hits[hit_n++]=vm_jump(c,OP_CASE_RANGE,-2);}
+                else{vm_expr(c,cond);hits[hit_n++]=vm_jump(c,OP_CASE_EQ,-1);}}
+            next_test=vm_jump(c,OP_JUMP,0);
+        }
+        for(int h=0;h<hit_n;h++)vm_patch(c,hits[h]);free(hits);
+        if(body_end>=0)vm_patch(c,body_end);
+        c->line=-1;for(int j=0;j<b->child_n;j++)vm_stmt(c,b->children[j]);
+        body_end=vm_jump(c,OP_JUMP,0);
+    }
+    if(next_test>=0)vm_patch(c,next_test);if(body_end>=0)vm_patch(c,body_end);
+    vm_loop_end(c,&lp,0,c->ch->len);c->loop=lp.outer;vm_op(c,OP_POP,-1);
+}
+static void vm_stmt(Compiler *c,AST *n){
+    if(!n)return;
+    if(n->line!=c->line){c->line=n->line;vm_op1(c,OP_LINE,0,n->line);}
+    switch(n->type){
+        case AST_NOP:return;
+        case AST_EXPR_STMT:vm_expr(c,n->left);vm_op(c,OP_POP,-1);return;
+        case AST_ASSIGN:{AST *e=n->left;
+            if(!n->is_const&&e->type==AST_BINOP&&strcmp(e->op,"+")==0&&e->left->type==AST_VAR&&strcmp(e->left->name,n->name)==0){vm_declare(c,n->name);vm_expr(c,e->left);vm_expr(c,e->right);vm_op1(c,OP_APPEND_SET,-2,vm_ref(c,n->name));return;}
+            vm_expr(c,e);if(n->is_const)vm_def(c,n->name,1);else vm_set(c,n->name);return;}
+        case AST_INDEX_ASSIGN:{AST *t=n->left;vm_expr(c,n->right);vm_expr(c,t->left);if(t->type==AST_INDEX){vm_expr(c,t->right);vm_op(c,OP_SET_INDEX,-3);}else vm_op1(c,OP_SET_MEMBER,-2,vm_cache(c,t->name));return;}
+        case AST_COMPOUND:{
+            if(n->left->type!=AST_VAR){vm_op1(c,OP_ERROR,0,vm_const(c,val_string("invalid compound assignment target")));return;}
+            int r=vm_ref(c,n->left->name);vm_op1(c,OP_GET_TARGET,1,r);vm_expr(c,n->right);vm_op1(c,OP_COMPOUND,-2,r);vm_emit(c,n->op[0]);return;
+        }
+        case AST_BLOCK:vm_block_begin(c);for(int i=0;i<n->child_n;i++)vm_scan(c,n->children[i]);for(int i=0;i<n->child_n;i++)vm_stmt(c,n->children[i]);vm_block_end(c);return;
+        case AST_IF:{vm_expr(c,n->cond);int j=vm_jump(c,OP_JUMP_IF_FALSE,-1);vm_stmt(c,n->body);if(n->right){int e=vm_jump(c,OP_JUMP,0);vm_patch(c,j);vm_stmt(c,n->right);vm_patch(c,e);}else vm_patch(c,j);c->line=-1;return;}
+        case AST_WHILE:{int top=c->ch->len;c->line=-1;vm_expr(c,n->cond);int exit=vm_jump(c,OP_JUMP_IF_FALSE,-1);VMLoop lp={c->loop,0,c->slots,c->depth,{NULL,NULL},{0,0}};c->loop=&lp;vm_stmt(c,n->body);vm_op1(c,OP_JUMP,0,top);c->loop=lp.outer;vm_patch(c,exit);vm_loop_end(c,&lp,1,top);vm_loop_end(c,&lp,0,c->ch->len);c->line=-1;return;}
+        case AST_FOR_C:{
+            vm_block_begin(c);int vars=c->slots;vm_scan(c,n->init);vm_scan(c,n->update);if(n->init)vm_stmt(c,n->init);
+            int top=c->ch->len,exit=-1,var_n=c->slots-vars;c->line=-1;if(n->cond){vm_expr(c,n->cond);exit=vm_jump(c,OP_JUMP_IF_FALSE,-1);}
+            VMLoop lp={c->loop,0,c->slots,c->depth,{NULL,NULL},{0,0}};c->loop=&lp;vm_stmt(c,n->body);c->loop=lp.outer;
+            vm_loop_end(c,&lp,1,c->ch->len);if(var_n){vm_op1(c,OP_RENEW,0,vars);vm_emit(c,var_n);}if(n->update)vm_stmt(c,n->update);vm_op1(c,OP_JUMP,0,top);
+            if(exit>=0)vm_patch(c,exit);vm_loop_end(c,&lp,0,c->ch->len);vm_block_end(c);c->line=-1;return;
+        }
+        case AST_FOR:{
+            vm_expr(c,n->iter_expr);vm_op(c,OP_FOR_PREP,2);vm_block_begin(c);int idx=vm_declare(c,n->idx_var),item=vm_declare(c,n->iter_var);
+            int top=c->ch->len;c->line=-1;vm_op1(c,OP_FOR_NEXT,0,item);vm_emit(c,idx);vm_emit(c,-1);int exit=c->ch->len-1;
+            VMLoop lp={c->loop,0,c->slots,c->depth,{NULL,NULL},{0,0}};c->loop=&lp;vm_stmt(c,n->body);c->loop=lp.outer;vm_op1(c,OP_JUMP,0,top);
+            vm_patch(c,exit);vm_loop_end(c,&lp,1,top);vm_loop_end(c,&lp,0,c->ch->len);vm_block_end(c);
+            for(int i=0;i<3;i++)vm_op(c,OP_POP,-1);c->line=-1;return;
+        }
+        case AST_CASE:vm_case(c,n);c->line=-1;return;
+        case AST_BREAK:vm_break(c,0);return;
+        case AST_CONTINUE:vm_break(c,1);return;
+        case AST_RETURN:vm_expr(c,n->left);vm_op(c,OP_RETURN,-1);return;
+        case AST_YIELD:vm_expr(c,n->left);vm_op(c,OP_YIELD,-1);return;
+        case AST_FUNC:if(!n->name)break;vm_op1(c,OP_FUNC,1,vm_node(c,n));vm_def(c,n->name,0);return;
+        case AST_CLASS:vm_op1(c,OP_CLASS,1,vm_node(c,n));vm_def(c,n->name,0);return;
+        case AST_IMPORT:vm_op1(c,OP_IMPORT,1,vm_node(c,n));vm_def(c,n->imp_alias,0);return;
+        default:break;
+    }
+    vm_expr(c,n);vm_op(c,OP_POP,-1);
+}
+static void vm_compile_end(Compiler *c){vm_op(c,OP_NULL,1);vm_op(c,OP_RETURN,-1);c->ch->max_stack++;free(c->locals);free(c->blocks);}
+/* A program's top level binds globals by name; a module body is one block */
+static Chunk *vm_compile(AST *node,int toplevel){
+    if(node->chunk)return node->chunk;
+    Chunk *ch=xmalloc(sizeof(Chunk));memset(ch,0,sizeof(Chunk));Compiler c={0};c.ch=ch;c.line=-1;
+    if(toplevel)for(int i=0;i<node->child_n;i++)vm_stmt(&c,node->children[i]);else vm_stmt(&c,node);
+    vm_compile_end(&c);node->chunk=ch;return ch;
+}
+/* Parameters take the first slots; closures resolve free names through the enclosing compiler */
+static Chunk *vm_compile_fn(AST *body,char **params,int param_n,Compiler *enclosing){
+    if(body->chunk)return body->chunk;
+    Chunk *ch=xmalloc(sizeof(Chunk));memset(ch,0,sizeof(Chunk));Compiler c={0};c.ch=ch;c.line=-1;c.enclosing=enclosing;
+    body->chunk=ch;ch->param_n=param_n;vm_block_begin(&c);for(int i=0;i<param_n;i++)vm_local(&c,params[i]);
+    vm_stmt(&c,body);vm_compile_end(&c);return ch;
+}
+
+/* Frames */
+static Upvalue *upval_new(Value *val,int is_const){Upvalue *u=xmalloc(sizeof(Upvalue));u->val=val;u->is_const=is_const;u->refs=1;u->gc=0;return u;}
+static void upval_release(Upvalue *u){if(--u->refs>0){if(!(u->gc&GC_BUFFERED))gc_possible_root(GC_UPVAL,u);return;}val_decref(u->val);u->val=NULL;if(u->gc&GC_BUFFERED)u->gc|=GC_DEAD;else free(u);}
+static void slot_release(Slot *s){if(s->up)upval_release(s->up);else val_decref(s->val);s->val=NULL;s->up=NULL;s->is_const=0;}
+#define SLOT_VAL(s) ((s)->up?&(s)->up->val:&(s)->val)
+#define SLOT_CONST(s) ((s)->up?(s)->up->is_const:(s)->is_const)
+static void vm_store(Value **p,Value *v){val_incref(v);val_decref(*p);*p=v;}
+/* Base-scope lookups remember where the name was last found; symbols never move index */
+static Symbol *vm_global(VMRef *r){
+    Scope *s=g_scope;int i=r->cache_idx;
+    if(r->cache_scope==s&&i<0&&r->epoch==g_sym_epoch)return NULL;
+    if(r->cache_scope!=s||i<0||i>=s->count||strcmp(s->syms[i].name,r->name)!=0){
+        for(i=0;i<s->count&&strcmp(s->syms[i].name,r->name)!=0;i++);
+        if(i==s->count){Symbol *sym=scope_find(s->parent,r->name);if(!sym){r->cache_scope=s;r->cache_idx=-1;r->epoch=g_sym_epoch;}return sym;}
+        r->cache_scope=s;r->cache_idx=i;
+    }
+    return &s->syms[i];
+}
+static Value **vm_where(VMRef *r,int from,Slot *slots,Upvalue **ups,int *is_const){
+    for(int i=from;i<r->n;i++){
+        int l=r->locs[i];
+        if(l>=0){Slot *s=&slots[l];Value **p=SLOT_VAL(s);if(*p){*is_const=SLOT_CONST(s);return p;}}
+        else{Upvalue *u=ups[-l-1];if(u->val){*is_const=u->is_const;return &u->val;}}
+    }
+    Symbol *sym=vm_global(r);if(sym){*is_const=sym->is_const;return &sym->val;}
+    return NULL;
+}
+static Value *vm_lookup(VMRef *r,Slot *slots,Upvalue **ups){
+    int is_const;Value **p=vm_where(r,0,slots,ups,&is_const);if(p){val_incref(*p);return *p;}
+    if(!func_find(r->name))runtime_error(g_line,"undefined variable '%s'",r->name);return val_func(r->name);
+}
+static Value **vm_target(VMRef *r,Slot *slots,Upvalue **ups){
+    int is_const;Value **p=vm_where(r,0,slots,ups,&is_const);
+    if(!p)runtime_error(g_line,"undefined '%s'",r->name);if(is_const)runtime_error(g_line,"cannot modify constant");return p;
+}
+static void vm_define(VMRef *r,Slot *slots,Value *v,int is_const){
+    if(!r->n){scope_def(g_scope,r->name,v,is_const);return;}
+    Slot *s=&slots[r->locs[0]];Value **p=SLOT_VAL(s);
+    if(*p&&SLOT_CONST(s))runtime_error(g_line,"cannot reassign constant '%s'",r->name);
+    if(!*p){if(s->up)s->up->is_const=is_const;else s->is_const=is_const;}
+    vm_store(p,v);
+}
+/* Same rules as assign_var(): own block, then the first outer binding unless constant, else define */
+static void vm_assign(VMRef *r,Slot *slots,Upvalue **ups,Value *v){
+    if(!r->n){assign_var(r->name,v,0,g_line);return;}
+    Slot *s=&slots[r->locs[0]];Value **p=SLOT_VAL(s);
+    if(*p){if(SLOT_CONST(s))runtime_error(g_line,"cannot reassign constant '%s'",r->name);vm_store(p,v);return;}
+    int is_const;Value **outer=vm_where(r,1,slots,ups,&is_const);
+    if(outer&&!is_const)vm_store(outer,v);else vm_define(r,slots,v,0);
+}
+static Object *vm_props(Value *obj){return obj->type==V_OBJECT||obj->type==V_MODULE?obj->as.obj:obj->type==V_INSTANCE?obj->as.inst->props:NULL;}
+static Value *vm_member_get(Value *obj,VMCache *ic){
+    Object *o=vm_props(obj);if(!o)return val_null();int i;
+    if(o->shape&&o->shape==ic->shape)i=ic->index;
+    else{i=o->shape?shape_find(o->shape,o->pairs,ic->key):obj_index(o,ic->key);if(i>=0&&o->shape){ic->shape=o->shape;ic->index=i;}}
+    return i>=0?val_copy(o->pairs[i].val):val_null();
+}
+static void vm_member_set(Value *obj,VMCache *ic,Value *val){
+    Object *o=vm_props(obj);if(!o)return;
+    if(o->shape&&o->shape==ic->shape){Value **p=&o->pairs[ic->index].val;val_incref(val);val_decref(*p);*p=val;return;}
+    if(o->shape&&o->shape==ic->from&&o->count<o->cap){val_incref(val);o->pairs[o->count].key=(char*)ic->key;o->pairs[o->count++].val=val;o->shape=ic->to;return;}
+    Shape *before=o->shape;int n=o->count;obj_put(o,ic->key,val);
+    if(!o->shape)return;
+    if(o->count>n&&before){ic->from=before;ic->to=o->shape;}else{ic->shape=o->shape;ic->index=shape_find(o->shape,o->pairs,ic->key);}
+}
+static Value *vm_invoke(Value *obj,VMCache *ic,Value **args,int argc){
+    const char *method=ic->key;
+    if(obj->type==V_INSTANCE){ClassDef *cd=obj->as.inst->cd;if(ic->cd!=cd){Method *m=method_find(cd,method);if(m){ic->cd=cd;ic->m=m;}}if(ic->cd==cd)return call_method_body(obj,ic->m,args,argc);}
+    Value *result=obj->type==V_INSTANCE?val_null():call_method_id(obj,ic->mid,args,argc);
+    if(result->type!=V_NULL||(obj->type!=V_OBJECT&&obj->type!=V_MODULE&&obj->type!=V_INSTANCE))return result;
+    val_decref(result);
+    if(obj->type==V_OBJECT||obj->type==V_MODULE){Value *fn=obj_get(obj,method);if(fn&&fn->type==V_FUNC)return call_named(fn->as.s,args,argc);if(fn&&fn->type==V_CLOSURE)return call_closure(fn,args,argc);}
+    Value *fn=member_get(obj,method);if(fn->type!=V_CLOSURE&&fn->type!=V_FUNC)runtime_error(g_line,"not a function");
+    result=call_closure(fn,args,argc);val_decref(fn);return result;
+}
+static void vm_drop(Value **vals,int n){for(int i=0;i<n;i++)val_decref(vals[i]);}
+static Value *vm_concat(Value **parts,int n){StrBuf sb;sb_init(&sb);for(int i=0;i<n;i++)sb_append_val(&sb,parts[i]);return sb_value(&sb);}
+
+#ifdef VM_COMPUTED_GOTO
+#define VM_LABEL(n) &&L_##n,
+#define VM_CASE(n) L_##n:
+#define VM_NEXT goto *labels[*ip++]
+#define VM_LOOP VM_NEXT;
+#define VM_END
+#else
+#define VM_CASE(n) case OP_##n:
+#define VM_NEXT continue
+#define VM_LOOP for(;;){switch(*ip++){
+#define VM_END default:runtime_error(g_line,"bad opcode");}}
+#endif
+#define VM_ARITH(name,bop,fast) VM_CASE(name){Value *r=sp[-1],*l=sp[-2],*res=(l->type==V_INT&&r->type==V_INT)?(fast):binop_apply(bop,l,r,g_line);val_decref(l);val_decref(r);*(--sp-1)=res;}VM_NEXT;
+
+static Value *vm_exec(Chunk *ch,Value **args,int argc,Upvalue **ups){
+#ifdef VM_COMPUTED_GOTO
+    static void *labels[]={VM_OPS(VM_LABEL)};
+#endif
+    if(!g_stack){g_stack=xmalloc(sizeof(Value*)*VM_STACK);g_slots=xmalloc(sizeof(Slot)*VM_SLOTS);}
+    if(g_sp+ch->max_stack>=g_stack_cap||g_slot_sp+ch->slot_n>=g_slot_cap||cstack_low())runtime_error(g_line,"stack overflow");
+    Value **base=g_stack+g_sp,**sp=base,**k=ch->consts,*result;int *code=ch->code,*ip=code;Slot *slots=g_slots+g_slot_sp;
+    g_sp+=ch->max_stack;g_slot_sp+=ch->slot_n;memset(slots,0,sizeof(Slot)*ch->slot_n);
+    for(int i=0;i<ch->param_n;i++)if(i<argc){val_incref(args[i]);slots[i].val=args[i];}else slots[i].val=val_null();
+    VM_LOOP
+    VM_CASE(NOP) VM_NEXT;
+    VM_CASE(LINE) g_line=*ip++;GC_SAFEPOINT();VM_NEXT;
+    VM_CASE(CONST){Value *v=k[*ip++];val_incref(v);*sp++=v;}VM_NEXT;
+    VM_CASE(NULL) *sp++=val_null();VM_NEXT;
+    VM_CASE(POP) val_decref(*--sp);VM_NEXT;
+    VM_CASE(GET_LOCAL){Slot *s=&slots[*ip++];Value *v=*SLOT_VAL(s);if(v){val_incref(v);*sp++=v;ip++;}else *sp++=vm_lookup(&ch->refs[*ip++],slots,ups);}VM_NEXT;
+    VM_CASE(GET_NAME) *sp++=vm_lookup(&ch->refs[*ip++],slots,ups);VM_NEXT;
+    VM_CASE(SET_LOCAL){Slot *s=&slots[*ip++];Value *v=*--sp;if(s->val&&!s->is_const){val_decref(s->val);s->val=v;ip++;}else{vm_assign(&ch->refs[*ip++],slots,ups,v);val_decref(v);}}VM_NEXT;
+    VM_CASE(SET_NAME){Value *v=*--sp;vm_assign(&ch->refs[*ip++],slots,ups,v);val_decref(v);}VM_NEXT;
+    VM_CASE(DEF_NAME){Value *v=*--sp;VMRef *r=&ch->refs[*ip++];vm_define(r,slots,v,*ip++);val_decref(v);}VM_NEXT;
+    VM_CASE(GET_TARGET) *sp++=val_copy(*vm_target(&ch->refs[*ip++],slots,ups));VM_NEXT;
+    VM_CASE(COMPOUND){VMRef *r=&ch->refs[*ip++];int op=*ip++;Value *rhs=*--sp,*cur=*--sp;int is_const=0;Value **p=vm_where(r,0,slots,ups,&is_const);
+        if(op=='+'&&!is_const&&str_append_inplace(p,cur,rhs)){val_decref(cur);val_decref(rhs);VM_NEXT;}
+        Value *v=compound_apply((char)op,cur,rhs,g_line);
+        if(p){if(is_const)runtime_error(g_line,"cannot reassign constant '%s'",r->name);vm_store(p,v);}else vm_assign(r,slots,ups,v);val_decref(v);val_decref(cur);val_decref(rhs);}VM_NEXT;
+    VM_CASE(APPEND_SET){VMRef *r=&ch->refs[*ip++];Value *rhs=*--sp,*cur=*--sp;int is_const=0;Value **p=cur->type==V_STRING?vm_where(r,0,slots,ups,&is_const):NULL;
+        if(!is_const&&str_append_inplace(p,cur,rhs)){val_decref(cur);val_decref(rhs);VM_NEXT;}
+        Value *v=(cur->type==V_INT&&rhs->type==V_INT)?val_int(cur->as.i+rhs->as.i):binop_apply(BOP_ADD,cur,rhs,g_line);val_decref(cur);val_decref(rhs);vm_assign(r,slots,ups,v);val_decref(v);}VM_NEXT;
+    VM_CASE(INC_VAR){Value **p=vm_target(&ch->refs[*ip++],slots,ups);*sp++=incdec_at(p,*ip++,0);}VM_NEXT;
+    VM_CASE(POSTINC_VAR){Value **p=vm_target(&ch->refs[*ip++],slots,ups);*sp++=incdec_at(p,*ip++,1);}VM_NEXT;
+    VM_CASE(LEAVE){Slot *s=slots+*ip++;for(int n=*ip++;n>0;n--,s++)if(s->val||s->up)slot_release(s);}VM_NEXT;
+    /* Loop variables a closure captured move to a fresh cell, so each iteration keeps its own */
+    VM_CASE(RENEW){Slot *s=slots+*ip++;for(int n=*ip++;n>0;n--,s++)if(s->up){Upvalue *u=s->up;Value *v=u->val;int k=u->is_const;val_incref(v);upval_release(u);s->up=NULL;s->val=v;s->is_const=k;}}VM_NEXT;
+    VM_ARITH(ADD,BOP_ADD,val_int(l->as.i+r->as.i))
+    VM_ARITH(SUB,BOP_SUB,val_int(l->as.i-r->as.i))
+    VM_ARITH(MUL,BOP_MUL,val_int(l->as.i*r->as.i))
+    VM_ARITH(DIV,BOP_DIV,binop_apply(BOP_DIV,l,r,g_line))
+    VM_ARITH(MOD,BOP_MOD,binop_apply(BOP_MOD,l,r,g_line))
+    VM_ARITH(POW,BOP_POW,val_float(pow((double)l->as.i,(double)r->as.i)))
+    VM_ARITH(LT,BOP_LT,val_bool((double)l->as.i<(double)r->as.i))
+    VM_ARITH(GT,BOP_GT,val_bool((double)l->as.i>(double)r->as.i))
+    VM_ARITH(LE,BOP_LE,val_bool((double)l->as.i<=(double)r->as.i))
+    VM_ARITH(GE,BOP_GE,val_bool((double)l->as.i>=(double)r->as.i))
+    VM_ARITH(EQ,BOP_EQ,val_bool((double)l->as.i==(double)r->as.i))
+    VM_ARITH(NE,BOP_NE,val_bool((double)l->as.i!=(double)r->as.i))
+    VM_CASE(NEG){Value *v=sp[-1];sp[-1]=(v->type==V_FLOAT)?val_float(-v->as.f):val_int(-(long long)val_tonum(v));val_decref(v);}VM_NEXT;
+    VM_CASE(NOT){Value *v=sp[-1];sp[-1]=val_bool(!val_truthy(v));val_decref(v);}VM_NEXT;
+    VM_CASE(JUMP) ip=code+*ip;VM_NEXT;
+    VM_CASE(JUMP_IF_FALSE){Value *v=*--sp;int t=val_truthy(v);val_decref(v);ip=t?ip+1:code+*ip;}VM_NEXT;
+    VM_CASE(AND) if(!val_truthy(sp[-1]))ip=code+*ip;else{val_decref(*--sp);ip++;}VM_NEXT;
+    VM_CASE(OR) if(val_truthy(sp[-1]))ip=code+*ip;else{val_decref(*--sp);ip++;}VM_NEXT;
+    VM_CASE(ARRAY){int n=*ip++;Value *arr=val_array(n);memcpy(arr->as.arr->items,sp-n,sizeof(Value*)*n);arr->as.arr->len=n;sp-=n;*sp++=arr;}VM_NEXT;
+    VM_CASE(OBJECT){AST *node=ch->nodes[*ip++];int n=node->child_n;Value *obj=val_object();for(int i=0;i<n;i++){obj_set(obj,node->keys[i],sp[i-n]);val_decref(sp[i-n]);}sp-=n;*sp++=obj;}VM_NEXT;
+    VM_CASE(INDEX){Value *idx=*--sp,*c=sp[-1];sp[-1]=index_get(c,idx);val_decref(c);val_decref(idx);}VM_NEXT;
+    VM_CASE(MEMBER){Value *o=sp[-1];sp[-1]=vm_member_get(o,&ch->caches[*ip++]);val_decref(o);}VM_NEXT;
+    VM_CASE(SET_INDEX){Value *idx=*--sp,*c=*--sp,*v=*--sp;index_set(c,idx,v);val_decref(idx);val_decref(c);val_decref(v);}VM_NEXT;
+    VM_CASE(SET_MEMBER){Value *o=*--sp,*v=*--sp;vm_member_set(o,&ch->caches[*ip++],v);val_decref(o);val_decref(v);}VM_NEXT;
+    VM_CASE(CALL){int argc=*ip++;Value **args=sp-argc,*fn=args[-1];if(fn->type!=V_CLOSURE&&fn->type!=V_FUNC)runtime_error(g_line,"not a function");int line=g_line;Value *r=call_closure(fn,args,argc);g_line=line;vm_drop(args,argc);val_decref(fn);sp=args;sp[-1]=r;}VM_NEXT;
+    VM_CASE(CALL_NAME){VMRef *ref=&ch->refs[*ip++];int argc=*ip++,line=g_line,is_const;Value **args=sp-argc,*r,**fn=vm_where(ref,0,slots,ups,&is_const);
+        if(fn&&((*fn)->type==V_CLOSURE||(*fn)->type==V_FUNC)){Value *f=*fn;val_incref(f);r=call_closure(f,args,argc);val_decref(f);}else r=call_bound(ref->name,ref->bi,&ref->bi_epoch,ref->mod,args,argc);
+        g_line=line;vm_drop(args,argc);sp=args;*sp++=r;}VM_NEXT;
+    VM_CASE(CALL_METHOD){VMCache *ic=&ch->caches[*ip++];int argc=*ip++,line=g_line;Value **args=sp-argc,*obj=args[-1],*r=vm_invoke(obj,ic,args,argc);g_line=line;vm_drop(args,argc);val_decref(obj);sp=args;sp[-1]=r;}VM_NEXT;
+    VM_CASE(PRINT){int mode=*ip++;if(mode==2)printf("\n");else{Value *v=*--sp;printf("%s%s",val_tostr(v),mode?"\n":" ");val_decref(v);}}VM_NEXT;
+    VM_CASE(NEW){AST *node=ch->nodes[*ip++];int argc=*ip++;Value **args=sp-argc;ClassDef *cd=class_find(node->name);
+        if(!cd)runtime_error(g_line,"undefined class '%s'",node->name);
+        Value *inst=val_instance(cd);Method *init=method_find(cd,"init");if(init){int line=g_line;Value *r=call_method_body(inst,init,args,argc);g_line=line;val_decref(r);}vm_drop(args,argc);sp=args;*sp++=inst;}VM_NEXT;
+    VM_CASE(THIS){int sup=*ip++;if(!g_this||(sup&&g_this->type!=V_INSTANCE))runtime_error(g_line,sup?"'super' outside of method":"'this' outside of method");val_incref(g_this);*sp++=g_this;}VM_NEXT;
+    VM_CASE(FOR_PREP){Value *it=sp[-1],*ctr=val_new(V_INT);long long len=0;if(it->type==V_INSTANCE){sp[-1]=iter_from(it);val_decref(it);it=sp[-1];}if(it->type==V_MAP||it->type==V_SET||it->type==V_DEQUE||it->type==V_PQ){sp[-1]=coll_to_array(it);val_decref(it);it=sp[-1];}if(it->type==V_ARRAY)len=it->as.arr->len;else if(it->type==V_TYPED)len=it->as.ta->len;else if(it->type==V_OBJECT||it->type==V_MODULE)len=it->as.obj->count;else if(it->type==V_STRING)len=strlen(it->as.s);else if(it->type==V_ITER)len=LLONG_MAX;*sp++=ctr;*sp++=val_int(len);}VM_NEXT;
+    VM_CASE(FOR_NEXT){Slot *item_slot=&slots[*ip++],*idx_slot=&slots[*ip++];Value *it=sp[-3],*ctr=sp[-2],*nx=NULL;long long i=ctr->as.i;if(it->type==V_ITER?!(nx=iter_next(it)):i>=sp[-1]->as.i){ip=code+*ip;VM_NEXT;}ip++;ctr->as.i=i+1;
+        slot_release(idx_slot);idx_slot->val=val_int(i);slot_release(item_slot);
+        if(nx)item_slot->val=nx;else if(it->type==V_ARRAY)item_slot->val=i<it->as.arr->len?val_copy(it->as.arr->items[i]):val_null();else if(it->type==V_TYPED)item_slot->val=i<it->as.ta->len?ta_box(it->as.ta,i):val_null();else if(it->type==V_STRING){char s[2]={it->as.s[i],'\0'};item_slot->val=val_string(s);}else item_slot->val=i<it->as.obj->count?val_string(it->as.obj->pairs[i].key):val_null();}VM_NEXT;
+    VM_CASE(CASE_EQ){Value *cv=*--sp;int eq=case_eq(sp[-1],cv);val_decref(cv);ip=eq?code+*ip:ip+1;}VM_NEXT;
+    VM_CASE(CASE_RANGE){Value *hi=*--sp,*lo=*--sp;double s=val_tonum(sp[-1]);int in=s>=val_tonum(lo)&&s<=val_tonum(hi);val_decref(lo);val_decref(hi);ip=in?code+*ip:ip+1;}VM_NEXT;
+    VM_CASE(FUNC){AST *node=ch->nodes[*ip++];func_register(node);*sp++=val_func(node->name);}VM_NEXT;
+    VM_CASE(CLOSURE){AST *node=ch->nodes[*ip++];Chunk *fc=node->body->chunk;Value *v=closure_new(node);Closure *cl=v->as.cl;
+        cl->upval_n=fc->cap_n;cl->upvals=fc->cap_n?xmalloc(sizeof(Upvalue*)*fc->cap_n):NULL;
+        for(int i=0;i<fc->cap_n;i++){VMCapture *cap=&fc->caps[i];Upvalue *u;
+            if(cap->from_local){Slot *s=&slots[cap->index];if(!s->up){s->up=upval_new(s->val,s->is_const);s->val=NULL;s->is_const=0;}u=s->up;}else u=ups[cap->index];
+            u->refs++;cl->upvals[i]=u;}
+        *sp++=v;}VM_NEXT;
+    VM_CASE(CLASS) *sp++=define_class(ch->nodes[*ip++]);VM_NEXT;
+    VM_CASE(IMPORT){AST *node=ch->nodes[*ip++];char *path=resolve_path(node->imp_path,g_dir);*sp++=do_import(path,node->imp_alias);free(path);}VM_NEXT;
+    VM_CASE(CONCAT){int n=*ip++;Value *v=vm_concat(sp-n,n);vm_drop(sp-n,n);sp-=n;*sp++=v;}VM_NEXT;
+    VM_CASE(ERROR) runtime_error(g_line,"%s",k[*ip++]->as.s);VM_NEXT;
+    VM_CASE(RETURN) result=*--sp;goto done;
+    VM_CASE(YIELD) if(gen_yield(*--sp)){result=val_null();goto done;}VM_NEXT;
+    VM_END
+done:
+    while(sp>base)val_decref(*--sp);
+    for(int i=0;i<ch->slot_n;i++)if(slots[i].val||slots[i].up)slot_release(&slots[i]);
+    g_sp-=ch->max_stack;g_slot_sp-=ch->slot_n;
+    return result;
+}
+static Value *vm_call(AST *body,char **params,int param_n,Value **args,int argc){
+    Scope *prev=g_scope;g_scope=g_global;Value *result=vm_exec(vm_compile_fn(body,params,param_n,NULL),args,argc,NULL);g_scope=prev;return result;
+}
+
+static Value *run_body(AST *body){
+    if(cstack_low())runtime_error(g_line,"stack overflow");
+    g_return=0;g_retval=NULL;val_decref(eval(body));Value *result=g_retval?g_retval:val_null();g_return=0;g_retval=NULL;return result;
+}
+
+/* Generators
+   Calling a function whose body contains `yield` returns an iterator instead of running it.
+   The body runs on its own C stack (a ucontext, or a fiber on Windows) and its own VM stack;
+   each next() switches in and runs to the following yield. A generator that is dropped while
+   suspended is resumed once more with its yield acting as `return`, which unwinds its frames.
+   Each generator gets one region holding its VM stack, its slots and a GEN_CSTACK C stack;
+   regions are carved GEN_CHUNK at a time from a single mapping and reused, so even tens of
+   thousands of suspended generators stay far below the kernel's limit on mappings. Only
+   touched pages are committed. Calls that get within GEN_CSTACK_SLACK of the end of the C
+   stack raise "stack overflow". */
+#define GEN_CSTACK (1<<20)
+#define GEN_CSTACK_SLACK (64<<10)
+#define GEN_STACK (1<<14)
+#define GEN_SLOTS (1<<12)
+#define GEN_REGION (((GEN_STACK*sizeof(Value*)+GEN_SLOTS*sizeof(Slot)+4095)&~(size_t)4095)+GEN_CSTACK)
+#define GEN_CHUNK 32
+typedef struct { Value **stack; Slot *slots; int sp,slot_sp,stack_cap,slot_cap,line,brk,cont,ret; Scope *scope; Value *self,*retval; } InterpState;
+enum { GEN_NEW,GEN_SUSPENDED,GEN_RUNNING,GEN_DONE };
+typedef struct Gen {
+    Value *fn,*self,**args,*out; Method *m; int argc,state,closing; InterpState own,caller; struct Gen *outer;
+    Value **stack; Slot *slots; uintptr_t c_limit;
+#ifdef _WIN32
+    LPVOID ctx,back;
+#else
+    ucontext_t ctx,back; char *region;
+#endif
+} Gen;
+static Gen *g_gen=NULL;
+static void interp_save(InterpState *s) {
+    s->stack=g_stack;s->slots=g_slots;s->sp=g_sp;s->slot_sp=g_slot_sp;s->stack_cap=g_stack_cap;s->slot_cap=g_slot_cap;
+    s->line=g_line;s->brk=g_break;s->cont=g_continue;s->ret=g_return;s->scope=g_scope;s->self=g_this;s->retval=g_retval;
+}
+static void interp_load(InterpState *s) {
+    g_stack=s->stack;g_slots=s->slots;g_sp=s->sp;g_slot_sp=s->slot_sp;g_stack_cap=s->stack_cap;g_slot_cap=s->slot_cap;
+    g_line=s->line;g_break=s->brk;g_continue=s->cont;g_return=s->ret;g_scope=s->scope;g_this=s->self;g_retval=s->retval;
+}
+static void gen_main(void) {
+    Gen *g=g_gen;char top;
+    g->c_limit=g_cstack_limit=(uintptr_t)&top-GEN_CSTACK+GEN_CSTACK_SLACK;
+    g_stack=g->stack;g_slots=g->slots;g_sp=g_slot_sp=0;g_stack_cap=GEN_STACK;g_slot_cap=GEN_SLOTS;
+    g_scope=g_global;g_this=NULL;g_retval=NULL;g_break=g_continue=g_return=0;
+    g_gen_enter=1;val_decref(g->m?call_method_body(g->self,g->m,g->args,g->argc):call_closure(g->fn,g->args,g->argc));
+    g->state=GEN_DONE;
+#ifdef _WIN32
+    SwitchToFiber(g->back);
+#else
+    swapcontext(&g->ctx,&g->back);
+#endif
+}
+#ifdef _WIN32
+static VOID CALLBACK gen_fiber(LPVOID p) { (void)p; gen_main(); }
+#endif
+#ifndef _WIN32
+/* Free regions are linked through their first word. Beyond the first 16 kept warm, a freed
+   region's pages are handed back to the kernel, but the address range stays in the pool. */
+static char *g_region_free=NULL; static int g_region_free_n=0;
+static char *gen_region_get(void) {
+    if(!g_region_free){
+        char *p=mmap(NULL,GEN_REGION*GEN_CHUNK,PROT_READ|PROT_WRITE,MAP_PRIVATE|MAP_ANONYMOUS|MAP_NORESERVE,-1,0);
+        if(p==MAP_FAILED)runtime_error(g_line,"cannot allocate a generator stack: too many live generators");
+        for(int i=GEN_CHUNK-1;i>=0;i--){*(char**)(p+i*GEN_REGION)=g_region_free;g_region_free=p+i*GEN_REGION;g_region_free_n++;}
+    }
+    char *r=g_region_free;g_region_free=*(char**)r;g_region_free_n--;return r;
+}
+static void gen_region_put(char *r) {
+    if(g_region_free_n>=16)madvise(r,GEN_REGION,MADV_DONTNEED);
+    *(char**)r=g_region_free;g_region_free=r;g_region_free_n++;
+}
+#endif
+/* Run g until it yields or finishes, then return to the caller's interpreter state */
+static void gen_resume(Gen *g) {
+    if(g->state==GEN_RUNNING)runtime_error(g_line,"generator is already running");
+    interp_save(&g->caller);g->outer=g_gen;g_gen=g;uintptr_t limit=g_cstack_limit;g_cstack_limit=g->c_limit;
+#ifdef _WIN32
+    static LPVOID main_fiber=NULL;if(!main_fiber)main_fiber=ConvertThreadToFiber(NULL);
+    if(g->state==GEN_NEW){
+        if(!(g->ctx=CreateFiberEx(0,GEN_CSTACK,0,gen_fiber,NULL)))runtime_error(g_line,"cannot allocate a generator stack: too many live generators");
+        g->stack=xmalloc(sizeof(Value*)*GEN_STACK);g->slots=xmalloc(sizeof(Slot)*GEN_SLOTS);}
+    g->state=GEN_RUNNING;g->back=GetCurrentFiber();SwitchToFiber(g->ctx);
+#else
+    if(g->state==GEN_NEW){
+        char *r=g->region=gen_region_get();g->stack=(Value**)r;g->slots=(Slot*)(r+GEN_STACK*sizeof(Value*));
+        getcontext(&g->ctx);g->ctx.uc_stack.ss_sp=r+GEN_REGION-GEN_CSTACK;g->ctx.uc_stack.ss_size=GEN_CSTACK;g->ctx.uc_link=NULL;makecontext(&g->ctx,gen_main,0);}
+    g->state=GEN_RUNNING;swapcontext(&g->back,&g->ctx);
+#endif
+    g_gen=g->outer;interp_load(&g->caller);g_cstack_limit=limit;
+}
+/* Hand v to the consumer and suspend; returns 1 when the generator is being closed */
+static int gen_yield(Value *v) {
+    Gen *g=g_gen;
+    if(!g){val_decref(v);runtime_error(g_line,"'yield' outside of a generator");}
+    if(g->closing){val_decref(v);return 1;}
+    g->out=v;g->state=GEN_SUSPENDED;interp_save(&g->own);
+#ifdef _WIN32
+    SwitchToFiber(g->back);
+#else
+    swapcontext(&g->ctx,&g->back);
+#endif
+    interp_load(&g->own);return g->closing;
+}
+static Value *gen_next(Iter *t) {
+    Gen *g=t->st;if(g->state==GEN_DONE)return NULL;
+    gen_resume(g);if(g->state==GEN_DONE)return NULL;
+    Value *v=g->out;g->out=NULL;return v;
+}
+static void gen_drop(Iter *t) {
+    Gen *g=t->st;
+    if(g->state==GEN_RUNNING)runtime_error(g_line,"generator is already running");
+    if(g->state==GEN_SUSPENDED){g->closing=1;gen_resume(g);}
+#ifdef _WIN32
+    if(g->ctx)DeleteFiber(g->ctx);
+    free(g->stack);free(g->slots);
+#else
+    if(g->region)gen_region_put(g->region);
+#endif
+    for(int i=0;i<g->argc;i++)val_decref(g->args[i]);
+    if(g->fn)val_decref(g->fn);
+    if(g->self)val_decref(g->self);
+    free(g->args);free(g);
+}
+static Value *gen_new(Value *fn,Value *self,Method *m,Value **args,int argc) {
+    Gen *g=xmalloc(sizeof(Gen));memset(g,0,sizeof(Gen));g->fn=fn;g->self=self;g->m=m;g->argc=argc;
+    if(fn)val_incref(fn);
+    if(self)val_incref(self);
+    g->args=xmalloc(sizeof(Value*)*(argc+1));for(int i=0;i<argc;i++){val_incref(args[i]);g->args[i]=args[i];}
+    return iter_new(gen_next,gen_drop,g);
+}
+
 /* Main */
 static void init_globals(void){g_global=scope_new(NULL);g_scope=g_global;Value *pi=val_float(3.14159265358979323846);scope_def(g_global,"PI",pi,1);val_decref(pi);Value *e=val_float(2.71828182845904523536);scope_def(g_global,"E",e,1);val_decref(e);Value *ver=val_string("3.0");scope_def(g_global,"VERSION",ver,1);val_decref(ver);}
 
 int main(int argc,char **argv){
     char *source=NULL;
+    val_init_immediates();
+    for(int i=1;i<argc;i++){int *flag=strcmp(argv[i],"--no-vm")==0?&g_use_vm:strcmp(argv[i],"--mem-stats")==0?&g_mem_stats:NULL;if(flag){*flag=flag==&g_mem_stats;memmove(&argv[i],&argv[i+1],sizeof(char*)*(argc-i));argc--;i--;}}
+    if(g_mem_stats)atexit(mem_report);
+    if(getenv("JEEM_GC_THRESHOLD"))g_gc_threshold=atoi(getenv("JEEM_GC_THRESHOLD"));
     if(argc>=2&&(strcmp(argv[1],"-v")==0||strcmp(argv[1],"--version")==0)){printf("Jeem v3.0\n");return 0;}
-    if(argc>=2&&(strcmp(argv[1],"-h")==0||strcmp(argv[1],"--help")==0)){printf("Jeem v3.0 - A lightweight scripting language\n\nUsage: jeem <file.jm>       Run a script file\n       jeem -e \"code\"       Execute code directly\n       jeem init [name]     Initialize a new project\n       jeem start           Run scripts.start from jeem.json\n       jeem test            Run scripts.test from jeem.json\n       jeem run <script>    Run custom script from jeem.json\n       jeem -v, --version   Show version\n       jeem -h, --help      Show this help\n");return 0;}
+    if(argc>=2&&(strcmp(argv[1],"-h")==0||strcmp(argv[1],"--help")==0)){printf("Jeem v3.0 - A lightweight scripting language\n\nUsage: jeem <file.jm>       Run a script file\n       jeem -e \"code\"       Execute code directly\n       jeem init [name]     Initialize a new project\n       jeem start           Run scripts.start from jeem.json\n       jeem test            Run scripts.test from jeem.json\n       jeem run <script>    Run custom script from jeem.json\n       jeem --no-vm <file>  Run with the tree-walking evaluator\n       jeem --mem-stats <file>  Report memory use on exit\n       jeem -v, --version   Show version\n       jeem -h, --help      Show this help\n");return 0;}
     if(argc>=2&&strcmp(argv[1],"init")==0){
         const char *name=(argc>=3)?argv[2]:"my-project";
         FILE *f=fopen("jeem.json","w");
@@ -754,9 +3708,9 @@ run_source:
     if(!g_global)init_globals();
     Value *args_arr=val_array(argc-1);for(int i=1;i<argc;i++){Value *arg=val_string(argv[i]);arr_push(args_arr,arg);val_decref(arg);}scope_def(g_global,"ARGS",args_arr,1);val_decref(args_arr);
     g_src=source;g_len=strlen(source);g_pos=0;g_line=1;advance();AST *prog=parse_program();
-    g_scope=g_global;Value *result=val_null();for(int i=0;i<prog->child_n;i++){val_decref(result);result=eval(prog->children[i]);if(g_return||g_break||g_continue)break;}val_decref(result);
+    g_scope=g_global;Value *result=val_null();if(g_use_vm){val_decref(result);result=vm_exec(vm_compile(prog,1),NULL,0,NULL);}else for(int i=0;i<prog->child_n;i++){val_decref(result);result=eval(prog->children[i]);if(g_return||g_break||g_continue)break;}val_decref(result);
     free(source);free(g_dir);
     /* Auto-run pending timers (like JavaScript event loop) */
-    while(has_active_timers()){process_timers();sleep_ms(1);}
+    run_timers();
     return 0;
 }